@@ -1,6 +1,10 @@
 /*
  * The main modifications for memcached-1.4.24_RDMA project
- * were adding shared_malloc option, and forbidding work without preallocation
+ * were adding shared_malloc option, and forbidding work without preallocation.
+ * With shared_malloc_assoc the table grows into a new shared region, keyed
+ * <shared_malloc_assoc>.<hashpower>, which replaces the replicated assoc region
+ * as soon as the expansion starts (see assoc_publish), so that the backups
+ * always hold a complete table.
  */
 
 /* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
@@ -18,6 +22,7 @@
 
 #include "sharedmalloc.h"
 #include "memcached.h"
+#include "backup.h"
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/signal.h>
@@ -43,15 +48,17 @@ unsigned int hashpower = HASHPOWER_DEFAULT;
 
 #define hashsize(n) ((ub4)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
+/* longest chain assoc_find_replica follows, the table grows at 1.5 items a bucket */
+#define ASSOC_REPLICA_DEPTH 64
 
-/* Main hash table. This is where we look except during expansion. */
-static item** primary_hashtable = 0;
+/* Main hash table. This is where we look, during expansion too. */
+static item_ref *primary_hashtable = 0;
+/* shared_malloc key of primary_hashtable, allocated unless it is the configured one */
+static char *primary_key = NULL;
 
-/*
- * Previous hash table. During expansion, we look here for keys that haven't
- * been moved over to the primary yet.
- */
-static item** old_hashtable = 0;
+/* Previous hash table, only kept while it is being replaced */
+static item_ref *old_hashtable = 0;
+static char *old_key = NULL;
 
 /* Number of items in the hash table. */
 static unsigned int hash_items = 0;
@@ -61,19 +68,87 @@ static bool expanding = false;
 static bool started_expanding = false;
 
 /*
- * During expansion we migrate values with bucket granularity; this is how
- * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
+ * During expansion we split the buckets one at a time; this is how far we've
+ * gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
+ * A bucket b at or past expand_bucket and b + hashsize(hashpower - 1) are a
+ * pair that was not split yet: both point to the same chain, of the items of
+ * both buckets.
  */
 static unsigned int expand_bucket = 0;
 
+/*
+ * Allocates a zeroed shared table of 2^power buckets under a new key.
+ * Returns NULL on failure.
+ */
+static item_ref *assoc_shared_alloc(const unsigned int power, char **key) {
+    size_t len = strlen(settings.shared_malloc_assoc_key) + 4;
+    item_ref *table;
+
+    *key = malloc(len);
+    if (*key == NULL)
+        return NULL;
+    snprintf(*key, len, "%s.%u", settings.shared_malloc_assoc_key, power);
+    table = shared_malloc(NULL, hashsize(power) * sizeof(item_ref), *key,
+                          NO_LOCK | (settings.huge_pages ? HUGE_PAGES : 0));
+    if (table == NULL) {
+        free(*key);
+        *key = NULL;
+        return NULL;
+    }
+    /* the file may be left over from an earlier run */
+    memset(table, 0, hashsize(power) * sizeof(item_ref));
+    return table;
+}
+
+/* Unmaps a shared table that was replaced, and removes its file */
+static void assoc_shared_free(item_ref *table, const unsigned int power, char *key) {
+    char *path = gen_full_path(key ? key : settings.shared_malloc_assoc_key, KEYPATH);
+
+    shared_free(table, hashsize(power) * sizeof(item_ref));
+    if (path != NULL) {
+        unlink(path);
+        free(path);
+    }
+    free(key);
+}
+
+/*
+ * Makes primary_hashtable the replicated assoc region. The syncs in progress
+ * are waited for and the workers paused, so no sender or writer sees the
+ * region change under it, and the next sync sends all of the new table.
+ * swap, if not NULL, is called while the workers are paused.
+ */
+static void assoc_publish(void (*swap)(void)) {
+    backup_regions_hold();
+    pause_threads(PAUSE_ALL_THREADS);
+    if (swap != NULL)
+        swap();
+    region_register(REGION_ASSOC, primary_hashtable,
+                    hashsize(hashpower) * sizeof(item_ref),
+                    primary_key ? primary_key : settings.shared_malloc_assoc_key);
+    backup_region_replaced(REGION_ASSOC);
+    slabs_meta_update();
+    pause_threads(RESUME_ALL_THREADS);
+    backup_regions_release();
+}
+
 void assoc_init(const int hashtable_init) {
     if (hashtable_init) {
         hashpower = hashtable_init;
     }
     if (settings.shared_malloc_assoc) {
-        primary_hashtable = shared_malloc((void *)0x00007fa2fdf10000, hashsize(hashpower)*sizeof(void *), settings.shared_malloc_assoc_key, NO_LOCK);//TODO: check that no need to add zeroes (like in calloc)
+        primary_hashtable = shared_malloc(NULL, hashsize(hashpower)*sizeof(item_ref), settings.shared_malloc_assoc_key,
+                                          NO_LOCK | (settings.huge_pages ? HUGE_PAGES : 0));
+        if (primary_hashtable) {
+            /* the file may be left over from an earlier run, whose items
+             * are relinked from scratch by a warm restart */
+            memset(primary_hashtable, 0, hashsize(hashpower) * sizeof(item_ref));
+            region_register(REGION_ASSOC, primary_hashtable,
+                            hashsize(hashpower) * sizeof(item_ref),
+                            settings.shared_malloc_assoc_key);
+        }
     } else {
-        primary_hashtable = calloc(hashsize(hashpower), sizeof(void *));
+        primary_hashtable = calloc(hashsize(hashpower), sizeof(item_ref));
     }
     if (! primary_hashtable) {
         fprintf(stderr, "Failed to init hashtable.\n");
@@ -81,21 +156,18 @@ void assoc_init(const int hashtable_init) {
     }
     STATS_LOCK();
     stats.hash_power_level = hashpower;
-    stats.hash_bytes = hashsize(hashpower) * sizeof(void *);
+    stats.hash_bytes = hashsize(hashpower) * sizeof(item_ref);
     STATS_UNLOCK();
+    slabs_meta_update();
 }
 
-item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
-    item *it;
-    unsigned int oldbucket;
+/* true if the bucket and its pair were not split yet */
+static inline bool assoc_unsplit(const ub4 bucket) {
+    return expanding && (bucket & hashmask(hashpower - 1)) >= expand_bucket;
+}
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        it = old_hashtable[oldbucket];
-    } else {
-        it = primary_hashtable[hv & hashmask(hashpower)];
-    }
+item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
+    item *it = item_ref_ptr(primary_hashtable[hv & hashmask(hashpower)]);
 
     item *ret = NULL;
     int depth = 0;
@@ -104,81 +176,118 @@ item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
             ret = it;
             break;
         }
-        it = it->h_next;
+        it = ITEM_h_next(it);
         ++depth;
     }
     MEMCACHED_ASSOC_FIND(key, nkey, depth);
     return ret;
 }
 
-/* returns the address of the item pointer before the key.  if *item == 0,
+/*
+ * assoc_find on a backup serving reads, between two syncs: the table and the
+ * items are the primary's, and the links are only followed into the slabs,
+ * ASSOC_REPLICA_DEPTH deep at most.
+ */
+item *assoc_find_replica(const char *key, const size_t nkey, const uint32_t hv) {
+    item *it = item_ref_ptr(primary_hashtable[hv & hashmask(hashpower)]);
+    int depth = 0;
+
+    while (it && depth++ < ASSOC_REPLICA_DEPTH) {
+        if (!slabs_holds(it, sizeof(item)) || !slabs_holds(it, ITEM_ntotal(it)))
+            return NULL;
+        if ((nkey == it->nkey) && (memcmp(key, ITEM_key(it), nkey) == 0))
+            return it;
+        it = ITEM_h_next(it);
+    }
+    return NULL;
+}
+
+/* returns the address of the item ref before the key.  if *item == 0,
    the item wasn't found */
 
-static item** _hashitem_before (const char *key, const size_t nkey, const uint32_t hv) {
-    item **pos;
-    unsigned int oldbucket;
+static item_ref *_hashitem_before (const char *key, const size_t nkey, const uint32_t hv) {
+    item_ref *pos = &primary_hashtable[hv & hashmask(hashpower)];
+    item *it;
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        pos = &old_hashtable[oldbucket];
-    } else {
-        pos = &primary_hashtable[hv & hashmask(hashpower)];
+    while ((it = item_ref_ptr(*pos)) && ((nkey != it->nkey) || memcmp(key, ITEM_key(it), nkey))) {
+        pos = &it->h_next;
     }
+    return pos;
+}
 
-    while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, ITEM_key(*pos), nkey))) {
-        pos = &(*pos)->h_next;
+/* the table assoc_expand grows into, allocated before the workers are paused */
+static item_ref *expand_table = NULL;
+static char *expand_key = NULL;
+
+/* Allocates expand_table, returns 0 on success */
+static int assoc_expand_alloc(void) {
+    if (settings.shared_malloc_assoc) {
+        expand_table = assoc_shared_alloc(hashpower + 1, &expand_key);
+    } else {
+        expand_table = calloc(hashsize(hashpower + 1), sizeof(item_ref));
     }
-    return pos;
+    /* Bad news, but we can keep running. */
+    return expand_table == NULL ? -1 : 0;
 }
 
-/* grows the hashtable to the next power of 2. */
-static void assoc_expand(void) { /* if expend is called, exit that system. expending should not happen */
-    fprintf(stderr, "expending hashtable is forbidden.\n");
-    exit(EXIT_FAILURE);
-//    old_hashtable = primary_hashtable;
-
-//    primary_hashtable = calloc(hashsize(hashpower + 1), sizeof(void *));
-//    if (primary_hashtable) {
-//        if (settings.verbose > 1)
-//            fprintf(stderr, "Hash table expansion starting\n");
-//        hashpower++;
-//        expanding = true;
-//        expand_bucket = 0;
-//        STATS_LOCK();
-//       stats.hash_power_level = hashpower;
-//        stats.hash_bytes += hashsize(hashpower) * sizeof(void *);
-//        stats.hash_is_expanding = 1;
-//        STATS_UNLOCK();
-//    } else {
-//        primary_hashtable = old_hashtable;
-//        /* Bad news, but we can keep running. */
-//    }
+/*
+ * grows the hashtable to the next power of 2. Called with the workers paused:
+ * both halves of the new table start out as a copy of the old one, so every
+ * pair points to the chain of its old bucket until the maintenance thread
+ * splits it. The old table is left in old_*.
+ */
+static void assoc_expand(void) {
+    size_t half = hashsize(hashpower) * sizeof(item_ref);
+
+    memcpy(expand_table, primary_hashtable, half);
+    memcpy((char *)expand_table + half, primary_hashtable, half);
+    old_hashtable = primary_hashtable;
+    old_key = primary_key;
+    primary_hashtable = expand_table;
+    primary_key = expand_key;
+    expand_table = NULL;
+    expand_key = NULL;
+
+    if (settings.verbose > 1)
+        fprintf(stderr, "Hash table expansion starting\n");
+    hashpower++;
+    expanding = true;
+    expand_bucket = 0;
+    STATS_LOCK();
+    stats.hash_power_level = hashpower;
+    stats.hash_bytes = hashsize(hashpower) * sizeof(item_ref);
+    stats.hash_is_expanding = 1;
+    STATS_UNLOCK();
 }
 
 static void assoc_start_expand(void) {
-    if (started_expanding)
+    if (started_expanding || hashpower >= HASHPOWER_MAX)
         return;
 
     started_expanding = true;
     pthread_cond_signal(&maintenance_cond);
 }
 
+/* Sets the head of a bucket, and of its pair while they are not split */
+static void assoc_set_head(const ub4 bucket, const item_ref ref) {
+    primary_hashtable[bucket] = ref;
+    region_mark_dirty(&primary_hashtable[bucket], sizeof(item_ref));
+    if (assoc_unsplit(bucket)) {
+        ub4 pair = bucket ^ hashsize(hashpower - 1);
+
+        primary_hashtable[pair] = ref;
+        region_mark_dirty(&primary_hashtable[pair], sizeof(item_ref));
+    }
+}
+
 /* Note: this isn't an assoc_update.  The key must not already exist to call this */
 int assoc_insert(item *it, const uint32_t hv) {
-    unsigned int oldbucket;
+    ub4 bucket = hv & hashmask(hashpower);
 
 //    assert(assoc_find(ITEM_key(it), it->nkey) == 0);  /* shouldn't have duplicately named things defined */
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        it->h_next = old_hashtable[oldbucket];
-        old_hashtable[oldbucket] = it;
-    } else {
-        it->h_next = primary_hashtable[hv & hashmask(hashpower)];
-        primary_hashtable[hv & hashmask(hashpower)] = it;
-    }
+    it->h_next = primary_hashtable[bucket];
+    assoc_set_head(bucket, item_ref_of(it));
 
     pthread_mutex_lock(&hash_items_counter_lock);
     hash_items++;
@@ -191,11 +300,29 @@ int assoc_insert(item *it, const uint32_t hv) {
     return 1;
 }
 
+void assoc_relink(item *it, const uint32_t hv) {
+    item_ref *bucket = &primary_hashtable[hv & hashmask(hashpower)];
+
+    it->h_next = *bucket;
+    *bucket = item_ref_of(it);
+    region_mark_dirty(bucket, sizeof(item_ref));
+}
+
+void assoc_relinked(const uint64_t items) {
+    pthread_mutex_lock(&hash_items_counter_lock);
+    hash_items += items;
+    if (! expanding && hash_items > (hashsize(hashpower) * 3) / 2) {
+        assoc_start_expand();
+    }
+    pthread_mutex_unlock(&hash_items_counter_lock);
+}
+
 void assoc_delete(const char *key, const size_t nkey, const uint32_t hv) {
-    item **before = _hashitem_before(key, nkey, hv);
+    ub4 bucket = hv & hashmask(hashpower);
+    item_ref *before = _hashitem_before(key, nkey, hv);
 
     if (*before) {
-        item *nxt;
+        item_ref nxt;
         pthread_mutex_lock(&hash_items_counter_lock);
         hash_items--;
         pthread_mutex_unlock(&hash_items_counter_lock);
@@ -203,9 +330,15 @@ void assoc_delete(const char *key, const size_t nkey, const uint32_t hv) {
          * due to possible tail-optimization by the compiler
          */
         MEMCACHED_ASSOC_DELETE(key, nkey, hash_items);
-        nxt = (*before)->h_next;
-        (*before)->h_next = 0;   /* probably pointless, but whatever. */
-        *before = nxt;
+        nxt = ((item *)item_ref_ptr(*before))->h_next;
+        ((item *)item_ref_ptr(*before))->h_next = 0;   /* probably pointless, but whatever. */
+        /* before is either a bucket or the h_next of the previous item */
+        if (before == &primary_hashtable[bucket]) {
+            assoc_set_head(bucket, nxt);
+        } else {
+            *before = nxt;
+            region_mark_dirty(before, sizeof(item_ref));
+        }
         return;
     }
     /* Note:  we never actually get here.  the callers don't delete things
@@ -213,6 +346,72 @@ void assoc_delete(const char *key, const size_t nkey, const uint32_t hv) {
     assert(*before != 0);
 }
 
+/* The caller holds the item locks of the bucket. While expanding, a pair
+ * that was not split yet is returned with its lower bucket, so a walk racing
+ * with the split may see an item twice. */
+item *assoc_bucket(const uint64_t bucket) {
+    if (bucket >= hashsize(hashpower))
+        return NULL;
+    if (assoc_unsplit(bucket) && bucket >= hashsize(hashpower - 1))
+        return NULL;
+    return item_ref_ptr(primary_hashtable[bucket]);
+}
+
+/* Adopts the table size of the primary, see assoc.h */
+static item_ref *adopt_table = NULL;
+static char *adopt_key = NULL;
+static unsigned int adopt_power = 0;
+
+/* Swaps the adopted table in, and leaves the replaced one in old_* */
+static void assoc_adopt_swap(void) {
+    unsigned int power = hashpower;
+
+    old_hashtable = primary_hashtable;
+    old_key = primary_key;
+    primary_hashtable = adopt_table;
+    primary_key = adopt_key;
+    hashpower = adopt_power;
+    adopt_power = power;
+}
+
+int assoc_adopt(const size_t size) {
+    unsigned int power;
+
+    if (!settings.shared_malloc_assoc)
+        return -1;
+    for (power = 12; power < HASHPOWER_MAX && hashsize(power) * sizeof(item_ref) < size; power++)
+        ;
+    if (hashsize(power) * sizeof(item_ref) != size)
+        return -1;
+
+    /* no expansion runs while the maintenance thread is idle */
+    mutex_lock(&maintenance_lock);
+    if (power == hashpower) {
+        mutex_unlock(&maintenance_lock);
+        return 0;
+    }
+    adopt_table = assoc_shared_alloc(power, &adopt_key);
+    if (adopt_table == NULL) {
+        mutex_unlock(&maintenance_lock);
+        return -1;
+    }
+    adopt_power = power;
+    assoc_publish(assoc_adopt_swap);
+    /* the workers were paused, none of them still looks at the old table,
+     * whose hashpower the swap left in adopt_power */
+    assoc_shared_free(old_hashtable, adopt_power, old_key);
+    old_hashtable = NULL;
+    old_key = NULL;
+    STATS_LOCK();
+    stats.hash_power_level = hashpower;
+    stats.hash_bytes = hashsize(hashpower) * sizeof(item_ref);
+    STATS_UNLOCK();
+    mutex_unlock(&maintenance_lock);
+    if (settings.verbose > 0)
+        fprintf(stderr, "Hash table resized to the primary's, hashpower %u\n", hashpower);
+    return 0;
+}
+
 
 static volatile int do_run_maintenance_thread = 1;
 
@@ -228,7 +427,8 @@ static void *assoc_maintenance_thread(void *arg) {
         /* There is only one expansion thread, so no need to global lock. */
         for (ii = 0; ii < hash_bulk_move && expanding; ++ii) {
             item *it, *next;
-            int bucket;
+            ub4 half = hashsize(hashpower - 1);
+            item_ref heads[2] = { 0, 0 };
             void *item_lock = NULL;
 
             /* bucket = hv & hashmask(hashpower) =>the bucket of hash table
@@ -236,21 +436,24 @@ static void *assoc_maintenance_thread(void *arg) {
              *  also the lowest M bits of hv, and N is greater than M.
              *  So we can process expanding with only one item_lock. cool! */
             if ((item_lock = item_trylock(expand_bucket))) {
-                    for (it = old_hashtable[expand_bucket]; NULL != it; it = next) {
-                        next = it->h_next;
-                        bucket = hash(ITEM_key(it), it->nkey) & hashmask(hashpower);
-                        it->h_next = primary_hashtable[bucket];
-                        primary_hashtable[bucket] = it;
+                    for (it = item_ref_ptr(primary_hashtable[expand_bucket]); NULL != it; it = next) {
+                        int upper = (hash(ITEM_key(it), it->nkey) & half) != 0;
+
+                        next = ITEM_h_next(it);
+                        it->h_next = heads[upper];
+                        region_mark_dirty(&it->h_next, sizeof(item_ref));
+                        heads[upper] = item_ref_of(it);
                     }
 
-                    old_hashtable[expand_bucket] = NULL;
+                    primary_hashtable[expand_bucket] = heads[0];
+                    primary_hashtable[expand_bucket + half] = heads[1];
+                    region_mark_dirty(&primary_hashtable[expand_bucket], sizeof(item_ref));
+                    region_mark_dirty(&primary_hashtable[expand_bucket + half], sizeof(item_ref));
 
                     expand_bucket++;
-                    if (expand_bucket == hashsize(hashpower - 1)) {
+                    if (expand_bucket == half) {
                         expanding = false;
-                        free(old_hashtable);
                         STATS_LOCK();
-                        stats.hash_bytes -= hashsize(hashpower - 1) * sizeof(void *);
                         stats.hash_is_expanding = 0;
                         STATS_UNLOCK();
                         if (settings.verbose > 1)
@@ -271,6 +474,8 @@ static void *assoc_maintenance_thread(void *arg) {
             /* We are done expanding.. just wait for next invocation */
             started_expanding = false;
             pthread_cond_wait(&maintenance_cond, &maintenance_lock);
+            if (!do_run_maintenance_thread || assoc_expand_alloc() != 0)
+                continue;
             /* assoc_expand() swaps out the hash table entirely, so we need
              * all threads to not hold any references related to the hash
              * table while this happens.
@@ -278,9 +483,19 @@ static void *assoc_maintenance_thread(void *arg) {
              * allow dynamic hash table expansion without causing significant
              * wait times.
              */
-            pause_threads(PAUSE_ALL_THREADS);
-            assoc_expand();
-            pause_threads(RESUME_ALL_THREADS);
+            if (settings.shared_malloc_assoc) {
+                /* the new table is replicated from the start, with every
+                 * item in it, and the old one is dropped right away */
+                assoc_publish(assoc_expand);
+                assoc_shared_free(old_hashtable, hashpower - 1, old_key);
+                old_key = NULL;
+            } else {
+                pause_threads(PAUSE_ALL_THREADS);
+                assoc_expand();
+                pause_threads(RESUME_ALL_THREADS);
+                free(old_hashtable);
+            }
+            old_hashtable = NULL;
         }
     }
     return NULL;
@@ -1,8 +1,31 @@
 /* associative array */
+
+/* largest hashpower, hashsize is 32 bits */
+#define HASHPOWER_MAX 31
+
 void assoc_init(const int hashpower_init);
 item *assoc_find(const char *key, const size_t nkey, const uint32_t hv);
+/*
+ * Backup side, see item_read: looks the key up in the replicated table
+ * without trusting its links
+ */
+item *assoc_find_replica(const char *key, const size_t nkey, const uint32_t hv);
 int assoc_insert(item *item, const uint32_t hv);
+/*
+ * Warm restart: relinks an item into its bucket without counting it, with
+ * its item lock held, and adds the relinked items to the count at the end.
+ */
+void assoc_relink(item *it, const uint32_t hv);
+void assoc_relinked(const uint64_t items);
 void assoc_delete(const char *key, const size_t nkey, const uint32_t hv);
+/* Returns the first item of a hash bucket, for walking the whole table */
+item *assoc_bucket(const uint64_t bucket);
+/*
+ * Backup side: resizes the shared table to size bytes, the size of the primary's
+ * table, whose contents are received next. Returns 0 on success, -1 if size is
+ * not a table size or the table can't be allocated.
+ */
+int assoc_adopt(const size_t size);
 void do_assoc_move_next_bucket(void);
 int start_assoc_maintenance_thread(void);
 void stop_assoc_maintenance_thread(void);
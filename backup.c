@@ -1,16 +1,18 @@
 /********************************************************
  * Added as part of the memcached-1.4.24_RDMA project.
  * Implementing backup system via BSD sockets.
- * BackupClient method receives the address to connect too,
- * connects to the Memcached Backup Server in connectToServer method, and runs a RunBackupClient thread.
- * The client thread samples the queue every 2 seconds, and when there is an item in the queue,
- * starts the backup process.
- * BackupServer method receives an address to listen too,
+ * BackupClient method receives the transport and the address to connect too, starts the backup's
+ * RunReplicaSender thread, which connects over the transport (see backup_transport.h),
+ * and runs a RunBackupClient thread (one for all the backups). The client thread blocks on the queue, and when an item is enqueued
+ * and the batching window (failover_batch_ops/failover_batch_usec) closes, starts the backup process. Only the pages that were marked dirty since the previous
+ * sync are sent (see regions.h), each region as a list of (offset, length, data) runs.
+ * BackupServer method receives the transport and an address to listen too,
  * creates a RunBackupServer thread, and on each incoming connection starts connection_handler thread.
  * After the connection with the client is establisged, the backup receives the memory backup, and closes the connection.
  ********************************************************/
 
 #include "backup.h"
+#include "backup_transport.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -19,21 +21,29 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <pthread.h>
 #include <assert.h>
 #include "queue.h"
 #include "sharedmalloc.h"
 #include "memcached.h"
+#include "checkpoint.h"
+#include "merkle.h"
+#include "pack.h"
 
 #define MAXDATASIZE 10000 // max number of bytes we can get at once
-/*
- * get sockaddr, IPv4 or IPv6:
- */ 
-void *get_in_addr(struct sockaddr *sa);
+#define BACKUP_RECONNECT_MIN_MS 100 // first reconnect delay, doubled on every failure
+#define BACKUP_CUT_CHUNK (1024 * 1024) // a cut checks its deadline after copying this much
+#define BACKUP_FORCED_CUT_ROUNDS 16     // fuzzy syncs in a row before a cut is forced
+#define BACKUP_RECONNECT_MAX_MS 5000
+#define BACKUP_DISCARD_CHUNK (1024 * 1024) // what a discarding receiver reads at once
+#define BACKUP_SHADOW_SUFFIX ".shadow"
 /*
  * Closes the socket
  */
@@ -43,8 +53,7 @@ int closeSocket(int sockfd);
  */
 void sigchld_handler(int s);
 /*
- * Server connection handler thread.
- * Receives the memory backup within 3 steps - assoc, slabs and slabs_lists.
+ * Server connection handler thread, runs backup_receive on the connection.
  */
 void *connection_handler(void *socket_desc);
 /*
@@ -52,48 +61,216 @@ void *connection_handler(void *socket_desc);
  */
 void *RunBackupServer(void *arg);
 /*
- * Samples the queue every 2 seconds. When the queue is not empty,
- * starts the backup process - sebds the assoc, slabs and slab_lists memory sections.
+ * Waits on the queue. When an item is enqueued, starts the backup process -
+ * hands the dirty pages of the assoc, slabs and slab_lists memory sections
+ * (or in the oplog mode the pending operation log) to the replica senders.
  */
 void *RunBackupClient(void *arg);
+
+/*
+ * Sender context of a single backup, see RunReplicaSender.
+ * The client thread ORs the pages of every sync into dirty, and appends the
+ * log records of every sync to log. The sender swaps them with sending and
+ * log_sending, and ships those. If a sync fails they are merged back, so the
+ * backlog holds everything after the last acknowledged sync, and a backup that
+ * reconnects resumes from there. The backlog is bounded by the region sizes
+ * and failover_log_window_mb; a backup that falls further behind than that
+ * gets a full resync.
+ */
+typedef struct
+{
+    const backup_transport *transport;
+    backup_link link;
+    char *name;                     // the backup, as given in failover_dest
+    volatile bool connected;
+    bool full_resync;               // the backlog does not reach back to acked_seq
+    pthread_t thread;
+    pthread_mutex_t lock;           // protects everything but the sending side
+    pthread_cond_t cond;
+    bool pending;                   // work was handed to the sender
+    uint64_t pending_since;         // usec time the oldest unsent work was handed, 0 if none
+    uint64_t pending_seq;           // last sync handed to the sender
+    volatile uint64_t acked_seq;    // last sync the backup acknowledged
+    uint64_t *dirty[REGION_MAX];    // pages not sent to this backup yet
+    uint64_t *sending[REGION_MAX];  // pages of the sync in progress
+    size_t nwords[REGION_MAX];      // words in dirty and sending, per region
+    char *log;                      // log records not sent to this backup yet
+    size_t log_used;
+    size_t log_size;
+    char *log_sending;              // log records of the sync in progress
+    size_t log_sending_used;
+    size_t log_sending_size;
+    char *snapshot;                 // copy of the sending pages taken at a consistent cut
+    size_t snapshot_size;
+    const char *snapshot_at[REGION_MAX]; // runs of each region in snapshot, NULL to send live
+    size_t snapshot_budget;         // largest backlog copied at a consistent cut
+    bool want_cut;                  // the sender waits for a cut, see backup_take_cut
+    bool cut_taken;                 // which was taken, with the results below
+    bool cut_forced;                // past the budget and the deadline, see RunReplicaSender
+    unsigned int fuzzy_streak;      // fuzzy syncs acknowledged since the last consistent one
+    bool cut_resync;
+    bool cut_consistent;
+    uint64_t cut_since;
+    uint64_t cut_seq;
+    uint64_t cut_pause_usec;
+    size_t cut_copied;
+    bool checkpoint;                // the checkpointer, see BackupCheckpoint
+    uint64_t interval_usec;         // least time between the syncs of the checkpointer
+    uint64_t last_sync;             // usec time the checkpointer last started a sync
+    bool last_consistent;           // the last acknowledged sync was a consistent cut
+    uint64_t verify_every;          // usec between the anti-entropy passes, 0 for none
+    uint64_t last_verify;           // usec time of the last pass, 0 to make one at once
+    struct backup_replica_stats stats;
+} backup_replica;
+
+/*
+ * A region mapped by a backup server connection. It stays mapped between syncs,
+ * and the runs are received straight into it.
+ */
+typedef struct
+{
+    char *addr;
+    long size;
+} backup_mapping;
+
+/*
+ * Sends the dirty pages of the given region to the backup
+ */
+int sendRegionToReplica(backup_replica *rep, enum region_id id);
+/*
+ * Sends the pending operation log records to the backup (oplog mode)
+ */
+int sendLogToReplica(backup_replica *rep);
+/*
+ * Sends a buffer of log records to the backup, also used to send a full dump
+ */
+static int sendRecordsToReplica(const char *buf, size_t len, void *arg);
+static void distributeToReplicas(uint64_t seq);
+/*
+ * Starts a new sync and hands its work to the replicas.
+ * Called with g_distribute_lock held.
+ */
+static void backup_start_sync(void);
+/*
+ * Takes the backlog of the replica into its sending side, with the replica's lock held
+ */
+static void replica_take_backlog(backup_replica *rep, bool *resync, uint64_t *since,
+                                 uint64_t *seq);
+/*
+ * Copies the sending pages of the replica into its snapshot buffer, and adds the
+ * copied bytes to *copied. Returns false if they don't fit in its snapshot budget
+ * (unless forced), or if the copy would not be done by deadline (usec time, 0 for none).
+ */
+static bool replica_snapshot(backup_replica *rep, size_t *copied, uint64_t deadline,
+                             bool forced);
+/*
+ * Takes a consistent cut for every replica waiting for one.
+ * Called with g_distribute_lock held.
+ */
+static void backup_take_cut(void);
+/*
+ * A sender uses the regions between these, and waits while a region is replaced
+ */
+static void regions_enter(void);
+static void regions_leave(void);
+static void *RunReplicaSender(void *arg);
+/*
+ * Waits for the next checkpoint, with the replica's lock held
+ */
+static void replica_wait_interval(backup_replica *rep);
+/*
+ * Waits for work or for the next anti-entropy pass, with the replica's lock held.
+ * Returns true if the pass is due, which goes ahead of the work.
+ */
+static bool replica_wait_work(backup_replica *rep);
+/*
+ * Compares the regions with the backup's and puts the blocks that differ back
+ * into the backlog. Returns 0, or -1 if the link failed.
+ */
+static int replica_verify(backup_replica *rep);
 /*
- * Connects via BSD Socket to the given server.
+ * Connects to the backup, retrying with an exponential backoff until it succeeds,
+ * and agrees with it where to resume from
  */
-int connectToServer(char *clientHostname, char *clientPort, int *sockfd);
+static void replica_reconnect(backup_replica *rep);
 /*
- * Load the given file into memory (RAM) and sends it in chunks via BSD Socket
+ * Maps the region of the given key, unless it is already mapped with that size.
  */
-int sendBackupToClients(char *fileToSend, char *msg, int msgSize);
+static int backup_map_region(backup_mapping *m, const char *key, long size);
 
 static pthread_t g_serverThread;
+static pthread_t g_clientThread;
 static int g_backups_count = 0;
-static int g_client_socketfd[MAX_BACKUPS];
-
+static backup_replica g_replicas[MAX_BACKUPS + 1]; // and the checkpointer
+/*
+ * Sequence number of the last sync handed to the replicas. A write is covered
+ * by the first sync whose number is above the value read after the write.
+ */
+static volatile uint64_t g_sync_seq = 0;
+/*
+ * Serializes starting a sync, between the client thread and the senders
+ * taking a consistent cut
+ */
+static pthread_mutex_t g_distribute_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Bytes per usec the last cut copied at, 0 before the first one */
+static volatile uint64_t g_cut_copy_rate = 0;
+/*
+ * Senders in the middle of a sync, which use the regions and their bitmaps, and
+ * whether a region is being replaced (see backup_regions_hold)
+ */
+static pthread_mutex_t g_regions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_regions_cond = PTHREAD_COND_INITIALIZER;
+static int g_regions_users = 0;
+static bool g_regions_replacing = false;
+static __thread uint64_t g_signal_target = 0;
 /*
- * Loads the given file into the memory (RAM)
+ * Tells this instance's sync numbers from those of an earlier run. A backup
+ * only resumes from a sync number of the same epoch.
  */
-long ae_load_file_to_memory(const char *filename, char **result)
+static uint64_t g_epoch = 0;
+/* Last sync applied by this instance as a backup, and the epoch of its primary */
+static volatile long g_applied_epoch = 0;
+static volatile long g_applied_seq = 0;
+static volatile bool g_applied_consistent = false;
+/*
+ * Reads served from the replicated regions (see item_read). A connection makes
+ * the generation odd before it writes a sync to the regions, and even again
+ * once the sync was applied. The readers count themselves in g_replica_readers
+ * and back off while the generation is odd, and a writer waits for those
+ * already in to leave, on g_replica_cond, which the last of them signals.
+ */
+static pthread_mutex_t g_replica_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_replica_cond = PTHREAD_COND_INITIALIZER;
+static int g_replica_writers = 0;
+static volatile uint64_t g_replica_gen = 0;
+static volatile int g_replica_readers = 0;
+static uint64_t g_replica_write_start = 0;
+static uint64_t g_replica_published = 0; // usec time the last sync was applied
+static struct backup_serve_stats g_serve_stats;
+/*
+ * Shadow regions of a backup with failover_shadow, see backup_receive. The
+ * syncs are received into a second file per region, which is swapped with the
+ * live one once a consistent cut was received whole. written holds the pages
+ * in which the shadow differs from the live region: those of the syncs
+ * received since the last cut, and after a swap those just swapped in, which
+ * are then copied to the new shadow. A connection holds g_shadow_lock from the
+ * first run of a sync until its marker.
+ */
+typedef struct
 {
-	long size = 0;
-	FILE *f = fopen(filename, "rb");
-	if (f == NULL)
-	{
-		*result = NULL;
-		return -1; // -1 means file opening fail
-	}
-	fseek(f, 0, SEEK_END);
-	size = ftell(f);
-	fseek(f, 0, SEEK_SET);
-	*result = (char *)malloc(size+1);
-	if (size != fread(*result, sizeof(char), size, f))
-	{
-		free(*result);
-		return -2; // -2 means file reading fail
-	}
-	fclose(f);
-	(*result)[size] = 0;
-	return size;
-}
+    backup_mapping map;
+    char *key;                  // the region's shared_malloc key and BACKUP_SHADOW_SUFFIX
+    uint64_t *written;
+    size_t nwords;
+    bool seeded;                // copied from the live region once
+} backup_shadow;
+
+static pthread_mutex_t g_shadow_lock = PTHREAD_MUTEX_INITIALIZER;
+static backup_shadow g_shadows[REGION_MAX];
+static struct backup_shadow_stats g_shadow_stats;
+/* Semi-synchronous replication statistics */
+static pthread_mutex_t g_semisync_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct backup_semisync_stats g_semisync_stats;
 
 /*
  * Loads the given data into a file.
@@ -166,73 +343,6 @@ char** str_split(char* a_str, const char a_delim)
     return result;
 }
 
-/*
- * get sockaddr, IPv4 or IPv6:
- */ 
-void *get_in_addr(struct sockaddr *sa)
-{
-    if (sa->sa_family == AF_INET)
-    {
-        return &(((struct sockaddr_in*)sa)->sin_addr);
-    }
-
-    return &(((struct sockaddr_in6*)sa)->sin6_addr);
-}
-
-/*
- * Connects via BSD Socket to the given server.
- */
-int connectToServer(char *clientHostname, char *clientPort, int *sockfd)
-{
-    struct addrinfo hints, *servinfo, *p;
-    int rv;
-    char s[INET6_ADDRSTRLEN];
-
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-
-    rv = getaddrinfo(clientHostname, clientPort, &hints, &servinfo);
-    if (rv != 0)
-    {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
-    }
-
-    // loop through all the results and connect to the first we can
-    for (p = servinfo; p != NULL; p = p->ai_next)
-    {
-    	*sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (*sockfd == -1)
-        {
-            perror("client: socket\n");
-            continue;
-        }
-        rv = connect(*sockfd, p->ai_addr, p->ai_addrlen);
-        if (rv == -1)
-        {
-            close(*sockfd);
-            perror("client: connect\n");
-            continue;
-        }
-
-        break;
-    }
-
-    if (p == NULL)
-    {
-        fprintf(stderr, "client: failed to connect\n");
-        return 2;
-    }
-
-    inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr), s, sizeof s);
-    printf("client: connecting to %s\n", s);
-
-    freeaddrinfo(servinfo); // all done with this structure
-
-    return 0;
-}
-
 /*
  * receivs data from sockfd, and returns it in buf.
  * numbytes is the number of received bytes.
@@ -263,7 +373,6 @@ int closeSocket(int sockfd)
 	return 0;
 }
 
-#define BACKLOG 10     // how many pending connections queue will hold
 
 /*
  * Handels SIGCHLD Signal
@@ -278,402 +387,2098 @@ void sigchld_handler(int s)
     errno = saved_errno;
 }
 
-/*
- * Load the given file into memory (RAM) and sends it in chunks via BSD Socket
- */
-int sendBackupToClients(char *fileToSend, char *msg, int msgSize)
-{
-	int i;
-	char *content;
-	char *content_temp;
-	long size, size_temp;
-	ssize_t n;
-	size = ae_load_file_to_memory(fileToSend, &content);
-	if (size < 0)
-	{
-		puts("Error loading file");
-		return 1;
-	}
-	for (i = 0; i < g_backups_count; i++)
-	{
-		size_temp = size;
-		content_temp = content;
-		send((g_client_socketfd[i]), msg, msgSize, 0);
-		send((g_client_socketfd[i]), &size_temp, sizeof(long), 0);
-		do
-		{
-			n = send((g_client_socketfd[i]), content_temp, size_temp, 0);
-			content_temp += n;
-			size_temp -= n;
-		} while(size_temp > 0);
-	}
 
-	free(content);
-	return 0;
+static int backup_map_region(backup_mapping *m, const char *key, long size)
+{
+    if (m->addr != NULL && m->size == size)
+    {
+        return 0;
+    }
+    if (m->addr != NULL)
+    {
+        //the primary's region changed size, map it again
+        shared_free(m->addr, m->size);
+        m->addr = NULL;
+    }
+    m->addr = shared_malloc(NULL, size, key, NO_LOCK);
+    if (m->addr == NULL)
+    {
+        return -1;
+    }
+    m->size = size;
+    return 0;
 }
 
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
 
-int BackupClient(char *clientHostnamePortwithPort)
+/*
+ * Sends the pages of the given region that are set in the replica's sending bitmap.
+ */
+int sendRegionToReplica(backup_replica *rep, enum region_id id)
 {
-	int rv;
-	char** hostAndPort = str_split(clientHostnamePortwithPort, ':');
-	struct addr	*addr = (struct addr*)malloc(sizeof(struct addr));
-	addr->ip = hostAndPort[0];
-	addr->port = hostAndPort[1];
+    return rep->transport->send_region(&rep->link, id, rep->sending[id],
+                                       rep->snapshot_at[id]);
+}
 
-	if (g_backups_count >= MAX_BACKUPS)
-	{
-		printf("Maximal number of backups reached\n");
-		return -1;
-	}
+/*
+ * Sends the log records in the replica's sending buffer.
+ */
+int sendLogToReplica(backup_replica *rep)
+{
+    return sendRecordsToReplica(rep->log_sending, rep->log_sending_used, rep);
+}
 
-    if (connectToServer(hostAndPort[0], hostAndPort[1] , &g_client_socketfd[g_backups_count]) != 0)
-    {
-    	printf("Error creating client connection\n");
-    	return -1;
+static int sendRecordsToReplica(const char *buf, size_t len, void *arg)
+{
+    backup_replica *rep = (backup_replica *)arg;
 
-    }
-    g_backups_count++;
+    return rep->transport->send_records(&rep->link, buf, len);
+}
 
-    //Create backup server thread
-    rv = pthread_create(&g_serverThread, NULL, RunBackupClient, (void*) addr);
-    if(rv < 0)
+/*
+ * Allocates the replica's bitmaps of a region. A replica starts with every page
+ * dirty (every backed one of a sparse region), so whenever it joins it first
+ * gets a full copy of the region.
+ */
+static void replica_alloc_bitmaps(backup_replica *rep, enum region_id id, region_t *r)
+{
+    rep->dirty[id] = malloc(r->nwords * sizeof(uint64_t));
+    rep->sending[id] = calloc(r->nwords, sizeof(uint64_t));
+    if (rep->dirty[id] == NULL || rep->sending[id] == NULL)
     {
-    	printf("Error creating backup client thread\n");
-    	return -1;
+        fprintf(stderr, "Failed to allocate the dirty bitmaps of backup %s\n", rep->name);
+        exit(EXIT_FAILURE);
     }
-
-    return 0;
-
+    region_full_bitmap(id, rep->dirty[id]);
+    rep->nwords[id] = r->nwords;
 }
 
-int BackupServer(char *clientHostnamePortwithPort)
+/*
+ * Hands the pages collected since the previous sync to every replica.
+ * Called with the replica's lock held.
+ */
+static void replica_add_dirty_pages(backup_replica *rep)
 {
-	int rv;
-	char** hostAndPort = str_split(clientHostnamePortwithPort, ':');
-	struct addr	*addr = (struct addr*)malloc(sizeof(struct addr));
-	addr->ip = hostAndPort[0];
-	addr->port = hostAndPort[1];
+    int id;
+    size_t w;
+    region_t *r;
 
-    //Create backup server thread
-    rv = pthread_create(&g_serverThread, NULL, RunBackupServer, (void*) addr);
-    if(rv < 0)
+    for (id = 0; id < REGION_MAX; id++)
     {
-    	printf("Error creating backup server thread\n");
+        r = region_get(id);
+        if (r == NULL)
+            continue;
+        if (rep->dirty[id] == NULL)
+        {
+            replica_alloc_bitmaps(rep, id, r);
+            continue;
+        }
+        for (w = 0; w < r->nwords; w++)
+        {
+            rep->dirty[id][w] |= r->collected[w];
+        }
     }
-    return 0;
 }
 
 /*
- * Samples the queue every 2 seconds. When the queue is not empty,
- * starts the backup process - sebds the assoc, slabs and slab_lists memory sections.
+ * Drops the log backlog of the replica, which then needs a full resync.
+ * Called with the replica's lock held.
  */
-void *RunBackupClient(void *arg)
+static void replica_drop_log(backup_replica *rep)
 {
-	int queue_val;
-	char *path;
-
-	while (1)
-	{
-		//check if there a message waiting in the queue
-		if (!queue_empty())
-		{
-				queue_val = queue_frontelement();
-				printf("Got something in the queue! value = %d\n",queue_val);
-				queue_deq();
-				path = gen_full_path(settings.shared_malloc_assoc_key, KEYPATH);
-				sendBackupToClients(path,"queue data step 1 sending", 25);
-				free(path);
-				path = gen_full_path(settings.shared_malloc_slabs_key, KEYPATH);
-				sendBackupToClients(path,"queue data step 2 sending", 25);
-				free(path);
-				path = gen_full_path(settings.shared_malloc_slabs_lists_key, KEYPATH);
-				sendBackupToClients(path,"queue data step 3 sending", 25);
-				free(path);
-
-		}
-		sleep(2);
-	}
+    rep->stats.log_dropped += rep->log_used;
+    rep->log_used = 0;
+    rep->full_resync = true;
 }
 
 /*
- * Server backup thread. Waits for incoming communication.
+ * Appends the taken log records to the replica's buffer.
+ * Called with the replica's lock held.
  */
-void *RunBackupServer(void *arg)
+static void replica_add_log(backup_replica *rep, const char *log, size_t len)
 {
-    int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
-    struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_storage their_addr; // connector's address information
-    socklen_t sin_size;
-    struct sigaction sa;
-    int yes=1;
-    char s[INET6_ADDRSTRLEN];
-    int rv;
-    struct addr 		*addr = (struct addr*)arg;
+    size_t window = (size_t)settings.failover_log_window_mb * 1024 * 1024;
+    size_t new_size;
+    char *new_log;
 
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE; // use my IP
-
-    rv = getaddrinfo(NULL, addr->port, &hints, &servinfo);
-    if (rv != 0)
+    if (rep->log_used + len > window)
     {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        exit(1);
+        /* Too far behind to resume from the log, don't let it hold the memory */
+        replica_drop_log(rep);
+        if (len > window)
+        {
+            rep->stats.log_dropped += len;
+            return;
+        }
     }
-
-    // loop through all the results and bind to the first we can
-    for (p = servinfo; p != NULL; p = p->ai_next)
+    if (rep->log_used + len > rep->log_size)
     {
-    	sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (sockfd == -1)
+        new_size = rep->log_size ? rep->log_size : 64 * 1024;
+        while (new_size < rep->log_used + len)
+            new_size *= 2;
+        new_log = realloc(rep->log, new_size);
+        if (new_log == NULL)
         {
-            perror("server: socket\n");
-            continue;
+            replica_drop_log(rep);
+            rep->stats.log_dropped += len;
+            return;
         }
+        rep->log = new_log;
+        rep->log_size = new_size;
+    }
+    memcpy(rep->log + rep->log_used, log, len);
+    rep->log_used += len;
+}
 
-    	rv = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-        if (rv == -1)
-        {
-            perror("setsockopt\n");
-            exit(1);
-        }
+/*
+ * Merges the work of a failed sync back into the replica's backlog, ahead of
+ * the work handed since, so the next sync after a reconnect sends it again.
+ * Called with the replica's lock held.
+ */
+static void replica_requeue(backup_replica *rep, bool resync)
+{
+    int id;
+    size_t w, new_size;
+    region_t *r;
+    char *tmp_log;
 
-        rv = bind(sockfd, p->ai_addr, p->ai_addrlen);
-        if (rv == -1) {
-            close(sockfd);
-            perror("server: bind\n");
+    for (id = 0; id < REGION_MAX; id++)
+    {
+        r = region_get(id);
+        if (r == NULL || rep->sending[id] == NULL)
             continue;
+        for (w = 0; w < r->nwords; w++)
+        {
+            rep->dirty[id][w] |= rep->sending[id][w];
+            rep->sending[id][w] = 0;
         }
-
-        break;
     }
 
-    freeaddrinfo(servinfo); // all done with this structure
+    new_size = rep->log_sending_used + rep->log_used;
+    if (new_size > (size_t)settings.failover_log_window_mb * 1024 * 1024)
+    {
+        rep->stats.log_dropped += rep->log_sending_used;
+        replica_drop_log(rep);
+    }
+    else if (rep->log_sending_used > 0)
+    {
+        //the older records go first: append the newer ones and swap the buffers
+        tmp_log = new_size > rep->log_sending_size ?
+            realloc(rep->log_sending, new_size) : rep->log_sending;
+        if (tmp_log == NULL)
+        {
+            rep->stats.log_dropped += rep->log_sending_used;
+            replica_drop_log(rep);
+        }
+        else
+        {
+            if (new_size > rep->log_sending_size)
+                rep->log_sending_size = new_size;
+            rep->log_sending = tmp_log;
+            if (rep->log_used > 0)
+                memcpy(rep->log_sending + rep->log_sending_used, rep->log, rep->log_used);
+            rep->log_sending_used = new_size;
+            tmp_log = rep->log;
+            new_size = rep->log_size;
+            rep->log = rep->log_sending;
+            rep->log_size = rep->log_sending_size;
+            rep->log_used = rep->log_sending_used;
+            rep->log_sending = tmp_log;
+            rep->log_sending_size = new_size;
+        }
+    }
+    rep->log_sending_used = 0;
+    if (resync)
+        rep->full_resync = true;
+    rep->pending = true;
+}
 
-    if (p == NULL)
+/*
+ * Hands the work of a sync to every replica and wakes up their senders.
+ * A sync with no work is handed too, so its number gets acknowledged.
+ * A disconnected replica keeps its backlog until it reconnects.
+ */
+static void distributeToReplicas(uint64_t seq)
+{
+    int i, id;
+    char *log = NULL;
+    size_t len = 0;
+    bool overflow = false;
+    uint64_t now = now_usec();
+    backup_replica *rep;
+
+    if (settings.failover_oplog)
     {
-        fprintf(stderr, "server: failed to bind\n");
-        exit(1);
+        log = replog_take(&len, &overflow);
+        if (overflow)
+            fprintf(stderr, "The replication log outgrew %u MB, the backups get a full resync\n",
+                    settings.failover_log_window_mb);
+    }
+    else
+    {
+        for (id = 0; id < REGION_MAX; id++)
+        {
+            if (region_get(id) != NULL)
+                region_collect_dirty(id);
+        }
     }
 
-    rv = listen(sockfd, BACKLOG);
-    if (rv == -1)
+    for (i = 0; i < g_backups_count; i++)
     {
-        perror("listen\n");
-        exit(1);
+        rep = &g_replicas[i];
+        pthread_mutex_lock(&rep->lock);
+        if (overflow)
+            replica_drop_log(rep);
+        else if (log != NULL)
+            replica_add_log(rep, log, len);
+        else if (!settings.failover_oplog)
+            replica_add_dirty_pages(rep);
+        if (rep->pending_since == 0)
+            rep->pending_since = now;
+        rep->pending_seq = seq;
+        rep->pending = true;
+        pthread_cond_signal(&rep->cond);
+        pthread_mutex_unlock(&rep->lock);
     }
 
-    sa.sa_handler = sigchld_handler; // reap all dead processes
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
+    if (log != NULL)
+        replog_release();
+}
 
-    rv = sigaction(SIGCHLD, &sa, NULL);
-    if (rv == -1)
+static void backup_start_sync(void)
+{
+	uint64_t seq;
+
+	//every write signalled before this point is covered by sync seq
+#ifdef HAVE_GCC_ATOMICS
+	seq = __sync_add_and_fetch(&g_sync_seq, 1);
+#else
+	pthread_mutex_lock(&g_semisync_lock);
+	seq = ++g_sync_seq;
+	pthread_mutex_unlock(&g_semisync_lock);
+#endif
+	distributeToReplicas(seq);
+}
+
+static void replica_take_backlog(backup_replica *rep, bool *resync, uint64_t *since,
+                                 uint64_t *seq)
+{
+    uint64_t *tmp;
+    char *tmp_log;
+    size_t tmp_size;
+    int id;
+
+    for (id = 0; id < REGION_MAX; id++)
     {
-        perror("sigaction\n");
-        exit(1);
+        tmp = rep->sending[id];
+        rep->sending[id] = rep->dirty[id];
+        rep->dirty[id] = tmp;
     }
+    tmp_log = rep->log_sending;
+    tmp_size = rep->log_sending_size;
+    rep->log_sending = rep->log;
+    rep->log_sending_size = rep->log_size;
+    rep->log_sending_used = rep->log_used;
+    rep->log = tmp_log;
+    rep->log_size = tmp_size;
+    rep->log_used = 0;
+    *resync = rep->full_resync;
+    rep->full_resync = false;
+    *since = rep->pending_since;
+    *seq = rep->pending_seq;
+    rep->pending_since = 0;
+    rep->pending = false;
+}
 
-    printf("server: waiting for connections...\n");
+/*
+ * Whether a cut can copy pages for the replica: within its budget, and at the
+ * rate of the last copy within failover_snapshot_pause_usec
+ */
+static bool replica_cut_fits(backup_replica *rep, size_t pages)
+{
+    uint64_t rate = g_cut_copy_rate;
 
-    while(1) // main accept() loop
+    if (pages > rep->snapshot_budget / REGION_PAGE_SIZE)
+        return false;
+    return settings.failover_snapshot_pause_usec == 0 || rate == 0 ||
+           pages * REGION_PAGE_SIZE / rate <= settings.failover_snapshot_pause_usec;
+}
+
+/*
+ * Number of pages in the replica's backlog plus those dirtied since the last
+ * sync, which is what a consistent cut would have to copy.
+ * Called with the replica's lock held.
+ */
+static size_t replica_cut_pages(backup_replica *rep)
+{
+    region_t *r;
+    size_t w, pages = 0;
+    int id;
+
+    for (id = 0; id < REGION_MAX; id++)
     {
-        sin_size = sizeof their_addr;
-        new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
-        if (new_fd == -1)
-        {
-            perror("accept\n");
+        r = region_get(id);
+        if (r == NULL)
             continue;
-        }
+        if (rep->dirty[id] == NULL)
+            return SIZE_MAX;
+        for (w = 0; w < r->nwords; w++)
+            pages += __builtin_popcountll(rep->dirty[id][w] | r->dirty[w]);
+    }
+    return pages;
+}
 
-        inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr), s, sizeof s);
-        printf("server: got connection from %s\n", s);
+static bool replica_snapshot(backup_replica *rep, size_t *copied, uint64_t deadline,
+                             bool forced)
+{
+    size_t budget = rep->snapshot_budget;
+    size_t pos, offset, len, n, used = 0, done = 0;
+    uint64_t start = now_usec(), now;
+    region_t *r;
+    char *p;
+    int id;
+
+    for (id = 0; id < REGION_MAX; id++)
+    {
+        if (region_get(id) == NULL || rep->sending[id] == NULL)
+            continue;
+        pos = 0;
+        while (region_next_dirty_run(id, rep->sending[id], &pos, &offset, &len))
+            used += len;
+    }
+    if (used > budget && !forced)
+        return false;
+    //don't start a copy that can't be done in time
+    if (deadline != 0 && g_cut_copy_rate > 0 && start + used / g_cut_copy_rate > deadline)
+        return false;
+    if (used > rep->snapshot_size)
+    {
+        p = realloc(rep->snapshot, used);
+        if (p == NULL)
+            return false;
+        rep->snapshot = p;
+        rep->snapshot_size = used;
+    }
 
-        //Create receive thread
-        pthread_t thread;
-        rv = pthread_create(&thread, NULL , connection_handler, (void*) &new_fd);
-        if(rv < 0)
+    p = rep->snapshot;
+    for (id = 0; id < REGION_MAX; id++)
+    {
+        r = region_get(id);
+        if (r == NULL || rep->sending[id] == NULL)
+            continue;
+        rep->snapshot_at[id] = p;
+        pos = 0;
+        while (region_next_dirty_run(id, rep->sending[id], &pos, &offset, &len))
         {
-        	printf("Error creating receive thread\n");
+            //a MB at a time, and give up once past the deadline
+            for (n = 0; n < len; n += BACKUP_CUT_CHUNK)
+            {
+                memcpy(p + n, (char *)r->base + offset + n,
+                       len - n < BACKUP_CUT_CHUNK ? len - n : BACKUP_CUT_CHUNK);
+                if (deadline != 0 && (now = now_usec()) > deadline)
+                {
+                    done += n;
+                    if (now > start)
+                        g_cut_copy_rate = done / (now - start) + 1;
+                    for (id = 0; id < REGION_MAX; id++)
+                        rep->snapshot_at[id] = NULL;
+                    return false;
+                }
+            }
+            p += len;
+            done += len;
         }
     }
-
-    exit(0);
+    now = now_usec();
+    if (used >= BACKUP_CUT_CHUNK && now > start)
+        g_cut_copy_rate = used / (now - start) + 1;
+    *copied += used;
+    return true;
 }
 
 /*
- * Server connection handler thread.
- * Receives the memory backup within 3 steps - assoc, slabs and slabs_lists.
+ * The workers are paused once for all the replicas that wait for a cut, rather than
+ * once per replica, since their senders tend to wake up together on every sync.
+ * With failover_snapshot_pause_usec the pause ends by then: a replica whose copy
+ * would not be done in time is sent fuzzy instead, and asks for a cut again after.
+ * A forced cut copies its whole backlog, however long the pause gets.
  */
-void *connection_handler(void *socket_desc)
+static void backup_take_cut(void)
 {
-	int received = 0;
-	int sock = *(int*)socket_desc;
-	long data_size = 0;
-	long original_data_size = 0;
-	char msg[25];
-	char data[MAXDATASIZE];
-	int step = 0;
-	data_size = 0;
-	void *memcached1_slabs = NULL;
-	void *memcached1_slabs_lists = NULL;
-	void *memcached1_assoc = NULL;
-	while (1)
-	{
-		received = 0;
-		memset(data, 0, MAXDATASIZE);
-		memset(msg, 0, 25);
-		if (step == 0)
-		{
-			received = recv(sock, &msg, sizeof(char) * 25, 0);
-			if (received == -1 || received != 25)
-			{
-				printf("error0\n");
-			}
-			if (strncmp(msg,"queue data step 1 sending",25) == 0)
-			{
-				received = recv(sock, &data_size, sizeof(long), 0);
-				if (received == -1)
-				{
-					printf("error1\n");
-				}
-				original_data_size = data_size;
-				step = 1;
-				memcached1_assoc = shared_malloc(NULL, original_data_size,settings.shared_malloc_assoc_key,NO_LOCK);
-
-				printf("Moving to step 1\n");
-			}
-
-		}
-		if (step == 1 && data_size != 0)
+    bool in_cut[MAX_BACKUPS + 1];
+    uint64_t start, deadline, pause_usec;
+    backup_replica *rep;
+    int i, id;
+
+    start = now_usec();
+    deadline = settings.failover_snapshot_pause_usec > 0 ?
+               start + settings.failover_snapshot_pause_usec : 0;
+    pause_threads(PAUSE_ALL_THREADS);
+    //no write is in flight now, a new sync covers all of them (unless
+    //nothing was written since the last one, which then already does)
+    for (id = 0; id < REGION_MAX; id++)
+    {
+        if (region_get(id) != NULL && region_count_dirty(id) > 0)
+        {
+            backup_start_sync();
+            break;
+        }
+    }
+    for (i = 0; i < g_backups_count; i++)
+    {
+        rep = &g_replicas[i];
+        pthread_mutex_lock(&rep->lock);
+        in_cut[i] = rep->want_cut;
+        if (in_cut[i])
+        {
+            replica_take_backlog(rep, &rep->cut_resync, &rep->cut_since, &rep->cut_seq);
+            rep->want_cut = false;
+        }
+        pthread_mutex_unlock(&rep->lock);
+        if (in_cut[i])
+        {
+            rep->cut_copied = 0;
+            rep->cut_consistent = replica_snapshot(rep, &rep->cut_copied,
+                                                   rep->cut_forced ? 0 : deadline,
+                                                   rep->cut_forced);
+        }
+    }
+    pause_threads(RESUME_ALL_THREADS);
+    pause_usec = now_usec() - start;
+    for (i = 0; i < g_backups_count; i++)
+    {
+        if (in_cut[i])
+        {
+            g_replicas[i].cut_pause_usec = pause_usec;
+            g_replicas[i].cut_taken = true;
+        }
+    }
+}
+
+static void regions_enter(void)
+{
+    pthread_mutex_lock(&g_regions_lock);
+    while (g_regions_replacing)
+        pthread_cond_wait(&g_regions_cond, &g_regions_lock);
+    g_regions_users++;
+    pthread_mutex_unlock(&g_regions_lock);
+}
+
+static void regions_leave(void)
+{
+    pthread_mutex_lock(&g_regions_lock);
+    if (--g_regions_users == 0)
+        pthread_cond_broadcast(&g_regions_cond);
+    pthread_mutex_unlock(&g_regions_lock);
+}
+
+void backup_regions_hold(void)
+{
+    pthread_mutex_lock(&g_regions_lock);
+    while (g_regions_replacing)
+        pthread_cond_wait(&g_regions_cond, &g_regions_lock);
+    g_regions_replacing = true;
+    while (g_regions_users > 0)
+        pthread_cond_wait(&g_regions_cond, &g_regions_lock);
+    pthread_mutex_unlock(&g_regions_lock);
+    pthread_mutex_lock(&g_distribute_lock);
+}
+
+void backup_regions_release(void)
+{
+    pthread_mutex_unlock(&g_distribute_lock);
+    pthread_mutex_lock(&g_regions_lock);
+    g_regions_replacing = false;
+    pthread_cond_broadcast(&g_regions_cond);
+    pthread_mutex_unlock(&g_regions_lock);
+}
+
+void backup_region_replaced(enum region_id id)
+{
+    region_t *r = region_get(id);
+    backup_replica *rep;
+    int i;
+
+    for (i = 0; i < g_backups_count && r != NULL; i++)
+    {
+        rep = &g_replicas[i];
+        pthread_mutex_lock(&rep->lock);
+        free(rep->dirty[id]);
+        free(rep->sending[id]);
+        replica_alloc_bitmaps(rep, id, r);
+        pthread_mutex_unlock(&rep->lock);
+    }
+    //send the new region without waiting for the next write, with the pages
+    //written before it that no write signalled (the copy the expansion made)
+    if (g_backups_count > 0 && r != NULL)
+        backup_start_sync();
+}
+
+void backup_region_resized(enum region_id id)
+{
+    region_t *r = region_get(id);
+    backup_replica *rep;
+    uint64_t *dirty, *sending;
+    size_t old;
+    int i;
+
+    for (i = 0; i < g_backups_count && r != NULL; i++)
+    {
+        rep = &g_replicas[i];
+        pthread_mutex_lock(&rep->lock);
+        old = rep->nwords[id];
+        if (rep->dirty[id] != NULL && r->nwords > old)
+        {
+            dirty = realloc(rep->dirty[id], r->nwords * sizeof(uint64_t));
+            if (dirty != NULL)
+                rep->dirty[id] = dirty;
+            sending = realloc(rep->sending[id], r->nwords * sizeof(uint64_t));
+            if (sending != NULL)
+                rep->sending[id] = sending;
+            if (dirty == NULL || sending == NULL)
+            {
+                fprintf(stderr, "Failed to allocate the dirty bitmaps of backup %s\n", rep->name);
+                exit(EXIT_FAILURE);
+            }
+            //the new pages hold nothing yet, the backup's file grows with zeros
+            memset(dirty + old, 0, (r->nwords - old) * sizeof(uint64_t));
+            memset(sending + old, 0, (r->nwords - old) * sizeof(uint64_t));
+            rep->nwords[id] = r->nwords;
+        }
+        pthread_mutex_unlock(&rep->lock);
+    }
+}
+
+/*
+ * Sender thread of a single replica. Takes the work handed to the replica,
+ * and ships it at the replica's own pace. While a sync is in progress new work
+ * accumulates in the replica's bitmaps and log, so a slow replica sends larger
+ * and fewer syncs, without stalling the primary or the other backups.
+ * When the connection fails, the work of the failed sync is put back, and the
+ * sender reconnects and resumes.
+ *
+ * The pages of a sync are read from the live regions while the workers keep
+ * writing, so the backup gets a fuzzy image that mixes states of the primary.
+ * When the backlog fits in failover_snapshot_mb, the sender makes a consistent
+ * cut instead: with the workers paused it starts a new sync, so nothing written
+ * before the pause is left out, and copies the pages of the backlog; the workers
+ * are resumed as soon as the copy is done, and the copy is sent. A single pause
+ * takes the cuts of all the senders waiting for one, and is cut short after
+ * failover_snapshot_pause_usec (see backup_take_cut). The backlog
+ * holds every page written since the last acknowledged sync, so a cut also fixes
+ * what the fuzzy syncs before it got wrong, and the backup then holds the exact
+ * state of the primary at the cut. A large backlog (a full sync or a backup that
+ * fell far behind) is sent fuzzy, and a cut is made right after it. Under
+ * sustained writes the backlog may never get back under the budget, so after
+ * BACKUP_FORCED_CUT_ROUNDS fuzzy syncs in a row the cut is forced: it copies the
+ * whole backlog, past failover_snapshot_mb and failover_snapshot_pause_usec.
+ */
+static void *RunReplicaSender(void *arg)
+{
+    backup_replica *rep = (backup_replica *)arg;
+    uint64_t since, seq, start, end, pause_usec;
+    size_t w, copied, budget = rep->snapshot_budget;
+    region_t *r;
+    bool resync, cut, consistent, verify;
+    int id, rv;
+
+    while (1)
+    {
+        if (!rep->connected)
+        {
+            replica_reconnect(rep);
+        }
+        pthread_mutex_lock(&rep->lock);
+        if (rep->checkpoint)
+        {
+            replica_wait_interval(rep);
+        }
+        verify = replica_wait_work(rep);
+        pthread_mutex_unlock(&rep->lock);
+        if (verify)
+        {
+            regions_enter();
+            rv = replica_verify(rep);
+            regions_leave();
+            if (rv != 0)
+            {
+                pthread_mutex_lock(&rep->lock);
+                rep->connected = false;
+                pthread_mutex_unlock(&rep->lock);
+                printf("backup %s disconnected\n", rep->name);
+                rep->transport->close(&rep->link);
+            }
+            continue;
+        }
+        regions_enter();
+        pthread_mutex_lock(&rep->lock);
+        pause_usec = 0;
+        copied = 0;
+        cut = !settings.failover_oplog && budget > 0 && !rep->full_resync;
+        //a backlog that stays over the budget under the writes is cut anyway
+        rep->cut_forced = cut && rep->fuzzy_streak >= BACKUP_FORCED_CUT_ROUNDS;
+        cut = cut && (rep->cut_forced || replica_cut_fits(rep, replica_cut_pages(rep)));
+        if (!cut)
+        {
+            replica_take_backlog(rep, &resync, &since, &seq);
+            pthread_mutex_unlock(&rep->lock);
+            consistent = settings.failover_oplog;
+        }
+        else
+        {
+            //the sender that gets the lock first takes the cut of every waiting one
+            rep->want_cut = true;
+            rep->cut_taken = false;
+            pthread_mutex_unlock(&rep->lock);
+            pthread_mutex_lock(&g_distribute_lock);
+            if (!rep->cut_taken)
+                backup_take_cut();
+            pthread_mutex_unlock(&g_distribute_lock);
+            resync = rep->cut_resync;
+            since = rep->cut_since;
+            seq = rep->cut_seq;
+            consistent = rep->cut_consistent;
+            copied = rep->cut_copied;
+            pause_usec = rep->cut_pause_usec;
+        }
+
+        start = now_usec();
+        rep->link.bytes = 0;
+        rep->link.zero_bytes = 0;
+        rep->link.packed_saved = 0;
+        rv = 0;
+        if (resync && !settings.failover_oplog)
+        {
+            for (id = 0; id < REGION_MAX; id++)
+            {
+                r = region_get(id);
+                if (r != NULL && rep->sending[id] != NULL)
+                    region_full_bitmap(id, rep->sending[id]);
+            }
+        }
+        else if (resync)
+        {
+            //the dump goes first, the records logged meanwhile are applied after it
+            rv = replog_dump(sendRecordsToReplica, rep);
+        }
+        for (id = 0; id < REGION_MAX && rv == 0; id++)
+            rv = sendRegionToReplica(rep, id);
+        if (rv == 0)
+            rv = sendLogToReplica(rep);
+        if (rv == 0)
+            rv = rep->transport->ack(&rep->link, seq, consistent);
+        end = now_usec();
+        for (id = 0; id < REGION_MAX; id++)
+            rep->snapshot_at[id] = NULL;
+
+        pthread_mutex_lock(&rep->lock);
+        rep->stats.syncs++;
+        rep->stats.bytes_sent += rep->link.bytes;
+        rep->stats.zero_bytes += rep->link.zero_bytes;
+        rep->stats.packed_saved += rep->link.packed_saved;
+        rep->stats.send_usec += end - start;
+        rep->stats.lag_usec = end - since;
+        if (rep->stats.lag_usec > rep->stats.max_lag_usec)
+            rep->stats.max_lag_usec = rep->stats.lag_usec;
+        if (rv == 0)
+        {
+            if (resync)
+                rep->stats.full_resyncs++;
+            if (consistent)
+            {
+                rep->stats.consistent_syncs++;
+                rep->fuzzy_streak = 0;
+            }
+            else
+            {
+                rep->stats.fuzzy_syncs++;
+                rep->fuzzy_streak++;
+            }
+            if (consistent && rep->cut_forced && rep->stats.forced_cuts++ == 0)
+                fprintf(stderr, "Backup %s got %d fuzzy syncs in a row, its cuts are "
+                        "forced past the snapshot budget and pause\n",
+                        rep->name, BACKUP_FORCED_CUT_ROUNDS);
+            rep->stats.snapshot_bytes += copied;
+            rep->stats.snapshot_pause_usec += pause_usec;
+            if (pause_usec > rep->stats.max_snapshot_pause_usec)
+                rep->stats.max_snapshot_pause_usec = pause_usec;
+            rep->acked_seq = seq;
+            rep->last_consistent = consistent;
+            //a cut follows a fuzzy sync at once, so that the backup converges
+            //even if nothing is written after it
+            if (!consistent && budget > 0 && !rep->checkpoint && !rep->pending)
+            {
+                rep->pending = true;
+                rep->pending_since = end;
+            }
+            rep->log_sending_used = 0;
+            for (id = 0; id < REGION_MAX; id++)
+            {
+                r = region_get(id);
+                if (r == NULL || rep->sending[id] == NULL)
+                    continue;
+                for (w = 0; w < r->nwords; w++)
+                    rep->sending[id][w] = 0;
+            }
+        }
+        else
+        {
+            rep->connected = false;
+            if (rep->pending_since == 0 || since < rep->pending_since)
+                rep->pending_since = since;
+            replica_requeue(rep, resync);
+        }
+        pthread_mutex_unlock(&rep->lock);
+        regions_leave();
+
+        if (rv == 0)
+        {
+            backup_acks_notify();
+        }
+        else
+        {
+            printf("backup %s disconnected\n", rep->name);
+            rep->transport->close(&rep->link);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The syncs handed meanwhile accumulate in the backlog, so a checkpoint writes
+ * a page once however often it was written to. The writes that signal no sync
+ * (deletes, incr/decr and the like) are collected by a sync the checkpointer
+ * starts itself when nothing else did. After a fuzzy sync it asks for a cut
+ * even if nothing was written since, to make the checkpoint consistent.
+ */
+static void replica_wait_interval(backup_replica *rep)
+{
+    struct timespec ts;
+    uint64_t due, now;
+    bool dirty;
+    int id;
+
+    while (1)
+    {
+        due = rep->last_sync + rep->interval_usec;
+        while ((now = now_usec()) < due)
+        {
+            ts.tv_sec = due / 1000000;
+            ts.tv_nsec = (due % 1000000) * 1000;
+            pthread_cond_timedwait(&rep->cond, &rep->lock, &ts);
+        }
+        rep->last_sync = now;
+        if (rep->pending)
+            return;
+        pthread_mutex_unlock(&rep->lock);
+        pthread_mutex_lock(&g_distribute_lock);
+        dirty = false;
+        for (id = 0; id < REGION_MAX && !dirty; id++)
+            dirty = region_get(id) != NULL && region_count_dirty(id) > 0;
+        if (dirty)
+            backup_start_sync();
+        pthread_mutex_unlock(&g_distribute_lock);
+        pthread_mutex_lock(&rep->lock);
+        if (!rep->pending && rep->connected && rep->acked_seq > 0 && !rep->last_consistent)
+            rep->pending = true;
+        if (rep->pending)
+            return;
+    }
+}
+
+static bool replica_wait_work(backup_replica *rep)
+{
+    struct timespec ts;
+    uint64_t due, now;
+
+    while (1)
+    {
+        //a backup about to get everything again has nothing to compare yet
+        due = rep->verify_every > 0 && rep->acked_seq > 0 && !rep->full_resync ?
+              rep->last_verify + rep->verify_every : 0;
+        now = now_usec();
+        if (due != 0 && due <= now)
+            return true;
+        if (rep->pending)
+            return false;
+        if (due == 0)
+        {
+            pthread_cond_wait(&rep->cond, &rep->lock);
+            continue;
+        }
+        ts.tv_sec = due / 1000000;
+        ts.tv_nsec = (due % 1000000) * 1000;
+        pthread_cond_timedwait(&rep->cond, &rep->lock, &ts);
+    }
+}
+
+/*
+ * Anti-entropy pass, between two syncs. The Merkle tree of every region (see
+ * merkle.h) is compared with the backup's from the roots down, asking only for
+ * the children of the nodes that differ, so regions that match cost a digest
+ * each. The backup holds the last acknowledged sync meanwhile, and every page
+ * written since is dirty or in the backlog: a block with such a page differs
+ * because it is on its way, the others because the backup diverged (a write
+ * that marked nothing, a bug, a file changed under it), and only those are put
+ * back into the backlog, where the next sync finds them.
+ */
+static int replica_verify(backup_replica *rep)
+{
+    merkle_tree tree;
+    region_t *r;
+    long *nodes = NULL, *next = NULL, *tmp;
+    uint32_t *digests = NULL;
+    size_t n, m, i, j, page, last, marked, blocks = 0;
+    uint64_t start = now_usec(), sent = rep->link.bytes, received = 0;
+    long got = 1;
+    int id, level, rv = 0;
+    bool written;
+
+    memset(&tree, 0, sizeof(tree));
+    for (id = 0; id < REGION_MAX && rv == 0 && got != 0; id++)
+    {
+        r = region_get(id);
+        if (r == NULL || rep->dirty[id] == NULL)
+            continue;
+        free(nodes);
+        free(next);
+        free(digests);
+        if (merkle_build(&tree, r->base, r->size, r->size, r->key) != 0 ||
+            (nodes = malloc(tree.count[0] * sizeof(long))) == NULL ||
+            (next = malloc(tree.count[0] * sizeof(long))) == NULL ||
+            (digests = malloc(tree.count[0] * sizeof(uint32_t))) == NULL)
+        {
+            printf("backup %s: out of memory for the digests of region %d\n", rep->name, id);
+            break;
+        }
+        level = tree.levels - 1;
+        nodes[0] = 0;
+        n = 1;
+        while (n > 0)
+        {
+            //0 if the backup keeps no copy of the regions (the LOOP transport)
+            got = rep->transport->digests(&rep->link, id, r->size, level, nodes, n, digests);
+            if (got <= 0)
+            {
+                rv = got < 0 ? -1 : 0;
+                n = 0;
+                break;
+            }
+            received += sizeof(long) + got * sizeof(uint32_t);
+            for (i = m = 0; i < n; i++)
+            {
+                if (digests[i] != tree.nodes[level][nodes[i]])
+                    nodes[m++] = nodes[i];
+            }
+            n = m;
+            if (level == 0)
+                break;
+            level--;
+            for (i = m = 0; i < n; i++)
+            {
+                for (j = nodes[i] * MERKLE_FANOUT;
+                     j < (nodes[i] + 1) * MERKLE_FANOUT && j < tree.count[level]; j++)
+                    next[m++] = j;
+            }
+            tmp = nodes;
+            nodes = next;
+            next = tmp;
+            n = m;
+        }
+        if (n == 0)
+            continue;
+
+        pthread_mutex_lock(&g_distribute_lock);
+        pthread_mutex_lock(&rep->lock);
+        for (i = 0; i < n; i++)
+        {
+            page = nodes[i] * (MERKLE_BLOCK_SIZE / REGION_PAGE_SIZE);
+            last = page + MERKLE_BLOCK_SIZE / REGION_PAGE_SIZE;
+            if (last > (r->size + REGION_PAGE_SIZE - 1) / REGION_PAGE_SIZE)
+                last = (r->size + REGION_PAGE_SIZE - 1) / REGION_PAGE_SIZE;
+            written = false;
+            for (j = page; j < last && !written; j++)
+                written = ((r->dirty[j / 64] | rep->dirty[id][j / 64]) >> (j % 64)) & 1;
+            if (written)
+                continue;
+            //the pages that hold nothing on this side are not read
+            marked = 0;
+            for (j = page; j < last; j++)
+            {
+                if (r->backed != NULL && !((r->backed[j / 64] >> (j % 64)) & 1))
+                    continue;
+                rep->dirty[id][j / 64] |= 1ULL << (j % 64);
+                marked++;
+            }
+            if (marked > 0)
+                blocks++;
+        }
+        if (blocks > 0)
+        {
+            if (rep->pending_since == 0)
+                rep->pending_since = now_usec();
+            rep->pending = true;
+        }
+        pthread_mutex_unlock(&rep->lock);
+        pthread_mutex_unlock(&g_distribute_lock);
+    }
+    merkle_free(&tree);
+    free(nodes);
+    free(next);
+    free(digests);
+
+    pthread_mutex_lock(&rep->lock);
+    rep->last_verify = now_usec();
+    if (rv == 0 && got != 0)
+    {
+        rep->stats.verify_passes++;
+        rep->stats.verify_blocks += blocks;
+        rep->stats.verify_bytes += rep->link.bytes - sent + received;
+        rep->stats.verify_usec = rep->last_verify - start;
+    }
+    pthread_mutex_unlock(&rep->lock);
+    if (blocks > 0)
+        printf("backup %s diverged in %zu blocks, sending them again\n", rep->name, blocks);
+    return rv;
+}
+
+/*
+ * Opens the connection to the backup, and tells it the epoch and the last sync
+ * it acknowledged (the hello of the transport). The backup replies with the last sync it applied.
+ * If that is not the acknowledged sync of this epoch or a later one (the backup
+ * restarted, or another primary sent to it), it needs a full resync.
+ */
+static int replica_connect(backup_replica *rep)
+{
+    long hello[2], reply[2];
+
+    if (rep->transport->connect(&rep->link) != 0)
+    {
+        return -1;
+    }
+
+    hello[0] = g_epoch;
+    hello[1] = rep->acked_seq;
+    if (rep->transport->hello(&rep->link, hello, reply) != 0)
+    {
+        printf("backup %s did not answer the handshake\n", rep->name);
+        rep->transport->close(&rep->link);
+        return -1;
+    }
+
+    pthread_mutex_lock(&rep->lock);
+    if (reply[0] != hello[0] || reply[1] < hello[1] || hello[1] == 0)
+    {
+        rep->full_resync = true;
+    }
+    if (rep->stats.syncs > 0)
+    {
+        rep->stats.reconnects++;
+        if (!rep->full_resync)
+            rep->stats.resumes++;
+    }
+    rep->connected = true;
+    //compare at once after a resume, what the backlog holds is skipped
+    rep->last_verify = rep->full_resync ? now_usec() : 0;
+    //catch up right away, unless nothing was handed yet (the workers may not be up)
+    if (rep->pending_seq > 0)
+    {
+        rep->pending = true;
+    }
+    pthread_mutex_unlock(&rep->lock);
+
+    printf("backup %s connected, %s from sync %ld\n", rep->name,
+           rep->full_resync ? "full resync" : "resuming", hello[1]);
+    return 0;
+}
+
+static void replica_reconnect(backup_replica *rep)
+{
+    unsigned int delay_ms = BACKUP_RECONNECT_MIN_MS;
+
+    while (replica_connect(rep) != 0)
+    {
+        usleep(delay_ms * 1000);
+        delay_ms *= 2;
+        if (delay_ms > BACKUP_RECONNECT_MAX_MS)
+            delay_ms = BACKUP_RECONNECT_MAX_MS;
+    }
+}
+
+uint64_t backup_signal(void)
+{
+#ifdef HAVE_GCC_ATOMICS
+    __sync_synchronize();
+#else
+    pthread_mutex_lock(&g_semisync_lock);
+    pthread_mutex_unlock(&g_semisync_lock);
+#endif
+    g_signal_target = g_sync_seq + 1;
+    queue_enq(1);
+    return g_signal_target;
+}
+
+void backup_write_signal(void)
+{
+    if (!settings.failover_oplog &&
+        settings.shared_malloc_slabs &&
+        settings.shared_malloc_assoc &&
+        settings.shared_malloc_slabs_lists &&
+        settings.failover_dest &&
+        settings.failover_src)
+    {
+        if (settings.verbose > 1)
+            fprintf(stderr, "writing to backup client\n");
+        backup_signal();
+    }
+}
+
+uint64_t backup_last_signal(void)
+{
+    return g_signal_target;
+}
+
+bool backup_sync_acked(uint64_t seq)
+{
+    int i, backups = 0, acks = 0;
+
+    for (i = 0; i < g_backups_count; i++)
+    {
+        if (g_replicas[i].checkpoint)
+            continue;
+        backups++;
+        if (g_replicas[i].connected && g_replicas[i].acked_seq >= seq)
+            acks++;
+    }
+    return backups == 0 || acks >= settings.failover_semisync_acks;
+}
+
+void backup_semisync_record(uint64_t usec, bool timed_out)
+{
+    int bucket = 0;
+
+    while (bucket < BACKUP_SEMISYNC_BUCKETS - 1 &&
+           usec > (BACKUP_SEMISYNC_FIRST_BUCKET_USEC << bucket))
+        bucket++;
+    pthread_mutex_lock(&g_semisync_lock);
+    g_semisync_stats.waits++;
+    if (timed_out)
+        g_semisync_stats.timeouts++;
+    g_semisync_stats.wait_usec += usec;
+    g_semisync_stats.hist[bucket]++;
+    pthread_mutex_unlock(&g_semisync_lock);
+}
+
+void backup_get_semisync_stats(struct backup_semisync_stats *stats)
+{
+    pthread_mutex_lock(&g_semisync_lock);
+    *stats = g_semisync_stats;
+    pthread_mutex_unlock(&g_semisync_lock);
+}
+
+/*
+ * A connection is about to write to the regions: stops the reads, and waits
+ * for the readers in the middle of a copy
+ */
+static void replica_write_begin(void)
+{
+    pthread_mutex_lock(&g_replica_lock);
+    if (g_replica_writers++ == 0)
+    {
+        g_replica_write_start = now_usec();
+        __sync_add_and_fetch(&g_replica_gen, 1);
+    }
+    while (g_replica_readers > 0)
+        pthread_cond_wait(&g_replica_cond, &g_replica_lock);
+    pthread_mutex_unlock(&g_replica_lock);
+}
+
+/* The connection applied its sync (or broke off), publishes the regions again */
+static void replica_write_end(void)
+{
+    uint64_t now = now_usec();
+
+    pthread_mutex_lock(&g_replica_lock);
+    if (--g_replica_writers == 0)
+    {
+        g_serve_stats.apply_usec = now - g_replica_write_start;
+        g_replica_published = now;
+        __sync_add_and_fetch(&g_replica_gen, 1);
+    }
+    pthread_mutex_unlock(&g_replica_lock);
+}
+
+/*
+ * A reader leaves. The last one out wakes the writer waiting for it: a
+ * writer makes the generation odd before it waits, and the sub is a full
+ * barrier, so a reader that sees it even leaves before the writer looks.
+ */
+static void replica_read_leave(void)
+{
+    if (__sync_sub_and_fetch(&g_replica_readers, 1) == 0 && (g_replica_gen & 1))
+    {
+        pthread_mutex_lock(&g_replica_lock);
+        pthread_cond_broadcast(&g_replica_cond);
+        pthread_mutex_unlock(&g_replica_lock);
+    }
+}
+
+bool backup_read_begin(void)
+{
+    __sync_add_and_fetch(&g_replica_readers, 1);
+    //the add is a full barrier: a writer either sees us or we see its generation
+    if ((g_replica_gen & 1) || !g_applied_consistent)
+    {
+        replica_read_leave();
+        __sync_add_and_fetch(&g_serve_stats.reads_busy, 1);
+        return false;
+    }
+    return true;
+}
+
+void backup_read_end(bool hit)
+{
+    replica_read_leave();
+    if (hit)
+        __sync_add_and_fetch(&g_serve_stats.reads, 1);
+}
+
+void backup_get_serve_stats(struct backup_serve_stats *stats)
+{
+    pthread_mutex_lock(&g_replica_lock);
+    *stats = g_serve_stats;
+    stats->generation = g_replica_gen;
+    if (g_replica_published != 0)
+        stats->sync_age_usec = now_usec() - g_replica_published;
+    pthread_mutex_unlock(&g_replica_lock);
+}
+
+bool backup_get_applied(long *seq, bool *consistent)
+{
+    if (g_applied_epoch == 0)
+        return false;
+    *seq = g_applied_seq;
+    *consistent = g_applied_consistent;
+    return true;
+}
+
+int backup_replica_count(void)
+{
+    return g_backups_count;
+}
+
+int backup_get_stats(int i, struct backup_replica_stats *stats)
+{
+    backup_replica *rep;
+    size_t w;
+    int id;
+
+    if (i < 0 || i >= g_backups_count)
+        return -1;
+    rep = &g_replicas[i];
+    pthread_mutex_lock(&rep->lock);
+    *stats = rep->stats;
+    stats->name = rep->name;
+    stats->acked_seq = rep->acked_seq;
+    stats->connected = rep->connected;
+    stats->pending_pages = 0;
+    for (id = 0; id < REGION_MAX; id++)
+    {
+        if (rep->dirty[id] == NULL)
+            continue;
+        for (w = 0; w < rep->nwords[id]; w++)
+            stats->pending_pages += __builtin_popcountll(rep->dirty[id][w]);
+    }
+    stats->pending_log_bytes = rep->log_used;
+    if (rep->pending_since)
+        stats->lag_usec = now_usec() - rep->pending_since;
+    pthread_mutex_unlock(&rep->lock);
+    return 0;
+}
+
+/*
+ * Sets up the next replica and starts its sender thread
+ */
+static backup_replica *replica_start(const backup_transport *transport, const char *name,
+                                     bool checkpoint)
+{
+	backup_replica *rep;
+
+	if (g_backups_count >= MAX_BACKUPS + (checkpoint ? 1 : 0))
+	{
+		printf("Maximal number of backups reached\n");
+		return NULL;
+	}
+	if (g_epoch == 0)
+	{
+		g_epoch = ((now_usec() << 16) ^ getpid()) & 0x7fffffffffffffffULL;
+	}
+
+    rep = &g_replicas[g_backups_count];
+    rep->name = strdup(name);
+    rep->transport = transport;
+    rep->link.fd = -1;
+    rep->link.addr = rep->name;
+    rep->checkpoint = checkpoint;
+    rep->snapshot_budget = (size_t)(checkpoint ? settings.checkpoint_snapshot_mb :
+                                    settings.failover_snapshot_mb) * 1024 * 1024;
+    rep->interval_usec = checkpoint ? (uint64_t)settings.checkpoint_interval * 1000000 : 0;
+    rep->verify_every = checkpoint || transport->digests == NULL ? 0 :
+                        (uint64_t)settings.failover_verify_interval * 1000000;
+    pthread_mutex_init(&rep->lock, NULL);
+    pthread_cond_init(&rep->cond, NULL);
+
+    //Create the sender thread of this backup, it connects in the background
+    if (pthread_create(&rep->thread, NULL, RunReplicaSender, (void*) rep) != 0)
+    {
+    	printf("Error creating backup sender thread\n");
+    	return NULL;
+    }
+    g_backups_count++;
+    return rep;
+}
+
+int BackupCheckpoint(char *dir)
+{
+	return replica_start(checkpoint_transport(), dir, true) != NULL ? 0 : -1;
+}
+
+int BackupClient(const backup_transport *transport, char *clientHostnamePortwithPort)
+{
+	int rv;
+
+	if (transport->client != NULL)
+	{
+		return transport->client(clientHostnamePortwithPort);
+	}
+	if (replica_start(transport, clientHostnamePortwithPort, false) == NULL)
+	{
+		return -1;
+	}
+    if (g_backups_count > 1)
+    {
+    	//a single client thread hands the work to all the backups
+    	return 0;
+    }
+
+    //Create backup client thread
+    rv = pthread_create(&g_clientThread, NULL, RunBackupClient, NULL);
+    if(rv < 0)
+    {
+    	printf("Error creating backup client thread\n");
+    	return -1;
+    }
+
+    return 0;
+
+}
+
+int BackupServer(const backup_transport *transport, char *clientHostnamePortwithPort)
+{
+	int rv, sockfd;
+
+	if (transport->server != NULL)
+	{
+		return transport->server(clientHostnamePortwithPort);
+	}
+	if (transport->listen == NULL)
+	{
+		//the backups of this transport don't need a listener
+		return 0;
+	}
+	sockfd = transport->listen(clientHostnamePortwithPort);
+	if (sockfd == -1)
+	{
+		printf("Error listening on %s\n", clientHostnamePortwithPort);
+		return -1;
+	}
+
+    //Create backup server thread
+    rv = pthread_create(&g_serverThread, NULL, RunBackupServer, (void*)(long) sockfd);
+    if(rv != 0)
+    {
+    	printf("Error creating backup server thread\n");
+    	close(sockfd);
+    	return -1;
+    }
+    return 0;
+}
+
+/*
+ * Waits on the queue. When an item is enqueued, starts the backup process -
+ * hands the dirty pages of the assoc, slabs and slab_lists memory sections
+ * (or in the oplog mode the pending operation log) to the replica senders.
+ */
+void *RunBackupClient(void *arg)
+{
+	int queue_val;
+
+	while (1)
+	{
+		//wait for a message in the queue, and for the batching window to close
+		if (!queue_wait(&queue_val, settings.failover_batch_ops,
+						settings.failover_batch_usec, 0))
+		{
+			continue;
+		}
+		if (settings.verbose > 1)
+		{
+			printf("Got something in the queue! value = %d\n",queue_val);
+		}
+		pthread_mutex_lock(&g_distribute_lock);
+		backup_start_sync();
+		pthread_mutex_unlock(&g_distribute_lock);
+	}
+}
+
+/*
+ * Server backup thread. Waits for incoming communication.
+ */
+void *RunBackupServer(void *arg)
+{
+    int sockfd = (int)(long)arg;  // listen on sock_fd, new connection on new_fd
+    int new_fd;
+    struct sockaddr_storage their_addr; // connector's address information
+    socklen_t sin_size;
+    struct sigaction sa;
+    int yes=1;
+    char s[INET6_ADDRSTRLEN];
+    int rv;
+    pthread_t thread;
+
+    sa.sa_handler = sigchld_handler; // reap all dead processes
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+
+    rv = sigaction(SIGCHLD, &sa, NULL);
+    if (rv == -1)
+    {
+        perror("sigaction\n");
+        exit(1);
+    }
+
+    printf("server: waiting for connections...\n");
+
+    while(1) // main accept() loop
+    {
+        sin_size = sizeof their_addr;
+        new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
+        if (new_fd == -1)
+        {
+            perror("accept\n");
+            continue;
+        }
+
+        if (their_addr.ss_family == AF_INET || their_addr.ss_family == AF_INET6)
+        {
+            getnameinfo((struct sockaddr *)&their_addr, sin_size, s, sizeof s, NULL, 0, NI_NUMERICHOST);
+            //acks are sent as soon as a sync is applied
+            setsockopt(new_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
+        }
+        else
+        {
+            strcpy(s, "local socket");
+        }
+        printf("server: got connection from %s\n", s);
+
+        //Create receive thread
+        rv = pthread_create(&thread, NULL , connection_handler, (void*)(long) new_fd);
+        if(rv != 0)
+        {
+        	printf("Error creating receive thread\n");
+        	close(new_fd);
+        	continue;
+        }
+        pthread_detach(thread);
+    }
+
+    exit(0);
+}
+
+void *connection_handler(void *socket_desc)
+{
+	backup_receive((int)(long)socket_desc, false);
+	return 0;
+}
+
+/*
+ * The largest log a primary sends at once: its backlog is dropped past
+ * failover_log_window_mb (the backup's must be as large), and a full resync
+ * dumps the items in chunks of REPLOG_DUMP_CHUNK and one more record
+ */
+static size_t backup_max_log_bytes(void)
+{
+	size_t chunk = REPLOG_DUMP_CHUNK + sizeof(replog_record_hdr) + KEY_MAX_LENGTH +
+				   settings.item_size_max;
+	size_t window = (size_t)settings.failover_log_window_mb * 1024 * 1024;
+
+	return window > chunk ? window : chunk;
+}
+
+/*
+ * Receives and throws away len bytes, in chunks of the scratch buffer
+ */
+static int recv_discard(int sock, char **scratch, long len)
+{
+	long chunk;
+
+	if (*scratch == NULL && (*scratch = malloc(BACKUP_DISCARD_CHUNK)) == NULL)
+	{
+		return -1;
+	}
+	while (len > 0)
+	{
+		chunk = len < BACKUP_DISCARD_CHUNK ? len : BACKUP_DISCARD_CHUNK;
+		if (backup_recv_all(sock, *scratch, chunk) != 0)
 		{
-			while (data_size > 0)
-			{
-				memset(data, 0, MAXDATASIZE);
-				if (data_size < MAXDATASIZE)
-				{
-					received = recv(sock, data, data_size, 0);
-				}
-				else
-				{
-					received = recv(sock, data, MAXDATASIZE, 0);
-				}
-				if (received == -1)
-				{
-					printf("error3\n");
-				}
-				memcpy((char *)memcached1_assoc + original_data_size - data_size, data,received);
+			return -1;
+		}
+		len -= chunk;
+	}
+	return 0;
+}
 
-				data_size -= received;
+/*
+ * Receives the data of a run of a region (see stream_send_region) into dest, which
+ * the region is mapped at, or throws it away with a NULL dest
+ */
+static int recv_run(int sock, const long *run, char *dest, char **scratch)
+{
+	long plen;
 
-			}
-			shared_free(memcached1_assoc, original_data_size);
-			original_data_size = 0;
-			printf("Finished step 1\n");
+	switch (run[2])
+	{
+	case BACKUP_RUN_DATA:
+		return dest != NULL ? backup_recv_all(sock, dest + run[0], run[1]) :
+							  recv_discard(sock, scratch, run[1]);
+	case BACKUP_RUN_ZERO:
+		if (dest != NULL)
+		{
+			memset(dest + run[0], 0, run[1]);
+		}
+		return 0;
+	case BACKUP_RUN_PACKED:
+		if (backup_recv_all(sock, &plen, sizeof(long)) != 0)
+		{
+			return -1;
+		}
+		//only the chunks that got smaller are sent packed
+		if (run[1] > BACKUP_PACK_CHUNK || plen <= 0 || plen >= run[1])
+		{
+			printf("error bad packed run, %ld bytes packed into %ld\n", run[1], plen);
+			return -1;
+		}
+		//lands in the scratch buffer, plen being at most a chunk
+		if (recv_discard(sock, scratch, plen) != 0)
+		{
+			return -1;
+		}
+		if (dest != NULL && unpack_block(*scratch, plen, dest + run[0], run[1]) != 0)
+		{
+			printf("error corrupt packed run at %ld\n", run[0]);
+			return -1;
+		}
+		return 0;
+	default:
+		printf("error unknown run kind %ld\n", run[2]);
+		return -1;
+	}
+}
+
+/*
+ * Copies the pages of src set in pages to dst, or with a NULL pages every page
+ * that is not zero (dst is new). Returns the bytes copied.
+ */
+static size_t shadow_copy(char *dst, const char *src, size_t size, const uint64_t *pages)
+{
+	static const char zero[REGION_PAGE_SIZE];
+	size_t page, off, len, copied = 0;
+
+	for (page = 0; page * REGION_PAGE_SIZE < size; page++)
+	{
+		if (pages != NULL && !(pages[page / 64] & (1ULL << (page % 64))))
+		{
+			if (pages[page / 64] == 0)
+				page |= 63;
+			continue;
 		}
-		if (step == 1 && data_size == 0)
+		off = page * REGION_PAGE_SIZE;
+		len = size - off < REGION_PAGE_SIZE ? size - off : REGION_PAGE_SIZE;
+		if (pages == NULL && memcmp(src + off, zero, len) == 0)
+			continue;
+		memcpy(dst + off, src + off, len);
+		copied += len;
+	}
+	return copied;
+}
+
+static bool shadow_written(const backup_shadow *sh)
+{
+	size_t w;
+
+	for (w = 0; w < sh->nwords; w++)
+		if (sh->written[w] != 0)
+			return true;
+	return false;
+}
+
+/*
+ * Maps the shadow of region id with size bytes, for a sync to be received into.
+ * The first time it starts empty and gets a copy of the live region.
+ * Returns its address, NULL on error.
+ */
+static char *shadow_map(enum region_id id, long size)
+{
+	static const char *const suffix = BACKUP_SHADOW_SUFFIX;
+	backup_shadow *sh = &g_shadows[id];
+	region_t *r = region_get(id);
+	const char *key = id == REGION_ASSOC ? settings.shared_malloc_assoc_key :
+		id == REGION_SLABS ? settings.shared_malloc_slabs_key :
+		settings.shared_malloc_slabs_lists_key;
+	size_t nwords = (size + 64 * REGION_PAGE_SIZE - 1) / (64 * REGION_PAGE_SIZE);
+	uint64_t *written;
+	char *path;
+
+	if (r == NULL)
+	{
+		return NULL;
+	}
+	if (sh->key == NULL)
+	{
+		if ((sh->key = malloc(strlen(key) + strlen(suffix) + 1)) == NULL)
+			return NULL;
+		strcpy(sh->key, key);
+		strcat(sh->key, suffix);
+		//a shadow left over by an earlier run holds nothing we know of
+		if ((path = gen_full_path(sh->key, KEYPATH)) != NULL)
+		{
+			unlink(path);
+			free(path);
+		}
+	}
+	if (nwords > sh->nwords)
+	{
+		if ((written = realloc(sh->written, nwords * sizeof(uint64_t))) == NULL)
+			return NULL;
+		memset(written + sh->nwords, 0, (nwords - sh->nwords) * sizeof(uint64_t));
+		sh->written = written;
+		sh->nwords = nwords;
+	}
+	if (backup_map_region(&sh->map, sh->key, size) != 0)
+	{
+		return NULL;
+	}
+	//a hash table of another size is sent whole
+	if (!sh->seeded && r->size == (size_t)size)
+	{
+		__sync_add_and_fetch(&g_shadow_stats.copied_bytes,
+							 shadow_copy(sh->map.addr, r->base, size, NULL));
+	}
+	sh->seeded = true;
+	return sh->map.addr;
+}
+
+/* Marks the pages of [off, off + len) of the shadow of region id written */
+static void shadow_mark(enum region_id id, long off, long len)
+{
+	backup_shadow *sh = &g_shadows[id];
+	size_t page;
+
+	for (page = off / REGION_PAGE_SIZE; len > 0 &&
+		 page <= (size_t)(off + len - 1) / REGION_PAGE_SIZE; page++)
+		sh->written[page / 64] |= 1ULL << (page % 64);
+}
+
+/*
+ * Swaps the shadows that were written into with the live regions, with the
+ * readers held off: the hash table is first resized to the primary's, and a
+ * shadow whose file can't be swapped has its written pages copied instead.
+ * Returns 0, or -1 if the hash table could not be resized.
+ */
+static int shadow_swap(void)
+{
+	backup_shadow *sh;
+	region_t *r;
+	int id;
+
+	for (id = 0; id < REGION_MAX; id++)
+	{
+		sh = &g_shadows[id];
+		if (sh->map.addr == NULL || !shadow_written(sh) || (r = region_get(id)) == NULL)
+			continue;
+		if (id == REGION_ASSOC && r->size != (size_t)sh->map.size)
 		{
-			received = recv(sock, &msg, sizeof(char) * 25, 0);
-			if (received == -1 || received != 25)
+			if (assoc_adopt(sh->map.size) != 0)
 			{
-				printf("error5\n");
+				printf("error can't resize the hash table to %ld bytes\n", sh->map.size);
+				return -1;
 			}
-			if (strncmp(msg,"queue data step 2 sending",25) == 0)
-			{
-				received = recv(sock, &data_size, sizeof(long), 0);
-				if (received == -1)
-				{
-					printf("error6\n");
-				}
-				original_data_size = data_size;
-				step = 2;
+			r = region_get(id);
+		}
+		if (r->size <= (size_t)sh->map.size &&
+			shared_swap(r->base, r->size, r->key, sh->key,
+						settings.huge_pages && id != REGION_SLABS_LISTS ? HUGE_PAGES : 0) == 0)
+		{
+			//the mapping is of the live memory now, the shadow is the old one
+			shared_free(sh->map.addr, sh->map.size);
+			sh->map.addr = NULL;
+			__sync_add_and_fetch(&g_shadow_stats.swaps, 1);
+			continue;
+		}
+		__sync_add_and_fetch(&g_shadow_stats.copied_bytes, shadow_copy(r->base, sh->map.addr,
+			r->size < (size_t)sh->map.size ? r->size : (size_t)sh->map.size, sh->written));
+		memset(sh->written, 0, sh->nwords * sizeof(uint64_t));
+		__sync_add_and_fetch(&g_shadow_stats.copies, 1);
+	}
+	return 0;
+}
 
+/*
+ * Copies the written pages of the live regions to their shadows after a swap,
+ * so that the shadows equal them again
+ */
+static void shadow_catch_up(void)
+{
+	backup_shadow *sh;
+	region_t *r;
+	int id;
 
-				memcached1_slabs = shared_malloc(NULL, original_data_size, settings.shared_malloc_slabs_key, NO_LOCK);
-			}
-			printf("Moving to step 2\n");
+	for (id = 0; id < REGION_MAX; id++)
+	{
+		sh = &g_shadows[id];
+		if (sh->written == NULL || !shadow_written(sh) || (r = region_get(id)) == NULL)
+			continue;
+		if (backup_map_region(&sh->map, sh->key, r->size) != 0)
+		{
+			//copy the whole of it the next time
+			sh->seeded = false;
+			if (sh->map.addr != NULL)
+				shared_free(sh->map.addr, sh->map.size);
+			sh->map.addr = NULL;
+			free(sh->key);
+			sh->key = NULL;
 		}
-		if (step == 2 && data_size != 0)
+		else
 		{
-			while (data_size > 0)
-			{
-				memset(data, 0, MAXDATASIZE);
-				if (data_size < MAXDATASIZE)
-				{
-					received = recv(sock, data, data_size, 0);
-				}
-				else
-				{
-					received = recv(sock, data, MAXDATASIZE, 0);
-				}
-				if (received == -1)
-				{
-					printf("error8\n");
-				}
+			__sync_add_and_fetch(&g_shadow_stats.copied_bytes,
+								 shadow_copy(sh->map.addr, r->base, r->size, sh->written));
+		}
+		memset(sh->written, 0, sh->nwords * sizeof(uint64_t));
+	}
+}
+
+/*
+ * Answers a query of the primary's anti-entropy pass (step 7) with digests of
+ * the Merkle tree of a live region. The tree is built when its root is asked
+ * for, which the primary does first, and kept for the queries down from there.
+ * Without keep (discarding, or in the middle of a sync) there are no digests.
+ * Returns 0, -1 if the connection is to be closed.
+ */
+static int receive_digests(int sock, merkle_tree *trees, bool keep)
+{
+	long query[4], i, n = 0;
+	long *nodes;
+	uint32_t *digests;
+	merkle_tree *t;
+	region_t *r;
+	int rv;
+
+	//the step of the region, its size, the level and the number of nodes
+	if (backup_recv_all(sock, query, sizeof(query)) != 0)
+	{
+		return -1;
+	}
+	if (query[0] < 1 || query[0] > REGION_MAX || query[1] <= 0 || query[2] < 0 ||
+		query[2] >= MERKLE_MAX_LEVELS || query[3] < 1 ||
+		query[3] > (query[1] + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE)
+	{
+		printf("error bad digest query\n");
+		return -1;
+	}
+	nodes = malloc(query[3] * sizeof(long));
+	digests = malloc(query[3] * sizeof(uint32_t));
+	if (nodes == NULL || digests == NULL ||
+		backup_recv_all(sock, nodes, query[3] * sizeof(long)) != 0)
+	{
+		free(nodes);
+		free(digests);
+		return -1;
+	}
+	t = &trees[query[0] - 1];
+	r = region_get(query[0] - 1);
+	if (keep && r != NULL && (t->levels == 0 || t->size != (size_t)query[1] ||
+							  query[2] == t->levels - 1))
+	{
+		//over the primary's size, a smaller region counts as zeros past its end
+		merkle_build(t, r->base, r->size, query[1], r->key);
+	}
+	if (keep && r != NULL && query[2] < t->levels)
+	{
+		n = query[3];
+		for (i = 0; i < n; i++)
+		{
+			digests[i] = nodes[i] >= 0 && (size_t)nodes[i] < t->count[query[2]] ?
+				t->nodes[query[2]][nodes[i]] : 0;
+		}
+	}
+	rv = backup_send_all(sock, &n, sizeof(long)) != 0 ||
+		(n > 0 && backup_send_all(sock, digests, n * sizeof(uint32_t)) != 0) ? -1 : 0;
+	free(nodes);
+	free(digests);
+	return rv;
+}
+
+void backup_get_shadow_stats(struct backup_shadow_stats *stats)
+{
+	//not under g_shadow_lock, which is held for a whole sync
+	*stats = g_shadow_stats;
+}
 
-				memcpy((char *)memcached1_slabs + original_data_size - data_size, data,received);
+/*
+ * Receives the memory backup within 3 steps - assoc, slabs and slabs_lists.
+ * Each step carries only the runs of pages that changed since the previous sync.
+ * In the oplog mode, step 4 carries operation log records which are applied.
+ * Step 5 ends a sync, and is acknowledged once everything before it was applied;
+ * it tells whether the regions now hold a consistent snapshot of the primary.
+ * Step 6 opens a connection: the primary sends its epoch and the last sync it got
+ * acknowledged, and is told the last sync applied here, to decide where to resume.
+ * Step 7, between syncs, asks for digests of the regions (see replica_verify).
+ * With discard nothing is applied, and the position is kept for this connection only.
+ * With failover_shadow the runs go to the shadow regions, which are swapped with
+ * the live ones on the marker of a consistent cut, so the live regions only ever
+ * hold whole cuts.
+ */
+void backup_receive(int sock, bool discard)
+{
+	char msg[25];
+	int step;
+	long region_size, run[3];
+	long hello[2], marker[2], epoch = 0;
+	backup_mapping maps[4];
+	char *log = NULL;
+	long log_size = 0;
+	char *scratch = NULL;
+	const char *key;
+	region_t *r;
+	volatile long discard_epoch = 0, discard_seq = 0;
+	volatile long *applied_epoch = discard ? &discard_epoch : &g_applied_epoch;
+	volatile long *applied_seq = discard ? &discard_seq : &g_applied_seq;
+	volatile bool discard_consistent = false;
+	volatile bool *applied_consistent = discard ? &discard_consistent : &g_applied_consistent;
+	bool writing = false;
+	bool shadow = !discard && settings.failover_shadow;
+	enum region_id id = REGION_ASSOC;
+	char *dest = NULL;
+	long shadow_size;
+	uint64_t start = 0;
+	merkle_tree trees[REGION_MAX];
+	int rv;
 
-				data_size -= received;
+	memset(maps, 0, sizeof(maps));
+	memset(trees, 0, sizeof(trees));
 
-			}
-			shared_free(memcached1_slabs, original_data_size);
-			original_data_size = 0;
-			printf("Finished step 2\n");
+	while (1)
+	{
+		if (backup_recv_all(sock, msg, sizeof(msg)) != 0)
+		{
+			break;
+		}
+		if (strncmp(msg, "queue data step ", 16) != 0 ||
+			strncmp(msg + 17, " sending", 8) != 0)
+		{
+			printf("error unknown message\n");
+			break;
 		}
-		if (step == 2 && data_size == 0)
+		step = msg[16] - '0';
+		if (step == 4)
 		{
-			received = recv(sock, &msg, sizeof(char) * 25, 0);
-			if (received == -1 || received != 25)
+			if (backup_recv_all(sock, &region_size, sizeof(long)) != 0 ||
+				region_size <= 0)
+			{
+				break;
+			}
+			//the primary sends at most its log window, or a chunk of its dump
+			if ((size_t)region_size > backup_max_log_bytes())
 			{
-				printf("error10\n");
+				printf("error the primary's log of %ld bytes is over failover_log_window_mb\n",
+					   region_size);
+				break;
 			}
-			if (strncmp(msg,"queue data step 3 sending",25) == 0)
+			//the buffer is kept for the next syncs of this connection
+			if (region_size > log_size)
 			{
-				received = recv(sock, &data_size, sizeof(long), 0);
-				original_data_size = data_size;
-				if (received == -1)
+				free(log);
+				log_size = region_size;
+				log = malloc(log_size);
+				if (log == NULL)
 				{
-					printf("error11\n");
+					log_size = 0;
+					break;
 				}
-				step = 3;
-
-				memcached1_slabs_lists = shared_malloc(NULL, original_data_size, settings.shared_malloc_slabs_lists_key, NO_LOCK);
-
 			}
-			printf("Moving to step 3\n");
+			if (backup_recv_all(sock, log, region_size) != 0)
+			{
+				break;
+			}
+			if (!discard && replog_apply(log, region_size) != 0)
+			{
+				printf("error bad operation log\n");
+			}
+			continue;
 		}
-		if (step == 3 && data_size != 0)
+		if (step == 5)
 		{
-			while (data_size > 0)
+			//everything before the marker was applied, acknowledge it
+			if (backup_recv_all(sock, marker, sizeof(marker)) != 0)
 			{
-				memset(data, 0, MAXDATASIZE);
-				if (data_size < MAXDATASIZE)
-				{
-					received = recv(sock, data, data_size, 0);
-				}
-				else
-				{
-					received = recv(sock, data, MAXDATASIZE, 0);
-				}
-				if (received == -1)
+				break;
+			}
+			rv = 0;
+			if (writing && shadow && marker[1] == 0)
+			{
+				//a fuzzy sync stays in the shadows, under the next ones, until a
+				//consistent cut completes them; the live regions keep the last cut
+				*applied_epoch = epoch;
+				*applied_seq = marker[0];
+				pthread_mutex_unlock(&g_shadow_lock);
+				writing = false;
+				if (backup_send_all(sock, &marker[0], sizeof(long)) != 0)
 				{
-					printf("error13\n");
+					break;
 				}
+				continue;
+			}
+			if (writing && shadow)
+			{
+				//the shadows hold a consistent cut, swap them in
+				start = now_usec();
+				replica_write_begin();
+				rv = shadow_swap();
+			}
+			if (rv == 0)
+			{
+				*applied_epoch = epoch;
+				*applied_seq = marker[0];
+				*applied_consistent = marker[1] != 0;
+			}
+			if (writing && shadow)
+			{
+				replica_write_end();
+				g_shadow_stats.swap_usec = now_usec() - start;
+			}
+			else if (writing)
+			{
+				replica_write_end();
+				writing = false;
+			}
+			if (rv != 0 || backup_send_all(sock, &marker[0], sizeof(long)) != 0)
+			{
+				break;
+			}
+			if (writing)
+			{
+				shadow_catch_up();
+				pthread_mutex_unlock(&g_shadow_lock);
+				writing = false;
+			}
+			continue;
+		}
+		if (step == 6)
+		{
+			if (backup_recv_all(sock, hello, sizeof(hello)) != 0)
+			{
+				break;
+			}
+			epoch = hello[0];
+			printf("Primary acknowledged sync %ld, last applied %ld\n", hello[1],
+				   *applied_epoch == epoch ? *applied_seq : 0L);
+			hello[0] = *applied_epoch;
+			hello[1] = *applied_seq;
+			if (backup_send_all(sock, hello, sizeof(hello)) != 0)
+			{
+				break;
+			}
+			if (*applied_epoch != epoch)
+			{
+				//another primary's syncs are about to overwrite what was applied
+				*applied_epoch = epoch;
+				*applied_seq = 0;
+				*applied_consistent = false;
+			}
+			continue;
+		}
+		if (step == 7)
+		{
+			if (receive_digests(sock, trees, !discard && !writing) != 0)
+			{
+				break;
+			}
+			continue;
+		}
+		switch (step)
+		{
+		case 1:
+			//the table is keyed by its size once it was resized, see assoc.c
+			r = region_get(REGION_ASSOC);
+			key = r != NULL ? r->key : settings.shared_malloc_assoc_key;
+			break;
+		case 2:
+			key = settings.shared_malloc_slabs_key;
+			break;
+		case 3:
+			key = settings.shared_malloc_slabs_lists_key;
+			break;
+		default:
+			printf("error unknown step %d\n", step);
+			key = NULL;
+			break;
+		}
+		if ((key == NULL && !discard) || (step < 1 || step > 3) ||
+			backup_recv_all(sock, &region_size, sizeof(long)) != 0)
+		{
+			break;
+		}
+		//the size is the peer's, which can't have us map anything larger than a table
+		//of HASHPOWER_MAX (checked here since the shadow has no table to adopt it)
+		if (region_size <= 0 ||
+			(step == 1 && (size_t)region_size > ((size_t)1 << HASHPOWER_MAX) * sizeof(item_ref)))
+		{
+			printf("error bad header in step %d\n", step);
+			break;
+		}
+		if (settings.verbose > 1)
+		{
+			printf("Moving to step %d\n", step);
+		}
+		//the regions are mid-overwrite until the marker, and maybe remapped below,
+		//unless the sync goes to the shadows
+		if (!discard && !writing)
+		{
+			if (shadow)
+			{
+				pthread_mutex_lock(&g_shadow_lock);
+			}
+			else
+			{
+				replica_write_begin();
+				*applied_consistent = false;
+			}
+			writing = true;
+		}
+		//the primary's hash table grew (or was configured larger), grow ours too
+		if (step == 1 && !discard && !shadow && (r = region_get(REGION_ASSOC)) != NULL &&
+			r->size != (size_t)region_size)
+		{
+			if (assoc_adopt(region_size) != 0)
+			{
+				printf("error can't resize the hash table to %ld bytes\n", region_size);
+				break;
+			}
+			key = region_get(REGION_ASSOC)->key;
+		}
+		//the items link to each other by their offset in the slabs, which must all fit in
+		//ours: grow them as the primary's grew (see the memlimit command) if we can
+		if (step == 2 && !discard && (r = region_get(REGION_SLABS)) != NULL &&
+			r->size < (size_t)region_size && slabs_adopt(region_size) != 0)
+		{
+			printf("error the primary's slabs are %ld bytes, larger than ours (%zu),"
+				   " the backup's -m and memlimit_max are smaller than the primary's\n",
+				   region_size, r->size);
+			break;
+		}
+		//nor larger slabs or lists than ours, whose size doesn't depend on the primary's
+		if (step > 1 && !discard &&
+			(r = region_get(step == 2 ? REGION_SLABS : REGION_SLABS_LISTS)) != NULL &&
+			r->size < (size_t)region_size)
+		{
+			printf("error the primary's region of step %d is %ld bytes, larger than ours\n",
+				   step, region_size);
+			break;
+		}
 
-				memcpy((char *)memcached1_slabs_lists + original_data_size - data_size, data,received);
-
-				data_size -= received;
-
+		if (shadow)
+		{
+			//the hash table is resized to the primary's when the shadow is swapped in
+			id = step == 1 ? REGION_ASSOC : step == 2 ? REGION_SLABS : REGION_SLABS_LISTS;
+			r = region_get(id);
+			shadow_size = step == 1 || r == NULL ? region_size : (long)r->size;
+			if (region_size > shadow_size)
+			{
+				printf("error the primary's region of step %d is %ld bytes, larger than ours\n",
+					   step, region_size);
+				break;
+			}
+			if ((dest = shadow_map(id, shadow_size)) == NULL)
+			{
+				break;
+			}
+		}
+		else if (!discard)
+		{
+			if (backup_map_region(&maps[step], key, region_size) != 0)
+			{
+				break;
+			}
+			dest = maps[step].addr;
+		}
+		//offset, length and kind of every run, then its data straight into the
+		//mapping, up to the run at offset -1
+		run[0] = 0;
+		while (backup_recv_all(sock, run, sizeof(run)) == 0 && run[0] != -1)
+		{
+			if (run[0] < 0 || run[1] < 0 || run[0] > region_size ||
+				run[1] > region_size - run[0])
+			{
+				printf("error bad run in step %d\n", step);
+				break;
+			}
+			if (shadow)
+			{
+				shadow_mark(id, run[0], run[1]);
+			}
+			if (recv_run(sock, run, discard ? NULL : dest, &scratch) != 0)
+			{
+				break;
 			}
-			shared_free(memcached1_slabs_lists, original_data_size);
-			original_data_size = 0;
-			printf("Finished step 3\n");
 		}
-		step = 0;
+		if (run[0] != -1)
+		{
+			break;
+		}
+		if (settings.verbose > 1)
+		{
+			printf("Finished step %d\n", step);
+		}
+	}
+	for (step = 0; step < 4; step++)
+	{
+		if (maps[step].addr != NULL)
+		{
+			shared_free(maps[step].addr, maps[step].size);
+		}
+	}
+	if (writing && shadow)
+	{
+		//the live regions were not touched, and the shadows keep what they got: the
+		//fuzzy syncs acknowledged before, and pages the primary sends again
+		pthread_mutex_unlock(&g_shadow_lock);
+	}
+	else if (writing)
+	{
+		//a sync cut short leaves the regions fuzzy, the reads miss until the next one
+		replica_write_end();
+	}
+	for (step = 0; step < REGION_MAX; step++)
+	{
+		merkle_free(&trees[step]);
 	}
+	free(log);
+	free(scratch);
     close(sock);
     printf("Downloaded backup successfully\n");
-    return 0;
 }
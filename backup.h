@@ -1,10 +1,11 @@
 /********************************************************
  * Added as part of the memcached-1.4.24_RDMA project.
  * Implementing backup system via BSD sockets.
- * BackupClient method receives the address to connect too,
- * connects to the Memcached Backup Server in connectToServer method, and runs a RunBackupClient thread.
- * The client thread samples the queue every 2 seconds, and when there is an item in the queue,
- * starts the backup process.
+ * BackupClient method receives the transport and the address to connect too,
+ * starts the sender thread of the backup, and runs a RunBackupClient thread.
+ * The client thread blocks in queue_wait on the queue's condition variable until a write
+ * enqueues a signal, then lets the batching window (failover_batch_ops/failover_batch_usec)
+ * close before it starts the backup process.
  * BackupServer method receives an address to listen too,
  * creates a RunBackupServer thread, and on each incoming connection starts connection_handler thread.
  * After the connection with the client is establisged, the backup receives the memory backup, and closes the connection.
@@ -12,16 +13,163 @@
 #ifndef BACKUP_H_
 #define BACKUP_H_
 
+#include <stdint.h>
+#include <stdbool.h>
+#include "backup_transport.h"
+
 #define MAX_BACKUPS 3
 
 /*
- * Receives an address to listen too and starts the RunBackupServer thread
+ * Statistics of a single backup, reported by "stats backups"
+ */
+struct backup_replica_stats
+{
+	const char	*name;              // ip:port of the backup
+	bool		connected;
+	uint64_t	syncs;
+	uint64_t	bytes_sent;
+	uint64_t	zero_bytes;         // pages of zeros sent as a run header only
+	uint64_t	packed_saved;       // bytes failover_compress saved
+	uint64_t	send_usec;          // time spent sending
+	uint64_t	pending_pages;      // dirty pages not sent yet
+	uint64_t	pending_log_bytes;  // log records not sent yet
+	uint64_t	log_dropped;        // log bytes dropped since the backup was too far behind
+	uint64_t	lag_usec;           // age of the oldest unsent work, or the lag of the last sync
+	uint64_t	max_lag_usec;
+	uint64_t	acked_seq;          // last sync the backup acknowledged
+	uint64_t	reconnects;
+	uint64_t	resumes;            // reconnects that only sent the backlog
+	uint64_t	full_resyncs;       // syncs that sent everything again
+	uint64_t	consistent_syncs;   // syncs sent from a copy taken at a consistent cut
+	uint64_t	fuzzy_syncs;        // syncs sent from the live regions
+	uint64_t	forced_cuts;        // cuts made past the budget after too many fuzzy syncs
+	uint64_t	snapshot_bytes;     // bytes copied at consistent cuts
+	uint64_t	snapshot_pause_usec; // time the workers were paused for the cuts
+	uint64_t	max_snapshot_pause_usec;
+	uint64_t	verify_passes;      // anti-entropy passes, see failover_verify_interval
+	uint64_t	verify_blocks;      // blocks found to differ and sent again
+	uint64_t	verify_bytes;       // bytes of the digest queries and replies
+	uint64_t	verify_usec;        // time the last pass took
+};
+
+#define BACKUP_SEMISYNC_BUCKETS 20
+#define BACKUP_SEMISYNC_FIRST_BUCKET_USEC 16ULL
+
+/*
+ * Semi-synchronous replication statistics, bucket i counts the ack waits of
+ * at most BACKUP_SEMISYNC_FIRST_BUCKET_USEC << i microseconds (the last one the rest)
+ */
+struct backup_semisync_stats
+{
+	uint64_t	waits;
+	uint64_t	timeouts;
+	uint64_t	wait_usec;
+	uint64_t	hist[BACKUP_SEMISYNC_BUCKETS];
+};
+
+/*
+ * Reads served by a backup from its replicated regions, reported by "stats backups"
+ */
+struct backup_serve_stats
+{
+	uint64_t	generation;         // odd while a sync is written to the regions
+	uint64_t	sync_age_usec;      // time since the last sync was applied
+	uint64_t	apply_usec;         // time the reads were held off for the last sync
+	uint64_t	reads;              // items copied out of the regions
+	uint64_t	reads_busy;         // misses while a sync was applied or the regions were fuzzy
+};
+
+/*
+ * Shadow regions of a backup (failover_shadow), reported by "stats backups"
+ */
+struct backup_shadow_stats
+{
+	uint64_t	swaps;              // shadows swapped in as the live regions
+	uint64_t	copies;             // shadows copied into the live regions, where they can't be swapped
+	uint64_t	copied_bytes;       // copied to seed and catch up the shadows, or instead of a swap
+	uint64_t	swap_usec;          // time the last sync took to be swapped in
+};
+
+/*
+ * Receives an address to listen too and starts the RunBackupServer thread,
+ * or the backup side of a transport with its own threads
+ */
+int BackupServer(const backup_transport *transport, char *clientHostnamePortwithPort);
+/*
+ * Receives an address to connect too, and starts the sender thread of that backup,
+ * which connects (and reconnects with a backoff) in the background over the transport
+ */
+int BackupClient(const backup_transport *transport, char *clientHostnamePortwithPort);
+/*
+ * Starts the checkpointer of the given directory (see checkpoint.h): a backup
+ * whose sender starts a sync of its own every checkpoint_interval seconds, and
+ * which does not count as a semi-synchronous ack
+ */
+int BackupCheckpoint(char *dir);
+/*
+ * Number of backups this instance sends to, and their statistics
  */
-int BackupServer(char *clientHostnamePortwithPort);
+int backup_replica_count(void);
+int backup_get_stats(int i, struct backup_replica_stats *stats);
 /*
- * Receives an address to connect too, perform the connection and starts the RunBackupClient thread
+ * Last sync applied by this instance as a backup, and whether the regions held a
+ * consistent snapshot after it. Returns false if no sync was applied.
  */
-int BackupClient(char *clientHostnamePortwithPort);
+bool backup_get_applied(long *seq, bool *consistent);
+/*
+ * A backup serving reads (failover_serve_reads) reads the regions between
+ * backup_read_begin and backup_read_end, while no sync writes to them.
+ * backup_read_begin returns false if they can't be read now: a sync is being
+ * applied, or the last one was not a consistent snapshot of the primary.
+ * backup_read_end counts the read as a hit or not.
+ */
+bool backup_read_begin(void);
+void backup_read_end(bool hit);
+void backup_get_serve_stats(struct backup_serve_stats *stats);
+void backup_get_shadow_stats(struct backup_shadow_stats *stats);
+/*
+ * Replacing a replicated region: backup_regions_hold waits for the syncs in
+ * progress and holds off new ones, until backup_regions_release. In between the
+ * region is registered again, and backup_region_replaced makes every backup get
+ * all of it in its next sync.
+ *
+ * Lock order: a sender between two syncs (or the holder here) comes first, then
+ * the distribute lock, then what pause_threads takes (the rebalancer, the LRU
+ * crawler and maintainer, the workers). The cuts pause the threads with the
+ * distribute lock held, and assoc_publish pauses them inside a hold, so a hold
+ * must never be waited for by a thread that pause_threads waits for. slabs_map
+ * holds slabs_map_lock while it waits here; that is safe only because it runs
+ * on the slab maintenance thread or a backup connection, which are not paused,
+ * and no paused thread takes slabs_map_lock.
+ */
+void backup_regions_hold(void);
+void backup_regions_release(void);
+void backup_region_replaced(enum region_id id);
+/*
+ * Same for a region grown in place with region_resize: the backups keep what
+ * they have, and get the new size with their next sync.
+ */
+void backup_region_resized(enum region_id id);
+/*
+ * Signals the backup client that a write was done, and returns the sync
+ * sequence number that covers it (also kept per thread in backup_last_signal)
+ */
+uint64_t backup_signal(void);
+uint64_t backup_last_signal(void);
+/*
+ * Signals a write to the memory sections in the snapshot mode: every
+ * store, delete, touch, arithmetic and flush_all calls it, so the backups
+ * get the write even if no other one follows. The oplog mode signals as it
+ * logs the record instead.
+ */
+void backup_write_signal(void);
+/*
+ * Returns true if failover_semisync_acks backups acknowledged the sync seq,
+ * or if there are no backups but the checkpointer
+ */
+bool backup_sync_acked(uint64_t seq);
+void backup_semisync_record(uint64_t usec, bool timed_out);
+void backup_get_semisync_stats(struct backup_semisync_stats *stats);
 /*
  * splits string accroding to the given delimiter
  */
@@ -32,10 +180,6 @@ char** str_split(char* a_str, const char a_delim);
  * The received data is null terminated.
  */
 int receive(int sockfd, char *buf, int *numbytes);
-/*
- * Load the given file into memory (RAM) and sends it in chunks via BSD Socket
- */
-long ae_load_file_to_memory(const char *filename, char **result);
 /*
  * Loads the given data into a file.
  */
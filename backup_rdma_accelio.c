@@ -4,8 +4,10 @@
  * BackupClientRDMA method receives the address to connect too,
  * and starts the RunBackupClientRDMA thread.
  * RunBackupClientRDMA creates a connection and starts an event loop.
- * On receiving response to a generic beacon message, the client samples the queue,
- * and if the queue is not empty, starts the backup session.
+ * On receiving response to a generic beacon message, the client hands the next
+ * request to its queue waiter thread, which waits for the queue (or the beacon
+ * interval) off the event loop and wakes the loop through an eventfd to post
+ * either the backup data or another beacon.
  * BackupServer receives the address to listen too,
  * and starts the RunBackupServerRDMA thread.
  * RunBackupServerRDMA starts and event loop, and responds to clients messages.
@@ -58,6 +60,8 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "queue.h"
 #include "backup_rdma_accelio.h"
 #include "libxio.h"
@@ -100,7 +104,7 @@ static int on_session_event_client(struct xio_session *session,
 			    void *cb_user_context);
 /*
  * Parses the response.
- * Samples the queue, and when the queue isn't empty, starts sending backup data.
+ * Arms the queue waiter, which has the backup data posted once the queue isn't empty.
  */
 static int on_response_client(struct xio_session *session, struct xio_msg *rsp,
 		       int last_in_rxq,
@@ -137,6 +141,7 @@ void send_file_continue(struct xio_msg *req, int stepNumber);
 //#define MAX_MESSAGE_SIZE	1048576 // = 2 ^ 20 = the maximum size of the block that can be registered is limited to device_attr.max_mr_size
 #define MAX_MESSAGE_SIZE	10000
 #define MAX_RDMA_BACKUPS	3
+#define BEACON_INTERVAL_USEC	1000000 // idle beacons keep the Accelio connection alive
 
 
 static pthread_t g_serverThread;
@@ -191,6 +196,16 @@ struct session_data {
 	uint64_t		pad;
 	struct xio_msg		req_ring[QUEUE_DEPTH];
 	struct xio_msg		single_req;
+	/* the queue waiter, see run_queue_waiter */
+	pthread_t		waiter;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int			wake_fd;	/* eventfd the waiter wakes the loop with */
+	struct xio_msg		*next_req;	/* the request to post next, once armed */
+	int			armed;
+	int			stop;
+	int			got_data;
+	int			queue_val;
 };
 
 
@@ -258,9 +273,93 @@ static void process_response_client(struct session_data *session_data,
 	}
 }
 
+/*
+ * Posts req (the backup data or a beacon) on the connection
+ */
+static void send_next_request(struct session_data *session_data, struct xio_msg *req)
+{
+	req->in.header.iov_base	  = NULL;
+	req->in.header.iov_len	  = 0;
+	vmsg_sglist_set_nents(&req->in, 0);
+
+	/* resend the message */
+	xio_send_request(session_data->conn, req);
+	session_data->nsent++;
+}
+
+/*
+ * Waits for the queue off the event loop, since queue_wait blocks for up to the
+ * batching window (or the beacon interval) and would stall every other event
+ * of the context. Every response arms it once, and it wakes the loop when done.
+ */
+static void *run_queue_waiter(void *arg)
+{
+	struct session_data *session_data = (struct session_data *)arg;
+	int got, val = 0;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&session_data->lock);
+		while (!session_data->armed && !session_data->stop)
+			pthread_cond_wait(&session_data->cond, &session_data->lock);
+		session_data->armed = 0;
+		if (session_data->stop)
+		{
+			pthread_mutex_unlock(&session_data->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&session_data->lock);
+
+		//wait for a message in the queue, but send a beacon at least every BEACON_INTERVAL_USEC
+		got = queue_wait(&val, settings.failover_batch_ops,
+						 settings.failover_batch_usec, BEACON_INTERVAL_USEC);
+
+		pthread_mutex_lock(&session_data->lock);
+		session_data->got_data = got;
+		session_data->queue_val = val;
+		pthread_mutex_unlock(&session_data->lock);
+		eventfd_write(session_data->wake_fd, 1);
+	}
+}
+
+/*
+ * Runs on the event loop when the queue waiter is done, and posts the request
+ */
+static void on_queue_wake(int fd, int events, void *data)
+{
+	struct session_data *session_data = (struct session_data *)data;
+	struct xio_msg *req;
+	eventfd_t n;
+	int got, val;
+
+	(void)events;
+	if (eventfd_read(fd, &n) != 0)
+		return;
+	pthread_mutex_lock(&session_data->lock);
+	req = session_data->next_req;
+	session_data->next_req = NULL;
+	got = session_data->got_data;
+	val = session_data->queue_val;
+	pthread_mutex_unlock(&session_data->lock);
+	if (req == NULL)
+		return;
+
+	if (got)
+	{
+		printf("Got something in the queue! value = %d\n", val);
+		create_queue_data_request(req);
+	}
+	else
+	{
+		create_basic_request(req);
+	}
+	send_next_request(session_data, req);
+}
+
 /*
  * Parses the response.
- * Samples the queue, and when the queue isn't empty, starts sending backup data.
+ * Sends the rest of a file at once, else arms the queue waiter, which has the
+ * backup data (or a beacon) posted from the loop once the queue isn't empty.
  */
 static int on_response_client(struct xio_session *session,
 		       struct xio_msg *rsp,
@@ -270,7 +369,6 @@ static int on_response_client(struct xio_session *session,
 	struct session_data *session_data = (struct session_data *)
 						cb_user_context;
 	struct xio_msg	    *req = rsp;
-	int queue_val;
 
 
 	session_data->nrecv++;
@@ -290,29 +388,18 @@ static int on_response_client(struct xio_session *session,
 			return 0;
 	}
 
-	//check if there a message waiting in the queue
-	if (!queue_empty() || g_clientSendFile)
+	if (g_clientSendFile)
 	{
-		if (!g_clientSendFile)
-		{
-			queue_val = queue_frontelement();
-			printf("Got something in the queue! value = %d\n",queue_val);
-			queue_deq();
-		}
 		create_queue_data_request(req);
-	}
-	else
-	{
-		create_basic_request(req);
+		send_next_request(session_data, req);
+		return 0;
 	}
 
-	req->in.header.iov_base	  = NULL;
-	req->in.header.iov_len	  = 0;
-	vmsg_sglist_set_nents(&req->in, 0);
-
-	/* resend the message */
-	xio_send_request(session_data->conn, req);
-	session_data->nsent++;
+	pthread_mutex_lock(&session_data->lock);
+	session_data->next_req = req;
+	session_data->armed = 1;
+	pthread_cond_signal(&session_data->cond);
+	pthread_mutex_unlock(&session_data->lock);
 
 	return 0;
 }
@@ -961,6 +1048,19 @@ void *RunBackupClientRDMA(void *arg)
 	/* create thread context for the client */
 	session_data.ctx = xio_context_create(NULL, 0, -1);
 
+	/* the queue is waited for on its own thread, which wakes the loop */
+	pthread_mutex_init(&session_data.lock, NULL);
+	pthread_cond_init(&session_data.cond, NULL);
+	session_data.wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (session_data.wake_fd == -1 ||
+		xio_context_add_ev_handler(session_data.ctx, session_data.wake_fd, XIO_POLLIN,
+								   on_queue_wake, &session_data) != 0 ||
+		pthread_create(&session_data.waiter, NULL, run_queue_waiter, &session_data) != 0)
+	{
+		printf("Error starting the backup queue waiter\n");
+		return 0;
+	}
+
 	/* create url to connect to */
 	sprintf(url, "rdma://%s:%s", addr->ip, addr->port);
 	free(addr->ip);
@@ -995,6 +1095,14 @@ void *RunBackupClientRDMA(void *arg)
 	/* normal exit phase */
 	fprintf(stdout, "exit signaled\n");
 
+	pthread_mutex_lock(&session_data.lock);
+	session_data.stop = 1;
+	pthread_cond_signal(&session_data.cond);
+	pthread_mutex_unlock(&session_data.lock);
+	pthread_join(session_data.waiter, NULL);
+	xio_context_del_ev_handler(session_data.ctx, session_data.wake_fd);
+	close(session_data.wake_fd);
+
 	/* free the message */
 	free(req->out.header.iov_base);
 	free(req->out.data_iov.sglist[0].iov_base);
@@ -0,0 +1,839 @@
+/********************************************************
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * The transports of the backups, see backup_transport.h.
+ * TCP, UNIX and LOOP are stream transports sharing the wire protocol below;
+ * they only differ in how the stream is opened.
+ * Every message starts with "queue data step N sending":
+ * steps 1-3 carry the dirty runs of the assoc, slabs and slabs_lists regions,
+ * step 4 carries operation log records, step 5 ends a sync and is acknowledged
+ * (it also tells whether the backup's image is consistent at that point),
+ * step 6 opens a link, and step 7 asks for digests of the backup's regions
+ * between syncs (see backup_receive in backup.c for the backup side).
+ ********************************************************/
+
+#include "config.h"
+#include "backup_transport.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include "backup.h"
+#include "backup_rdma_accelio.h"
+#include "sharedmalloc.h"
+#include "memcached.h"
+#include "pack.h"
+
+#define BACKUP_SEND_TIMEOUT_MS 30000 // a backup that accepts nothing for that long is dropped
+#define BACKLOG 10     // how many pending connections queue will hold
+#define BIND_RETRY_MS 1000 // how long a port still held by an exiting instance is waited for
+#define STEP_MSG_SIZE 25
+
+/*
+ * get sockaddr, IPv4 or IPv6:
+ */
+static void *get_in_addr(struct sockaddr *sa);
+/*
+ * Waits until the non-blocking socket is writable. Fails after BACKUP_SEND_TIMEOUT_MS.
+ */
+static int wait_writable(int sockfd);
+/*
+ * Receives exactly len bytes from a non-blocking socket. Fails after BACKUP_SEND_TIMEOUT_MS.
+ */
+static int recv_reply(int sockfd, void *buf, size_t len);
+/*
+ * Sends len bytes of the region starting at offset, straight from the page cache
+ * of its backing file, so the data is never copied to user space.
+ */
+static int send_region_range(int sockfd, region_t *r, int fd, size_t offset, size_t len);
+/*
+ * Makes a connected stream socket ready for a sender thread
+ */
+static void stream_setup(int sockfd);
+static int send_step(backup_link *link, int step);
+
+/* Backing files of the regions under KEYPATH, the runs are sent from them with sendfile */
+static int g_region_fd[REGION_MAX] = { -1, -1, -1 };
+static unsigned int g_region_fd_generation[REGION_MAX];
+static pthread_mutex_t g_region_fd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *get_in_addr(struct sockaddr *sa)
+{
+    if (sa->sa_family == AF_INET)
+    {
+        return &(((struct sockaddr_in*)sa)->sin_addr);
+    }
+
+    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+
+int backup_send_all(int sockfd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+    while (len > 0)
+    {
+        n = send(sockfd, p, len, MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(sockfd) == 0)
+                continue;
+            perror("send\n");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int wait_writable(int sockfd)
+{
+    struct pollfd pfd;
+    int rv;
+
+    pfd.fd = sockfd;
+    pfd.events = POLLOUT;
+    do
+    {
+        rv = poll(&pfd, 1, BACKUP_SEND_TIMEOUT_MS);
+    } while (rv == -1 && errno == EINTR);
+    if (rv == 0)
+    {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return rv == 1 ? 0 : -1;
+}
+
+int backup_recv_all(int sockfd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+    while (len > 0)
+    {
+        //a single call fills the whole buffer unless a signal or an error cuts it short
+        n = recv(sockfd, p, len, MSG_WAITALL);
+        if (n == 0)
+            return -1;
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("recv\n");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_reply(int sockfd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+    struct pollfd pfd;
+
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    while (len > 0)
+    {
+        n = recv(sockfd, p, len, 0);
+        if (n > 0)
+        {
+            p += n;
+            len -= n;
+            continue;
+        }
+        if (n == 0)
+            return -1;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            perror("recv reply\n");
+            return -1;
+        }
+        n = poll(&pfd, 1, BACKUP_SEND_TIMEOUT_MS);
+        if (n == 0 || (n == -1 && errno != EINTR))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int send_region_range(int sockfd, region_t *r, int fd, size_t offset, size_t len)
+{
+    off_t off = offset;
+    ssize_t n;
+
+    while (len > 0 && fd != -1)
+    {
+        n = sendfile(sockfd, fd, &off, len);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(sockfd) == 0)
+                continue;
+            if (errno == EINVAL || errno == ENOSYS)
+                break; // sendfile not supported for this file, send from the mapping
+            perror("sendfile\n");
+            return -1;
+        }
+        if (n == 0)
+            break; // the file is shorter than the region
+        len -= n;
+    }
+    return backup_send_all(sockfd, (char *)r->base + off, len);
+}
+
+/*
+ * Opens the backing file of the region, -1 if it can't be used with sendfile.
+ * The file is reopened when the region was replaced.
+ */
+static int region_backing_fd(enum region_id id, region_t *r)
+{
+    char *path;
+    int fd;
+
+    pthread_mutex_lock(&g_region_fd_lock);
+    if (g_region_fd_generation[id] != r->generation)
+    {
+        if (g_region_fd[id] != -1)
+            close(g_region_fd[id]);
+        g_region_fd[id] = -1;
+        g_region_fd_generation[id] = r->generation;
+    }
+    fd = g_region_fd[id];
+    if (fd == -1 && r->key != NULL && (path = gen_full_path(r->key, KEYPATH)) != NULL)
+    {
+        fd = g_region_fd[id] = open(path, O_RDONLY);
+        if (fd == -1)
+        {
+            perror("open region backing file\n");
+        }
+        free(path);
+    }
+    pthread_mutex_unlock(&g_region_fd_lock);
+    return fd;
+}
+
+static void stream_setup(int sockfd)
+{
+    int flags;
+
+    //a slow backup must not block its sender forever, see wait_writable
+    flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("setting O_NONBLOCK\n");
+    }
+}
+
+static int send_step(backup_link *link, int step)
+{
+    char msg[STEP_MSG_SIZE + 1];
+
+    snprintf(msg, sizeof(msg), "queue data step %d sending", step);
+    if (backup_send_all(link->fd, msg, STEP_MSG_SIZE) != 0)
+    {
+        return -1;
+    }
+    link->bytes += STEP_MSG_SIZE;
+    return 0;
+}
+
+/*
+ * Wire format: step 6, epoch and acknowledged sync; the reply is the backup's
+ * epoch and last applied sync.
+ */
+static int stream_hello(backup_link *link, const long hello[2], long reply[2])
+{
+    if (send_step(link, 6) != 0 ||
+        backup_send_all(link->fd, hello, 2 * sizeof(long)) != 0 ||
+        recv_reply(link->fd, reply, 2 * sizeof(long)) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Whether the len bytes at p, at offset in the region, are all zeros. The holes
+ * of the backing file fd are, and aren't read, since a read through the mapping
+ * would fill them in. [*start, *stop) caches the extent of data last found.
+ */
+static bool page_is_zero(int fd, size_t offset, const char *p, size_t len,
+                         size_t *start, size_t *stop)
+{
+    off_t data, hole;
+
+    if (fd != -1 && offset >= *stop)
+    {
+        *start = offset;
+        *stop = SIZE_MAX;
+        if ((data = lseek(fd, offset, SEEK_DATA)) == -1)
+        {
+            if (errno == ENXIO)
+                *start = SIZE_MAX;
+        }
+        else
+        {
+            *start = data;
+            if ((hole = lseek(fd, data, SEEK_HOLE)) != -1)
+                *stop = hole;
+        }
+    }
+    if (fd != -1 && offset < *start)
+    {
+        return true;
+    }
+    return p[0] == 0 && memcmp(p, p + 1, len - 1) == 0;
+}
+
+static int send_run_header(backup_link *link, size_t offset, size_t len, long kind)
+{
+    long run[3];
+
+    run[0] = offset;
+    run[1] = len;
+    run[2] = kind;
+    if (backup_send_all(link->fd, run, sizeof(run)) != 0)
+    {
+        return -1;
+    }
+    link->bytes += sizeof(run);
+    return 0;
+}
+
+/*
+ * Sends the len bytes at offset in the region, which are not zeros, from data:
+ * the copy, or the live region without copy. With failover_compress they are
+ * packed a chunk at a time, and the chunks that don't get smaller are sent as they are.
+ */
+static int send_run_data(backup_link *link, region_t *r, int fd, size_t offset, size_t len,
+                         const char *data, bool copy)
+{
+    size_t n, packed;
+    long plen;
+
+    while (len > 0)
+    {
+        n = len;
+        packed = 0;
+        if (settings.failover_compress)
+        {
+            if (link->pack_buf == NULL && (link->pack_buf = malloc(BACKUP_PACK_CHUNK)) == NULL)
+            {
+                return -1;
+            }
+            n = len < BACKUP_PACK_CHUNK ? len : BACKUP_PACK_CHUNK;
+            packed = pack_block(data, n, link->pack_buf, n - n / 8);
+        }
+        if (packed > 0)
+        {
+            plen = packed;
+            if (send_run_header(link, offset, n, BACKUP_RUN_PACKED) != 0 ||
+                backup_send_all(link->fd, &plen, sizeof(long)) != 0 ||
+                backup_send_all(link->fd, link->pack_buf, packed) != 0)
+            {
+                return -1;
+            }
+            link->bytes += sizeof(long) + packed;
+            link->packed_saved += n - packed;
+        }
+        else
+        {
+            if (send_run_header(link, offset, n, BACKUP_RUN_DATA) != 0 ||
+                (copy ? backup_send_all(link->fd, data, n) :
+                        send_region_range(link->fd, r, fd, offset, n)) != 0)
+            {
+                return -1;
+            }
+            link->bytes += n;
+        }
+        offset += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Wire format: step (1 + region id), region size, then the runs, each as its
+ * offset, its length and its kind, and a run at offset -1 after the last one.
+ * A run of BACKUP_RUN_DATA is followed by its data, one of BACKUP_RUN_ZERO by
+ * nothing, and one of BACKUP_RUN_PACKED by the packed length and data (see pack.h).
+ * The dirty runs are cut where their pages turn from zeros to data or back, so
+ * the pages of zeros (the empty buckets and lists, the pages given back) cost a
+ * header, and the others are packed with failover_compress.
+ * Live data is sent with sendfile from the region's backing file, which is the same
+ * page cache the MAP_SHARED mapping writes to, so no copy of it is ever made.
+ */
+static int stream_send_region(backup_link *link, enum region_id id, const uint64_t *bitmap,
+                              const char *copy)
+{
+    region_t *r = region_get(id);
+    size_t pos, offset, len, off, n, page, start = 0, stop = 0;
+    long size;
+    const char *data;
+    bool zero;
+    int fd, zfd, nruns = 0;
+
+    if (r == NULL || bitmap == NULL)
+    {
+        return 0;
+    }
+
+    pos = 0;
+    if (!region_next_dirty_run(id, bitmap, &pos, &offset, &len))
+    {
+        return 0;
+    }
+    fd = region_backing_fd(id, r);
+    size = r->size;
+
+    if (send_step(link, 1 + id) != 0 ||
+        backup_send_all(link->fd, &size, sizeof(long)) != 0)
+    {
+        return -1;
+    }
+    link->bytes += sizeof(long);
+    zfd = copy ? -1 : fd;
+    pos = 0;
+    while (region_next_dirty_run(id, bitmap, &pos, &offset, &len))
+    {
+        data = copy ? copy : (char *)r->base + offset;
+        for (off = 0; off < len; off += n)
+        {
+            //the pages from off on that are all zeros, or all not
+            page = len - off < REGION_PAGE_SIZE ? len - off : REGION_PAGE_SIZE;
+            zero = page_is_zero(zfd, offset + off, data + off, page, &start, &stop);
+            for (n = page; off + n < len; n += page)
+            {
+                page = len - off - n < REGION_PAGE_SIZE ? len - off - n : REGION_PAGE_SIZE;
+                if (page_is_zero(zfd, offset + off + n, data + off + n, page, &start, &stop) != zero)
+                    break;
+            }
+            if (zero)
+            {
+                if (send_run_header(link, offset + off, n, BACKUP_RUN_ZERO) != 0)
+                {
+                    return -1;
+                }
+                link->zero_bytes += n;
+            }
+            else if (send_run_data(link, r, fd, offset + off, n, data + off, copy != NULL) != 0)
+            {
+                return -1;
+            }
+        }
+        if (copy)
+            copy += len;
+        nruns++;
+    }
+    if (send_run_header(link, -1, 0, BACKUP_RUN_DATA) != 0)
+    {
+        return -1;
+    }
+
+    if (settings.verbose > 1)
+    {
+        fprintf(stderr, "%s: step %d: %d dirty runs\n", link->addr, 1 + id, nruns);
+    }
+    return 0;
+}
+
+/*
+ * Wire format: step 4, log size, and the records (see replog.h).
+ */
+static int stream_send_records(backup_link *link, const char *buf, size_t len)
+{
+    long size = len;
+
+    if (size == 0)
+    {
+        return 0;
+    }
+    if (send_step(link, 4) != 0 ||
+        backup_send_all(link->fd, &size, sizeof(long)) != 0 ||
+        backup_send_all(link->fd, buf, size) != 0)
+    {
+        return -1;
+    }
+    link->bytes += sizeof(long) + size;
+
+    if (settings.verbose > 1)
+    {
+        fprintf(stderr, "%s: oplog: sent %ld bytes\n", link->addr, size);
+    }
+    return 0;
+}
+
+/*
+ * Wire format: step 5, the sync number and the consistent flag. The backup echoes
+ * the sync number back once everything before it was applied.
+ */
+static int stream_ack(backup_link *link, uint64_t seq, bool consistent)
+{
+    long marker[2], ack;
+
+    marker[0] = seq;
+    marker[1] = consistent;
+    if (send_step(link, 5) != 0 ||
+        backup_send_all(link->fd, marker, sizeof(marker)) != 0)
+    {
+        return -1;
+    }
+    link->bytes += sizeof(marker);
+    if (recv_reply(link->fd, &ack, sizeof(long)) != 0)
+    {
+        printf("backup %s did not acknowledge sync %ld\n", link->addr, marker[0]);
+        return -1;
+    }
+    return ack == marker[0] ? 0 : -1;
+}
+
+/*
+ * Wire format: step 7, then the step of the region, its size, the level and the
+ * number of nodes, and the nodes. The reply is the number of digests and the digests.
+ */
+static long stream_digests(backup_link *link, enum region_id id, long size, int level,
+                           const long *nodes, long count, uint32_t *digests)
+{
+    long query[4], n;
+
+    query[0] = 1 + id;
+    query[1] = size;
+    query[2] = level;
+    query[3] = count;
+    if (send_step(link, 7) != 0 ||
+        backup_send_all(link->fd, query, sizeof(query)) != 0 ||
+        backup_send_all(link->fd, nodes, count * sizeof(long)) != 0 ||
+        recv_reply(link->fd, &n, sizeof(long)) != 0)
+    {
+        return -1;
+    }
+    link->bytes += sizeof(query) + count * sizeof(long);
+    if (n != 0 && n != count)
+    {
+        printf("backup %s sent %ld digests for %ld nodes\n", link->addr, n, count);
+        return -1;
+    }
+    if (n > 0 && recv_reply(link->fd, digests, n * sizeof(uint32_t)) != 0)
+    {
+        return -1;
+    }
+    return n;
+}
+
+static void stream_close(backup_link *link)
+{
+    close(link->fd);
+    link->fd = -1;
+    free(link->pack_buf);
+    link->pack_buf = NULL;
+}
+
+/*
+ * TCP: connects to host:port
+ */
+static int tcp_connect(backup_link *link)
+{
+    struct addrinfo hints, *servinfo, *p;
+    char *host, *port;
+    char s[INET6_ADDRSTRLEN];
+    int rv, yes = 1;
+
+    host = strdup(link->addr);
+    if (host == NULL)
+    {
+        return -1;
+    }
+    port = strrchr(host, ':');
+    if (port == NULL)
+    {
+        fprintf(stderr, "backup %s is not host:port\n", link->addr);
+        free(host);
+        return -1;
+    }
+    *port++ = '\0';
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    rv = getaddrinfo(host, port, &hints, &servinfo);
+    free(host);
+    if (rv != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+
+    // loop through all the results and connect to the first we can
+    for (p = servinfo; p != NULL; p = p->ai_next)
+    {
+        link->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (link->fd == -1)
+        {
+            perror("client: socket\n");
+            continue;
+        }
+        rv = connect(link->fd, p->ai_addr, p->ai_addrlen);
+        if (rv == -1)
+        {
+            close(link->fd);
+            perror("client: connect\n");
+            continue;
+        }
+
+        break;
+    }
+
+    if (p == NULL)
+    {
+        fprintf(stderr, "client: failed to connect\n");
+        freeaddrinfo(servinfo);
+        return -1;
+    }
+
+    inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr), s, sizeof s);
+    printf("client: connecting to %s\n", s);
+
+    freeaddrinfo(servinfo); // all done with this structure
+
+    stream_setup(link->fd);
+    //the sync marker is small and waited on, don't let Nagle hold it back
+    setsockopt(link->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return 0;
+}
+
+/*
+ * TCP: listens on the port of host:port, on every address
+ */
+static int tcp_listen(const char *addr)
+{
+    struct addrinfo hints, *servinfo, *p;
+    const char *port;
+    int sockfd = -1;
+    int yes = 1;
+    int rv, waited;
+
+    port = strrchr(addr, ':');
+    port = port ? port + 1 : addr;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE; // use my IP
+
+    rv = getaddrinfo(NULL, port, &hints, &servinfo);
+    if (rv != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+
+    // loop through all the results and bind to the first we can
+    for (p = servinfo; p != NULL; p = p->ai_next)
+    {
+        sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (sockfd == -1)
+        {
+            perror("server: socket\n");
+            continue;
+        }
+
+        rv = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+        if (rv == -1)
+        {
+            perror("setsockopt\n");
+            close(sockfd);
+            continue;
+        }
+
+        //the instance an upgrade took over from releases its port a moment after it exits
+        for (waited = 0;
+             (rv = bind(sockfd, p->ai_addr, p->ai_addrlen)) == -1 &&
+             errno == EADDRINUSE && waited < BIND_RETRY_MS;
+             waited += 10)
+        {
+            usleep(10 * 1000);
+        }
+        if (rv == -1) {
+            close(sockfd);
+            perror("server: bind\n");
+            continue;
+        }
+
+        break;
+    }
+
+    freeaddrinfo(servinfo); // all done with this structure
+
+    if (p == NULL)
+    {
+        fprintf(stderr, "server: failed to bind\n");
+        return -1;
+    }
+    if (listen(sockfd, BACKLOG) == -1)
+    {
+        perror("listen\n");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+static int unix_address(const char *addr, struct sockaddr_un *sun)
+{
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    if (strlen(addr) >= sizeof(sun->sun_path))
+    {
+        fprintf(stderr, "unix socket path %s is too long\n", addr);
+        return -1;
+    }
+    strcpy(sun->sun_path, addr);
+    return 0;
+}
+
+/*
+ * UNIX: connects to the socket path
+ */
+static int unix_connect(backup_link *link)
+{
+    struct sockaddr_un sun;
+
+    if (unix_address(link->addr, &sun) != 0)
+    {
+        return -1;
+    }
+    link->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (link->fd == -1)
+    {
+        perror("client: socket\n");
+        return -1;
+    }
+    if (connect(link->fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+    {
+        perror("client: connect\n");
+        close(link->fd);
+        return -1;
+    }
+    stream_setup(link->fd);
+    return 0;
+}
+
+/*
+ * UNIX: listens on the socket path, replacing a stale socket of an earlier run
+ */
+static int unix_listen(const char *addr)
+{
+    struct sockaddr_un sun;
+    int sockfd;
+
+    if (unix_address(addr, &sun) != 0)
+    {
+        return -1;
+    }
+    sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1)
+    {
+        perror("server: socket\n");
+        return -1;
+    }
+    unlink(addr);
+    if (bind(sockfd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+        listen(sockfd, BACKLOG) == -1)
+    {
+        perror("server: bind\n");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+static void *loop_receiver(void *arg)
+{
+    int sockfd = (int)(long)arg;
+
+    backup_receive(sockfd, true);
+    return NULL;
+}
+
+/*
+ * LOOP: connects to a receiver thread of this process over a socket pair
+ */
+static int loop_connect(backup_link *link)
+{
+    int sv[2];
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    {
+        perror("socketpair\n");
+        return -1;
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, loop_receiver, (void *)(long)sv[1]) != 0)
+    {
+        printf("Error creating loopback receive thread\n");
+        pthread_attr_destroy(&attr);
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+    link->fd = sv[0];
+    stream_setup(link->fd);
+    return 0;
+}
+
+static const backup_transport g_transports[] = {
+    { "TCP", tcp_listen, tcp_connect, stream_hello, stream_send_region,
+      stream_send_records, stream_ack, stream_digests, stream_close, NULL, NULL },
+    { "UNIX", unix_listen, unix_connect, stream_hello, stream_send_region,
+      stream_send_records, stream_ack, stream_digests, stream_close, NULL, NULL },
+    { "LOOP", NULL, loop_connect, stream_hello, stream_send_region,
+      stream_send_records, stream_ack, stream_digests, stream_close, NULL, NULL },
+    { "RDMA", NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+      BackupServerRDMA, BackupClientRDMA },
+};
+
+const backup_transport *backup_transport_find(const char *name)
+{
+    size_t i;
+
+    if (name == NULL)
+    {
+        return NULL;
+    }
+    for (i = 0; i < sizeof(g_transports) / sizeof(g_transports[0]); i++)
+    {
+        if (strcmp(g_transports[i].name, name) == 0)
+        {
+            return &g_transports[i];
+        }
+    }
+    return NULL;
+}
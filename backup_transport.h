@@ -0,0 +1,112 @@
+/*
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * Transports the backups are sent over, chosen with failover_comm_type.
+ * A transport carries the syncs of a single backup over a link: it connects
+ * and agrees where to resume from, sends the dirty runs of the regions and
+ * the operation log records, and ends the sync with a marker the backup
+ * acknowledges. The sender threads in backup.c drive the link operations.
+ *
+ * TCP  - BSD sockets, the backup is given as host:port.
+ * UNIX - unix domain sockets, the backup is given as a socket path. Runs the
+ *        same protocol as TCP, for a backup process on the same host.
+ * LOOP - an in-process backup that receives and acknowledges every sync and
+ *        throws it away, to benchmark and test the primary side (throughput
+ *        and lag in "stats backups") without a network or a second process.
+ * RDMA - Accelio. It runs its own client and server threads, so it has no
+ *        link operations.
+ */
+
+#ifndef BACKUP_TRANSPORT_H_
+#define BACKUP_TRANSPORT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "regions.h"
+
+/*
+ * A link to a single backup
+ */
+typedef struct
+{
+	int fd;
+	const char *addr;           // the backup, as given in failover_dest
+	uint64_t bytes;             // bytes sent on the link
+	uint64_t zero_bytes;        // pages of zeros sent as a run header only
+	uint64_t packed_saved;      // bytes packing saved (failover_compress)
+	char *pack_buf;             // BACKUP_PACK_CHUNK bytes to pack into, once needed
+} backup_link;
+
+/*
+ * Kinds of the runs of a region on a stream link, see stream_send_region. A
+ * RUN_PACKED run is BACKUP_PACK_CHUNK bytes at most.
+ */
+#define BACKUP_RUN_DATA 0
+#define BACKUP_RUN_ZERO 1
+#define BACKUP_RUN_PACKED 2
+#define BACKUP_PACK_CHUNK (64 * 1024)
+
+typedef struct
+{
+	const char *name;
+	/*
+	 * Backup side: returns a listening socket for the address given in
+	 * failover_src, whose connections are received by backup_receive.
+	 * NULL if the transport has no separate backup side.
+	 */
+	int (*listen)(const char *addr);
+	/* Opens the link to link->addr. Returns 0 on success, -1 on error */
+	int (*connect)(backup_link *link);
+	/*
+	 * Tells the backup the epoch and the last sync it acknowledged, and gets
+	 * back the epoch and the last sync it applied
+	 */
+	int (*hello)(backup_link *link, const long hello[2], long reply[2]);
+	/*
+	 * Sends the pages of the region set in bitmap, as runs. The data is taken from
+	 * copy, which holds the runs back to back, or from the live region if it is NULL.
+	 */
+	int (*send_region)(backup_link *link, enum region_id id, const uint64_t *bitmap,
+	                   const char *copy);
+	/* Sends a buffer of operation log records (see replog.h) */
+	int (*send_records)(backup_link *link, const char *buf, size_t len);
+	/*
+	 * Ends the sync seq, and waits for the backup to acknowledge it. consistent
+	 * tells the backup whether its image is a consistent snapshot after this sync.
+	 */
+	int (*ack)(backup_link *link, uint64_t seq, bool consistent);
+	/*
+	 * Gets the digests of count nodes of a level of the backup's Merkle tree of
+	 * the region (see merkle.h), built over size bytes, between two syncs.
+	 * Returns the number of digests received: count, or 0 if the backup keeps no
+	 * copy of the region. -1 on error.
+	 */
+	long (*digests)(backup_link *link, enum region_id id, long size, int level,
+	                const long *nodes, long count, uint32_t *digests);
+	void (*close)(backup_link *link);
+	/* Transports with their own threads start their backup and primary sides with these */
+	int (*server)(char *addr);
+	int (*client)(char *addr);
+} backup_transport;
+
+/*
+ * Returns the transport of the given failover_comm_type, or NULL if there is none
+ */
+const backup_transport *backup_transport_find(const char *name);
+
+/*
+ * Sends/receives exactly len bytes over a stream link. Returns 0 on success,
+ * -1 on error or EOF. backup_recv_all is for blocking sockets only, it waits
+ * for the whole buffer in the kernel.
+ */
+int backup_send_all(int sockfd, const void *buf, size_t len);
+int backup_recv_all(int sockfd, void *buf, size_t len);
+
+/*
+ * Receives the syncs of a primary from a connected stream socket, until it
+ * is closed. With discard, the syncs are acknowledged without being applied
+ * (the LOOP transport). Implemented in backup.c.
+ */
+void backup_receive(int sockfd, bool discard);
+
+#endif /* BACKUP_TRANSPORT_H_ */
@@ -0,0 +1,728 @@
+/*
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * Checkpoints of the replicated regions to a directory. See checkpoint.h.
+ */
+
+#include "config.h"
+#include "checkpoint.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include "sharedmalloc.h"
+#include "memcached.h"
+
+#define CHECKPOINT_MAGIC "memcached-checkpoint 1"
+#define MANIFEST_NAME "MANIFEST"
+#define MANIFEST_TMP_NAME "MANIFEST.tmp"
+#define JOURNAL_NAME "journal"
+#define KEY_MAX 256
+/* A region file is named by its key and, past the first, its generation */
+#define FILE_MAX (KEY_MAX + 24)
+/* Bytes written to a file before its writeback is started */
+#define WRITEBACK_BYTES (8 * 1024 * 1024)
+#define COPY_CHUNK (1024 * 1024)
+
+typedef struct {
+    long epoch;
+    long seq;
+    int consistent;
+    long journal;               /* bytes of the journal to replay, 0 if none */
+    long generation;            /* of the region files, one per full sync */
+    bool present[REGION_MAX];
+    long size[REGION_MAX];
+    char key[REGION_MAX][KEY_MAX];
+} manifest;
+
+/* A run in the journal, followed by its data */
+typedef struct {
+    uint32_t id;
+    uint32_t pad;
+    uint64_t offset;
+    uint64_t len;
+} journal_run;
+
+/* The state of the link, there is a single checkpointer */
+static struct {
+    int dirfd;
+    int journal_fd;
+    long epoch;                 /* of the primary, from the hello */
+    bool full;                  /* the next sync writes new region files */
+    long generation;            /* of the region files the manifest points to */
+    bool syncing;               /* a sync was started and not acked yet */
+    int new_fd[REGION_MAX];     /* region files of the full sync, -1 if not open */
+    size_t unflushed[REGION_MAX];
+    size_t journal_len;         /* bytes appended to the journal by this sync */
+    size_t journal_unflushed;
+    uint64_t pace_start;
+    uint64_t paced;             /* bytes written since pace_start */
+} ckpt = { .dirfd = -1, .journal_fd = -1 };
+
+static uint64_t now_usec(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Sleeps as long as the bytes written in this sync are ahead of checkpoint_rate_mb */
+static void pace(size_t len) {
+    uint64_t due, now;
+
+    ckpt.paced += len;
+    if (settings.checkpoint_rate_mb == 0)
+        return;
+    due = ckpt.pace_start +
+        ckpt.paced * 1000000 / ((uint64_t)settings.checkpoint_rate_mb * 1024 * 1024);
+    now = now_usec();
+    if (due > now)
+        usleep(due - now);
+}
+
+/* Starts the writeback of the file every WRITEBACK_BYTES, so the sync at the end is short */
+static void writeback(int fd, size_t *unflushed, size_t len) {
+    *unflushed += len;
+    if (*unflushed >= WRITEBACK_BYTES) {
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        *unflushed = 0;
+    }
+}
+
+static int pwrite_all(int fd, const char *buf, size_t len, off_t at) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = pwrite(fd, buf, len, at);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        at += n;
+    }
+    return 0;
+}
+
+static int pread_all(int fd, char *buf, size_t len, off_t at) {
+    ssize_t n;
+
+    while (len > 0) {
+        n = pread(fd, buf, len, at);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        at += n;
+    }
+    return 0;
+}
+
+/*
+ * Copies len bytes from src at *src_at to dst at *dst_at, in the kernel where
+ * it can, and advances both offsets
+ */
+static int copy_range(int src, off_t *src_at, int dst, off_t *dst_at, size_t len, bool paced) {
+    static char *buf;
+    ssize_t n;
+    size_t chunk;
+
+    while (len > 0) {
+        chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+        n = copy_file_range(src, src_at, dst, dst_at, chunk, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                        errno == EOPNOTSUPP)) {
+            /* only the checkpointer or the startup copies, one at a time */
+            if (buf == NULL && (buf = malloc(COPY_CHUNK)) == NULL)
+                return -1;
+            if (pread_all(src, buf, chunk, *src_at) != 0 ||
+                pwrite_all(dst, buf, chunk, *dst_at) != 0)
+                return -1;
+            n = chunk;
+            *src_at += n;
+            *dst_at += n;
+        } else if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+        if (paced)
+            pace(n);
+    }
+    return 0;
+}
+
+/* The name of the file of a region in the directory */
+static void region_file(char *name, const char *key, long generation) {
+    if (generation == 0)
+        snprintf(name, FILE_MAX, "%s", key);
+    else
+        snprintf(name, FILE_MAX, "%s.%ld", key, generation);
+}
+
+static int manifest_read(int dirfd, manifest *m) {
+    char line[PATH_MAX];
+    char key[KEY_MAX];
+    long size;
+    int id, fd, ok = 0;
+    FILE *f;
+
+    memset(m, 0, sizeof(*m));
+    if ((fd = openat(dirfd, MANIFEST_NAME, O_RDONLY)) == -1)
+        return -1;
+    if ((f = fdopen(fd, "r")) == NULL) {
+        close(fd);
+        return -1;
+    }
+    if (fgets(line, sizeof(line), f) == NULL ||
+        strncmp(line, CHECKPOINT_MAGIC "\n", sizeof(CHECKPOINT_MAGIC)) != 0) {
+        fclose(f);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "epoch %ld", &m->epoch) == 1 ||
+            sscanf(line, "seq %ld", &m->seq) == 1 ||
+            sscanf(line, "consistent %d", &m->consistent) == 1 ||
+            sscanf(line, "journal %ld", &m->journal) == 1 ||
+            sscanf(line, "generation %ld", &m->generation) == 1)
+            continue;
+        if (sscanf(line, "region %d %ld %255s", &id, &size, key) == 3 &&
+            id >= 0 && id < REGION_MAX && size > 0) {
+            m->present[id] = true;
+            m->size[id] = size;
+            strcpy(m->key[id], key);
+        } else if (strcmp(line, "end\n") == 0) {
+            ok = 1;
+            break;
+        }
+    }
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+/* Replaces the manifest: writes it aside, syncs it and renames it over the old one */
+static int manifest_write(int dirfd, const manifest *m) {
+    FILE *f;
+    int fd, id, rv;
+
+    fd = openat(dirfd, MANIFEST_TMP_NAME, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || (f = fdopen(fd, "w")) == NULL) {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    fprintf(f, CHECKPOINT_MAGIC "\nepoch %ld\nseq %ld\nconsistent %d\njournal %ld\n"
+            "generation %ld\n", m->epoch, m->seq, m->consistent, m->journal, m->generation);
+    for (id = 0; id < REGION_MAX; id++) {
+        if (m->present[id])
+            fprintf(f, "region %d %ld %s\n", id, m->size[id], m->key[id]);
+    }
+    fprintf(f, "end\n");
+    rv = fflush(f) == 0 && fdatasync(fd) == 0 ? 0 : -1;
+    if (fclose(f) != 0)
+        rv = -1;
+    if (rv == 0 && renameat(dirfd, MANIFEST_TMP_NAME, dirfd, MANIFEST_NAME) != 0)
+        rv = -1;
+    if (rv == 0 && fsync(dirfd) != 0)
+        rv = -1;
+    return rv;
+}
+
+/*
+ * Copies the first m->journal bytes of the journal into the region files and
+ * syncs them
+ */
+static int journal_apply(int dirfd, int jfd, const manifest *m, bool paced) {
+    int fds[REGION_MAX];
+    journal_run run;
+    char name[FILE_MAX];
+    off_t at = 0, dst_at;
+    int id, rv = 0;
+
+    for (id = 0; id < REGION_MAX; id++)
+        fds[id] = -1;
+    while (rv == 0 && at < m->journal) {
+        if (pread_all(jfd, (char *)&run, sizeof(run), at) != 0 ||
+            run.id >= REGION_MAX || !m->present[run.id] ||
+            run.offset + run.len > (uint64_t)m->size[run.id]) {
+            rv = -1;
+            break;
+        }
+        at += sizeof(run);
+        if (fds[run.id] == -1) {
+            region_file(name, m->key[run.id], m->generation);
+            if ((fds[run.id] = openat(dirfd, name, O_WRONLY)) == -1) {
+                rv = -1;
+                break;
+            }
+        }
+        dst_at = run.offset;
+        rv = copy_range(jfd, &at, fds[run.id], &dst_at, run.len, paced);
+    }
+    for (id = 0; id < REGION_MAX; id++) {
+        if (fds[id] == -1)
+            continue;
+        if (rv == 0 && fdatasync(fds[id]) != 0)
+            rv = -1;
+        close(fds[id]);
+    }
+    return rv;
+}
+
+/*
+ * Replays the journal the manifest points to, left by a checkpoint that was
+ * cut short after its journal was synced
+ */
+static int journal_replay(int dirfd, manifest *m) {
+    int jfd, rv;
+
+    if (m->journal == 0)
+        return 0;
+    if ((jfd = openat(dirfd, JOURNAL_NAME, O_RDONLY)) == -1)
+        return -1;
+    rv = journal_apply(dirfd, jfd, m, false);
+    close(jfd);
+    if (rv == 0) {
+        m->journal = 0;
+        rv = manifest_write(dirfd, m);
+    }
+    return rv;
+}
+
+/*
+ * Checks that the region files of the manifest exist with their sizes, or
+ * larger: see region_files_grow
+ */
+static bool manifest_files_ok(int dirfd, const manifest *m) {
+    struct stat st;
+    char name[FILE_MAX];
+    int id;
+
+    for (id = 0; id < REGION_MAX; id++) {
+        if (!m->present[id])
+            continue;
+        region_file(name, m->key[id], m->generation);
+        if (fstatat(dirfd, name, &st, 0) != 0 || st.st_size < m->size[id])
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Grows the region files to the sizes of the manifest (the slabs grow with
+ * the memlimit command) before the manifest is written, so a file may be
+ * larger than the manifest says, never smaller
+ */
+static int region_files_grow(int dirfd, const manifest *m) {
+    struct stat st;
+    char name[FILE_MAX];
+    int id, fd, rv = 0;
+
+    for (id = 0; id < REGION_MAX && rv == 0; id++) {
+        if (!m->present[id])
+            continue;
+        region_file(name, m->key[id], m->generation);
+        if ((fd = openat(dirfd, name, O_WRONLY)) == -1)
+            return -1;
+        if (fstat(fd, &st) != 0 || (st.st_size < m->size[id] &&
+            (ftruncate(fd, m->size[id]) != 0 || fdatasync(fd) != 0)))
+            rv = -1;
+        close(fd);
+    }
+    return rv;
+}
+
+static void ckpt_close(backup_link *link) {
+    int id;
+
+    for (id = 0; id < REGION_MAX; id++) {
+        if (ckpt.new_fd[id] != -1)
+            close(ckpt.new_fd[id]);
+        ckpt.new_fd[id] = -1;
+    }
+    if (ckpt.journal_fd != -1)
+        close(ckpt.journal_fd);
+    ckpt.journal_fd = -1;
+    if (ckpt.dirfd != -1)
+        close(ckpt.dirfd);
+    ckpt.dirfd = -1;
+    link->fd = -1;
+}
+
+/* Opens the directory, creating it if needed */
+static int ckpt_connect(backup_link *link) {
+    int id;
+
+    for (id = 0; id < REGION_MAX; id++)
+        ckpt.new_fd[id] = -1;
+    if (mkdir(link->addr, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "checkpoint: can't create %s: %s\n", link->addr, strerror(errno));
+        return -1;
+    }
+    ckpt.dirfd = open(link->addr, O_RDONLY | O_DIRECTORY);
+    if (ckpt.dirfd != -1)
+        ckpt.journal_fd = openat(ckpt.dirfd, JOURNAL_NAME, O_RDWR | O_CREAT, 0644);
+    if (ckpt.dirfd == -1 || ckpt.journal_fd == -1) {
+        fprintf(stderr, "checkpoint: can't open %s: %s\n", link->addr, strerror(errno));
+        ckpt_close(link);
+        return -1;
+    }
+    link->fd = ckpt.dirfd;
+    ckpt.syncing = false;
+    return 0;
+}
+
+/*
+ * The reply is the epoch and the sync of the checkpoint in the directory,
+ * 0 if there is none. The next sync is a full one on the same terms as in
+ * replica_connect.
+ */
+static int ckpt_hello(backup_link *link, const long hello[2], long reply[2]) {
+    manifest m;
+
+    reply[0] = reply[1] = 0;
+    ckpt.generation = 0;
+    if (manifest_read(ckpt.dirfd, &m) == 0) {
+        /* a full sync never writes over the files the manifest points to */
+        ckpt.generation = m.generation;
+        if (journal_replay(ckpt.dirfd, &m) == 0 && manifest_files_ok(ckpt.dirfd, &m)) {
+            reply[0] = m.epoch;
+            reply[1] = m.seq;
+        }
+    }
+    ckpt.epoch = hello[0];
+    ckpt.full = reply[0] != hello[0] || reply[1] < hello[1] || hello[1] == 0;
+    return 0;
+}
+
+static bool page_is_zero(const char *page) {
+    const uint64_t *w = (const uint64_t *)page;
+    size_t i;
+
+    for (i = 0; i < REGION_PAGE_SIZE / sizeof(uint64_t); i++) {
+        if (w[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Writes a run into the new file of a full sync. The pages that were never
+ * written to are left out, so they stay holes of the file.
+ */
+static int write_full_run(enum region_id id, const char *data, size_t offset, size_t len) {
+    size_t start = 0, end, page;
+
+    while (start < len) {
+        while (start < len && page_is_zero(data + start))
+            start += REGION_PAGE_SIZE;
+        if (start >= len)
+            break;
+        for (end = start; end < len; end += page) {
+            page = len - end < REGION_PAGE_SIZE ? len - end : REGION_PAGE_SIZE;
+            if (page == REGION_PAGE_SIZE && page_is_zero(data + end))
+                break;
+        }
+        if (pwrite_all(ckpt.new_fd[id], data + start, end - start, offset + start) != 0)
+            return -1;
+        writeback(ckpt.new_fd[id], &ckpt.unflushed[id], end - start);
+        pace(end - start);
+        start = end;
+    }
+    return 0;
+}
+
+/*
+ * Opens the file of a region the full sync writes, of the next generation,
+ * sized as the region. One left by a full sync cut short is overwritten.
+ */
+static int ckpt_new_file(enum region_id id, region_t *r) {
+    char name[FILE_MAX];
+
+    if (ckpt.new_fd[id] != -1)
+        return 0;
+    if (r->key == NULL || strlen(r->key) >= KEY_MAX)
+        return -1;
+    region_file(name, r->key, ckpt.generation + 1);
+    ckpt.new_fd[id] = openat(ckpt.dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (ckpt.new_fd[id] == -1 || ftruncate(ckpt.new_fd[id], r->size) != 0) {
+        fprintf(stderr, "checkpoint: can't create %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    ckpt.unflushed[id] = 0;
+    return 0;
+}
+
+/*
+ * A full sync writes the runs into the region files of a new generation, at their offsets, so the
+ * pages it does not send (and the zero ones) stay holes. An incremental one appends them to the
+ * journal. The hash table is left out.
+ */
+static int ckpt_send_region(backup_link *link, enum region_id id, const uint64_t *bitmap,
+                            const char *copy) {
+    region_t *r = region_get(id);
+    size_t pos = 0, offset, len;
+    journal_run run;
+    const char *data;
+
+    if (!ckpt.syncing) {
+        ckpt.syncing = true;
+        ckpt.journal_len = 0;
+        ckpt.journal_unflushed = 0;
+        ckpt.pace_start = now_usec();
+        ckpt.paced = 0;
+    }
+    if (id == REGION_ASSOC || r == NULL || bitmap == NULL)
+        return 0;
+    if (ckpt.full && ckpt_new_file(id, r) != 0)
+        return -1;
+
+    while (region_next_dirty_run(id, bitmap, &pos, &offset, &len)) {
+        data = copy ? copy : (const char *)r->base + offset;
+        if (ckpt.full) {
+            if (write_full_run(id, data, offset, len) != 0)
+                goto fail;
+        } else {
+            memset(&run, 0, sizeof(run));
+            run.id = id;
+            run.offset = offset;
+            run.len = len;
+            if (pwrite_all(ckpt.journal_fd, (const char *)&run, sizeof(run),
+                           ckpt.journal_len) != 0 ||
+                pwrite_all(ckpt.journal_fd, data, len,
+                           ckpt.journal_len + sizeof(run)) != 0)
+                goto fail;
+            ckpt.journal_len += sizeof(run) + len;
+            writeback(ckpt.journal_fd, &ckpt.journal_unflushed, sizeof(run) + len);
+            pace(len);
+        }
+        if (copy)
+            copy += len;
+        link->bytes += len;
+    }
+    return 0;
+
+fail:
+    fprintf(stderr, "checkpoint: write to %s failed: %s\n", link->addr, strerror(errno));
+    return -1;
+}
+
+static int ckpt_send_records(backup_link *link, const char *buf, size_t len) {
+    /* checkpoint_dir requires the snapshot mode */
+    return len == 0 ? 0 : -1;
+}
+
+/* Fills in the regions the checkpoint holds */
+static void ckpt_manifest(manifest *m, uint64_t seq, bool consistent) {
+    region_t *r;
+    int id;
+
+    memset(m, 0, sizeof(*m));
+    m->epoch = ckpt.epoch;
+    m->seq = seq;
+    m->consistent = consistent;
+    m->generation = ckpt.full ? ckpt.generation + 1 : ckpt.generation;
+    for (id = 0; id < REGION_MAX; id++) {
+        r = region_get(id);
+        if (id == REGION_ASSOC || r == NULL || r->key == NULL || strlen(r->key) >= KEY_MAX)
+            continue;
+        m->present[id] = true;
+        m->size[id] = r->size;
+        strcpy(m->key[id], r->key);
+    }
+}
+
+/*
+ * Syncs the region files of a full sync, and the directory, so that they
+ * are all there once the manifest points to them
+ */
+static int ckpt_commit_full(const manifest *m) {
+    int id;
+
+    for (id = 0; id < REGION_MAX; id++) {
+        if (!m->present[id])
+            continue;
+        if (ckpt_new_file(id, region_get(id)) != 0 || fdatasync(ckpt.new_fd[id]) != 0)
+            return -1;
+        close(ckpt.new_fd[id]);
+        ckpt.new_fd[id] = -1;
+    }
+    return fsync(ckpt.dirfd);
+}
+
+/*
+ * Removes the region files of the generation a full sync replaced, once the
+ * manifest that points to the new one is in place
+ */
+static void ckpt_remove_generation(const manifest *old) {
+    char name[FILE_MAX];
+    int id;
+
+    for (id = 0; id < REGION_MAX; id++) {
+        if (!old->present[id])
+            continue;
+        region_file(name, old->key[id], old->generation);
+        unlinkat(ckpt.dirfd, name, 0);
+    }
+    fsync(ckpt.dirfd);
+}
+
+/*
+ * Makes the sync durable, see checkpoint.h. Until the manifest is replaced
+ * the directory holds the previous checkpoint, or the journal that completes
+ * this one.
+ */
+static int ckpt_ack(backup_link *link, uint64_t seq, bool consistent) {
+    manifest m, old;
+    bool replaced = false;
+    int rv = 0;
+
+    ckpt_manifest(&m, seq, consistent);
+    if (ckpt.full) {
+        rv = ckpt_commit_full(&m);
+        replaced = manifest_read(ckpt.dirfd, &old) == 0 && old.generation != m.generation;
+    } else if (region_files_grow(ckpt.dirfd, &m) != 0) {
+        rv = -1;
+    } else if (ckpt.journal_len > 0) {
+        m.journal = ckpt.journal_len;
+        if (fdatasync(ckpt.journal_fd) != 0 || manifest_write(ckpt.dirfd, &m) != 0 ||
+            journal_apply(ckpt.dirfd, ckpt.journal_fd, &m, true) != 0)
+            rv = -1;
+        m.journal = 0;
+    }
+    if (rv == 0)
+        rv = manifest_write(ckpt.dirfd, &m);
+    if (rv == 0 && ckpt.full) {
+        ckpt.generation = m.generation;
+        if (replaced)
+            ckpt_remove_generation(&old);
+    }
+    if (rv == 0 && ckpt.journal_len > 0)
+        ftruncate(ckpt.journal_fd, 0);
+    ckpt.syncing = false;
+    if (rv != 0) {
+        fprintf(stderr, "checkpoint: sync %lu to %s failed: %s\n",
+                (unsigned long)seq, link->addr, strerror(errno));
+        return -1;
+    }
+    ckpt.full = false;
+    if (settings.verbose > 1) {
+        fprintf(stderr, "checkpoint: sync %lu written to %s, %s\n", (unsigned long)seq,
+                link->addr, consistent ? "consistent" : "fuzzy");
+    }
+    return 0;
+}
+
+static const backup_transport ckpt_transport = {
+    "CHECKPOINT", NULL, ckpt_connect, ckpt_hello, ckpt_send_region,
+    ckpt_send_records, ckpt_ack, NULL, ckpt_close, NULL, NULL
+};
+
+const backup_transport *checkpoint_transport(void) {
+    return &ckpt_transport;
+}
+
+/* Copies the data of a sparse file, leaving its holes as holes */
+static int copy_sparse(int src, int dst, off_t size) {
+    off_t data = 0, hole, dst_at;
+
+    if (ftruncate(dst, size) != 0)
+        return -1;
+    while (data < size) {
+        data = lseek(src, data, SEEK_DATA);
+        if (data == -1)
+            return errno == ENXIO ? 0 : -1;
+        hole = lseek(src, data, SEEK_HOLE);
+        if (hole == -1 || hole > size)
+            hole = size;
+        dst_at = data;
+        if (copy_range(src, &data, dst, &dst_at, hole - data, false) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int checkpoint_restore(const char *dir) {
+    manifest m;
+    struct stat st;
+    char *paths[REGION_MAX] = { NULL };
+    char name[FILE_MAX];
+    uint64_t start = now_usec();
+    int dirfd, src, dst, id, rv = 0;
+    bool lost = false;
+
+    if ((dirfd = open(dir, O_RDONLY | O_DIRECTORY)) == -1)
+        return 0;
+    if (manifest_read(dirfd, &m) != 0) {
+        close(dirfd);
+        return 0;
+    }
+    if (journal_replay(dirfd, &m) != 0 || !manifest_files_ok(dirfd, &m)) {
+        fprintf(stderr, "checkpoint: %s is damaged, not restored\n", dir);
+        close(dirfd);
+        return -1;
+    }
+    for (id = 0; id < REGION_MAX; id++) {
+        if (!m.present[id])
+            continue;
+        if ((paths[id] = gen_full_path(m.key[id], KEYPATH)) == NULL) {
+            rv = -1;
+            goto out;
+        }
+        /* a larger one grew after the checkpoint */
+        if (stat(paths[id], &st) != 0 || st.st_size < m.size[id])
+            lost = true;
+    }
+    if (!lost)
+        goto out;
+    if (!m.consistent) {
+        fprintf(stderr, "checkpoint: sync %ld in %s is not a consistent cut, not restored\n",
+                m.seq, dir);
+        rv = -1;
+        goto out;
+    }
+
+    mkdir(KEYPATH, 0766);
+    for (id = 0; id < REGION_MAX && rv == 0; id++) {
+        if (!m.present[id])
+            continue;
+        region_file(name, m.key[id], m.generation);
+        src = openat(dirfd, name, O_RDONLY);
+        dst = open(paths[id], O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (src == -1 || dst == -1 || copy_sparse(src, dst, m.size[id]) != 0) {
+            fprintf(stderr, "checkpoint: can't restore %s: %s\n", paths[id], strerror(errno));
+            rv = -1;
+        }
+        if (src != -1)
+            close(src);
+        if (dst != -1)
+            close(dst);
+    }
+    if (rv != 0) {
+        /* a cold start rather than a mix of files */
+        for (id = 0; id < REGION_MAX; id++) {
+            if (paths[id] != NULL)
+                unlink(paths[id]);
+        }
+        goto out;
+    }
+    rv = 1;
+    fprintf(stderr, "Restored checkpoint %ld of %s in %lu ms\n", m.seq, dir,
+            (unsigned long)((now_usec() - start) / 1000));
+
+out:
+    for (id = 0; id < REGION_MAX; id++)
+        free(paths[id]);
+    close(dirfd);
+    return rv;
+}
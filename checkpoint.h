@@ -0,0 +1,46 @@
+/*
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * Checkpoints of the replicated regions to a directory on durable storage,
+ * so that a warm restart can reload the cache after the shared memory files
+ * were lost with the page cache (a power loss). See -o checkpoint_dir.
+ *
+ * The checkpointer is a backup like the others (see backup.c), whose sender
+ * runs every checkpoint_interval seconds and whose transport writes to files
+ * instead of a socket. It gets the same incremental syncs and consistent
+ * cuts, so a checkpoint only writes the pages dirtied since the last one.
+ * The directory holds a file per region, named by its shared_malloc key and
+ * its generation, a journal and a manifest:
+ *
+ * - A full sync (the first one of a run) writes the region files of a new
+ *   generation next to the old ones, syncs them and points the manifest at
+ *   them, and only then removes the old ones.
+ * - An incremental sync appends its runs to the journal. Once the journal
+ *   is synced the manifest points to it, the runs are copied into the region
+ *   files, and the manifest is rewritten without it. A checkpoint cut short
+ *   is either ignored or replayed from the journal.
+ *
+ * So the directory always holds a whole checkpoint. The manifest is replaced
+ * atomically (written aside, synced and renamed), and tells the sync number,
+ * whether the checkpoint is a consistent cut, the generation of the region
+ * files, and the size and key of every region. The hash table is not written: a warm restart relinks the items
+ * from the slabs.
+ */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include "backup_transport.h"
+
+/* The transport of the checkpointer, its address is the directory */
+const backup_transport *checkpoint_transport(void);
+
+/*
+ * Restores the shared memory files of the regions from the checkpoint in
+ * dir, unless they all exist with at least the sizes of the checkpoint (a
+ * restart that did not lose them). Only a consistent checkpoint is restored.
+ * Called at startup, before the regions are attached.
+ * Returns 1 if the files were restored, 0 if not, -1 on error.
+ */
+int checkpoint_restore(const char *dir);
+
+#endif /* CHECKPOINT_H_ */
@@ -90,8 +90,9 @@ static int lru_crawler_start(uint32_t id, uint32_t remaining);
 
 /* Get the next CAS id for a new item. */
 /* TODO: refactor some atomics for this. */
+static uint64_t cas_id = 0;
+
 uint64_t get_cas_id(void) {
-    static uint64_t cas_id = 0;
     pthread_mutex_lock(&cas_id_lock);
     uint64_t next_id = ++cas_id;
     pthread_mutex_unlock(&cas_id_lock);
@@ -276,11 +277,13 @@ static void do_item_link_q(item *it) { /* item is the new head */
     assert(it != *head);
     assert((*head && *tail) || (*head == 0 && *tail == 0));
     it->prev = 0;
-    it->next = *head;
-    if (it->next) it->next->prev = it;
+    it->next = item_ref_of(*head);
+    if (it->next) ITEM_next(it)->prev = item_ref_of(it);
     *head = it;
     if (*tail == 0) *tail = it;
     sizes[it->slabs_clsid]++;
+    region_mark_dirty(it, sizeof(item));
+    if (it->next) region_mark_dirty(ITEM_next(it), sizeof(item));
     return;
 }
 
@@ -297,18 +300,20 @@ static void do_item_unlink_q(item *it) {
 
     if (*head == it) {
         assert(it->prev == 0);
-        *head = it->next;
+        *head = ITEM_next(it);
     }
     if (*tail == it) {
         assert(it->next == 0);
-        *tail = it->prev;
+        *tail = ITEM_prev(it);
     }
-    assert(it->next != it);
-    assert(it->prev != it);
+    assert(ITEM_next(it) != it);
+    assert(ITEM_prev(it) != it);
 
-    if (it->next) it->next->prev = it->prev;
-    if (it->prev) it->prev->next = it->next;
+    if (it->next) ITEM_next(it)->prev = it->prev;
+    if (it->prev) ITEM_prev(it)->next = it->next;
     sizes[it->slabs_clsid]--;
+    if (it->next) region_mark_dirty(ITEM_next(it), sizeof(item));
+    if (it->prev) region_mark_dirty(ITEM_prev(it), sizeof(item));
     return;
 }
 
@@ -335,6 +340,8 @@ int do_item_link(item *it, const uint32_t hv) {
     assoc_insert(it, hv);
     item_link_q(it);
     refcount_incr(&it->refcount);
+    /* The whole item was written between alloc and link */
+    region_mark_dirty(it, ITEM_ntotal(it));
 
     return 1;
 }
@@ -349,6 +356,7 @@ void do_item_unlink(item *it, const uint32_t hv) {
         STATS_UNLOCK();
         assoc_delete(ITEM_key(it), it->nkey, hv);
         item_unlink_q(it);
+        region_mark_dirty(it, sizeof(item));
         do_item_remove(it);
     }
 }
@@ -364,6 +372,7 @@ void do_item_unlink_nolock(item *it, const uint32_t hv) {
         STATS_UNLOCK();
         assoc_delete(ITEM_key(it), it->nkey, hv);
         do_item_unlink_q(it);
+        region_mark_dirty(it, sizeof(item));
         do_item_remove(it);
     }
 }
@@ -405,6 +414,7 @@ void do_item_update(item *it) {
                 item_unlink_q(it);
                 item_link_q(it);
             }
+            region_mark_dirty(it, sizeof(item));
         }
     }
 }
@@ -418,6 +428,104 @@ int do_item_replace(item *it, item *new_it, const uint32_t hv) {
     return do_item_link(new_it, hv);
 }
 
+typedef struct {
+    item *heads[LARGEST_ID];
+    item *tails[LARGEST_ID];
+    unsigned int sizes[LARGEST_ID];
+    uint64_t items;
+    uint64_t bytes;
+    uint64_t cas;
+} restore_lrus;
+
+void *item_restore_begin(void) {
+    return calloc(1, sizeof(restore_lrus));
+}
+
+bool item_restore(void *arg, item *it, const unsigned int id, const unsigned int size) {
+    restore_lrus *lrus = arg;
+    item *found;
+    uint32_t hv;
+
+    /* anything the last run was not done with, or left half written */
+    if ((it->it_flags & (ITEM_LINKED | ITEM_SLABBED)) != ITEM_LINKED ||
+        ITEM_clsid(it) != id || it->nkey == 0 || it->nkey > KEY_MAX_LENGTH ||
+        it->nbytes < 2 || ITEM_ntotal(it) > size ||
+        memcmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2) != 0) {
+        return false;
+    }
+    if (!settings.lru_maintainer_thread) {
+        it->slabs_clsid = id;
+    }
+
+    hv = hash(ITEM_key(it), it->nkey);
+    item_lock(hv);
+    /* a crash amid a replace may leave the key linked twice, keep one */
+    found = assoc_find(ITEM_key(it), it->nkey, hv);
+    if (found == NULL) {
+        assoc_relink(it, hv);
+    }
+    item_unlock(hv);
+    if (found != NULL) {
+        return false;
+    }
+
+    /* the link is the only reference left */
+    it->refcount = 1;
+    it->next = 0;
+    it->prev = item_ref_of(lrus->tails[it->slabs_clsid]);
+    if (it->prev) {
+        ITEM_prev(it)->next = item_ref_of(it);
+    } else {
+        lrus->heads[it->slabs_clsid] = it;
+    }
+    lrus->tails[it->slabs_clsid] = it;
+    lrus->sizes[it->slabs_clsid]++;
+    lrus->items++;
+    lrus->bytes += ITEM_ntotal(it);
+    if (ITEM_get_cas(it) > lrus->cas) {
+        lrus->cas = ITEM_get_cas(it);
+    }
+    return true;
+}
+
+void item_restore_end(void *arg) {
+    restore_lrus *lrus = arg;
+    int id;
+
+    for (id = 0; id < LARGEST_ID; id++) {
+        item *head = lrus->heads[id];
+        if (head == NULL)
+            continue;
+        /* the restored items go behind the ones of the other threads */
+        pthread_mutex_lock(&lru_locks[id]);
+        head->prev = item_ref_of(tails[id]);
+        if (tails[id]) {
+            tails[id]->next = item_ref_of(head);
+            region_mark_dirty(tails[id], sizeof(item));
+        } else {
+            heads[id] = head;
+        }
+        region_mark_dirty(head, sizeof(item));
+        tails[id] = lrus->tails[id];
+        sizes[id] += lrus->sizes[id];
+        pthread_mutex_unlock(&lru_locks[id]);
+    }
+
+    STATS_LOCK();
+    stats.curr_bytes += lrus->bytes;
+    stats.curr_items += lrus->items;
+    stats.total_items += lrus->items;
+    STATS_UNLOCK();
+    assoc_relinked(lrus->items);
+
+    /* new CAS ids must not repeat those of the restored items */
+    pthread_mutex_lock(&cas_id_lock);
+    if (lrus->cas > cas_id)
+        cas_id = lrus->cas;
+    pthread_mutex_unlock(&cas_id_lock);
+    free(lrus);
+}
+
 /*@null@*/
 /* This is walking the line of violating lock order, but I think it's safe.
  * If the LRU lock is held, an item in the LRU cannot be wiped and freed.
@@ -451,7 +559,7 @@ char *item_cachedump(const unsigned int slabs_clsid, const unsigned int limit, u
     while (it != NULL && (limit == 0 || shown < limit)) {
         assert(it->nkey <= KEY_MAX_LENGTH);
         if (it->nbytes == 0 && it->nkey == 0) {
-            it = it->next;
+            it = ITEM_next(it);
             continue;
         }
         /* Copy the key since it may not be null-terminated in the struct */
@@ -465,7 +573,7 @@ char *item_cachedump(const unsigned int slabs_clsid, const unsigned int limit, u
         memcpy(buffer + bufcurr, temp, len);
         bufcurr += len;
         shown++;
-        it = it->next;
+        it = ITEM_next(it);
     }
 
     memcpy(buffer + bufcurr, "END\r\n", 6);
@@ -650,7 +758,7 @@ void item_stats_sizes(ADD_STAT add_stats, void *c) {
                 int bucket = ntotal / 32;
                 if ((ntotal % 32) != 0) bucket++;
                 if (bucket < num_buckets) histogram[bucket]++;
-                iter = iter->next;
+                iter = ITEM_next(iter);
             }
             pthread_mutex_unlock(&lru_locks[i]);
         }
@@ -740,10 +848,44 @@ item *do_item_touch(const char *key, size_t nkey, uint32_t exptime,
     item *it = do_item_get(key, nkey, hv);
     if (it != NULL) {
         it->exptime = exptime;
+        region_mark_dirty(it, sizeof(item));
     }
     return it;
 }
 
+/*
+ * Copies the item of key out of the replicated regions of a backup, between
+ * two syncs (see item_read). Nothing in them is trusted: the item must lie in
+ * the slabs, be linked, fit in item_size_max, and be live by the primary's
+ * clock. The copy is ITEM_COPY, and freed by item_remove.
+ */
+item *item_replica_copy(const char *key, const size_t nkey, const uint32_t hv) {
+    item *it = assoc_find_replica(key, nkey, hv);
+    item *copy;
+    rel_time_t now, oldest_live;
+    uint64_t oldest_cas, cas;
+    size_t ntotal;
+
+    if (it == NULL || (it->it_flags & (ITEM_LINKED|ITEM_SLABBED)) != ITEM_LINKED ||
+        it->nbytes < 2 || (ntotal = ITEM_ntotal(it)) > (size_t)settings.item_size_max ||
+        !slabs_replica_clock(&now, &oldest_live, &oldest_cas))
+        return NULL;
+    if (it->exptime != 0 && it->exptime <= now)
+        return NULL;
+    cas = ITEM_get_cas(it);
+    if (oldest_live != 0 && oldest_live <= now && (it->time <= oldest_live ||
+        (oldest_cas != 0 && cas != 0 && cas < oldest_cas)))
+        return NULL;
+
+    if ((copy = malloc(ntotal)) == NULL)
+        return NULL;
+    memcpy(copy, it, ntotal);
+    copy->next = copy->prev = copy->h_next = 0;
+    copy->refcount = 1;
+    copy->it_flags = (it->it_flags & ITEM_CAS) | ITEM_COPY;
+    return copy;
+}
+
 /*** LRU MAINTENANCE THREAD ***/
 
 /* Returns number of items remove, expired, or evicted.
@@ -769,7 +911,7 @@ static int lru_pull_tail(const int orig_id, const int cur_lru,
     /* We walk up *only* for locked items, and if bottom is expired. */
     for (; tries > 0 && search != NULL; tries--, search=next_it) {
         /* we might relink search mid-loop, so search->prev isn't reliable */
-        next_it = search->prev;
+        next_it = ITEM_prev(search);
         if (search->nbytes == 0 && search->nkey == 0 && search->it_flags == 1) {
             /* We are a crawler, ignore it. */
             tries++;
@@ -1097,11 +1239,11 @@ static void crawler_link_q(item *it) { /* item is the new tail */
     assert(*tail != 0);
     assert(it != *tail);
     assert((*head && *tail) || (*head == 0 && *tail == 0));
-    it->prev = *tail;
+    it->prev = item_ref_of(*tail);
     it->next = 0;
     if (it->prev) {
-        assert(it->prev->next == 0);
-        it->prev->next = it;
+        assert(ITEM_prev(it)->next == 0);
+        ITEM_prev(it)->next = item_ref_of(it);
     }
     *tail = it;
     if (*head == 0) *head = it;
@@ -1115,17 +1257,17 @@ static void crawler_unlink_q(item *it) {
 
     if (*head == it) {
         assert(it->prev == 0);
-        *head = it->next;
+        *head = ITEM_next(it);
     }
     if (*tail == it) {
         assert(it->next == 0);
-        *tail = it->prev;
+        *tail = ITEM_prev(it);
     }
-    assert(it->next != it);
-    assert(it->prev != it);
+    assert(ITEM_next(it) != it);
+    assert(ITEM_prev(it) != it);
 
-    if (it->next) it->next->prev = it->prev;
-    if (it->prev) it->prev->next = it->next;
+    if (it->next) ITEM_next(it)->prev = it->prev;
+    if (it->prev) ITEM_prev(it)->next = it->next;
     return;
 }
 
@@ -1143,47 +1285,47 @@ static item *crawler_crawl_q(item *it) {
     if (it->prev == 0) {
         assert(*head == it);
         if (it->next) {
-            *head = it->next;
-            assert(it->next->prev == it);
-            it->next->prev = 0;
+            *head = ITEM_next(it);
+            assert(ITEM_next(it)->prev == item_ref_of(it));
+            ITEM_next(it)->prev = 0;
         }
         return NULL; /* Done */
     }
 
     /* Swing ourselves in front of the next item */
     /* NB: If there is a prev, we can't be the head */
-    assert(it->prev != it);
+    assert(ITEM_prev(it) != it);
     if (it->prev) {
-        if (*head == it->prev) {
+        if (*head == ITEM_prev(it)) {
             /* Prev was the head, now we're the head */
             *head = it;
         }
         if (*tail == it) {
             /* We are the tail, now they are the tail */
-            *tail = it->prev;
+            *tail = ITEM_prev(it);
         }
-        assert(it->next != it);
+        assert(ITEM_next(it) != it);
         if (it->next) {
-            assert(it->prev->next == it);
-            it->prev->next = it->next;
-            it->next->prev = it->prev;
+            assert(ITEM_prev(it)->next == item_ref_of(it));
+            ITEM_prev(it)->next = it->next;
+            ITEM_next(it)->prev = it->prev;
         } else {
             /* Tail. Move this above? */
-            it->prev->next = 0;
+            ITEM_prev(it)->next = 0;
         }
         /* prev->prev's next is it->prev */
         it->next = it->prev;
-        it->prev = it->next->prev;
-        it->next->prev = it;
+        it->prev = ITEM_next(it)->prev;
+        ITEM_next(it)->prev = item_ref_of(it);
         /* New it->prev now, if we're not at the head. */
         if (it->prev) {
-            it->prev->next = it;
+            ITEM_prev(it)->next = item_ref_of(it);
         }
     }
-    assert(it->next != it);
-    assert(it->prev != it);
+    assert(ITEM_next(it) != it);
+    assert(ITEM_prev(it) != it);
 
-    return it->next; /* success */
+    return ITEM_next(it); /* success */
 }
 
 /* I pulled this out to make the main thread clearer, but it reaches into the
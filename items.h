@@ -23,10 +23,22 @@ void item_stats_sizes(ADD_STAT add_stats, void *c);
 
 item *do_item_get(const char *key, const size_t nkey, const uint32_t hv);
 item *do_item_touch(const char *key, const size_t nkey, uint32_t exptime, const uint32_t hv);
+item *item_replica_copy(const char *key, const size_t nkey, const uint32_t hv);
 void item_stats_reset(void);
 extern pthread_mutex_t lru_locks[POWER_LARGEST];
 void item_stats_evictions(uint64_t *evicted);
 
+/*
+ * Warm restart, see slabs_restore. Each restoring thread gathers the items it
+ * keeps in LRUs of its own from item_restore_begin, which item_restore_end
+ * appends to the LRUs. item_restore relinks the chunk into the hash table and
+ * returns true if it holds a valid linked item of slab class id, whose chunks
+ * are size bytes; otherwise the caller frees it.
+ */
+void *item_restore_begin(void);
+bool item_restore(void *lrus, item *it, const unsigned int id, const unsigned int size);
+void item_restore_end(void *lrus);
+
 enum crawler_result_type {
     CRAWLER_OK=0, CRAWLER_RUNNING, CRAWLER_BADCLASS, CRAWLER_NOTSTARTED
 };
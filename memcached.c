@@ -24,6 +24,9 @@
 #include "sharedmalloc.h"
 #include "backup_rdma_accelio.h"
 #include "backup.h"
+#include "upgrade.h"
+#include "numa.h"
+#include "checkpoint.h"
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -100,6 +103,12 @@ static void event_handler(const int fd, const short which, void *arg);
 static void conn_close(conn *c);
 static void conn_init(void);
 static bool update_event(conn *c, const int new_flags);
+static uint64_t usec_now(void);
+static bool conn_backup_acked(conn *c);
+static bool conn_request_pending(conn *c);
+static bool conn_backup_park(conn *c);
+static void conn_backup_hold(conn *c);
+static void conn_backup_unpark(conn *c);
 static void complete_nread(conn *c);
 static void process_command(conn *c, char *command);
 static void write_and_free(conn *c, char *buf, int bytes);
@@ -141,6 +150,8 @@ static enum transmit_result transmit(conn *c);
  * can block the listener via a condition.
  */
 static volatile bool allow_new_conns = true;
+/* Set while an upgrade closes the client connections, see upgrade_handler */
+static volatile bool upgrade_draining = false;
 static struct event maxconnsevent;
 static void maxconns_handler(const int fd, const short which, void *arg) {
     struct timeval t = {.tv_sec = 0, .tv_usec = 10000};
@@ -152,7 +163,8 @@ static void maxconns_handler(const int fd, const short which, void *arg) {
         evtimer_add(&maxconnsevent, &t);
     } else {
         evtimer_del(&maxconnsevent);
-        accept_new_conns(true);
+        if (!upgrade_draining)
+            accept_new_conns(true);
     }
 
 }
@@ -267,11 +279,37 @@ static void settings_init(void) {
     settings.shared_malloc_slabs_lists_key = NULL;
     settings.shared_malloc_assoc = false;
     settings.shared_malloc_assoc_key = NULL;
+    settings.huge_pages = false;
+    settings.numa_arenas = false;
+    settings.memlimit_max = 0;
+    settings.lazy_prealloc = false;
+    settings.prefault_threads = 0;
     settings.failover_dest = false;
     settings.failover_dest_ips = NULL;
     settings.failover_src = false;
     settings.failover_src_ips = NULL;
     settings.failover_comm_type = NULL;
+    settings.failover_oplog = false;
+    settings.failover_queue_depth = QUEUE_DEFAULT_DEPTH;
+    settings.failover_batch_ops = 256;
+    settings.failover_batch_usec = 100;
+    settings.failover_semisync_acks = 1;
+    settings.failover_semisync_port = 0;
+    settings.failover_semisync_timeout_ms = 1000;
+    settings.failover_log_window_mb = REPLOG_DEFAULT_MAX_BYTES / (1024 * 1024);
+    settings.failover_snapshot_mb = 16;
+    settings.failover_snapshot_pause_usec = 5000;
+    settings.failover_serve_reads = false;
+    settings.failover_shadow = false;
+    settings.failover_verify_interval = 0;
+    settings.failover_compress = false;
+    settings.checkpoint_dir = NULL;
+    settings.checkpoint_interval = 60;
+    settings.checkpoint_rate_mb = 0;
+    settings.checkpoint_snapshot_mb = 256;
+    settings.warm_restart = false;
+    settings.upgrade_socket = NULL;
+    settings.standby = false;
 }
 
 /*
@@ -495,6 +533,20 @@ conn *conn_new(const int sfd, enum conn_states init_state,
 
     c->noreply = false;
 
+    c->backup_sync = false;
+    c->backup_parked = false;
+    if (transport == tcp_transport && init_state == conn_new_cmd &&
+        settings.failover_semisync_port) {
+        struct sockaddr_storage local;
+        socklen_t local_len = sizeof(local);
+        if (getsockname(sfd, (struct sockaddr *)&local, &local_len) == 0) {
+            int port = local.ss_family == AF_INET6 ?
+                ntohs(((struct sockaddr_in6 *)&local)->sin6_port) :
+                ntohs(((struct sockaddr_in *)&local)->sin_port);
+            c->backup_sync = (port == settings.failover_semisync_port);
+        }
+    }
+
     event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
     event_base_set(base, &c->event);
     c->ev_flags = event_flags;
@@ -594,6 +646,7 @@ static void conn_close(conn *c) {
 
     /* delete the event, the socket and the conn */
     event_del(&c->event);
+    conn_backup_unpark(c);
 
     if (settings.verbose > 1)
         fprintf(stderr, "<%d connection closed.\n", c->sfd);
@@ -687,7 +740,8 @@ static const char *state_text(enum conn_states state) {
                                        "conn_swallow",
                                        "conn_closing",
                                        "conn_mwrite",
-                                       "conn_closed" };
+                                       "conn_closed",
+                                       "conn_backup_wait" };
     return statenames[state];
 }
 
@@ -961,17 +1015,7 @@ static void complete_nread_ascii(conn *c) {
       switch (ret) {
       case STORED:
           out_string(c, "STORED");
-
-          if (settings.shared_malloc_slabs && 
-          	settings.shared_malloc_assoc && 
-          	settings.shared_malloc_slabs_lists && 
-          	settings.failover_dest &&
-          	settings.failover_src)
-          {
-              fprintf(stderr, "writing to backup client\n");
-              queue_enq(1);
-              fprintf(stderr, "writing to backup client - COMPLETED\n");
-          }
+          conn_backup_hold(c);
           break;
       case EXISTS:
           out_string(c, "EXISTS");
@@ -1056,6 +1100,15 @@ static void add_bin_header(conn *c, uint16_t err, uint8_t hdr_len, uint16_t key_
     add_iov(c, c->wbuf, sizeof(header->response));
 }
 
+/*
+ * A backup that serves reads or receives into its shadows takes no writes:
+ * the syncs of the primary overwrite its memory, and the hash table it reads
+ * is the primary's.
+ */
+static bool backup_read_only(void) {
+    return settings.failover_serve_reads || settings.failover_shadow;
+}
+
 /**
  * Writes a binary error response. If errstr is supplied, it is used as the
  * error text; otherwise a generic description of the error status code is
@@ -1094,6 +1147,9 @@ static void write_bin_error(conn *c, protocol_binary_response_status err,
         case PROTOCOL_BINARY_RESPONSE_AUTH_ERROR:
             errstr = "Auth failure.";
             break;
+        case PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED:
+            errstr = "Not supported.";
+            break;
         default:
             assert(false);
             errstr = "UNHANDLED ERROR";
@@ -1181,6 +1237,7 @@ static void complete_incr_bin(conn *c) {
         }
         write_bin_response(c, &rsp->message.body, 0, 0,
                            sizeof(rsp->message.body.value));
+        conn_backup_hold(c);
         break;
     case NON_NUMERIC:
         write_bin_error(c, PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL, NULL, 0);
@@ -1206,6 +1263,7 @@ static void complete_incr_bin(conn *c) {
                 if (store_item(it, NREAD_ADD, c)) {
                     c->cas = ITEM_get_cas(it);
                     write_bin_response(c, &rsp->message.body, 0, 0, sizeof(rsp->message.body.value));
+                    conn_backup_hold(c);
                 } else {
                     write_bin_error(c, PROTOCOL_BINARY_RESPONSE_NOT_STORED,
                                     NULL, 0);
@@ -1281,6 +1339,7 @@ static void complete_update_bin(conn *c) {
     case STORED:
         /* Stored */
         write_bin_response(c, NULL, 0, 0, 0);
+        conn_backup_hold(c);
         break;
     case EXISTS:
         write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, NULL, 0);
@@ -1328,7 +1387,7 @@ static void process_bin_get_or_touch(conn *c) {
 
         it = item_touch(key, nkey, realtime(exptime));
     } else {
-        it = item_get(key, nkey);
+        it = item_read(key, nkey);
     }
 
     if (it) {
@@ -1918,6 +1977,28 @@ static void dispatch_bin_command(conn *c) {
         c->noreply = false;
     }
 
+    switch (c->cmd) {
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+    case PROTOCOL_BINARY_CMD_FLUSH:
+    case PROTOCOL_BINARY_CMD_TOUCH:
+    case PROTOCOL_BINARY_CMD_GAT:
+    case PROTOCOL_BINARY_CMD_GATK:
+        if (backup_read_only()) {
+            write_bin_error(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED, NULL, bodylen);
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+
     switch (c->cmd) {
         case PROTOCOL_BINARY_CMD_VERSION:
             if (extlen == 0 && keylen == 0 && bodylen == 0) {
@@ -2206,6 +2287,9 @@ static void process_bin_flush(conn *c) {
     } else {
         settings.oldest_live = new_oldest;
     }
+    slabs_meta_update();
+    replog_flush(new_oldest);
+    backup_write_signal();
 
     pthread_mutex_lock(&c->thread->stats.mutex);
     c->thread->stats.flush_cmds++;
@@ -2247,6 +2331,7 @@ static void process_bin_delete(conn *c) {
             pthread_mutex_unlock(&c->thread->stats.mutex);
             item_unlink(it);
             write_bin_response(c, NULL, 0, 0, 0);
+            conn_backup_hold(c);
         } else {
             write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, NULL, 0);
         }
@@ -2445,6 +2530,8 @@ enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t h
 
     if (stored == STORED) {
         c->cas = ITEM_get_cas(it);
+        replog_item_stored(it);
+        backup_write_signal();
     }
 
     return stored;
@@ -2601,6 +2688,7 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
     threadlocal_stats_aggregate(&thread_stats);
     struct slab_stats slab_stats;
     slab_stats_aggregate(&thread_stats, &slab_stats);
+    struct queue_stats qstats;
 
 #ifndef WIN32
     struct rusage usage;
@@ -2675,6 +2763,17 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
     APPEND_STAT("malloc_fails", "%llu",
                 (unsigned long long)stats.malloc_fails);
     STATS_UNLOCK();
+    queue_get_stats(&qstats);
+    if (qstats.capacity) {
+        APPEND_STAT("backup_queue_depth", "%u", qstats.depth);
+        APPEND_STAT("backup_queue_enqueued", "%llu", (unsigned long long)qstats.enqueued);
+        APPEND_STAT("backup_queue_coalesced", "%llu", (unsigned long long)qstats.coalesced);
+        APPEND_STAT("backup_queue_drops", "%llu", (unsigned long long)qstats.drops);
+        APPEND_STAT("backup_queue_wakeups", "%llu", (unsigned long long)qstats.wakeups);
+    }
+    if (settings.failover_oplog) {
+        replog_stats(add_stats, c);
+    }
 }
 
 static void process_stat_settings(ADD_STAT add_stats, void *c) {
@@ -2725,11 +2824,38 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("shared_malloc_slabs_lists_key", "%s", settings.shared_malloc_slabs_lists_key ? settings.shared_malloc_slabs_lists_key : "NULL");
     APPEND_STAT("shared_malloc_assoc", "%s", settings.shared_malloc_assoc ? "yes" : "no");
     APPEND_STAT("shared_malloc_assoc_key", "%s", settings.shared_malloc_assoc_key ? settings.shared_malloc_assoc_key : "NULL");
+    APPEND_STAT("shared_malloc_dir", "%s", shared_malloc_dir);
+    APPEND_STAT("huge_pages", "%s", settings.huge_pages ? "yes" : "no");
+    APPEND_STAT("numa_arenas", "%s", settings.numa_arenas ? "yes" : "no");
+    APPEND_STAT("memlimit_max", "%llu", (unsigned long long)settings.memlimit_max);
+    APPEND_STAT("lazy_prealloc", "%s", settings.lazy_prealloc ? "yes" : "no");
+    APPEND_STAT("prefault_threads", "%d", settings.prefault_threads);
+    APPEND_STAT("warm_restart", "%s", settings.warm_restart ? "yes" : "no");
+    APPEND_STAT("upgrade_socket", "%s", settings.upgrade_socket ? settings.upgrade_socket : "NULL");
+    APPEND_STAT("standby", "%s", settings.standby ? "yes" : "no");
     APPEND_STAT("failover_dest", "%s", settings.failover_dest ? "yes" : "no");
     APPEND_STAT("failover_dest_ips", "%s", settings.failover_dest_ips ? settings.failover_dest_ips : "NULL");
     APPEND_STAT("failover_src", "%s", settings.failover_src ? "yes" : "no");
     APPEND_STAT("failover_src_ips", "%s", settings.failover_src_ips ? settings.failover_src_ips : "NULL");
     APPEND_STAT("failover_comm_type", "%s", settings.failover_comm_type ? settings.failover_comm_type : "NULL");
+    APPEND_STAT("failover_mode", "%s", settings.failover_oplog ? "oplog" : "snapshot");
+    APPEND_STAT("failover_queue_depth", "%u", settings.failover_queue_depth);
+    APPEND_STAT("failover_batch_ops", "%u", settings.failover_batch_ops);
+    APPEND_STAT("failover_batch_usec", "%u", settings.failover_batch_usec);
+    APPEND_STAT("failover_semisync_acks", "%d", settings.failover_semisync_acks);
+    APPEND_STAT("failover_semisync_port", "%d", settings.failover_semisync_port);
+    APPEND_STAT("failover_semisync_timeout_ms", "%u", settings.failover_semisync_timeout_ms);
+    APPEND_STAT("failover_log_window_mb", "%u", settings.failover_log_window_mb);
+    APPEND_STAT("failover_snapshot_mb", "%u", settings.failover_snapshot_mb);
+    APPEND_STAT("failover_snapshot_pause_usec", "%u", settings.failover_snapshot_pause_usec);
+    APPEND_STAT("failover_serve_reads", "%s", settings.failover_serve_reads ? "yes" : "no");
+    APPEND_STAT("failover_shadow", "%s", settings.failover_shadow ? "yes" : "no");
+    APPEND_STAT("failover_verify_interval", "%d", settings.failover_verify_interval);
+    APPEND_STAT("failover_compress", "%s", settings.failover_compress ? "yes" : "no");
+    APPEND_STAT("checkpoint_dir", "%s", settings.checkpoint_dir ? settings.checkpoint_dir : "NULL");
+    APPEND_STAT("checkpoint_interval", "%d", settings.checkpoint_interval);
+    APPEND_STAT("checkpoint_rate_mb", "%u", settings.checkpoint_rate_mb);
+    APPEND_STAT("checkpoint_snapshot_mb", "%u", settings.checkpoint_snapshot_mb);
 }
 
 static void conn_to_str(const conn *c, char *buf) {
@@ -2839,6 +2965,95 @@ static void process_stats_conns(ADD_STAT add_stats, void *c) {
     }
 }
 
+static void process_stats_backups(ADD_STAT add_stats, void *c) {
+    int i;
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen = 0, vlen = 0;
+    struct backup_replica_stats st;
+    long applied_seq;
+    bool applied_consistent;
+    struct backup_serve_stats serve;
+    struct backup_shadow_stats shadow;
+
+    assert(add_stats);
+
+    for (i = 0; i < backup_replica_count(); i++) {
+        if (backup_get_stats(i, &st) != 0)
+            continue;
+        APPEND_NUM_STAT(i, "addr", "%s", st.name);
+        APPEND_NUM_STAT(i, "state", "%s", st.connected ? "connected" : "disconnected");
+        APPEND_NUM_STAT(i, "syncs", "%llu", (unsigned long long)st.syncs);
+        APPEND_NUM_STAT(i, "bytes_sent", "%llu", (unsigned long long)st.bytes_sent);
+        APPEND_NUM_STAT(i, "throughput_bytes_per_sec", "%llu", st.send_usec ?
+                (unsigned long long)(st.bytes_sent * 1000000.0 / st.send_usec) : 0ULL);
+        APPEND_NUM_STAT(i, "zero_bytes", "%llu", (unsigned long long)st.zero_bytes);
+        APPEND_NUM_STAT(i, "packed_saved_bytes", "%llu", (unsigned long long)st.packed_saved);
+        APPEND_NUM_STAT(i, "pending_pages", "%llu", (unsigned long long)st.pending_pages);
+        APPEND_NUM_STAT(i, "pending_log_bytes", "%llu", (unsigned long long)st.pending_log_bytes);
+        APPEND_NUM_STAT(i, "log_dropped_bytes", "%llu", (unsigned long long)st.log_dropped);
+        APPEND_NUM_STAT(i, "lag_usec", "%llu", (unsigned long long)st.lag_usec);
+        APPEND_NUM_STAT(i, "max_lag_usec", "%llu", (unsigned long long)st.max_lag_usec);
+        APPEND_NUM_STAT(i, "acked_sync", "%llu", (unsigned long long)st.acked_seq);
+        APPEND_NUM_STAT(i, "reconnects", "%llu", (unsigned long long)st.reconnects);
+        APPEND_NUM_STAT(i, "resumes", "%llu", (unsigned long long)st.resumes);
+        APPEND_NUM_STAT(i, "full_resyncs", "%llu", (unsigned long long)st.full_resyncs);
+        APPEND_NUM_STAT(i, "consistent_syncs", "%llu", (unsigned long long)st.consistent_syncs);
+        APPEND_NUM_STAT(i, "fuzzy_syncs", "%llu", (unsigned long long)st.fuzzy_syncs);
+        APPEND_NUM_STAT(i, "forced_cuts", "%llu", (unsigned long long)st.forced_cuts);
+        APPEND_NUM_STAT(i, "snapshot_bytes", "%llu", (unsigned long long)st.snapshot_bytes);
+        APPEND_NUM_STAT(i, "snapshot_pause_usec", "%llu", (unsigned long long)st.snapshot_pause_usec);
+        APPEND_NUM_STAT(i, "max_snapshot_pause_usec", "%llu",
+                        (unsigned long long)st.max_snapshot_pause_usec);
+        APPEND_NUM_STAT(i, "verify_passes", "%llu", (unsigned long long)st.verify_passes);
+        APPEND_NUM_STAT(i, "verify_blocks", "%llu", (unsigned long long)st.verify_blocks);
+        APPEND_NUM_STAT(i, "verify_bytes", "%llu", (unsigned long long)st.verify_bytes);
+        APPEND_NUM_STAT(i, "verify_usec", "%llu", (unsigned long long)st.verify_usec);
+    }
+    if (backup_get_applied(&applied_seq, &applied_consistent)) {
+        APPEND_STAT("applied_sync", "%ld", applied_seq);
+        APPEND_STAT("applied_consistent", "%d", applied_consistent ? 1 : 0);
+    }
+    if (settings.failover_serve_reads) {
+        backup_get_serve_stats(&serve);
+        APPEND_STAT("replica_generation", "%llu", (unsigned long long)serve.generation);
+        APPEND_STAT("replica_sync_age_usec", "%llu", (unsigned long long)serve.sync_age_usec);
+        APPEND_STAT("replica_apply_usec", "%llu", (unsigned long long)serve.apply_usec);
+        APPEND_STAT("replica_reads", "%llu", (unsigned long long)serve.reads);
+        APPEND_STAT("replica_reads_busy", "%llu", (unsigned long long)serve.reads_busy);
+    }
+    if (settings.failover_shadow) {
+        backup_get_shadow_stats(&shadow);
+        APPEND_STAT("shadow_swaps", "%llu", (unsigned long long)shadow.swaps);
+        APPEND_STAT("shadow_copies", "%llu", (unsigned long long)shadow.copies);
+        APPEND_STAT("shadow_copied_bytes", "%llu", (unsigned long long)shadow.copied_bytes);
+        APPEND_STAT("shadow_swap_usec", "%llu", (unsigned long long)shadow.swap_usec);
+    }
+}
+
+static void process_stats_semisync(ADD_STAT add_stats, void *c) {
+    int i;
+    char key_str[STAT_KEY_LEN];
+    struct backup_semisync_stats st;
+
+    backup_get_semisync_stats(&st);
+    APPEND_STAT("semisync_waits", "%llu", (unsigned long long)st.waits);
+    APPEND_STAT("semisync_timeouts", "%llu", (unsigned long long)st.timeouts);
+    APPEND_STAT("semisync_wait_usec", "%llu", (unsigned long long)st.wait_usec);
+    for (i = 0; i < BACKUP_SEMISYNC_BUCKETS; i++) {
+        if (st.hist[i] == 0)
+            continue;
+        if (i == BACKUP_SEMISYNC_BUCKETS - 1) {
+            snprintf(key_str, STAT_KEY_LEN, "semisync_wait_usec_gt_%llu",
+                     BACKUP_SEMISYNC_FIRST_BUCKET_USEC << (i - 1));
+        } else {
+            snprintf(key_str, STAT_KEY_LEN, "semisync_wait_usec_le_%llu",
+                     BACKUP_SEMISYNC_FIRST_BUCKET_USEC << i);
+        }
+        APPEND_STAT(key_str, "%llu", (unsigned long long)st.hist[i]);
+    }
+}
+
 static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
     const char *subcommand = tokens[SUBCOMMAND_TOKEN].value;
     assert(c != NULL);
@@ -2890,6 +3105,9 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
         return ;
     } else if (strcmp(subcommand, "conns") == 0) {
         process_stats_conns(&append_stats, c);
+    } else if (strcmp(subcommand, "backups") == 0) {
+        process_stats_backups(&append_stats, c);
+        process_stats_semisync(&append_stats, c);
     } else {
         /* getting here means that the subcommand is either engine specific or
            is invalid. query the engine and see. */
@@ -2941,7 +3159,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                 return;
             }
 
-            it = item_get(key, nkey);
+            it = item_read(key, nkey);
             if (settings.detail_enabled) {
                 stats_prefix_record_get(key, nkey, NULL != it);
             }
@@ -3141,6 +3359,19 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
         return;
     }
 
+    if (backup_read_only()) {
+        /* swallow the data line, with noreply too */
+        c->sbytes = vlen;
+        if (c->noreply) {
+            c->noreply = false;
+            conn_set_state(c, conn_swallow);
+            return;
+        }
+        out_string(c, "SERVER_ERROR read-only backup");
+        c->write_and_go = conn_swallow;
+        return;
+    }
+
     if (settings.detail_enabled) {
         stats_prefix_record_set(key, nkey);
     }
@@ -3184,6 +3415,11 @@ static void process_touch_command(conn *c, token_t *tokens, const size_t ntokens
 
     set_noreply_maybe(c, tokens, ntokens);
 
+    if (backup_read_only()) {
+        out_string(c, "SERVER_ERROR read-only backup");
+        return;
+    }
+
     if (tokens[KEY_TOKEN].length > KEY_MAX_LENGTH) {
         out_string(c, "CLIENT_ERROR bad command line format");
         return;
@@ -3206,6 +3442,7 @@ static void process_touch_command(conn *c, token_t *tokens, const size_t ntokens
         pthread_mutex_unlock(&c->thread->stats.mutex);
 
         out_string(c, "TOUCHED");
+        conn_backup_hold(c);
         item_remove(it);
     } else {
         pthread_mutex_lock(&c->thread->stats.mutex);
@@ -3227,6 +3464,11 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
 
     set_noreply_maybe(c, tokens, ntokens);
 
+    if (backup_read_only()) {
+        out_string(c, "SERVER_ERROR read-only backup");
+        return;
+    }
+
     if (tokens[KEY_TOKEN].length > KEY_MAX_LENGTH) {
         out_string(c, "CLIENT_ERROR bad command line format");
         return;
@@ -3243,6 +3485,7 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
     switch(add_delta(c, key, nkey, incr, delta, temp, NULL)) {
     case OK:
         out_string(c, temp);
+        conn_backup_hold(c);
         break;
     case NON_NUMERIC:
         out_string(c, "CLIENT_ERROR cannot increment or decrement non-numeric value");
@@ -3340,6 +3583,9 @@ enum delta_result_type do_add_delta(conn *c, const char *key, const size_t nkey,
 
         memcpy(ITEM_data(it), buf, res);
         memset(ITEM_data(it) + res, ' ', it->nbytes - res - 2);
+        region_mark_dirty(it, ITEM_ntotal(it));
+        replog_item_stored(it);
+        backup_write_signal();
         do_item_update(it);
     } else if (it->refcount > 1) {
         item *new_it;
@@ -3351,6 +3597,8 @@ enum delta_result_type do_add_delta(conn *c, const char *key, const size_t nkey,
         memcpy(ITEM_data(new_it), buf, res);
         memcpy(ITEM_data(new_it) + res, "\r\n", 2);
         item_replace(it, new_it, hv);
+        replog_item_stored(new_it);
+        backup_write_signal();
         // Overwrite the older item's CAS with our new CAS since we're
         // returning the CAS of the old item below.
         ITEM_set_cas(it, (settings.use_cas) ? ITEM_get_cas(new_it) : 0);
@@ -3392,6 +3640,10 @@ static void process_delete_command(conn *c, token_t *tokens, const size_t ntoken
         }
     }
 
+    if (backup_read_only()) {
+        out_string(c, "SERVER_ERROR read-only backup");
+        return;
+    }
 
     key = tokens[KEY_TOKEN].value;
     nkey = tokens[KEY_TOKEN].length;
@@ -3416,6 +3668,7 @@ static void process_delete_command(conn *c, token_t *tokens, const size_t ntoken
         item_unlink(it);
         item_remove(it);      /* release our reference */
         out_string(c, "DELETED");
+        conn_backup_hold(c);
     } else {
         pthread_mutex_lock(&c->thread->stats.mutex);
         c->thread->stats.delete_misses++;
@@ -3438,6 +3691,33 @@ static void process_verbosity_command(conn *c, token_t *tokens, const size_t nto
     return;
 }
 
+static void process_memlimit_command(conn *c, token_t *tokens, const size_t ntokens) {
+    uint32_t memlimit;
+
+    assert(c != NULL);
+
+    set_noreply_maybe(c, tokens, ntokens);
+
+    if (!safe_strtoul(tokens[1].value, &memlimit)) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    switch (slabs_set_limit((size_t)memlimit * 1024 * 1024)) {
+    case MEMLIMIT_OK:
+        out_string(c, "OK");
+        break;
+    case MEMLIMIT_TOO_SMALL:
+        out_string(c, "MEMLIMIT_TOO_SMALL cannot hold a page of every slab class");
+        break;
+    case MEMLIMIT_TOO_LARGE:
+        out_string(c, "MEMLIMIT_TOO_LARGE cannot grow past memlimit_max");
+        break;
+    case MEMLIMIT_NO_REASSIGN:
+        out_string(c, "CLIENT_ERROR giving back memory in use requires slab_reassign");
+        break;
+    }
+}
+
 static void process_slabs_automove_command(conn *c, token_t *tokens, const size_t ntokens) {
     unsigned int level;
 
@@ -3544,6 +3824,11 @@ static void process_command(conn *c, char *command) {
             return;
         }
 
+        if (backup_read_only()) {
+            out_string(c, "SERVER_ERROR read-only backup");
+            return;
+        }
+
         if (ntokens != (c->noreply ? 3 : 2)) {
             exptime = strtol(tokens[1].value, NULL, 10);
             if(errno == ERANGE) {
@@ -3571,6 +3856,9 @@ static void process_command(conn *c, char *command) {
         } else {
             settings.oldest_live = new_oldest;
         }
+        slabs_meta_update();
+        replog_flush(new_oldest);
+        backup_write_signal();
         out_string(c, "OK");
         return;
 
@@ -3701,6 +3989,18 @@ static void process_command(conn *c, char *command) {
         }
     } else if ((ntokens == 3 || ntokens == 4) && (strcmp(tokens[COMMAND_TOKEN].value, "verbosity") == 0)) {
         process_verbosity_command(c, tokens, ntokens);
+    } else if ((ntokens == 3 || ntokens == 4) && (strcmp(tokens[COMMAND_TOKEN].value, "memlimit") == 0)) {
+        process_memlimit_command(c, tokens, ntokens);
+    } else if (ntokens == 3 && (strcmp(tokens[COMMAND_TOKEN].value, "semisync") == 0)) {
+        if (strcmp(tokens[1].value, "on") == 0) {
+            c->backup_sync = true;
+            out_string(c, "OK");
+        } else if (strcmp(tokens[1].value, "off") == 0) {
+            c->backup_sync = false;
+            out_string(c, "OK");
+        } else {
+            out_string(c, "CLIENT_ERROR bad command line format");
+        }
     } else {
         out_string(c, "ERROR");
     }
@@ -4142,6 +4442,12 @@ static void drive_machine(conn *c) {
             break;
 
         case conn_waiting:
+            /* an upgrade closes the connections between two requests */
+            if (upgrade_draining && !IS_UDP(c->transport) &&
+                !conn_request_pending(c)) {
+                conn_set_state(c, conn_closing);
+                break;
+            }
             if (!update_event(c, EV_READ | EV_PERSIST)) {
                 if (settings.verbose > 0)
                     fprintf(stderr, "Couldn't update event\n");
@@ -4393,6 +4699,25 @@ static void drive_machine(conn *c) {
             abort();
             break;
 
+        case conn_backup_wait:
+            if (conn_backup_acked(c)) {
+                conn_set_state(c, c->backup_wait_state);
+                break;
+            }
+            /* No socket events until the acks arrive; the timer fires at
+             * the timeout, and conn_backup_wakeup() re-drives us on acks */
+            if (!conn_backup_park(c)) {
+                conn_set_state(c, conn_closing);
+                break;
+            }
+            if (conn_backup_acked(c)) {
+                /* The acks arrived while we were parking */
+                conn_set_state(c, c->backup_wait_state);
+                break;
+            }
+            stop = true;
+            break;
+
         case conn_max_state:
             assert(false);
             break;
@@ -4402,6 +4727,125 @@ static void drive_machine(conn *c) {
     return;
 }
 
+static uint64_t usec_now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void conn_backup_unpark(conn *c) {
+    if (!c->backup_parked)
+        return;
+    if (c->backup_wait_prev)
+        c->backup_wait_prev->backup_wait_next = c->backup_wait_next;
+    else
+        c->thread->backup_waiters = c->backup_wait_next;
+    if (c->backup_wait_next)
+        c->backup_wait_next->backup_wait_prev = c->backup_wait_prev;
+    c->backup_parked = false;
+}
+
+/*
+ * Returns true once the reply held in conn_backup_wait can be sent: when
+ * enough backups acknowledged the write, or the wait timed out (the write
+ * is then only replicated asynchronously).
+ */
+static bool conn_backup_acked(conn *c) {
+    uint64_t waited = usec_now() - c->backup_wait_start;
+    bool acked = backup_sync_acked(c->backup_wait_seq);
+
+    if (!acked && waited < settings.failover_semisync_timeout_ms * 1000ULL)
+        return false;
+    conn_backup_unpark(c);
+    backup_semisync_record(waited, !acked);
+    return true;
+}
+
+/*
+ * Holds the reply to a write, just prepared, until the backups acknowledged
+ * the sync covering the write, on a semi-sync conn. The write signalled the
+ * backup client already. A noreply write has no reply to hold.
+ */
+static void conn_backup_hold(conn *c) {
+    if (!c->backup_sync || IS_UDP(c->transport) || backup_replica_count() == 0 ||
+        (c->state != conn_write && c->state != conn_mwrite))
+        return;
+    c->backup_wait_state = c->state;
+    c->backup_wait_seq = backup_last_signal();
+    c->backup_wait_start = usec_now();
+    conn_set_state(c, conn_backup_wait);
+}
+
+/*
+ * Puts the conn on its thread's list of conns waiting for backup acks, and
+ * replaces its socket event with a timer firing at the semi-sync timeout.
+ */
+static bool conn_backup_park(conn *c) {
+    struct event_base *base = c->event.ev_base;
+    uint64_t deadline = c->backup_wait_start +
+        settings.failover_semisync_timeout_ms * 1000ULL;
+    uint64_t now = usec_now();
+    struct timeval tv;
+
+    if (!c->backup_parked) {
+        c->backup_wait_prev = NULL;
+        c->backup_wait_next = c->thread->backup_waiters;
+        if (c->backup_wait_next)
+            c->backup_wait_next->backup_wait_prev = c;
+        c->thread->backup_waiters = c;
+        c->backup_parked = true;
+    }
+#ifdef HAVE_GCC_ATOMICS
+    __sync_synchronize();
+#endif
+
+    now = now < deadline ? deadline - now : 0;
+    tv.tv_sec = now / 1000000;
+    tv.tv_usec = now % 1000000;
+    if (event_del(&c->event) == -1) return false;
+    event_set(&c->event, c->sfd, 0, event_handler, (void *)c);
+    event_base_set(base, &c->event);
+    c->ev_flags = 0;
+    if (event_add(&c->event, &tv) == -1) return false;
+    return true;
+}
+
+/* Whether the client sent more than we read, without reading it */
+static bool conn_request_pending(conn *c) {
+    char byte;
+
+    return recv(c->sfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 1;
+}
+
+void conn_drain(LIBEVENT_THREAD *me) {
+    conn *c;
+    int i;
+
+    for (i = 0; i < max_fds; i++) {
+        c = conns[i];
+        /* a new conn is in conn_new_cmd until it first sends */
+        if (c == NULL || c->thread != me ||
+            (c->state != conn_read && c->state != conn_new_cmd) ||
+            c->rbytes != 0 || IS_UDP(c->transport))
+            continue;
+        /* a request already sent is served, and the conn closed after it */
+        if (conn_request_pending(c))
+            continue;
+        conn_close(c);
+    }
+}
+
+void conn_backup_wakeup(LIBEVENT_THREAD *me) {
+    conn *c, *next;
+
+    for (c = me->backup_waiters; c != NULL; c = next) {
+        next = c->backup_wait_next;
+        if (backup_sync_acked(c->backup_wait_seq)) {
+            drive_machine(c);
+        }
+    }
+}
+
 void event_handler(const int fd, const short which, void *arg) {
     conn *c;
 
@@ -4476,6 +4920,55 @@ static void maximize_sndbuf(const int sfd) {
         fprintf(stderr, "<%d send buffer was %d, now %d\n", sfd, old_size, last_good);
 }
 
+/* The listening sockets, handed over to the next instance on an upgrade */
+static upgrade_socket listen_sockets[UPGRADE_MAX_SOCKETS];
+static int listen_sockets_count = 0;
+
+/*
+ * Serves a bound socket: UDP sockets are read by the workers, the others
+ * are accepted on by the main thread.
+ */
+static void server_socket_register(int sfd, enum network_transport transport) {
+    if (listen_sockets_count < UPGRADE_MAX_SOCKETS) {
+        listen_sockets[listen_sockets_count].fd = sfd;
+        listen_sockets[listen_sockets_count].transport = transport;
+        listen_sockets_count++;
+    } else if (settings.upgrade_socket != NULL) {
+        fprintf(stderr, "Too many listening sockets to hand over on an upgrade\n");
+        exit(EX_USAGE);
+    }
+
+    if (IS_UDP(transport)) {
+        int c;
+
+        for (c = 0; c < settings.num_threads_per_udp; c++) {
+            /* Allocate one UDP file descriptor per worker thread;
+             * this allows "stats conns" to separately list multiple
+             * parallel UDP requests in progress.
+             *
+             * The dispatch code round-robins new connection requests
+             * among threads, so this is guaranteed to assign one
+             * FD to each thread.
+             */
+            int per_thread_fd = c ? dup(sfd) : sfd;
+            dispatch_conn_new(per_thread_fd, conn_read,
+                              EV_READ | EV_PERSIST,
+                              UDP_READ_BUFFER_SIZE, transport);
+        }
+    } else {
+        conn *listen_conn_add;
+
+        if (!(listen_conn_add = conn_new(sfd, conn_listening,
+                                         EV_READ | EV_PERSIST, 1,
+                                         transport, main_base))) {
+            fprintf(stderr, "failed to create listening connection\n");
+            exit(EXIT_FAILURE);
+        }
+        listen_conn_add->next = listen_conn;
+        listen_conn = listen_conn_add;
+    }
+}
+
 /**
  * Create a socket and bind it to a specific port number
  * @param interface the interface to bind to
@@ -4516,7 +5009,6 @@ static int server_socket(const char *interface,
     }
 
     for (next= ai; next; next= next->ai_next) {
-        conn *listen_conn_add;
         if ((sfd = new_socket(next)) == -1) {
             /* getaddrinfo can return "junk" addresses,
              * we make sure at least one works before erroring.
@@ -4596,33 +5088,7 @@ static int server_socket(const char *interface,
             }
         }
 
-        if (IS_UDP(transport)) {
-            int c;
-
-            for (c = 0; c < settings.num_threads_per_udp; c++) {
-                /* Allocate one UDP file descriptor per worker thread;
-                 * this allows "stats conns" to separately list multiple
-                 * parallel UDP requests in progress.
-                 *
-                 * The dispatch code round-robins new connection requests
-                 * among threads, so this is guaranteed to assign one
-                 * FD to each thread.
-                 */
-                int per_thread_fd = c ? dup(sfd) : sfd;
-                dispatch_conn_new(per_thread_fd, conn_read,
-                                  EV_READ | EV_PERSIST,
-                                  UDP_READ_BUFFER_SIZE, transport);
-            }
-        } else {
-            if (!(listen_conn_add = conn_new(sfd, conn_listening,
-                                             EV_READ | EV_PERSIST, 1,
-                                             transport, main_base))) {
-                fprintf(stderr, "failed to create listening connection\n");
-                exit(EXIT_FAILURE);
-            }
-            listen_conn_add->next = listen_conn;
-            listen_conn = listen_conn_add;
-        }
+        server_socket_register(sfd, transport);
     }
 
     freeaddrinfo(ai);
@@ -4736,16 +5202,166 @@ static int server_socket_unix(const char *path, int access_mask) {
         close(sfd);
         return 1;
     }
-    if (!(listen_conn = conn_new(sfd, conn_listening,
-                                 EV_READ | EV_PERSIST, 1,
-                                 local_transport, main_base))) {
-        fprintf(stderr, "failed to create listening connection\n");
-        exit(EXIT_FAILURE);
-    }
+    server_socket_register(sfd, local_transport);
 
     return 0;
 }
 
+/*
+ * Serves a listening socket taken over from the instance we upgrade. It
+ * kept its address, options and the connections queued meanwhile.
+ */
+static void server_socket_adopt(const upgrade_socket *sock) {
+    enum network_transport transport = sock->transport;
+
+    /* the old instance may have been refusing connections, see
+     * do_accept_new_conns */
+    if (!IS_UDP(transport) && listen(sock->fd, settings.backlog) == -1) {
+        perror("listen()");
+        exit(EX_OSERR);
+    }
+    server_socket_register(sock->fd, transport);
+}
+
+static struct event upgrade_event;
+/* The connection of our standby, which it reads EOF on when we die */
+static int standby_fd = -1;
+static struct event standby_event;
+
+/* The standby never writes: its connection is readable once it is gone */
+static void standby_handler(const int fd, const short which, void *arg) {
+    event_del(&standby_event);
+    close(fd);
+    standby_fd = -1;
+    fprintf(stderr, "The standby is gone\n");
+}
+
+/* Gives a standby copies of the listening sockets, and keeps its connection */
+static void standby_attach(int cfd) {
+    if (standby_fd != -1) {
+        fprintf(stderr, "Refusing a second standby\n");
+        close(cfd);
+        return;
+    }
+    if (upgrade_send(cfd, listen_sockets, listen_sockets_count) != 0)
+        return;
+    event_set(&standby_event, cfd, EV_READ | EV_PERSIST, standby_handler, 0);
+    event_base_set(main_base, &standby_event);
+    if (event_add(&standby_event, 0) == -1) {
+        close(cfd);
+        return;
+    }
+    standby_fd = cfd;
+    fprintf(stderr, "A standby holds copies of %d listening sockets\n",
+            listen_sockets_count);
+}
+
+/* Checks, as a standby, that we could take over from the running instance */
+static int standby_attached(void) {
+    return slabs_standby_check(settings.factor);
+}
+
+/* How long an upgrade waits for the client connections to finish their requests */
+#define UPGRADE_DRAIN_USEC (2 * 1000000)
+#define UPGRADE_DRAIN_POLL_USEC 10000
+
+/* The connection of the new instance while we drain */
+static int upgrade_cfd = -1;
+static int upgrade_drain_polls = 0;
+static struct event upgrade_drain_event;
+
+/* Counts the client connections still open, UDP aside */
+static int client_conns_open(void) {
+    conn *c;
+    int i, n = 0;
+
+    for (i = 0; i < max_fds; i++) {
+        c = conns[i];
+        if (c != NULL && c->state != conn_closed && c->state != conn_listening &&
+            !IS_UDP(c->transport))
+            n++;
+    }
+    return n;
+}
+
+/* Stops or resumes accepting, keeping the backlog: see server_socket_adopt */
+static void upgrade_accepting(const bool accept) {
+    conn *next;
+
+    for (next = listen_conn; next; next = next->next)
+        update_event(next, accept ? EV_READ | EV_PERSIST : 0);
+}
+
+/*
+ * The workers finish the commands they are on, and they and the threads
+ * that move items stay paused until we exit, which tells the new instance
+ * that the shared memory is its own. Only the hash table expansion may
+ * still run, and the new instance relinks every item into a new table
+ * anyway. Our standby is told to follow the new instance rather than take
+ * over.
+ */
+static void upgrade_handover(void) {
+    fprintf(stderr, "Handing %d listening sockets over to a new instance\n",
+            listen_sockets_count);
+    pause_threads(PAUSE_ALL_THREADS);
+    slabs_meta_update();
+    if (upgrade_send(upgrade_cfd, listen_sockets, listen_sockets_count) != 0) {
+        pause_threads(RESUME_ALL_THREADS);
+        upgrade_cfd = -1;
+        upgrade_draining = false;
+        upgrade_accepting(true);
+        return;
+    }
+    if (standby_fd != -1)
+        upgrade_notify(standby_fd);
+    exit(EXIT_SUCCESS);
+}
+
+/* Hands over once the client connections are closed, or at the deadline */
+static void upgrade_drain_handler(const int fd, const short which, void *arg) {
+    struct timeval t = {.tv_sec = 0, .tv_usec = UPGRADE_DRAIN_POLL_USEC};
+    int open = client_conns_open();
+
+    if (open > 0 && upgrade_drain_polls++ < UPGRADE_DRAIN_USEC / UPGRADE_DRAIN_POLL_USEC) {
+        evtimer_set(&upgrade_drain_event, upgrade_drain_handler, 0);
+        event_base_set(main_base, &upgrade_drain_event);
+        evtimer_add(&upgrade_drain_event, &t);
+        return;
+    }
+    if (open > 0)
+        fprintf(stderr, "%d client connections still busy, cutting them\n", open);
+    upgrade_handover();
+}
+
+/*
+ * A new instance asks for the listening sockets. We stop accepting, so the
+ * clients that connect wait in the backlog for the new instance, and close
+ * every client connection once it is done with the request it is on, so
+ * the clients see it closed between two requests. The sockets are handed
+ * over when they are all closed, or UPGRADE_DRAIN_USEC later.
+ */
+static void upgrade_handler(const int fd, const short which, void *arg) {
+    int cfd, standby;
+
+    if ((cfd = upgrade_accept(fd, &standby)) == -1)
+        return;
+    if (standby) {
+        standby_attach(cfd);
+        return;
+    }
+    if (upgrade_draining) {
+        /* one upgrade at a time */
+        close(cfd);
+        return;
+    }
+    upgrade_cfd = cfd;
+    upgrade_drain_polls = 0;
+    upgrade_draining = true;
+    upgrade_accepting(false);
+    threads_drain_conns();
+    upgrade_drain_handler(0, 0, 0);
+}
+
 /*
  * We keep the current time of day in a global variable that's updated by a
  * timer event. This saves us a bunch of time() system calls (we really only
@@ -5118,6 +5734,10 @@ int main (int argc, char **argv) {
     bool start_lru_crawler = false;
     enum hashfunc_type hash_type = JENKINS_HASH;
     uint32_t tocrawl;
+    uint32_t queue_depth;
+    /* listening sockets taken over from the instance we upgrade */
+    upgrade_socket upgraded[UPGRADE_MAX_SOCKETS];
+    int upgraded_count = 0;
 
     char *subopts;
     char *subopts_value;
@@ -5130,6 +5750,33 @@ int main (int argc, char **argv) {
         FAILOVER_DEST,
         FAILOVER_SRC,
         FAILOVER_COMM_TYPE,
+        FAILOVER_MODE,
+        FAILOVER_QUEUE_DEPTH,
+        FAILOVER_BATCH_OPS,
+        FAILOVER_BATCH_USEC,
+        FAILOVER_SEMISYNC_ACKS,
+        FAILOVER_SEMISYNC_PORT,
+        FAILOVER_SEMISYNC_TIMEOUT,
+        FAILOVER_LOG_WINDOW,
+        FAILOVER_SNAPSHOT,
+        FAILOVER_SNAPSHOT_PAUSE,
+        FAILOVER_SERVE_READS,
+        FAILOVER_SHADOW,
+        FAILOVER_VERIFY,
+        FAILOVER_COMPRESS,
+        CHECKPOINT_DIR,
+        CHECKPOINT_INTERVAL,
+        CHECKPOINT_RATE,
+        CHECKPOINT_SNAPSHOT,
+        WARM_RESTART,
+        UPGRADE_SOCKET,
+        STANDBY,
+        SHARED_MALLOC_DIR,
+        HUGE_PAGES_OPT,
+        NUMA_ARENAS,
+        MEMLIMIT_MAX,
+        LAZY_PREALLOC,
+        PREFAULT_THREADS,
         SLAB_REASSIGN,
         SLAB_AUTOMOVE,
         TAIL_REPAIR_TIME,
@@ -5151,6 +5798,33 @@ int main (int argc, char **argv) {
         [FAILOVER_DEST] = "failover_dest",
         [FAILOVER_SRC] = "failover_src",
         [FAILOVER_COMM_TYPE] = "failover_comm_type",
+        [FAILOVER_MODE] = "failover_mode",
+        [FAILOVER_QUEUE_DEPTH] = "failover_queue_depth",
+        [FAILOVER_BATCH_OPS] = "failover_batch_ops",
+        [FAILOVER_BATCH_USEC] = "failover_batch_usec",
+        [FAILOVER_SEMISYNC_ACKS] = "failover_semisync_acks",
+        [FAILOVER_SEMISYNC_PORT] = "failover_semisync_port",
+        [FAILOVER_SEMISYNC_TIMEOUT] = "failover_semisync_timeout_ms",
+        [FAILOVER_LOG_WINDOW] = "failover_log_window_mb",
+        [FAILOVER_SNAPSHOT] = "failover_snapshot_mb",
+        [FAILOVER_SNAPSHOT_PAUSE] = "failover_snapshot_pause_usec",
+        [FAILOVER_SERVE_READS] = "failover_serve_reads",
+        [FAILOVER_SHADOW] = "failover_shadow",
+        [FAILOVER_VERIFY] = "failover_verify_interval",
+        [FAILOVER_COMPRESS] = "failover_compress",
+        [CHECKPOINT_DIR] = "checkpoint_dir",
+        [CHECKPOINT_INTERVAL] = "checkpoint_interval",
+        [CHECKPOINT_RATE] = "checkpoint_rate_mb",
+        [CHECKPOINT_SNAPSHOT] = "checkpoint_snapshot_mb",
+        [WARM_RESTART] = "warm_restart",
+        [UPGRADE_SOCKET] = "upgrade_socket",
+        [STANDBY] = "standby",
+        [SHARED_MALLOC_DIR] = "shared_malloc_dir",
+        [HUGE_PAGES_OPT] = "huge_pages",
+        [NUMA_ARENAS] = "numa_arenas",
+        [MEMLIMIT_MAX] = "memlimit_max",
+        [LAZY_PREALLOC] = "lazy_prealloc",
+        [PREFAULT_THREADS] = "prefault_threads",
         [SLAB_REASSIGN] = "slab_reassign",
         [SLAB_AUTOMOVE] = "slab_automove",
         [TAIL_REPAIR_TIME] = "tail_repair_time",
@@ -5424,7 +6098,7 @@ int main (int argc, char **argv) {
                     fprintf(stderr, "Initial hashtable multiplier of %d is too low\n",
                         settings.hashpower_init);
                     return 1;
-                } else if (settings.hashpower_init > 64) {
+                } else if (settings.hashpower_init > HASHPOWER_MAX) {
                     fprintf(stderr, "Initial hashtable multiplier of %d is too high\n"
                         "Choose a value based on \"STAT hash_power_level\" from a running instance\n",
                         settings.hashpower_init);
@@ -5560,16 +6234,200 @@ int main (int argc, char **argv) {
             	    fprintf(stderr, "Missing failover_comm_type argument\n");
             	    return 1;
             	}
-            	if (strcmp(subopts_value, "TCP") == 0 || strcmp(subopts_value, "RDMA") == 0)
+            	if (backup_transport_find(subopts_value) != NULL)
             	{
             	    settings.failover_comm_type = subopts_value;
             	}
             	else
             	{
-            	    fprintf(stderr, "failover_comm_type argument isnt TCP of RDMA");
+            	    fprintf(stderr, "failover_comm_type argument isnt TCP, UNIX, LOOP or RDMA\n");
             	    return 1;
             	}
             	break;
+            case FAILOVER_MODE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing failover_mode argument\n");
+                    return 1;
+                }
+                if (strcmp(subopts_value, "oplog") == 0) {
+                    settings.failover_oplog = true;
+                } else if (strcmp(subopts_value, "snapshot") == 0) {
+                    settings.failover_oplog = false;
+                } else {
+                    fprintf(stderr, "failover_mode argument isnt snapshot or oplog\n");
+                    return 1;
+                }
+                break;
+            case FAILOVER_QUEUE_DEPTH:
+                if (!safe_strtoul(subopts_value, &queue_depth) || queue_depth < 2) {
+                    fprintf(stderr, "failover_queue_depth takes a numeric value of at least 2\n");
+                    return 1;
+                }
+                settings.failover_queue_depth = queue_depth;
+                break;
+            case FAILOVER_BATCH_OPS:
+                if (!safe_strtoul(subopts_value, &settings.failover_batch_ops)) {
+                    fprintf(stderr, "failover_batch_ops takes a numeric 32bit value\n");
+                    return 1;
+                }
+                break;
+            case FAILOVER_BATCH_USEC:
+                if (!safe_strtoul(subopts_value, &settings.failover_batch_usec)) {
+                    fprintf(stderr, "failover_batch_usec takes a numeric 32bit value\n");
+                    return 1;
+                }
+                break;
+            case FAILOVER_SEMISYNC_ACKS:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for failover_semisync_acks\n");
+                    return 1;
+                }
+                settings.failover_semisync_acks = atoi(subopts_value);
+                if (settings.failover_semisync_acks < 1 ||
+                    settings.failover_semisync_acks > MAX_BACKUPS) {
+                    fprintf(stderr, "failover_semisync_acks must be between 1 and %d\n",
+                            MAX_BACKUPS);
+                    return 1;
+                }
+                break;
+            case FAILOVER_SEMISYNC_PORT:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for failover_semisync_port\n");
+                    return 1;
+                }
+                settings.failover_semisync_port = atoi(subopts_value);
+                break;
+            case FAILOVER_SEMISYNC_TIMEOUT:
+                if (!safe_strtoul(subopts_value, &settings.failover_semisync_timeout_ms)) {
+                    fprintf(stderr, "failover_semisync_timeout_ms takes a numeric 32bit value\n");
+                    return 1;
+                }
+                break;
+            case FAILOVER_LOG_WINDOW:
+                if (!safe_strtoul(subopts_value, &settings.failover_log_window_mb) ||
+                    settings.failover_log_window_mb == 0 ||
+                    settings.failover_log_window_mb > 64 * 1024) {
+                    fprintf(stderr, "failover_log_window_mb must be between 1 and 65536\n");
+                    return 1;
+                }
+                break;
+            case FAILOVER_SNAPSHOT:
+                if (!safe_strtoul(subopts_value, &settings.failover_snapshot_mb) ||
+                    settings.failover_snapshot_mb > 64 * 1024) {
+                    fprintf(stderr, "failover_snapshot_mb must be between 0 and 65536\n");
+                    return 1;
+                }
+                break;
+            case FAILOVER_SNAPSHOT_PAUSE:
+                if (subopts_value == NULL ||
+                    !safe_strtoul(subopts_value, &settings.failover_snapshot_pause_usec)) {
+                    fprintf(stderr, "failover_snapshot_pause_usec takes microseconds, 0 for no limit\n");
+                    return 1;
+                }
+                break;
+            case FAILOVER_SERVE_READS:
+                settings.failover_serve_reads = true;
+                break;
+            case FAILOVER_SHADOW:
+                settings.failover_shadow = true;
+                break;
+            case FAILOVER_VERIFY:
+                if (subopts_value == NULL ||
+                    !safe_strtol(subopts_value, &settings.failover_verify_interval) ||
+                    settings.failover_verify_interval < 0) {
+                    fprintf(stderr, "failover_verify_interval takes a number of seconds, 0 for none\n");
+                    return 1;
+                }
+                break;
+            case FAILOVER_COMPRESS:
+                settings.failover_compress = true;
+                break;
+            case CHECKPOINT_DIR:
+                if (subopts_value == NULL || *subopts_value == '\0') {
+                    fprintf(stderr, "Missing checkpoint_dir argument\n");
+                    return 1;
+                }
+                settings.checkpoint_dir = subopts_value;
+                break;
+            case CHECKPOINT_INTERVAL:
+                if (subopts_value == NULL ||
+                    !safe_strtol(subopts_value, &settings.checkpoint_interval) ||
+                    settings.checkpoint_interval < 1) {
+                    fprintf(stderr, "checkpoint_interval takes a number of seconds\n");
+                    return 1;
+                }
+                break;
+            case CHECKPOINT_RATE:
+                if (subopts_value == NULL ||
+                    !safe_strtoul(subopts_value, &settings.checkpoint_rate_mb)) {
+                    fprintf(stderr, "checkpoint_rate_mb takes a number of MB per second, 0 for no limit\n");
+                    return 1;
+                }
+                break;
+            case CHECKPOINT_SNAPSHOT:
+                if (subopts_value == NULL ||
+                    !safe_strtoul(subopts_value, &settings.checkpoint_snapshot_mb) ||
+                    settings.checkpoint_snapshot_mb < 1 || settings.checkpoint_snapshot_mb > 64 * 1024) {
+                    fprintf(stderr, "checkpoint_snapshot_mb must be between 1 and 65536\n");
+                    return 1;
+                }
+                break;
+            case WARM_RESTART:
+                settings.warm_restart = true;
+                break;
+            case UPGRADE_SOCKET:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing upgrade_socket argument\n");
+                    return 1;
+                }
+                /* the shared memory is taken over as on a warm restart */
+                settings.upgrade_socket = subopts_value;
+                settings.warm_restart = true;
+                break;
+            case STANDBY:
+                settings.standby = true;
+                break;
+            case SHARED_MALLOC_DIR: {
+                char dir[PATH_MAX];
+                if (subopts_value == NULL || *subopts_value == '\0') {
+                    fprintf(stderr, "Missing shared_malloc_dir argument\n");
+                    return 1;
+                }
+                /* the key is appended to it as is */
+                if (snprintf(dir, sizeof(dir), "%s%s", subopts_value,
+                             subopts_value[strlen(subopts_value) - 1] == '/' ? "" : "/") >= (int)sizeof(dir) ||
+                    shared_malloc_set_dir(dir) != 0) {
+                    fprintf(stderr, "shared_malloc_dir is too long\n");
+                    return 1;
+                }
+                break;
+            }
+            case HUGE_PAGES_OPT:
+                settings.huge_pages = true;
+                break;
+            case NUMA_ARENAS:
+                settings.numa_arenas = true;
+                break;
+            case MEMLIMIT_MAX: {
+                unsigned int mb;
+                if (subopts_value == NULL || !safe_strtoul(subopts_value, &mb) || mb == 0) {
+                    fprintf(stderr, "memlimit_max takes a size in megabytes\n");
+                    return 1;
+                }
+                settings.memlimit_max = (size_t)mb * 1024 * 1024;
+                break;
+            }
+            case LAZY_PREALLOC:
+                settings.lazy_prealloc = true;
+                break;
+            case PREFAULT_THREADS:
+                if (subopts_value == NULL ||
+                    !safe_strtol(subopts_value, &settings.prefault_threads) ||
+                    settings.prefault_threads < 0) {
+                    fprintf(stderr, "prefault_threads takes a number of threads\n");
+                    return 1;
+                }
+                break;
             default:
                 printf("Illegal suboption \"%s\"\n", subopts_value);
                 return 1;
@@ -5583,9 +6441,87 @@ int main (int argc, char **argv) {
         }
     }
 
-    if (settings.shared_malloc_slabs && 
+    if (settings.failover_oplog && settings.failover_comm_type &&
+        backup_transport_find(settings.failover_comm_type)->send_records == NULL) {
+        fprintf(stderr, "failover_mode=oplog requires failover_comm_type=TCP, UNIX or LOOP\n");
+        exit(EX_USAGE);
+    }
+
+    if (settings.warm_restart && !(preallocate && settings.shared_malloc_slabs &&
+        settings.shared_malloc_slabs_lists && settings.shared_malloc_assoc)) {
+        fprintf(stderr, "warm_restart and upgrade_socket require -L and shared_malloc_slabs, shared_malloc_slabs_lists and shared_malloc_assoc\n");
+        exit(EX_USAGE);
+    }
+
+    if (settings.standby && settings.upgrade_socket == NULL) {
+        fprintf(stderr, "standby requires upgrade_socket\n");
+        exit(EX_USAGE);
+    }
+
+    if (settings.numa_arenas && !preallocate) {
+        fprintf(stderr, "numa_arenas requires -L\n");
+        exit(EX_USAGE);
+    }
+
+    if (settings.memlimit_max != 0 && (!preallocate ||
+        settings.memlimit_max < settings.maxbytes)) {
+        fprintf(stderr, "memlimit_max requires -L, and must be at least -m\n");
+        exit(EX_USAGE);
+    }
+
+    if ((settings.lazy_prealloc && !preallocate) ||
+        (settings.prefault_threads > 0 && !settings.lazy_prealloc)) {
+        fprintf(stderr, "lazy_prealloc requires -L, and prefault_threads lazy_prealloc\n");
+        exit(EX_USAGE);
+    }
+
+    /* the oplog mode does not replicate the regions */
+    if (settings.failover_verify_interval > 0 && settings.failover_oplog) {
+        fprintf(stderr, "failover_verify_interval requires the snapshot failover_mode\n");
+        exit(EX_USAGE);
+    }
+
+    /* the checkpoints are reloaded by a warm restart */
+    if (settings.checkpoint_dir != NULL && (settings.failover_oplog ||
+        !(preallocate && settings.shared_malloc_slabs &&
+          settings.shared_malloc_slabs_lists && settings.shared_malloc_assoc))) {
+        fprintf(stderr, "checkpoint_dir requires -L, shared_malloc_slabs, shared_malloc_slabs_lists and shared_malloc_assoc, and the snapshot failover_mode\n");
+        exit(EX_USAGE);
+    }
+
+    /* the backup side of the snapshot mode, with the regions in shared memory */
+    if ((settings.failover_serve_reads || settings.failover_shadow) &&
+        (!settings.failover_src || settings.failover_oplog ||
+         !(preallocate && settings.shared_malloc_slabs &&
+           settings.shared_malloc_slabs_lists && settings.shared_malloc_assoc))) {
+        fprintf(stderr, "failover_serve_reads and failover_shadow require failover_src, -L, shared_malloc_slabs, shared_malloc_slabs_lists and shared_malloc_assoc, and the snapshot failover_mode\n");
+        exit(EX_USAGE);
+    }
+
+    /* The running instance must be gone before we bind the backup server
+     * port or attach the shared memory */
+    if (settings.upgrade_socket != NULL && settings.standby) {
+        upgraded_count = upgrade_standby(settings.upgrade_socket, upgraded,
+                                         UPGRADE_MAX_SOCKETS, standby_attached);
+    } else if (settings.upgrade_socket != NULL) {
+        upgraded_count = upgrade_takeover(settings.upgrade_socket, upgraded,
+                                          UPGRADE_MAX_SOCKETS);
+    }
+    if (settings.upgrade_socket != NULL) {
+        if (upgraded_count < 0) {
+            exit(EX_OSERR);
+        }
+        if (upgraded_count > 0) {
+            fprintf(stderr, "Took over %d listening sockets from %s\n",
+                    upgraded_count, settings.upgrade_socket);
+        }
+    }
+
+    /* The oplog mode does not replicate memory, so it needs no shared_malloc */
+    if ((settings.failover_oplog ||
+        (settings.shared_malloc_slabs && 
     	settings.shared_malloc_assoc && 
-    	settings.shared_malloc_slabs_lists && 
+    	settings.shared_malloc_slabs_lists)) &&
     	settings.failover_dest && 
     	settings.failover_src &&
     	settings.failover_comm_type)
@@ -5593,49 +6529,53 @@ int main (int argc, char **argv) {
     	printf("Backup dest IPs=[%s]\n", settings.failover_dest_ips);
     	printf("Backup src IPs=[%s]\n", settings.failover_src_ips);
     	g_backup_dest_addr = str_split(settings.failover_dest_ips, ' ');
-    	queue_create();
+    	queue_create(settings.failover_queue_depth);
 
 	if (g_backup_dest_addr && settings.failover_src_ips)
 	{
-		if (strcmp(settings.failover_comm_type, "TCP") == 0)
+		const backup_transport *transport = backup_transport_find(settings.failover_comm_type);
+		int i;
+
+		//the transports with their own threads (RDMA) load the saved files instead
+		if (transport->client == NULL)
 		{
-			BackupServer(settings.failover_src_ips);
-	    	sleep(2); //TODO: remove it, only for testing
-	    	int i;
-			for (i = 0; *(g_backup_dest_addr + i); i++)
+			if (settings.failover_oplog)
 			{
-				printf("IP=[%s]\n", *(g_backup_dest_addr + i));
-				printf("connecting\n");
-				if (BackupClient(*(g_backup_dest_addr + i)) == 0)
-				{
-					printf("connected\n");
-					//int numbytes;
-					//char buf[100];
-					//receive(sockfd, buf, &numbytes);
-				}
-				else
-				{
-					printf("failed to connect\n");
-				}
-				//TODO: free(*(g_backup_dest_addr + i)); ?
+				replog_init((size_t)settings.failover_log_window_mb * 1024 * 1024);
+			}
+			else
+			{
+				regions_tracking_enable();
 			}
-			//TODO: free(g_backup_dest_addr);
 		}
-		else //RDMA
+		//the senders connect in the background, no need to wait for the peer
+		BackupServer(transport, settings.failover_src_ips);
+		for (i = 0; *(g_backup_dest_addr + i); i++)
 		{
-	    		BackupServerRDMA(settings.failover_src_ips);
-	    		sleep(2); //TODO: remove it, only for testing
-		    	int i;
-				for (i = 0; *(g_backup_dest_addr + i); i++)
-				{
-					printf("IP=[%s]\n", *(g_backup_dest_addr + i));
-					BackupClientRDMA(*(g_backup_dest_addr + i)); //TODO: add RDMA/TCP log. and success/fail log
-				}
-
+			printf("IP=[%s]\n", *(g_backup_dest_addr + i));
+			if (BackupClient(transport, *(g_backup_dest_addr + i)) == 0)
+			{
+				printf("sender started\n");
+			}
+			else
+			{
+				printf("failed to connect\n");
+			}
+			//TODO: free(*(g_backup_dest_addr + i)); ?
 		}
+		//TODO: free(g_backup_dest_addr);
 	}
     }
 
+    /* the checkpointer is one more backup, it needs no queue of its own */
+    if (settings.checkpoint_dir != NULL) {
+        regions_tracking_enable();
+        if (BackupCheckpoint(settings.checkpoint_dir) != 0) {
+            fprintf(stderr, "Failed to start the checkpointer of %s\n", settings.checkpoint_dir);
+            exit(EX_OSERR);
+        }
+    }
+
     if (settings.lru_maintainer_thread && settings.hot_lru_pct + settings.warm_lru_pct > 80) {
         fprintf(stderr, "hot_lru_pct + warm_lru_pct cannot be more than 80%% combined\n");
         exit(EX_USAGE);
@@ -5766,9 +6706,17 @@ int main (int argc, char **argv) {
     main_base = event_init();
     /* initialize other stuff */
     stats_init();
-    assoc_init(settings.hashpower_init);
-    conn_init();
+    if (settings.numa_arenas) {
+        numa_init();
+    }
+    /* shared memory files lost with the page cache come back from the checkpoint */
+    if (settings.checkpoint_dir != NULL && settings.warm_restart) {
+        checkpoint_restore(settings.checkpoint_dir);
+    }
     slabs_init(settings.maxbytes, settings.factor, preallocate);
+    /* a warm restart keeps the hash table size of the last run */
+    assoc_init(slabs_warm_hashpower() ? (int)slabs_warm_hashpower() : settings.hashpower_init);
+    conn_init();
 
     /*
      * ignore SIGPIPE signals; we can use errno == EPIPE if we
@@ -5781,6 +6729,17 @@ int main (int argc, char **argv) {
     /* start up worker threads if MT mode */
     memcached_thread_init(settings.num_threads, main_base);
 
+    /* the item locks exist now, relink the items of the last run before any
+     * thread that walks or moves them starts */
+    if (slabs_warm_hashpower()) {
+        slabs_restore(settings.num_threads);
+    }
+
+    if (settings.prefault_threads > 0 &&
+        slabs_prefault_start(settings.prefault_threads) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
     if (start_assoc_maintenance_thread() == -1) {
         exit(EXIT_FAILURE);
     }
@@ -5795,7 +6754,8 @@ int main (int argc, char **argv) {
         return 1;
     }
 
-    if (settings.slab_reassign &&
+    /* the thread also applies the limit of the memlimit command */
+    if ((settings.slab_reassign || settings.memlimit_max != 0) &&
         start_slab_maintenance_thread() == -1) {
         exit(EXIT_FAILURE);
     }
@@ -5804,7 +6764,7 @@ int main (int argc, char **argv) {
     clock_handler(0, 0, 0);
 
     /* create unix mode sockets after dropping privileges */
-    if (settings.socketpath != NULL) {
+    if (settings.socketpath != NULL && upgraded_count == 0) {
         errno = 0;
         if (server_socket_unix(settings.socketpath,settings.access)) {
             vperror("failed to listen on UNIX socket: %s", settings.socketpath);
@@ -5813,7 +6773,7 @@ int main (int argc, char **argv) {
     }
 
     /* create the listening socket, bind it, and init */
-    if (settings.socketpath == NULL) {
+    if (settings.socketpath == NULL && upgraded_count == 0) {
         const char *portnumber_filename = getenv("MEMCACHED_PORT_FILENAME");
         char temp_portnumber_filename[PATH_MAX];
         FILE *portnumber_file = NULL;
@@ -5858,6 +6818,25 @@ int main (int argc, char **argv) {
         }
     }
 
+    /* or serve the ones we took over, whatever -p, -U, -l and -s say now */
+    for (c = 0; c < upgraded_count; c++) {
+        server_socket_adopt(&upgraded[c]);
+    }
+
+    if (settings.upgrade_socket != NULL) {
+        int upgrade_fd = upgrade_listen(settings.upgrade_socket);
+        if (upgrade_fd == -1) {
+            exit(EX_OSERR);
+        }
+        event_set(&upgrade_event, upgrade_fd, EV_READ | EV_PERSIST,
+                  upgrade_handler, 0);
+        event_base_set(main_base, &upgrade_event);
+        if (event_add(&upgrade_event, 0) == -1) {
+            perror("event_add");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     /* Give the sockets a moment to open. I know this is dumb, but the error
      * is only an advisory.
      */
@@ -168,6 +168,7 @@ enum conn_states {
     conn_closing,    /**< closing this connection */
     conn_mwrite,     /**< writing out many items sequentially */
     conn_closed,     /**< connection is closed */
+    conn_backup_wait, /**< holding a reply until the backups acknowledged the write */
     conn_max_state   /**< Max state value (used for assertion) */
 };
 
@@ -351,6 +352,14 @@ struct settings {
     char* shared_malloc_slabs_lists_key; /* shared malloc for slabs.c slabs lists key */
     bool shared_malloc_assoc; /* shared malloc for assoc.c on/off */
     char* shared_malloc_assoc_key; /* shared malloc for assoc.c key */
+    bool huge_pages; /* back the slabs and the shared hash table with huge pages */
+    bool numa_arenas; /* a slab arena per NUMA node, and workers pinned to the nodes, see numa.h */
+    size_t memlimit_max; /* address space reserved for the memlimit command to grow the slabs into */
+    bool lazy_prealloc; /* reserve the preallocated slabs sparsely and commit them as they are used */
+    int prefault_threads; /* threads committing the lazy_prealloc slabs ahead of use */
+    bool warm_restart; /* reattach the shared memory left by the last run, see slabs_restore */
+    char *upgrade_socket; /* UNIX socket the listening sockets are handed over on, see upgrade.h */
+    bool standby;         /* wait on upgrade_socket to take over when the running instance dies */
     bool failover_manager; /* failover manager on/off */
     char* failover_manager_ips; /* failover manager key for using shared malloc */
     char* failover_comm_type; /* failover communication type for backup. TCP or RDMA */
@@ -358,6 +367,24 @@ struct settings {
     char* failover_dest_ips; /* failover backup destination ips */
     bool failover_src; /* failover backup source (this machines) ip is set */
     char* failover_src_ips; /* failover backup source (this machine) ip to listen too */
+    unsigned int failover_queue_depth; /* slots in the backup signal queue */
+    unsigned int failover_batch_ops; /* sync after this many signals... */
+    unsigned int failover_batch_usec; /* ...or after this many microseconds */
+    int failover_semisync_acks; /* backups that must ack a write before STORED */
+    int failover_semisync_port; /* connections to this port are semi-sync by default */
+    unsigned int failover_semisync_timeout_ms; /* reply anyway after this long */
+    unsigned int failover_log_window_mb; /* log kept per backup to resume from, in MB */
+    unsigned int failover_snapshot_mb; /* largest backlog copied at a consistent cut, 0 disables */
+    unsigned int failover_snapshot_pause_usec; /* longest the workers are paused for a cut, 0 for no limit */
+    bool failover_oplog; /* replicate a log of operations instead of memory snapshots */
+    bool failover_serve_reads; /* a backup serves gets from the replicated regions, see item_read */
+    bool failover_shadow; /* a backup receives the syncs aside and swaps them in, see backup_receive */
+    int failover_verify_interval; /* seconds between the anti-entropy passes, 0 for none */
+    bool failover_compress; /* pack the region data sent to the backups, see pack.h */
+    char *checkpoint_dir; /* directory the regions are checkpointed to, see checkpoint.h */
+    int checkpoint_interval; /* seconds between checkpoints */
+    unsigned int checkpoint_rate_mb; /* MB/s a checkpoint writes at most, 0 for no limit */
+    unsigned int checkpoint_snapshot_mb; /* failover_snapshot_mb of the checkpointer */
 };
 
 extern struct stats stats;
@@ -374,16 +401,42 @@ extern struct settings settings;
 #define ITEM_FETCHED 8
 /* Appended on fetch, removed on LRU shuffling */
 #define ITEM_ACTIVE 16
+/* A malloc'd copy of a replicated item, see item_read */
+#define ITEM_COPY 32
+
+/*
+ * Links to items (next, prev, h_next, the hash buckets and the slab lists) are
+ * stored as offsets from the start of the slab memory (item_ref_base), plus one
+ * so that 0 stays NULL. A copy of the shared regions, on a backup or after a
+ * restart, stays valid wherever the regions are mapped.
+ * A ref keeps the size of a pointer: the LRU crawlers are linked into the lists
+ * from outside the slab memory, and without preallocated slabs item_ref_base is
+ * NULL and a ref is the address itself, so neither fits a 32 bit offset.
+ */
+typedef uint64_t item_ref;
+extern char *item_ref_base;
+
+static inline item_ref item_ref_of(const void *p) {
+    return p ? (item_ref)((uintptr_t)p - (uintptr_t)item_ref_base) + 1 : 0;
+}
+
+static inline void *item_ref_ptr(const item_ref ref) {
+    return ref ? (void *)((uintptr_t)item_ref_base + (uintptr_t)(ref - 1)) : NULL;
+}
+
+#define ITEM_next(item) ((struct _stritem *)item_ref_ptr((item)->next))
+#define ITEM_prev(item) ((struct _stritem *)item_ref_ptr((item)->prev))
+#define ITEM_h_next(item) ((struct _stritem *)item_ref_ptr((item)->h_next))
 
 /**
  * Structure for storing items within memcached.
  */
 typedef struct _stritem {
     /* Protected by LRU locks */
-    struct _stritem *next;
-    struct _stritem *prev;
+    item_ref        next;
+    item_ref        prev;
     /* Rest are protected by an item lock */
-    struct _stritem *h_next;    /* hash chain next */
+    item_ref        h_next;     /* hash chain next */
     rel_time_t      time;       /* least recent access */
     rel_time_t      exptime;    /* expire time */
     int             nbytes;     /* size of data */
@@ -405,9 +458,9 @@ typedef struct _stritem {
 } item;
 
 typedef struct {
-    struct _stritem *next;
-    struct _stritem *prev;
-    struct _stritem *h_next;    /* hash chain next */
+    item_ref        next;
+    item_ref        prev;
+    item_ref        h_next;     /* hash chain next */
     rel_time_t      time;       /* least recent access */
     rel_time_t      exptime;    /* expire time */
     int             nbytes;     /* size of data */
@@ -428,6 +481,8 @@ typedef struct {
     struct thread_stats stats;  /* Stats generated by this thread */
     struct conn_queue *new_conn_queue; /* queue of new connections to handle */
     cache_t *suffix_cache;      /* suffix cache */
+    struct conn *backup_waiters; /* conns parked in conn_backup_wait */
+    int numa_node;              /* node it is pinned to, -1 for none */
 } LIBEVENT_THREAD;
 
 typedef struct {
@@ -527,6 +582,14 @@ struct conn {
     int keylen;
     conn   *next;     /* Used for generating a list of conn structures */
     LIBEVENT_THREAD *thread; /* Pointer to the thread object serving this connection */
+    /* semi-synchronous replication */
+    bool   backup_sync;       /* hold write replies until the backups acknowledged them */
+    bool   backup_parked;     /* on the thread's backup_waiters list */
+    uint64_t backup_wait_seq; /* backup sync covering the write */
+    uint64_t backup_wait_start; /* usec time the reply was held */
+    enum conn_states backup_wait_state; /* where the held reply goes on */
+    conn   *backup_wait_next;
+    conn   *backup_wait_prev;
 };
 
 /* array of conn structures, indexed by file descriptor */
@@ -572,6 +635,8 @@ extern int daemonize(int nochdir, int noclose);
 #include "trace.h"
 #include "hash.h"
 #include "util.h"
+#include "regions.h"
+#include "replog.h"
 
 /*
  * Functions such as the libevent-related calls that need to do cross-thread
@@ -583,6 +648,14 @@ extern int daemonize(int nochdir, int noclose);
 void memcached_thread_init(int nthreads, struct event_base *main_base);
 int  dispatch_event_add(int thread, conn *c);
 void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags, int read_buffer_size, enum network_transport transport);
+/* Wakes up the worker threads which hold replies for backup acks */
+void backup_acks_notify(void);
+/* Resumes the conns of the thread whose writes the backups acknowledged */
+void conn_backup_wakeup(LIBEVENT_THREAD *me);
+/* Has the worker threads close their idle client conns, for an upgrade */
+void threads_drain_conns(void);
+/* Closes the idle client conns of the thread */
+void conn_drain(LIBEVENT_THREAD *me);
 
 /* Lock wrappers for cache functions that are called from main loop. */
 enum delta_result_type add_delta(conn *c, const char *key,
@@ -595,6 +668,7 @@ bool  conn_add_to_freelist(conn *c);
 int   is_listen_thread(void);
 item *item_alloc(char *key, size_t nkey, int flags, rel_time_t exptime, int nbytes);
 item *item_get(const char *key, const size_t nkey);
+item *item_read(const char *key, const size_t nkey);
 item *item_touch(const char *key, const size_t nkey, uint32_t exptime);
 int   item_link(item *it);
 void  item_remove(item *it);
@@ -0,0 +1,197 @@
+/*
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * CRC32C and the Merkle trees of the replicated regions. See merkle.h.
+ */
+
+#include "config.h"
+#include "merkle.h"
+#include "sharedmalloc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78  /* reflected */
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static bool crc_hw = false;
+static const unsigned char zeros[MERKLE_BLOCK_SIZE];
+
+static void crc_init(void) {
+    uint32_t c;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++)
+            crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xff];
+    }
+#ifdef CRC32C_SSE42
+    __builtin_cpu_init();
+    crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#ifdef CRC32C_SSE42
+/* 8 bytes per instruction, the unaligned head and the tail a byte at a time */
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c;
+
+    for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    c = crc;
+    for (; len >= 8; len -= 8, p += 8)
+        c = _mm_crc32_u64(c, *(const uint64_t *)p);
+    crc = (uint32_t)c;
+    for (; len > 0; len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+/* Slicing by 8, for the CPUs without the instruction */
+static uint32_t crc_table_update(uint32_t crc, const unsigned char *p, size_t len) {
+#ifdef ENDIAN_LITTLE
+    uint64_t w;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&w, p, sizeof(w));
+        w ^= crc;
+        crc = crc_table[7][w & 0xff] ^ crc_table[6][(w >> 8) & 0xff] ^
+              crc_table[5][(w >> 16) & 0xff] ^ crc_table[4][(w >> 24) & 0xff] ^
+              crc_table[3][(w >> 32) & 0xff] ^ crc_table[2][(w >> 40) & 0xff] ^
+              crc_table[1][(w >> 48) & 0xff] ^ crc_table[0][w >> 56];
+    }
+#endif
+    for (; len > 0; len--)
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc_once, crc_init);
+    crc = ~crc;
+#ifdef CRC32C_SSE42
+    if (crc_hw)
+        return ~crc_sse42(crc, buf, len);
+#endif
+    return ~crc_table_update(crc, buf, len);
+}
+
+static uint32_t crc32c_zeros(uint32_t crc, size_t len) {
+    size_t n;
+
+    for (; len > 0; len -= n) {
+        n = len < sizeof(zeros) ? len : sizeof(zeros);
+        crc = crc32c(crc, zeros, n);
+    }
+    return crc;
+}
+
+/*
+ * Finds the first extent of data of the file at or after off, [*start, *end),
+ * within len. Without a file (or SEEK_DATA) everything is data.
+ */
+static void next_data(int fd, size_t off, size_t len, size_t *start, size_t *end) {
+    off_t data, hole;
+
+    *start = off;
+    *end = len;
+    if (fd == -1)
+        return;
+    data = lseek(fd, off, SEEK_DATA);
+    if (data == -1) {
+        if (errno == ENXIO)
+            *start = len;
+        return;
+    }
+    hole = lseek(fd, data, SEEK_HOLE);
+    *start = (size_t)data < len ? (size_t)data : len;
+    if (hole != -1 && (size_t)hole < len)
+        *end = hole;
+}
+
+int merkle_build(merkle_tree *t, const char *base, size_t len, size_t size, const char *key) {
+    size_t i, b, n, off, end, p, start = 0, stop = 0;
+    uint32_t crc, zero_block;
+    char *path;
+    int fd = -1, l;
+
+    merkle_free(t);
+    t->size = size;
+    t->count[0] = (size + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE;
+    for (t->levels = 1; t->count[t->levels - 1] > 1 && t->levels < MERKLE_MAX_LEVELS; t->levels++)
+        t->count[t->levels] = (t->count[t->levels - 1] + MERKLE_FANOUT - 1) / MERKLE_FANOUT;
+    for (l = 0; l < t->levels; l++) {
+        if ((t->nodes[l] = malloc((t->count[l] ? t->count[l] : 1) * sizeof(uint32_t))) == NULL) {
+            merkle_free(t);
+            return -1;
+        }
+    }
+
+    if (key != NULL && (path = gen_full_path(key, KEYPATH)) != NULL) {
+        fd = open(path, O_RDONLY);
+        free(path);
+    }
+    if (len > size)
+        len = size;
+    zero_block = crc32c_zeros(0, MERKLE_BLOCK_SIZE);
+    for (b = 0; b < t->count[0]; b++) {
+        off = b * MERKLE_BLOCK_SIZE;
+        end = size - off < MERKLE_BLOCK_SIZE ? size : off + MERKLE_BLOCK_SIZE;
+        crc = 0;
+        for (p = off; p < end; p += n) {
+            if (p >= len) {
+                n = end - p;
+                crc = n == MERKLE_BLOCK_SIZE ? zero_block : crc32c_zeros(crc, n);
+                continue;
+            }
+            if (p >= stop)
+                next_data(fd, p, len, &start, &stop);
+            if (p < start) {
+                n = (start < end ? start : end) - p;
+                crc = n == MERKLE_BLOCK_SIZE ? zero_block : crc32c_zeros(crc, n);
+            } else {
+                n = (stop < end ? stop : end) - p;
+                crc = crc32c(crc, base + p, n);
+            }
+        }
+        t->nodes[0][b] = crc;
+    }
+    if (fd != -1)
+        close(fd);
+
+    for (l = 1; l < t->levels; l++) {
+        for (i = 0; i < t->count[l]; i++) {
+            n = t->count[l - 1] - i * MERKLE_FANOUT;
+            t->nodes[l][i] = crc32c(0, t->nodes[l - 1] + i * MERKLE_FANOUT,
+                                    (n < MERKLE_FANOUT ? n : MERKLE_FANOUT) * sizeof(uint32_t));
+        }
+    }
+    return 0;
+}
+
+void merkle_free(merkle_tree *t) {
+    int l;
+
+    for (l = 0; l < MERKLE_MAX_LEVELS; l++) {
+        free(t->nodes[l]);
+        t->nodes[l] = NULL;
+    }
+    t->levels = 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * Merkle trees of the replicated regions, which the anti-entropy pass of a
+ * primary compares with its backups' (see failover_verify_interval). A region
+ * is split into MERKLE_BLOCK_SIZE blocks whose CRC32C digests are the leaves
+ * (level 0), and every node of the next level is the CRC32C of up to
+ * MERKLE_FANOUT digests of the level below, up to a single root. Both sides
+ * build the tree of the same size, so equal roots mean equal regions, and the
+ * blocks that differ are found by descending only into the nodes that differ.
+ */
+
+#ifndef MERKLE_H_
+#define MERKLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MERKLE_BLOCK_SIZE (64 * 1024)
+#define MERKLE_FANOUT 64
+#define MERKLE_MAX_LEVELS 10
+
+typedef struct {
+    size_t size;                        /* bytes covered by the tree */
+    int levels;                         /* the leaves are level 0, the root levels - 1 */
+    size_t count[MERKLE_MAX_LEVELS];    /* nodes of every level */
+    uint32_t *nodes[MERKLE_MAX_LEVELS];
+} merkle_tree;
+
+/*
+ * Returns the CRC32C (Castagnoli) of buf, continued from crc (0 to start).
+ * Uses the SSE4.2 crc32 instruction when the CPU has it.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/*
+ * Builds the tree of size bytes over the len bytes at base, the mapping of the
+ * shared memory file of key. The bytes past len, and the holes of the file
+ * (found with SEEK_DATA, and not read since that would fill them in), count as
+ * zeros. t is zeroed or holds a tree, which is freed first.
+ * Returns 0, or -1 if out of memory.
+ */
+int merkle_build(merkle_tree *t, const char *base, size_t len, size_t size, const char *key);
+
+void merkle_free(merkle_tree *t);
+
+#endif /* MERKLE_H_ */
@@ -0,0 +1,166 @@
+/*
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * NUMA placement without libnuma. See numa.h.
+ */
+
+#include "config.h"
+#include "numa.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+#define NODE_PATH "/sys/devices/system/node/"
+/* from linux/mempolicy.h */
+#define NUMA_MPOL_PREFERRED 1
+#define NUMA_MPOL_MF_MOVE (1 << 1)
+
+static int nnodes = 1;
+static int node_ids[NUMA_MAX_NODES];
+static cpu_set_t node_cpus[NUMA_MAX_NODES];
+/* node of every CPU, -1 for the CPUs of no node */
+static int cpu_nodes[CPU_SETSIZE];
+static int fake = 0;
+static __thread int pinned_node = -1;
+
+/*
+ * Parses a sysfs list such as "0-3,8,10-11" into set, or into the first max
+ * entries of ids if set is NULL. Returns the number of entries, -1 on error.
+ */
+static int parse_list(const char *path, cpu_set_t *set, int *ids, int max) {
+    char buf[4096];
+    char *p, *end;
+    FILE *f = fopen(path, "r");
+    int n = 0;
+    long lo, hi;
+
+    if (f == NULL)
+        return -1;
+    if (fgets(buf, sizeof(buf), f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    for (p = buf; *p != '\0' && *p != '\n'; p = end) {
+        lo = hi = strtol(p, &end, 10);
+        if (end == p || lo < 0)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo)
+                return -1;
+        }
+        for (; lo <= hi; lo++) {
+            if (set != NULL) {
+                if (lo < CPU_SETSIZE)
+                    CPU_SET(lo, set);
+            } else if (n < max) {
+                ids[n] = lo;
+            }
+            n++;
+        }
+        if (*end == ',')
+            end++;
+    }
+    return n;
+}
+
+int numa_init(void) {
+    char path[64];
+    char *env = getenv("T_MEMD_NUMA_NODES");
+    int i, cpu, n;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        cpu_nodes[cpu] = -1;
+    if (env != NULL) {
+        fake = atoi(env);
+        if (fake < 1)
+            fake = 1;
+        if (fake > NUMA_MAX_NODES)
+            fake = NUMA_MAX_NODES;
+        for (i = 0; i < fake; i++) {
+            node_ids[i] = i;
+            CPU_ZERO(&node_cpus[i]);
+            sched_getaffinity(0, sizeof(cpu_set_t), &node_cpus[i]);
+        }
+        nnodes = fake;
+        return nnodes;
+    }
+
+    n = parse_list(NODE_PATH "online", NULL, node_ids, NUMA_MAX_NODES);
+    if (n < 1) {
+        nnodes = 1;
+        return nnodes;
+    }
+    if (n > NUMA_MAX_NODES) {
+        fprintf(stderr, "numa: using the first %d of %d nodes\n", NUMA_MAX_NODES, n);
+        n = NUMA_MAX_NODES;
+    }
+    for (i = 0; i < n; i++) {
+        CPU_ZERO(&node_cpus[i]);
+        snprintf(path, sizeof(path), NODE_PATH "node%d/cpulist", node_ids[i]);
+        parse_list(path, &node_cpus[i], NULL, 0);
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &node_cpus[i]))
+                cpu_nodes[cpu] = i;
+        }
+    }
+    nnodes = n;
+    return nnodes;
+}
+
+int numa_nodes(void) {
+    return nnodes;
+}
+
+int numa_node_id(int node) {
+    return node >= 0 && node < nnodes ? node_ids[node] : -1;
+}
+
+int numa_bind(void *addr, size_t len, int node) {
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned long start = ((unsigned long)addr + page - 1) & ~(page - 1);
+    unsigned long end = ((unsigned long)addr + len) & ~(page - 1);
+    unsigned long mask[(1024 + 8 * sizeof(unsigned long) - 1) / (8 * sizeof(unsigned long))];
+    int id = node_ids[node];
+
+    if (fake || nnodes == 1 || end <= start)
+        return 0;
+    if (id >= 1024)
+        return -1;
+    memset(mask, 0, sizeof(mask));
+    mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_mbind, start, end - start, NUMA_MPOL_PREFERRED, mask,
+                (unsigned long)(sizeof(mask) * 8), NUMA_MPOL_MF_MOVE) != 0) {
+        fprintf(stderr, "numa: can't place memory on node %d: %s\n", id, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void numa_pin_thread(int node) {
+    if (node < 0 || node >= nnodes)
+        return;
+    pinned_node = node;
+    if (fake || nnodes == 1)
+        return;
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &node_cpus[node]) != 0)
+        fprintf(stderr, "numa: can't pin a thread to node %d: %s\n",
+                node_ids[node], strerror(errno));
+}
+
+int numa_node_self(void) {
+    int cpu;
+
+    if (pinned_node >= 0)
+        return pinned_node;
+    if (nnodes == 1 || (cpu = sched_getcpu()) < 0)
+        return 0;
+    if (fake)
+        return cpu % nnodes;
+    return cpu < CPU_SETSIZE && cpu_nodes[cpu] >= 0 ? cpu_nodes[cpu] : 0;
+}
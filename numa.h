@@ -0,0 +1,44 @@
+/*
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * NUMA placement without libnuma: the nodes and their CPUs are read from
+ * sysfs, memory is placed with mbind(2) and threads are pinned with
+ * sched_setaffinity(2). Nodes are numbered by their index here, from 0 to
+ * numa_nodes() - 1, whatever their ids. See -o numa_arenas.
+ */
+
+#ifndef NUMA_H_
+#define NUMA_H_
+
+#include <stddef.h>
+
+#define NUMA_MAX_NODES 8
+
+/*
+ * Reads the nodes and their CPUs. Returns the number of nodes, 1 if the
+ * layout can't be read. T_MEMD_NUMA_NODES fakes that many nodes for the
+ * test suite: they all share the CPUs, and no memory is bound.
+ */
+int numa_init(void);
+
+/* Returns the number of nodes found by numa_init, 1 before it */
+int numa_nodes(void);
+
+/* Returns the kernel's id of node, as shown in stats */
+int numa_node_id(int node);
+
+/*
+ * Asks for the pages of [addr, addr + len) to be placed on node, and moves
+ * those that are already elsewhere. Returns 0 on success.
+ */
+int numa_bind(void *addr, size_t len, int node);
+
+/* Pins the calling thread to the CPUs of node */
+void numa_pin_thread(int node);
+
+/*
+ * Returns the node of the calling thread: the one it was pinned to, or else
+ * the one of the CPU it runs on.
+ */
+int numa_node_self(void);
+
+#endif /* NUMA_H_ */
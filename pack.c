@@ -0,0 +1,175 @@
+/*
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * LZ77 block compression in the LZ4 block format. See pack.h.
+ */
+
+#include "config.h"
+#include "pack.h"
+#include <stdint.h>
+#include <string.h>
+
+#define PACK_HASH_BITS 12
+#define PACK_MIN_MATCH 4
+#define PACK_MAX_OFFSET 65535
+/* no match starts in the last bytes, and the last sequence has literals */
+#define PACK_TAIL 12
+#define PACK_LAST_LITERALS 5
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* The bytes after a token of 15, for a length of 15 + n */
+static unsigned char *put_length(unsigned char *op, unsigned char *oend, size_t n) {
+    for (; n >= 255; n -= 255) {
+        if (op >= oend)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend)
+        return NULL;
+    *op++ = (unsigned char)n;
+    return op;
+}
+
+/*
+ * Appends a sequence: nlit literals, then a match of mlen bytes offset back,
+ * or no match if mlen is 0 (the last sequence). Returns NULL if out of room.
+ */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend,
+                                   const unsigned char *lit, size_t nlit,
+                                   size_t offset, size_t mlen) {
+    unsigned char *token = op++;
+
+    if (token >= oend)
+        return NULL;
+    *token = (nlit < 15 ? nlit : 15) << 4;
+    if (nlit >= 15 && (op = put_length(op, oend, nlit - 15)) == NULL)
+        return NULL;
+    if ((size_t)(oend - op) < nlit)
+        return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0)
+        return op;
+    if (oend - op < 2)
+        return NULL;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    mlen -= PACK_MIN_MATCH;
+    *token |= mlen < 15 ? mlen : 15;
+    if (mlen >= 15)
+        op = put_length(op, oend, mlen - 15);
+    return op;
+}
+
+/* Length of the match of ip and ref, which is at least PACK_MIN_MATCH, up to end */
+static size_t match_length(const unsigned char *ip, const unsigned char *ref,
+                           const unsigned char *end) {
+    size_t n = PACK_MIN_MATCH;
+#ifdef ENDIAN_LITTLE
+    uint64_t a, b;
+
+    while (ip + n + sizeof(a) <= end) {
+        memcpy(&a, ip + n, sizeof(a));
+        memcpy(&b, ref + n, sizeof(b));
+        if (a != b)
+            return n + (__builtin_ctzll(a ^ b) >> 3);
+        n += sizeof(a);
+    }
+#endif
+    while (ip + n < end && ip[n] == ref[n])
+        n++;
+    return n;
+}
+
+size_t pack_block(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *in = (const unsigned char *)src;
+    const unsigned char *ip = in, *anchor = in, *ref;
+    const unsigned char *limit = len > PACK_TAIL ? in + len - PACK_TAIL : in;
+    const unsigned char *mlimit = len > PACK_LAST_LITERALS ? in + len - PACK_LAST_LITERALS : in;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+    uint32_t table[1 << PACK_HASH_BITS];
+    uint32_t seq, h;
+    size_t mlen;
+
+    /* every slot starts at position 0, which the compare below checks */
+    memset(table, 0, sizeof(table));
+    while (ip < limit) {
+        seq = read32(ip);
+        h = (seq * 2654435761U) >> (32 - PACK_HASH_BITS);
+        ref = in + table[h];
+        table[h] = ip - in;
+        if (ref >= ip || ip - ref > PACK_MAX_OFFSET || read32(ref) != seq) {
+            /* step faster the longer nothing matched */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        mlen = match_length(ip, ref, mlimit);
+        if ((op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, mlen)) == NULL)
+            return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+    op = put_sequence(op, oend, anchor, in + len - anchor, 0, 0);
+    return op != NULL ? (size_t)(op - (unsigned char *)dst) : 0;
+}
+
+/* Adds the bytes after a token of 15 to *n. Returns NULL past end */
+static const unsigned char *get_length(const unsigned char *ip, const unsigned char *end,
+                                       size_t *n) {
+    unsigned char b;
+
+    do {
+        if (ip >= end)
+            return NULL;
+        b = *ip++;
+        *n += b;
+    } while (b == 255);
+    return ip;
+}
+
+int unpack_block(const char *src, size_t plen, char *dst, size_t len) {
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + plen;
+    unsigned char *op = (unsigned char *)dst, *oend = op + len, *ref;
+    size_t n, offset;
+    unsigned char token;
+
+    while (ip < iend) {
+        token = *ip++;
+        n = token >> 4;
+        if (n == 15 && (ip = get_length(ip, iend, &n)) == NULL)
+            return -1;
+        if ((size_t)(iend - ip) < n || (size_t)(oend - op) < n)
+            return -1;
+        memcpy(op, ip, n);
+        op += n;
+        ip += n;
+        if (ip == iend)
+            break;
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst))
+            return -1;
+        n = token & 15;
+        if (n == 15 && (ip = get_length(ip, iend, &n)) == NULL)
+            return -1;
+        n += PACK_MIN_MATCH;
+        if ((size_t)(oend - op) < n)
+            return -1;
+        ref = op - offset;
+        if (offset >= n) {
+            memcpy(op, ref, n);
+            op += n;
+        } else {
+            /* overlapping, a byte at a time repeats the pattern */
+            while (n-- > 0)
+                *op++ = *ref++;
+        }
+    }
+    return op == oend ? 0 : -1;
+}
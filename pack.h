@@ -0,0 +1,28 @@
+/*
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * A fast LZ77 block compressor for the runs sent to the backups, see
+ * failover_compress. Blocks are packed on their own, in the LZ4 block format:
+ * sequences of literals and of a match (4 bytes or more, up to 64 KB back),
+ * found through a hash of the 4 bytes at every position, with no entropy
+ * coding. It is meant to be faster than the link, not to pack tight.
+ */
+
+#ifndef PACK_H_
+#define PACK_H_
+
+#include <stddef.h>
+
+/*
+ * Packs the len bytes of src into dst. Returns the packed length, or 0 if it
+ * would not fit in cap bytes (give cap below len to keep only the blocks that
+ * get smaller).
+ */
+size_t pack_block(const char *src, size_t len, char *dst, size_t cap);
+
+/*
+ * Unpacks the plen bytes of src into dst. Returns 0 if they unpacked to
+ * exactly len bytes, -1 if they are corrupt or of another length.
+ */
+int unpack_block(const char *src, size_t plen, char *dst, size_t len);
+
+#endif /* PACK_H_ */
@@ -1,127 +1,258 @@
 /*
  * Added as part of the memcached-1.4.24_RDMA project.
- * C implementation of Queue Data Structure using Linked List
- * source: http://www.sanfoundry.com/c-program-queue-using-linked-list/
- * not thread safe
+ * Bounded multi-producer queue of backup signals. See queue.h.
+ * Every slot carries a sequence number telling whether it is free for the
+ * producer at position pos (seq == pos) or holds the element published at
+ * pos (seq == pos + 1), so producers and consumers only contend on the
+ * head/tail positions, with a CAS each.
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "config.h"
 #include "queue.h"
 
-struct node
-{
+struct queue_slot {
+    volatile unsigned long seq;
     int info;
-    struct node *ptr;
-}*front,*rear,*temp,*front1;
-
-/*
-struct queue
-{
-	struct node* front;
-	struct node* rear;
-	struct node* temp;
-	struct node* front1;
 };
-*/
 
-int count = 0;
+static struct queue_slot *ring = NULL;
+static unsigned long mask;
+static volatile unsigned long enq_pos;
+static volatile unsigned long deq_pos;
+static volatile uint64_t enqueued, coalesced, drops, wakeups;
 
-/* Create an empty queue */
-void queue_create()
-{
-    front = rear = NULL;
+/* Number of queue_enq calls, including coalesced and dropped ones */
+static volatile uint64_t ops;
+static volatile uint64_t waiters;
+/* A sleeping consumer wants to be woken up once ops reaches wake_ops */
+static volatile uint64_t wake_ops;
+static pthread_mutex_t queue_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_wait_cond = PTHREAD_COND_INITIALIZER;
+
+#ifdef HAVE_GCC_ATOMICS
+#define queue_cas(ptr, old, new) __sync_bool_compare_and_swap(ptr, old, new)
+#define queue_incr(ptr) __sync_fetch_and_add(ptr, 1)
+#define queue_decr(ptr) __sync_fetch_and_sub(ptr, 1)
+#define queue_barrier() __sync_synchronize()
+#else
+static pthread_mutex_t queue_atomics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int queue_cas(volatile unsigned long *ptr, unsigned long old,
+                     unsigned long new) {
+    int rv = 0;
+    pthread_mutex_lock(&queue_atomics_lock);
+    if (*ptr == old) {
+        *ptr = new;
+        rv = 1;
+    }
+    pthread_mutex_unlock(&queue_atomics_lock);
+    return rv;
 }
 
-/* Returns queue size */
-void queue_queuesize()
-{
-    printf("Queue size : %d\n", count);
+static uint64_t queue_incr(volatile uint64_t *ptr) {
+    uint64_t rv;
+    pthread_mutex_lock(&queue_atomics_lock);
+    rv = (*ptr)++;
+    pthread_mutex_unlock(&queue_atomics_lock);
+    return rv;
 }
 
-/* Enqueing the queue */
-void queue_enq(int data)
+static void queue_waiters_add(volatile uint64_t *ptr, int n) {
+    pthread_mutex_lock(&queue_atomics_lock);
+    *ptr += n;
+    pthread_mutex_unlock(&queue_atomics_lock);
+}
+#define queue_decr(ptr) queue_waiters_add(ptr, -1)
+
+#define queue_barrier() do { \
+    pthread_mutex_lock(&queue_atomics_lock); \
+    pthread_mutex_unlock(&queue_atomics_lock); \
+} while (0)
+#endif
+
+void queue_create(unsigned int depth)
 {
-    if (rear == NULL)
-    {
-        rear = (struct node *)malloc(1*sizeof(struct node));
-        rear->ptr = NULL;
-        rear->info = data;
-        front = rear;
-    }
-    else
-    {
-        temp=(struct node *)malloc(1*sizeof(struct node));
-        rear->ptr = temp;
-        temp->info = data;
-        temp->ptr = NULL;
-
-        rear = temp;
+    /* At least two slots, so a consumed slot can't look like a pending one */
+    unsigned long size = 2;
+    unsigned long i;
+
+    if (depth == 0)
+        depth = QUEUE_DEFAULT_DEPTH;
+    while (size < depth)
+        size <<= 1;
+
+    ring = calloc(size, sizeof(struct queue_slot));
+    if (ring == NULL) {
+        fprintf(stderr, "Failed to allocate the backup queue\n");
+        exit(EXIT_FAILURE);
     }
-    count++;
+    for (i = 0; i < size; i++)
+        ring[i].seq = i;
+    mask = size - 1;
+    enq_pos = deq_pos = 0;
 }
 
-/* Displaying the queue elements */
-void queue_display()
+/* Wakes up the sleeping consumers, if any wait for this many ops */
+static void queue_wakeup(void)
 {
-    front1 = front;
-
-    if ((front1 == NULL) && (rear == NULL))
-    {
-        printf("Queue is empty\n");
+    /* queue_incr(&ops) is a full barrier, so either the consumer sees our
+     * element before sleeping, or we see it in waiters */
+    if (queue_incr(&ops) + 1 < wake_ops || waiters == 0)
         return;
+    pthread_mutex_lock(&queue_wait_lock);
+    if (waiters) {
+        wakeups++;
+        pthread_cond_broadcast(&queue_wait_cond);
     }
-    while (front1 != rear)
-    {
-        printf("%d ", front1->info);
-        front1 = front1->ptr;
-    }
-    if (front1 == rear)
-        printf("%d", front1->info);
+    pthread_mutex_unlock(&queue_wait_lock);
 }
 
-/* Dequeing the queue */
-void queue_deq()
+void queue_enq(int data)
 {
-    front1 = front;
+    struct queue_slot *slot;
+    unsigned long pos;
+    long dif;
 
-    if (front1 == NULL)
-    {
-        printf("Error: Trying to display elements from empty queue\n");
+    if (ring == NULL)
         return;
-    }
-    else
-        if (front1->ptr != NULL)
-        {
-            front1 = front1->ptr;
-            printf("Dequed value : %d\n", front->info);
-            free(front);
-            front = front1;
+
+    pos = enq_pos;
+    while (1) {
+        /* A pending element with the same value already requests this,
+         * and it is consumed only after our caller's writes are done */
+        slot = &ring[(pos - 1) & mask];
+        if (pos != deq_pos && slot->seq == pos && slot->info == data) {
+            queue_barrier();
+            if (slot->seq == pos) {
+                queue_incr(&coalesced);
+                queue_wakeup();
+                return;
+            }
         }
-        else
-        {
-            printf("Dequed value : %d\n", front->info);
-            free(front);
-            front = NULL;
-            rear = NULL;
+
+        slot = &ring[pos & mask];
+        dif = (long)(slot->seq - pos);
+        if (dif == 0) {
+            if (queue_cas(&enq_pos, pos, pos + 1))
+                break;
+        } else if (dif < 0) {
+            queue_incr(&drops);
+            return;
         }
-        count--;
+        pos = enq_pos;
+    }
+
+    slot->info = data;
+    queue_barrier();
+    slot->seq = pos + 1;
+    queue_incr(&enqueued);
+    queue_wakeup();
 }
 
-/* Returns the front element of queue */
-int queue_frontelement()
+int queue_deq(int *data)
 {
-    if ((front != NULL) && (rear != NULL))
-        return(front->info);
-    else
+    struct queue_slot *slot;
+    unsigned long pos;
+    long dif;
+
+    if (ring == NULL)
         return 0;
+
+    pos = deq_pos;
+    while (1) {
+        slot = &ring[pos & mask];
+        dif = (long)(slot->seq - (pos + 1));
+        if (dif == 0) {
+            if (queue_cas(&deq_pos, pos, pos + 1))
+                break;
+        } else if (dif < 0) {
+            return 0;
+        }
+        pos = deq_pos;
+    }
+
+    *data = slot->info;
+    queue_barrier();
+    slot->seq = pos + mask + 1;
+    return 1;
+}
+
+int queue_empty(void)
+{
+    return ring == NULL || enq_pos == deq_pos;
+}
+
+static void queue_deadline(struct timespec *ts, unsigned int usec)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    tv.tv_usec += usec;
+    ts->tv_sec = tv.tv_sec + tv.tv_usec / 1000000;
+    ts->tv_nsec = (tv.tv_usec % 1000000) * 1000;
 }
 
-/* Display if queue is empty or not */
-int queue_empty()
+int queue_wait(int *data, unsigned int batch_ops, unsigned int batch_usec,
+               unsigned int timeout_usec)
 {
-     if ((front == NULL) && (rear == NULL))
-        return 1;
-    else
-       return 0;
+    struct timespec ts;
+    uint64_t start;
+    int rv = 1;
+    int extra;
+
+    if (ring == NULL)
+        return 0;
+
+    if (timeout_usec)
+        queue_deadline(&ts, timeout_usec);
+    pthread_mutex_lock(&queue_wait_lock);
+    queue_incr(&waiters);
+    while (!queue_deq(data)) {
+        if (timeout_usec == 0) {
+            pthread_cond_wait(&queue_wait_cond, &queue_wait_lock);
+        } else if (pthread_cond_timedwait(&queue_wait_cond, &queue_wait_lock,
+                                          &ts) != 0) {
+            rv = queue_deq(data);
+            break;
+        }
+    }
+
+    if (rv && batch_usec) {
+        /* Let a batch build up behind the first element */
+        start = ops;
+        wake_ops = batch_ops ? start + batch_ops : (uint64_t)-1;
+        queue_deadline(&ts, batch_usec);
+        while (ops < wake_ops) {
+            if (pthread_cond_timedwait(&queue_wait_cond, &queue_wait_lock,
+                                       &ts) != 0)
+                break;
+        }
+        wake_ops = 0;
+    }
+    queue_decr(&waiters);
+    pthread_mutex_unlock(&queue_wait_lock);
+
+    /* One sync covers everything that was signalled before it starts */
+    if (rv) {
+        while (queue_deq(&extra))
+            ;
+    }
+    return rv;
 }
 
+void queue_get_stats(struct queue_stats *stats)
+{
+    unsigned long head = deq_pos;
+    unsigned long tail = enq_pos;
+
+    stats->capacity = ring ? mask + 1 : 0;
+    stats->depth = tail - head;
+    stats->enqueued = enqueued;
+    stats->coalesced = coalesced;
+    stats->drops = drops;
+    stats->wakeups = wakeups;
+}
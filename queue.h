@@ -1,22 +1,44 @@
 /*
  * Added as part of the memcached-1.4.24_RDMA project.
- * C implementation of Queue Data Structure using Linked List
- * source: http://www.sanfoundry.com/c-program-queue-using-linked-list/
- * not thread safe
+ * Bounded lock-free queue of backup signals, written by the worker threads
+ * and read by the backup client threads. The ring is allocated once by
+ * queue_create, so queue_enq never allocates. An element equal to the last
+ * pending one is coalesced into it, and an element that does not fit is
+ * dropped; both are counted in the queue stats.
+ * Consumers block in queue_wait, and queue_enq only takes the wait lock
+ * when a consumer is actually sleeping.
  */
 
 #ifndef QUEUE_H_
 #define QUEUE_H_
 
-int queue_frontelement(void);
-void queue_enq(int data);
-void queue_deq(void);
-int queue_empty(void);
-void queue_display(void);
-void queue_create(void);
-void queue_queuesize(void);
+#include <stdint.h>
 
+#define QUEUE_DEFAULT_DEPTH 64
 
+struct queue_stats {
+    unsigned int capacity;  /* number of slots, 0 if the queue was not created */
+    unsigned int depth;     /* number of pending elements */
+    uint64_t enqueued;
+    uint64_t coalesced;
+    uint64_t drops;
+    uint64_t wakeups;       /* consumers woken up by queue_enq */
+};
 
+/* Creates the queue, depth is rounded up to a power of two */
+void queue_create(unsigned int depth);
+void queue_enq(int data);
+/* Takes the front element. Returns 1 and sets *data, or 0 if the queue is empty */
+int queue_deq(int *data);
+int queue_empty(void);
+/*
+ * Blocks until an element is available, then keeps collecting until
+ * batch_ops more enqueues happened or batch_usec passed, whichever is first
+ * (batch_usec 0 returns at once), and drains the queue into that one element.
+ * Waits forever if timeout_usec is 0. Returns 1 and sets *data, 0 on timeout.
+ */
+int queue_wait(int *data, unsigned int batch_ops, unsigned int batch_usec,
+               unsigned int timeout_usec);
+void queue_get_stats(struct queue_stats *stats);
 
 #endif /* QUEUE_H_ */
@@ -0,0 +1,256 @@
+/*
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * Registry of the shared memory regions that are replicated to the backups,
+ * with a dirty page bitmap per region. See regions.h.
+ */
+
+#include "memcached.h"
+#include "regions.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+static region_t regions[REGION_MAX];
+volatile bool regions_tracking = false;
+
+#ifndef HAVE_GCC_ATOMICS
+static pthread_mutex_t regions_dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define BITS_PER_WORD 64
+
+void region_register(enum region_id id, void *base, size_t size, const char *key) {
+    region_t *r = &regions[id];
+    size_t npages = (size + REGION_PAGE_SIZE - 1) >> REGION_PAGE_SHIFT;
+
+    free(r->dirty);
+    free(r->collected);
+    free(r->backed);
+    r->backed = NULL;
+    r->generation++;
+    r->nwords = (npages + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    r->capacity = r->nwords;
+    r->dirty = calloc(r->nwords, sizeof(uint64_t));
+    r->collected = calloc(r->nwords, sizeof(uint64_t));
+    if (r->dirty == NULL || r->collected == NULL) {
+        fprintf(stderr, "Failed to allocate dirty page bitmap for region %d\n", id);
+        exit(EXIT_FAILURE);
+    }
+    r->size = size;
+    r->key = key;
+    r->base = base;
+    region_mark_all_dirty(id);
+}
+
+/* Grows a bitmap of old words to words, the new ones clear */
+static uint64_t *grow_bitmap(uint64_t *bitmap, size_t old, size_t words) {
+    uint64_t *ret = realloc(bitmap, words * sizeof(uint64_t));
+
+    if (ret == NULL) {
+        fprintf(stderr, "Failed to allocate dirty page bitmap\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(ret + old, 0, (words - old) * sizeof(uint64_t));
+    return ret;
+}
+
+void region_reserve(enum region_id id, size_t size) {
+    region_t *r = &regions[id];
+    size_t npages = (size + REGION_PAGE_SIZE - 1) >> REGION_PAGE_SHIFT;
+    size_t words = (npages + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+    if (words <= r->capacity)
+        return;
+    r->dirty = grow_bitmap(r->dirty, r->capacity, words);
+    r->collected = grow_bitmap(r->collected, r->capacity, words);
+    if (r->backed != NULL)
+        r->backed = grow_bitmap(r->backed, r->capacity, words);
+    r->capacity = words;
+}
+
+void region_resize(enum region_id id, size_t size) {
+    region_t *r = &regions[id];
+    size_t npages = (size + REGION_PAGE_SIZE - 1) >> REGION_PAGE_SHIFT;
+    size_t words = (npages + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+    if (words > r->capacity) {
+        fprintf(stderr, "Region %d can't grow to %zu bytes\n", id, size);
+        exit(EXIT_FAILURE);
+    }
+    /* the words past the old size were never marked */
+    r->nwords = words;
+    __sync_synchronize();
+    r->size = size;
+}
+
+region_t *region_get(enum region_id id) {
+    if (id >= REGION_MAX || regions[id].base == NULL)
+        return NULL;
+    return &regions[id];
+}
+
+void regions_tracking_enable(void) {
+    regions_tracking = true;
+}
+
+static inline void set_dirty_bits(uint64_t *word, uint64_t mask) {
+#ifdef HAVE_GCC_ATOMICS
+    __sync_fetch_and_or(word, mask);
+#else
+    pthread_mutex_lock(&regions_dirty_lock);
+    *word |= mask;
+    pthread_mutex_unlock(&regions_dirty_lock);
+#endif
+}
+
+static inline uint64_t take_dirty_bits(uint64_t *word) {
+#ifdef HAVE_GCC_ATOMICS
+    return __sync_fetch_and_and(word, 0);
+#else
+    uint64_t ret;
+    pthread_mutex_lock(&regions_dirty_lock);
+    ret = *word;
+    *word = 0;
+    pthread_mutex_unlock(&regions_dirty_lock);
+    return ret;
+#endif
+}
+
+/* Sets the bits of the pages of r covering [p, p + len) in bitmap */
+static void set_page_bits(region_t *r, uint64_t *bitmap, const char *p, size_t len) {
+    size_t first, last;
+
+    first = (p - (char *)r->base) >> REGION_PAGE_SHIFT;
+    last = (p + len - 1 - (char *)r->base) >> REGION_PAGE_SHIFT;
+    if (last >= r->nwords * BITS_PER_WORD)
+        last = r->nwords * BITS_PER_WORD - 1;
+    while (first <= last) {
+        size_t w = first / BITS_PER_WORD;
+        unsigned int lo = first % BITS_PER_WORD;
+        unsigned int hi = (last / BITS_PER_WORD == w) ?
+            last % BITS_PER_WORD : BITS_PER_WORD - 1;
+        uint64_t mask = (hi - lo == BITS_PER_WORD - 1) ? ~(uint64_t)0 :
+            (((uint64_t)1 << (hi - lo + 1)) - 1) << lo;
+        /* Skip the atomic if the pages are already set */
+        if ((bitmap[w] & mask) != mask)
+            set_dirty_bits(&bitmap[w], mask);
+        first = w * BITS_PER_WORD + hi + 1;
+    }
+}
+
+void region_mark_dirty(const void *addr, size_t len) {
+    int i;
+    const char *p = addr;
+
+    if (!regions_tracking || len == 0)
+        return;
+
+    for (i = 0; i < REGION_MAX; i++) {
+        region_t *r = &regions[i];
+        if (r->base == NULL || p < (char *)r->base ||
+            p >= (char *)r->base + r->size)
+            continue;
+
+        set_page_bits(r, r->dirty, p, len);
+        return;
+    }
+}
+
+void region_mark_all_dirty(enum region_id id) {
+    region_t *r = &regions[id];
+    size_t i;
+    for (i = 0; i < r->nwords; i++) {
+        set_dirty_bits(&r->dirty[i], ~(uint64_t)0);
+    }
+}
+
+void region_set_sparse(enum region_id id) {
+    region_t *r = &regions[id];
+    size_t i;
+
+    free(r->backed);
+    r->backed = calloc(r->capacity, sizeof(uint64_t));
+    if (r->backed == NULL) {
+        fprintf(stderr, "Failed to allocate backed page bitmap for region %d\n", id);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < r->nwords; i++) {
+        take_dirty_bits(&r->dirty[i]);
+    }
+}
+
+void region_mark_backed(enum region_id id, const void *addr, size_t len) {
+    region_t *r = &regions[id];
+    const char *p = addr;
+
+    if (r->backed == NULL || len == 0 || p < (char *)r->base ||
+        p >= (char *)r->base + r->size)
+        return;
+    set_page_bits(r, r->backed, p, len);
+}
+
+void region_full_bitmap(enum region_id id, uint64_t *bitmap) {
+    region_t *r = &regions[id];
+    size_t i;
+
+    if (r->backed == NULL) {
+        memset(bitmap, 0xff, r->nwords * sizeof(uint64_t));
+        return;
+    }
+    for (i = 0; i < r->nwords; i++) {
+        bitmap[i] = r->backed[i];
+    }
+}
+
+size_t region_count_dirty(enum region_id id) {
+    region_t *r = &regions[id];
+    size_t i, count = 0;
+    for (i = 0; i < r->nwords; i++) {
+        count += __builtin_popcountll(r->dirty[i]);
+    }
+    return count;
+}
+
+size_t region_collect_dirty(enum region_id id) {
+    region_t *r = &regions[id];
+    size_t i, count = 0;
+    for (i = 0; i < r->nwords; i++) {
+        r->collected[i] = take_dirty_bits(&r->dirty[i]);
+        count += __builtin_popcountll(r->collected[i]);
+    }
+    return count;
+}
+
+bool region_next_dirty_run(enum region_id id, const uint64_t *bitmap,
+                           size_t *pos, size_t *offset, size_t *len) {
+    region_t *r = &regions[id];
+    size_t npages = r->nwords * BITS_PER_WORD;
+    size_t page = *pos, start;
+
+#define PAGE_IS_DIRTY(n) (bitmap[(n) / BITS_PER_WORD] & \
+                          ((uint64_t)1 << ((n) % BITS_PER_WORD)))
+
+    /* Skip clean words quickly, then clean pages */
+    while (page < npages && !PAGE_IS_DIRTY(page)) {
+        if (page % BITS_PER_WORD == 0 && bitmap[page / BITS_PER_WORD] == 0)
+            page += BITS_PER_WORD;
+        else
+            page++;
+    }
+    if (page >= npages || ((size_t)page << REGION_PAGE_SHIFT) >= r->size) {
+        *pos = npages;
+        return false;
+    }
+    start = page;
+    while (page < npages && PAGE_IS_DIRTY(page))
+        page++;
+#undef PAGE_IS_DIRTY
+
+    *pos = page;
+    *offset = start << REGION_PAGE_SHIFT;
+    *len = (page - start) << REGION_PAGE_SHIFT;
+    if (*offset + *len > r->size)
+        *len = r->size - *offset;
+    return true;
+}
@@ -0,0 +1,115 @@
+/*
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * Registry of the shared memory regions that are replicated to the backups
+ * (assoc, slabs and slabs_lists), with a dirty page bitmap per region.
+ * Writers mark the pages they modify, and the backup client collects and
+ * clears the dirty bitmap on every sync, sending only the changed pages.
+ */
+
+#ifndef REGIONS_H_
+#define REGIONS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define REGION_PAGE_SHIFT 12
+#define REGION_PAGE_SIZE (1UL << REGION_PAGE_SHIFT)
+
+enum region_id {
+    REGION_ASSOC = 0,       /* assoc.c primary_hashtable */
+    REGION_SLABS,           /* slabs.c mem_base */
+    REGION_SLABS_LISTS,     /* slabs.c mem_slabs_lists_base */
+    REGION_MAX
+};
+
+typedef struct {
+    void *base;             /* start of the mapping, NULL if not registered */
+    size_t size;            /* size of the mapping in bytes */
+    const char *key;        /* shared_malloc key backing the mapping */
+    uint64_t *dirty;        /* one bit per REGION_PAGE_SIZE page */
+    uint64_t *collected;    /* bitmap handed to the sender by region_collect_dirty */
+    uint64_t *backed;       /* pages a full copy sends, NULL for all, see region_set_sparse */
+    size_t nwords;          /* number of words in dirty and collected */
+    size_t capacity;        /* words allocated for the bitmaps, see region_reserve */
+    unsigned int generation; /* bumped whenever the region is registered again */
+} region_t;
+
+/*
+ * Registers a shared region. All of its pages start out dirty, so the first
+ * sync to a backup is a full one. Registering a region again replaces it (the
+ * hash table after an expansion); the caller makes sure that nothing marks or
+ * collects it meanwhile, see backup_regions_hold.
+ */
+void region_register(enum region_id id, void *base, size_t size, const char *key);
+
+/*
+ * Allocates the bitmaps of a registered region for up to size bytes, so that
+ * region_resize can grow it that far while the region is in use. Called
+ * right after region_register.
+ */
+void region_reserve(enum region_id id, size_t size);
+
+/*
+ * Grows a region in place to size bytes, within what region_reserve allowed
+ * (the slabs, when the memlimit command maps more memory). The new pages are
+ * clean, and not backed in a sparse region. Nothing may be written to them
+ * before this returns, and the caller holds off the collector and the
+ * senders (see backup_regions_hold), which then see the new size.
+ */
+void region_resize(enum region_id id, size_t size);
+
+/* Returns the region descriptor, or NULL if the region was not registered */
+region_t *region_get(enum region_id id);
+
+/* Enables dirty tracking. Marking is a no-op until this is called */
+void regions_tracking_enable(void);
+
+/*
+ * Marks the pages covering [addr, addr + len) as dirty.
+ * Safe to call from any thread; addresses outside every region are ignored.
+ */
+void region_mark_dirty(const void *addr, size_t len);
+
+/* Marks every page of the region as dirty (used to force a full resync) */
+void region_mark_all_dirty(enum region_id id);
+
+/*
+ * Makes a registered region sparse: only its pages passed to
+ * region_mark_backed are read by a full copy, the others hold nothing (the
+ * slabs not handed out yet, holes that reading would fill in with -o
+ * lazy_prealloc). Every page starts out clean and not backed.
+ */
+void region_set_sparse(enum region_id id);
+
+/* Marks the pages covering [addr, addr + len) of a sparse region as backed */
+void region_mark_backed(enum region_id id, const void *addr, size_t len);
+
+/*
+ * Sets the bits of the pages a full copy of the region sends in bitmap, its
+ * nwords words: all of them, or the backed ones of a sparse region
+ */
+void region_full_bitmap(enum region_id id, uint64_t *bitmap);
+
+/* Returns the number of dirty pages of the region, without collecting them */
+size_t region_count_dirty(enum region_id id);
+
+/*
+ * Atomically moves the dirty bitmap of the region into its collected bitmap
+ * and returns the number of dirty pages. Only one thread may collect.
+ */
+size_t region_collect_dirty(enum region_id id);
+
+/*
+ * Iterates runs of consecutive pages set in bitmap, a bitmap of nwords words
+ * over the region (such as its collected bitmap).
+ * *pos is the page to continue the scan from (start at 0).
+ * Returns false when there are no more runs, otherwise sets the byte
+ * offset and length of the next run, clamped to the region size.
+ */
+bool region_next_dirty_run(enum region_id id, const uint64_t *bitmap,
+                           size_t *pos, size_t *offset, size_t *len);
+
+extern volatile bool regions_tracking;
+
+#endif /* REGIONS_H_ */
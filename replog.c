@@ -0,0 +1,392 @@
+/*
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * Logical replication log ("oplog" failover mode). See replog.h.
+ */
+
+#include "memcached.h"
+#include "backup.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+typedef struct {
+    char *buf;
+    size_t used;
+    size_t size;
+} replog_buffer;
+
+/*
+ * Writers append to the active buffer, the sender drains the other one.
+ * The buffers are reserved at replog_max_bytes and only committed as they
+ * are written, so they never move. A writer reserves its room by moving
+ * replog_tail forward, copies its record without a lock, and adds its
+ * length to the committed bytes of the buffer; replog_take switches the
+ * tail to the other buffer, then waits for the copies still running.
+ */
+static replog_buffer buffers[2];
+static volatile size_t committed[2];
+/* the active buffer in the top bit, the bytes reserved in it below */
+static volatile uint64_t replog_tail = 0;
+#define TAIL_ACTIVE ((uint64_t)1 << 63)
+/* A record did not fit: the backups need a full resync, see replog_take */
+static volatile bool replog_overflow = false;
+static size_t replog_max_bytes = REPLOG_DEFAULT_MAX_BYTES;
+/* Serializes the takers, and the stats of the applied records */
+static pthread_mutex_t replog_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Set while applying records from the primary, so they are not logged again
+ * and sent back to it (every instance is both a backup client and server) */
+static __thread bool replog_applying = false;
+
+static struct {
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t dropped;
+    uint64_t applied;
+    uint64_t apply_errors;
+} replog_stats_data;
+
+void replog_init(size_t max_bytes) {
+    int i;
+
+    if (max_bytes != 0)
+        replog_max_bytes = max_bytes;
+    for (i = 0; i < 2; i++) {
+        buffers[i].buf = mmap(NULL, replog_max_bytes, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (buffers[i].buf == MAP_FAILED) {
+            perror("Failed to reserve the replication log");
+            exit(EXIT_FAILURE);
+        }
+        buffers[i].size = replog_max_bytes;
+    }
+}
+
+/*
+ * Reserves room for len bytes in the active buffer, and returns the buffer
+ * it is in. Returns NULL if the record does not fit, in which case the
+ * backups get a full resync rather than miss it.
+ */
+static char *replog_reserve(size_t len, int *idx) {
+    uint64_t tail;
+    replog_buffer *b;
+
+    do {
+        tail = replog_tail;
+        *idx = (tail & TAIL_ACTIVE) != 0;
+        b = &buffers[*idx];
+        if (replog_overflow || (tail & ~TAIL_ACTIVE) + len > b->size) {
+            /* The backups are too far behind; don't grow forever */
+            replog_overflow = true;
+            __sync_fetch_and_add(&replog_stats_data.dropped, 1);
+            return NULL;
+        }
+    } while (!__sync_bool_compare_and_swap(&replog_tail, tail, tail + len));
+    return b->buf + (tail & ~TAIL_ACTIVE);
+}
+
+static void replog_append(const replog_record_hdr *hdr, const char *key,
+                          const char *data) {
+    size_t len = sizeof(*hdr) + hdr->nkey + hdr->nbytes;
+    char *p;
+    int idx;
+
+    p = replog_reserve(len, &idx);
+    if (p != NULL) {
+        memcpy(p, hdr, sizeof(*hdr));
+        memcpy(p + sizeof(*hdr), key, hdr->nkey);
+        if (hdr->nbytes)
+            memcpy(p + sizeof(*hdr) + hdr->nkey, data, hdr->nbytes);
+        __sync_fetch_and_add(&committed[idx], len);
+    }
+    /* Even if the record was dropped, so a semi-sync wait is not acked early */
+    backup_signal();
+}
+
+static uint32_t abs_exptime(const rel_time_t exptime) {
+    return exptime ? (uint32_t)(process_started + exptime) : 0;
+}
+
+static rel_time_t rel_exptime(const uint32_t exptime) {
+    if (exptime == 0)
+        return 0;
+    if (exptime <= process_started)
+        return (rel_time_t)1;
+    return (rel_time_t)(exptime - process_started);
+}
+
+static void replog_set_record(item *it, replog_record_hdr *hdr) {
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->op = REPLOG_SET;
+    hdr->nkey = it->nkey;
+    hdr->flags = (uint32_t)strtoul(ITEM_suffix(it), NULL, 10);
+    hdr->exptime = abs_exptime(it->exptime);
+    hdr->nbytes = it->nbytes;
+}
+
+void replog_item_stored(item *it) {
+    replog_record_hdr hdr;
+    if (!settings.failover_oplog || replog_applying)
+        return;
+    replog_set_record(it, &hdr);
+    replog_append(&hdr, ITEM_key(it), ITEM_data(it));
+}
+
+void replog_item_deleted(const char *key, const size_t nkey) {
+    replog_record_hdr hdr;
+    if (!settings.failover_oplog || replog_applying)
+        return;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.op = REPLOG_DELETE;
+    hdr.nkey = nkey;
+    replog_append(&hdr, key, NULL);
+}
+
+void replog_item_touched(const char *key, const size_t nkey, const rel_time_t exptime) {
+    replog_record_hdr hdr;
+    if (!settings.failover_oplog || replog_applying)
+        return;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.op = REPLOG_TOUCH;
+    hdr.nkey = nkey;
+    hdr.exptime = abs_exptime(exptime);
+    replog_append(&hdr, key, NULL);
+}
+
+void replog_flush(const rel_time_t new_oldest) {
+    replog_record_hdr hdr;
+    if (!settings.failover_oplog || replog_applying)
+        return;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.op = REPLOG_FLUSH;
+    hdr.exptime = abs_exptime(new_oldest);
+    replog_append(&hdr, NULL, NULL);
+}
+
+/* Appends a record to a dump buffer, growing it as needed */
+static int replog_dump_append(replog_buffer *b, const replog_record_hdr *hdr,
+                              const char *key, const char *data) {
+    size_t len = sizeof(*hdr) + hdr->nkey + hdr->nbytes;
+    char *p;
+
+    if (b->used + len > b->size) {
+        size_t new_size = b->size ? b->size : REPLOG_DUMP_CHUNK;
+        char *new_buf;
+        while (new_size < b->used + len)
+            new_size *= 2;
+        new_buf = realloc(b->buf, new_size);
+        if (new_buf == NULL)
+            return -1;
+        b->buf = new_buf;
+        b->size = new_size;
+    }
+    p = b->buf + b->used;
+    memcpy(p, hdr, sizeof(*hdr));
+    memcpy(p + sizeof(*hdr), key, hdr->nkey);
+    if (hdr->nbytes)
+        memcpy(p + sizeof(*hdr) + hdr->nkey, data, hdr->nbytes);
+    b->used += len;
+    return 0;
+}
+
+int replog_dump(int (*emit)(const char *buf, size_t len, void *arg), void *arg) {
+    replog_buffer b = { NULL, 0, 0 };
+    replog_record_hdr hdr;
+    uint64_t nbuckets = (uint64_t)1 << hashpower;
+    uint64_t nlocks = (uint64_t)1 << item_lock_hashpower;
+    uint64_t bucket, hv;
+    rel_time_t oldest_live;
+    item *it;
+    int rv = 0;
+
+    /* Whatever the backup holds and the primary doesn't must go */
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.op = REPLOG_FLUSH;
+    if (replog_dump_append(&b, &hdr, NULL, NULL) != 0)
+        return -1;
+
+    for (bucket = 0; bucket < nbuckets && rv == 0; bucket++) {
+        /* With more locks than buckets, a bucket spans several locks */
+        for (hv = bucket; hv < nbuckets || hv < nlocks; hv += nbuckets)
+            item_lock(hv);
+        oldest_live = settings.oldest_live;
+        for (it = assoc_bucket(bucket); it != NULL && rv == 0; it = ITEM_h_next(it)) {
+            if ((it->exptime != 0 && it->exptime <= current_time) ||
+                (oldest_live != 0 && oldest_live <= current_time &&
+                 it->time <= oldest_live))
+                continue;
+            replog_set_record(it, &hdr);
+            rv = replog_dump_append(&b, &hdr, ITEM_key(it), ITEM_data(it));
+        }
+        for (hv = bucket; hv < nbuckets || hv < nlocks; hv += nbuckets)
+            item_unlock(hv);
+
+        if (rv == 0 && b.used > 0 &&
+            (b.used >= REPLOG_DUMP_CHUNK || bucket == nbuckets - 1)) {
+            rv = emit(b.buf, b.used, arg);
+            b.used = 0;
+        }
+    }
+    free(b.buf);
+    return rv;
+}
+
+char *replog_take(size_t *len, bool *overflow) {
+    replog_buffer *b;
+    uint64_t tail;
+    char *p;
+
+    pthread_mutex_lock(&replog_lock);
+    *overflow = false;
+    do {
+        tail = replog_tail;
+        if ((tail & ~TAIL_ACTIVE) == 0 && !replog_overflow) {
+            pthread_mutex_unlock(&replog_lock);
+            return NULL;
+        }
+    } while (!__sync_bool_compare_and_swap(&replog_tail, tail,
+                                           (tail & TAIL_ACTIVE) ^ TAIL_ACTIVE));
+    b = &buffers[(tail & TAIL_ACTIVE) != 0];
+    b->used = tail & ~TAIL_ACTIVE;
+    /* the writers that reserved room before the switch are still copying */
+    while (committed[(tail & TAIL_ACTIVE) != 0] != b->used)
+        sched_yield();
+    if (replog_overflow) {
+        /* a record is missing: what was logged before it can't be sent
+         * either, the full resync dumps the items as they are now */
+        replog_overflow = false;
+        *overflow = true;
+        b->used = 0;
+        committed[(tail & TAIL_ACTIVE) != 0] = 0;
+    }
+    for (p = b->buf; p < b->buf + b->used; ) {
+        replog_record_hdr *hdr = (replog_record_hdr *)p;
+        p += sizeof(*hdr) + hdr->nkey + hdr->nbytes;
+        replog_stats_data.records++;
+    }
+    replog_stats_data.bytes += b->used;
+    pthread_mutex_unlock(&replog_lock);
+    *len = b->used;
+    /* nothing to release if it was dropped */
+    return b->used > 0 ? b->buf : NULL;
+}
+
+void replog_release(void) {
+    int idx;
+
+    pthread_mutex_lock(&replog_lock);
+    /* the buffer that is not active */
+    idx = (replog_tail & TAIL_ACTIVE) == 0;
+    buffers[idx].used = 0;
+    committed[idx] = 0;
+    pthread_mutex_unlock(&replog_lock);
+}
+
+static int replog_apply_set(const replog_record_hdr *hdr, const char *key,
+                            const char *data) {
+    conn c;
+    item *it;
+    enum store_item_type ret;
+
+    if (hdr->nbytes < 2)
+        return -1;
+    it = item_alloc((char *)key, hdr->nkey, hdr->flags,
+                    rel_exptime(hdr->exptime), hdr->nbytes);
+    if (it == NULL) {
+        /* Keep the stale value out of the cache, as a failed set would */
+        it = item_get(key, hdr->nkey);
+        if (it) {
+            item_unlink(it);
+            item_remove(it);
+        }
+        return -1;
+    }
+    memcpy(ITEM_data(it), data, hdr->nbytes);
+    /* Only the SET path is taken, which does not touch the thread stats */
+    memset(&c, 0, sizeof(c));
+    ret = store_item(it, NREAD_SET, &c);
+    item_remove(it);
+    return ret == STORED ? 0 : -1;
+}
+
+static void replog_apply_flush(const replog_record_hdr *hdr) {
+    rel_time_t new_oldest = rel_exptime(hdr->exptime);
+    if (new_oldest == 0)
+        new_oldest = current_time;
+    if (settings.use_cas) {
+        settings.oldest_live = new_oldest - 1;
+        if (settings.oldest_live <= current_time)
+            settings.oldest_cas = get_cas_id();
+    } else {
+        settings.oldest_live = new_oldest;
+    }
+    slabs_meta_update();
+}
+
+int replog_apply(const char *buf, size_t len) {
+    const char *p = buf;
+    const char *end = buf + len;
+    replog_record_hdr hdr;
+    const char *key, *data;
+    item *it;
+    int rv;
+
+    replog_applying = true;
+    while (p < end) {
+        if ((size_t)(end - p) < sizeof(hdr))
+            break;
+        memcpy(&hdr, p, sizeof(hdr));
+        if ((size_t)(end - p) < sizeof(hdr) + hdr.nkey + hdr.nbytes)
+            break;
+        key = p + sizeof(hdr);
+        data = key + hdr.nkey;
+        p = data + hdr.nbytes;
+
+        rv = 0;
+        switch (hdr.op) {
+        case REPLOG_SET:
+            rv = replog_apply_set(&hdr, key, data);
+            break;
+        case REPLOG_DELETE:
+            it = item_get(key, hdr.nkey);
+            if (it) {
+                item_unlink(it);
+                item_remove(it);
+            }
+            break;
+        case REPLOG_TOUCH:
+            it = item_touch(key, hdr.nkey, rel_exptime(hdr.exptime));
+            if (it)
+                item_remove(it);
+            break;
+        case REPLOG_FLUSH:
+            replog_apply_flush(&hdr);
+            break;
+        default:
+            /* Unknown record, the rest of the buffer can't be parsed */
+            replog_applying = false;
+            return -1;
+        }
+
+        pthread_mutex_lock(&replog_lock);
+        if (rv == 0)
+            replog_stats_data.applied++;
+        else
+            replog_stats_data.apply_errors++;
+        pthread_mutex_unlock(&replog_lock);
+    }
+    replog_applying = false;
+    return p == end ? 0 : -1;
+}
+
+void replog_stats(ADD_STAT add_stats, conn *c) {
+    pthread_mutex_lock(&replog_lock);
+    APPEND_STAT("replog_records", "%llu", (unsigned long long)replog_stats_data.records);
+    APPEND_STAT("replog_bytes", "%llu", (unsigned long long)replog_stats_data.bytes);
+    APPEND_STAT("replog_dropped", "%llu", (unsigned long long)replog_stats_data.dropped);
+    APPEND_STAT("replog_applied", "%llu", (unsigned long long)replog_stats_data.applied);
+    APPEND_STAT("replog_apply_errors", "%llu", (unsigned long long)replog_stats_data.apply_errors);
+    pthread_mutex_unlock(&replog_lock);
+}
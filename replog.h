@@ -0,0 +1,73 @@
+/*
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * Logical replication log ("oplog" failover mode).
+ * Every mutation is captured at the item layer as a compact record:
+ * stores (set/add/replace/append/prepend/cas/incr/decr) are logged as the
+ * resulting item, explicit deletes, touches and flush_all are logged as such.
+ * The backup client ships the records to the backups, which apply them
+ * through the normal item_alloc/store_item path. Unlike the snapshot mode,
+ * the backups do not need the same -m, hashpower or mmap addresses.
+ */
+
+#ifndef REPLOG_H_
+#define REPLOG_H_
+
+#include <stdint.h>
+
+enum replog_op {
+    REPLOG_SET = 1,
+    REPLOG_DELETE,
+    REPLOG_TOUCH,
+    REPLOG_FLUSH
+};
+
+/* Record header, followed by nkey bytes of key and nbytes bytes of data */
+typedef struct {
+    uint8_t  op;        /* enum replog_op */
+    uint8_t  nkey;      /* key length */
+    uint16_t reserved;
+    uint32_t flags;     /* client flags of the item */
+    uint32_t exptime;   /* absolute unix time, 0 for never */
+    uint32_t nbytes;    /* data length, including the trailing "\r\n" */
+} replog_record_hdr;
+
+/* Default limit on the amount of unsent records */
+#define REPLOG_DEFAULT_MAX_BYTES (64 * 1024 * 1024)
+/* Size of the chunks a dump is handed out in */
+#define REPLOG_DUMP_CHUNK (1024 * 1024)
+
+void replog_init(size_t max_bytes);
+
+/* Capture hooks, called with the item lock held */
+void replog_item_stored(item *it);
+void replog_item_deleted(const char *key, const size_t nkey);
+void replog_item_touched(const char *key, const size_t nkey, const rel_time_t exptime);
+/* Called after flush_all with the new oldest_live time */
+void replog_flush(const rel_time_t new_oldest);
+
+/*
+ * Hands the pending records to the sender and starts a new buffer.
+ * Returns NULL if nothing is pending. The returned buffer stays valid
+ * until replog_release() is called. Only one thread may take.
+ * Sets *overflow if records did not fit in the log since the last take,
+ * in which case the pending records are dropped too and every backup
+ * needs a full resync.
+ */
+char *replog_take(size_t *len, bool *overflow);
+void replog_release(void);
+
+/*
+ * Dumps the whole cache as records, for a full resync of a backup: a
+ * flush_all followed by a SET of every live item. The records are handed
+ * to emit in chunks of about REPLOG_DUMP_CHUNK bytes, outside the item
+ * locks. Records logged while the dump runs may describe older values,
+ * so they must be applied after it. Returns -1 if emit failed.
+ */
+int replog_dump(int (*emit)(const char *buf, size_t len, void *arg), void *arg);
+
+/* Applies a buffer of records received from the primary */
+int replog_apply(const char *buf, size_t len);
+
+void replog_stats(ADD_STAT add_stats, conn *c);
+
+#endif /* REPLOG_H_ */
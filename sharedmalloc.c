@@ -7,6 +7,17 @@
  */
 
 #include "sharedmalloc.h"
+#include <limits.h>
+#include <stdbool.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+
+#ifndef TMPFS_MAGIC
+#define TMPFS_MAGIC 0x01021994
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
 
 /*
 int file_lock(int fd){
@@ -57,6 +68,118 @@ void file_mutex_unlock(char *key){
 */
 
 
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+static char keypath[PATH_MAX] = "/tmp/memkey/";
+const char *shared_malloc_dir = keypath;
+
+int shared_malloc_set_dir(const char *dir){
+  if(strlen(dir) >= sizeof(keypath)){
+    return -1;
+  }
+  strcpy(keypath, dir);
+  return 0;
+}
+
+/*reserves size bytes of address space at a huge page boundary*/
+static void *huge_reserve(size_t size){
+  char *base = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  char *aligned;
+  if(base == MAP_FAILED){
+    return NULL;
+  }
+  aligned = (char *)(((unsigned long)base + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+  /*give back the slack on both sides*/
+  if(aligned > base){
+    munmap(base, aligned - base);
+  }
+  munmap(aligned + size, base + HUGE_PAGE_SIZE - aligned);
+  return aligned;
+}
+
+/*whether the kernel can do shared_commit on this mapping*/
+static bool commit_supported(void *ptr){
+#ifdef MADV_POPULATE_WRITE
+  return madvise(ptr, 0, MADV_POPULATE_WRITE) == 0;
+#else
+  (void)ptr;
+  return false;
+#endif
+}
+
+int shared_commit(void *ptr, size_t size){
+  unsigned long page = sysconf(_SC_PAGESIZE);
+  unsigned long start = (unsigned long)ptr & ~(page - 1);
+#ifdef MADV_POPULATE_WRITE
+  while(madvise((void *)start, (unsigned long)ptr + size - start, MADV_POPULATE_WRITE) == -1){
+    if(errno == EINTR){
+      continue;
+    }
+    /*an older kernel, and the memory was allocated up front*/
+    return errno == EINVAL ? 0 : -1;
+  }
+#endif
+  return 0;
+}
+
+static void huge_advise(void *ptr, size_t size){
+#ifdef MADV_HUGEPAGE
+  if(madvise(ptr, size, MADV_HUGEPAGE) == -1){
+    perror("Warning: no huge pages for shared memory: ");
+  }
+#endif
+}
+
+void *huge_malloc(size_t size){
+  void *reserved = huge_reserve(size);
+  void *ret;
+  if(!reserved){
+    return NULL;
+  }
+  ret = mmap(reserved, size, PROT_WRITE | PROT_READ,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  if(ret == MAP_FAILED){
+    munmap(reserved, size);
+    return NULL;
+  }
+  huge_advise(ret, size);
+  return ret;
+}
+
+size_t shared_huge_bytes(const void *ptr, size_t size){
+  static const char *fields[] = { "AnonHugePages:", "ShmemPmdMapped:",
+                                  "FilePmdMapped:", "Shared_Hugetlb:",
+                                  "Private_Hugetlb:" };
+  unsigned long start = (unsigned long)ptr, end = start + size;
+  unsigned long vma_start, vma_end, kb;
+  bool inside = false;
+  size_t ret = 0;
+  char line[512];
+  unsigned int i;
+  FILE *f = fopen("/proc/self/smaps", "r");
+  if(!f){
+    return 0;
+  }
+  while(fgets(line, sizeof(line), f)){
+    if(sscanf(line, "%lx-%lx ", &vma_start, &vma_end) == 2){
+      inside = vma_start < end && vma_end > start;
+      continue;
+    }
+    if(!inside){
+      continue;
+    }
+    for(i = 0; i < sizeof(fields) / sizeof(fields[0]); i++){
+      size_t len = strlen(fields[i]);
+      if(strncmp(line, fields[i], len) == 0 && sscanf(line + len, "%lu", &kb) == 1){
+        ret += kb * 1024;
+      }
+    }
+  }
+  fclose(f);
+  return ret;
+}
+
 char *gen_full_path(const char* key, const char *dir){
   size_t keylen = strlen(key);
   size_t pathlen = strlen(dir);
@@ -75,6 +198,13 @@ void *shared_malloc(void *addr, size_t size, const char *key, int lock){
   int dir_stat;
   int fd;
   int fallocate_ret;
+  int huge = lock & HUGE_PAGES;
+  int lazy = lock & LAZY_ALLOC;
+  int in_reserve = lock & IN_RESERVE;
+  int populate;
+  struct statfs fs;
+  struct stat st;
+  void *reserved = NULL;
   void *ret;
   dir_stat = mkdir(KEYPATH, 0766);
   if(dir_stat == -1 && errno != EEXIST){
@@ -95,27 +225,71 @@ void *shared_malloc(void *addr, size_t size, const char *key, int lock){
     return NULL;
   }
 
+  /*tmpfs allocates the memory on fallocate, which knows nothing of the
+  //huge page advice, so there the pages are faulted in through the
+  //advised mapping first*/
+  populate = huge && !lazy && fstatfs(fd, &fs) == 0 && fs.f_type == TMPFS_MAGIC;
+
   /*ensure the file is large enough*/
-  fallocate_ret = posix_fallocate(fd, 0, size);
-  if(fallocate_ret != 0){
-    errno = fallocate_ret;
-    perror("Error allocating shared memory: ");
-    close(fd);
-    return NULL;
+  if(populate || lazy){
+    if(fstat(fd, &st) == -1 || ((size_t)st.st_size < size && ftruncate(fd, size) == -1)){
+      perror("Error allocating shared memory: ");
+      close(fd);
+      return NULL;
+    }
+  }else{
+    fallocate_ret = posix_fallocate(fd, 0, size);
+    if(fallocate_ret != 0){
+      errno = fallocate_ret;
+      perror("Error allocating shared memory: ");
+      close(fd);
+      return NULL;
+    }
+  }
+
+  /*huge pages only back huge page aligned memory*/
+  if(huge && !addr){
+    addr = reserved = huge_reserve(size);
   }
 
   /*map the file into memory*/
-  ret = mmap((caddr_t)addr, size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+  ret = mmap((caddr_t)addr, size, PROT_WRITE | PROT_READ,
+             MAP_SHARED | (reserved || in_reserve ? MAP_FIXED : 0), fd, 0);
   if(ret == MAP_FAILED){
     perror("Error allocating shared memory: ");
+    if(reserved){
+      munmap(reserved, size);
+    }
     close(fd);
     return NULL;
   }
+  if(huge){
+    huge_advise(ret, size);
+  }
+  /*without shared_commit the file must be allocated now*/
+  if(lazy && !commit_supported(ret)){
+    populate = 1;
+  }
+  if(populate){
+#ifdef MADV_POPULATE_WRITE
+    /*a failure leaves the rest to fallocate*/
+    madvise(ret, size, MADV_POPULATE_WRITE);
+#endif
+    fallocate_ret = posix_fallocate(fd, 0, size);
+    if(fallocate_ret != 0){
+      errno = fallocate_ret;
+      perror("Error allocating shared memory: ");
+      munmap(ret, size);
+      close(fd);
+      return NULL;
+    }
+  }
   
   /*close the file*/
   close(fd);
   
   /*lock the file in memory if a lock is requested*/
+  lock &= ~(HUGE_PAGES | LAZY_ALLOC | IN_RESERVE);
   if(lock == SOFT_LOCK || lock == HARD_LOCK){
     if(mlock(ret, size) == -1){
       perror("Error locking shared memory: ");
@@ -129,6 +303,155 @@ void *shared_malloc(void *addr, size_t size, const char *key, int lock){
   return ret;  
 }
 
+void *shared_attach(size_t size, const char *key){
+  char *path = gen_full_path(key, KEYPATH);
+  struct stat st;
+  void *ret;
+  int fd;
+  if(!path){
+    return NULL;
+  }
+  fd = open(path, O_RDONLY);
+  free(path);
+  if(fd == -1){
+    return NULL;
+  }
+  /*a file too short would fault past its end*/
+  if(fstat(fd, &st) == -1 || (size_t)st.st_size < size){
+    close(fd);
+    return NULL;
+  }
+  ret = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  return ret == MAP_FAILED ? NULL : ret;
+}
+
+/*exchanges the names of two files atomically, where the kernel and the
+//file system can*/
+static int exchange_names(const char *a, const char *b){
+#ifdef SYS_renameat2
+  return syscall(SYS_renameat2, AT_FDCWD, a, AT_FDCWD, b, RENAME_EXCHANGE) == 0 ? 0 : -1;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int shared_swap(void *ptr, size_t size, const char *key, const char *other, int lock){
+  char *path = gen_full_path(key, KEYPATH);
+  char *other_path = gen_full_path(other, KEYPATH);
+  struct stat st;
+  int fd = -1;
+  int ret = -1;
+  if(path && other_path && exchange_names(path, other_path) == 0){
+    /*key now names the memory of other*/
+    fd = open(path, O_RDWR);
+    if(fd != -1 && fstat(fd, &st) == 0 && (size_t)st.st_size >= size &&
+       mmap(ptr, size, PROT_WRITE | PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED){
+      if(lock & HUGE_PAGES){
+        huge_advise(ptr, size);
+      }
+      ret = 0;
+    }else{
+      /*the mapping was left alone, so give the names back*/
+      exchange_names(path, other_path);
+    }
+    if(fd != -1){
+      close(fd);
+    }
+  }
+  free(path);
+  free(other_path);
+  return ret;
+}
+
+void *shared_reserve(size_t size){
+  return huge_reserve(size);
+}
+
+int shared_extend(void *ptr, size_t old_size, size_t size, const char *key, int lock){
+  char *path;
+  char *at = (char *)ptr + old_size;
+  size_t len = size - old_size;
+  int fd = -1;
+  int fallocate_ret;
+  int huge = lock & HUGE_PAGES;
+  int lazy = lock & LAZY_ALLOC;
+  struct stat st;
+  void *ret;
+  if(size <= old_size){
+    return 0;
+  }
+  if(key){
+    path = gen_full_path(key, KEYPATH);
+    if(!path){
+      fprintf(stderr, "Error extending shared memory: Malloc failed");
+      return -1;
+    }
+    fd = open(path, O_RDWR | O_CREAT, 0666);
+    free(path);
+    /*the file is sized as by shared_malloc, and allocated once mapped*/
+    if(fd == -1 || fstat(fd, &st) == -1 ||
+       ((size_t)st.st_size < size && ftruncate(fd, size) == -1)){
+      perror("Error extending shared memory: ");
+      if(fd != -1){
+        close(fd);
+      }
+      return -1;
+    }
+    ret = mmap(at, len, PROT_WRITE | PROT_READ, MAP_SHARED | MAP_FIXED, fd, old_size);
+  }else{
+    ret = mmap(at, len, PROT_WRITE | PROT_READ,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  }
+  if(ret == MAP_FAILED){
+    perror("Error extending shared memory: ");
+    if(fd != -1){
+      close(fd);
+    }
+    return -1;
+  }
+  if(huge){
+    huge_advise(ret, len);
+  }
+  if(fd != -1){
+    if(!lazy || !commit_supported(ret)){
+#ifdef MADV_POPULATE_WRITE
+      /*through the advised mapping first, see shared_malloc*/
+      if(huge){
+        madvise(ret, len, MADV_POPULATE_WRITE);
+      }
+#endif
+      fallocate_ret = posix_fallocate(fd, old_size, len);
+      if(fallocate_ret != 0){
+        errno = fallocate_ret;
+        perror("Error extending shared memory: ");
+        /*give the address space back to the reservation*/
+        mmap(at, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        close(fd);
+        return -1;
+      }
+    }
+    close(fd);
+  }
+
+  lock &= ~(HUGE_PAGES | LAZY_ALLOC | IN_RESERVE);
+  if((lock == SOFT_LOCK || lock == HARD_LOCK) && mlock(ret, len) == -1){
+    perror("Error locking shared memory: ");
+  }
+  return 0;
+}
+
+void shared_release(void *ptr, size_t size){
+#ifdef MADV_REMOVE
+  /*punches the pages out of the file behind a shared mapping*/
+  if(madvise(ptr, size, MADV_REMOVE) == 0){
+    return;
+  }
+#endif
+  madvise(ptr, size, MADV_DONTNEED);
+}
+
 void *shared_realloc(void *addr, void *ptr, size_t size, size_t old_size, char *key, int lock){
   void *ret = shared_malloc(addr, size, key, lock);
   if(ret){
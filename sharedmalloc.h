@@ -20,8 +20,17 @@
 #define NO_LOCK 0
 #define SOFT_LOCK 1
 #define HARD_LOCK 2
+/*or'ed into lock: ask for transparent huge pages, see shared_malloc*/
+#define HUGE_PAGES 4
+/*or'ed into lock: only size the file, see shared_malloc*/
+#define LAZY_ALLOC 8
+/*or'ed into lock: map over address space from shared_reserve, see shared_malloc*/
+#define IN_RESERVE 16
 char *gen_full_path(const char*key, const char *dir);
-#define KEYPATH "/tmp/memkey/"
+/*the directory of the key files, "/tmp/memkey/" unless
+//shared_malloc_set_dir was called*/
+extern const char *shared_malloc_dir;
+#define KEYPATH shared_malloc_dir
 #define LOCKPATH "/tmp/memlock/"
 
 /*shared_malloc allocates shared memory of a given size
@@ -37,9 +46,87 @@ char *gen_full_path(const char*key, const char *dir);
 //      NO_LOCK: do not attempt to lock into physical memory
 //      SOFT_LOCK: attempt to lock, but allow locking to fail
 //      HARD_LOCK: the allocation will fail if it can not be locked
+//      any of them or'ed with HUGE_PAGES: map the memory at a huge page
+//      boundary and advise the kernel to back it with huge pages.
+//      Files on a tmpfs mounted with huge=advise, within_size or always
+//      get them, and so do files on file systems with large folios on
+//      recent kernels; elsewhere the memory keeps regular pages
+//      any of them or'ed with LAZY_ALLOC: the file is only sized, sparse,
+//      so the call takes the same time whatever the size, and the memory
+//      must be reserved with shared_commit before it is written. Where
+//      the kernel can't do shared_commit the file is allocated as usual
+//      any of them or'ed with IN_RESERVE: addr is the start of address
+//      space from shared_reserve, and the file is mapped there, so that
+//      shared_extend can grow the mapping in place later
 */
 void *shared_malloc(void *addr, size_t size, const char *key, int lock);
 
+/*sets the directory of the key files, dir must end with a '/'
+//return: 0 on success, -1 if dir is too long
+*/
+int shared_malloc_set_dir(const char *dir);
+
+/*shared_commit reserves the backing of [ptr, ptr + size), memory from
+//shared_malloc or huge_malloc, by faulting it in for writing. Unlike a
+//plain write, running out of memory or disk space is an error here and
+//not a SIGBUS
+//return: 0 on success, or if the kernel can't do it (the memory was then
+//allocated up front), -1 with errno set on failure
+*/
+int shared_commit(void *ptr, size_t size);
+
+/*shared_attach maps the first size bytes of the memory of key read-only,
+//as another process shared_malloc'ed it, without changing it. It is freed
+//with shared_free
+//return: a ptr to the memory or NULL if there is no such memory, or less
+*/
+void *shared_attach(size_t size, const char *key);
+
+/*shared_swap maps the memory of the key other over [ptr, ptr + size), a
+//mapping of the memory of key, and exchanges the names of the two, so that
+//key names the memory mapped at ptr and other the memory that was. Either
+//both are done, atomically for the other threads and for another process
+//that attaches key, or none is (the file system can't exchange names)
+//return: 0 on success, -1 if nothing was changed
+*/
+int shared_swap(void *ptr, size_t size, const char *key, const char *other, int lock);
+
+/*shared_reserve reserves size bytes of address space, at a huge page
+//boundary, that nothing is mapped at. shared_malloc with IN_RESERVE and
+//shared_extend map memory over it. It is freed with shared_free
+//return: the start of the address space or NULL on failure
+*/
+void *shared_reserve(size_t size);
+
+/*shared_extend grows a mapping in place from old_size to size bytes,
+//over the address space reserved after it. With a key the mapping is the
+//one of shared_malloc with the same key and lock, and the file grows;
+//with a NULL key it is private memory (an old_size of 0 makes the first
+//mapping). The memory already mapped is left as it was
+//return: 0 on success, -1 on failure, the mapping is then unchanged
+*/
+int shared_extend(void *ptr, size_t old_size, size_t size, const char *key, int lock);
+
+/*shared_release gives the memory of [ptr, ptr + size) back to the system:
+//the pages of a shared mapping are punched out of the file, and those of
+//private memory are dropped. The range stays mapped and reads zeros (its
+//old contents on file systems that can't punch holes), and is reserved
+//again by shared_commit or by writing it
+*/
+void shared_release(void *ptr, size_t size);
+
+/*huge_malloc allocates size bytes of private memory at a huge page
+//boundary, and advises the kernel to back it with huge pages
+//return: a ptr to the memory or NULL on failure
+*/
+void *huge_malloc(size_t size);
+
+/*returns the number of bytes of the mappings overlapping
+//[ptr, ptr + size) that are backed by huge pages, as /proc/self/smaps
+//reports them
+*/
+size_t shared_huge_bytes(const void *ptr, size_t size);
+
 /*shared_free frees memory that was allocated by shared_malloc
 //it must be called in every process that calles shared_malloc
 //and calling it in one processs does not invalidate another
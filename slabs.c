@@ -14,6 +14,8 @@
  */
 #include "sharedmalloc.h"
 #include "memcached.h"
+#include "backup.h"
+#include "numa.h"
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/signal.h>
@@ -34,12 +36,12 @@ typedef struct {
     unsigned int size;      /* sizes of items */
     unsigned int perslab;   /* how many items per slab */
 
-    void *slots;           /* list of item ptrs */
-    unsigned int sl_curr;   /* total free items in list */
+    void *slots[NUMA_MAX_NODES]; /* lists of item ptrs, by arena */
+    unsigned int sl_curr;   /* total free items in the lists */
 
     unsigned int slabs;     /* how many slabs were allocated for this class */
 
-    void **slab_list;       /* array of slab pointers */
+    item_ref *slab_list;    /* array of slab pages, see item_ref */
     unsigned int list_size; /* size of prev array */
 
     unsigned int killing;  /* index+1 of dying slab, or zero if none */
@@ -55,13 +57,120 @@ static bool mem_limit_reached = false;
 static int power_largest;
 
 static void *mem_base = NULL;
-static void *mem_current = NULL;
-static size_t mem_avail = 0;
+char *item_ref_base = NULL;
+
+/*
+ * mem_base is cut into one arena per NUMA node with -o numa_arenas, and is
+ * a single arena otherwise. Each arena hands its pages out from its start.
+ */
+typedef struct {
+    char *base;
+    char *current;
+    size_t avail;
+    unsigned int free_chunks;   /* of all classes, in the arena */
+} slabs_arena;
+
+static slabs_arena arenas[NUMA_MAX_NODES];
+static int narenas = 1;
+static size_t arena_size = 0;
+
+/*
+ * With -o lazy_prealloc mem_base is reserved sparsely and committed (see
+ * shared_commit) a chunk at a time: by memory_allocate before it hands out
+ * a page of a chunk not committed yet, and ahead of it by the prefault
+ * threads and, without the slabs_lock, by slabs_commit_ahead. Nothing is written to a chunk before it is committed, so running
+ * out of memory fails an allocation instead of raising a SIGBUS.
+ */
+#define COMMIT_CHUNK_SIZE (4 * 1024 * 1024)
+
+enum commit_state {
+    CHUNK_UNCOMMITTED = 0, CHUNK_COMMITTING, CHUNK_COMMITTED
+};
+
+static volatile uint8_t *commit_chunks = NULL;
+static size_t commit_nchunks = 0;
+static volatile size_t commit_done = 0;
+/* next chunk for the prefault threads */
+static volatile size_t prefault_next = 0;
+
+/*
+ * With -o memlimit_max mem_base is the start of address space reserved for
+ * that much, of which the first mem_mapped bytes are mapped. Raising
+ * mem_limit past them maps more of it in place (see slabs_map), so the item
+ * offsets stay valid. The arenas hand out the mapped memory, and mem_limit
+ * only caps mem_malloced.
+ */
+static size_t mem_reserved = 0;
+static size_t mem_mapped = 0;
+static pthread_mutex_t slabs_map_lock = PTHREAD_MUTEX_INITIALIZER;
+/* mem_limit asked for by slabs_set_limit, 0 if none is pending */
+static volatile size_t mem_limit_target = 0;
+
+/*
+ * Pages given back to the system to lower mem_limit, which memory_allocate
+ * hands out again before the arena tails. Once tails_released the tails were
+ * given back too. Their memory reads zeros, and is committed again before a
+ * page is handed out.
+ */
+static char **released = NULL;
+static unsigned int released_count = 0;
+/* pages released since the last slabs_released_sweep */
+static unsigned int released_unswept = 0;
+static bool tails_released = false;
 
 static void *mem_slabs_lists_base = NULL;
 static void *mem_slabs_lists_current = NULL;
 static size_t mem_slabs_lists_avail = 0;
 
+/*
+ * Header at the start of the slab lists region, from which a warm restart
+ * reattaches the slabs. It is kept up to date under the slabs_lock, so it is
+ * good after a crash too, and the backups get it with the region.
+ */
+#define SLABS_META_MAGIC 0x316261736d656d31ULL
+
+typedef struct {
+    uint64_t magic;
+    uint64_t mem_limit;
+    uint64_t item_size_max;
+    uint64_t mem_malloced;
+    uint64_t mem_used;          /* from mem_base to the last page handed out */
+    uint64_t lists_used;        /* from the start of the region, header included */
+    int64_t process_started;    /* the item times are relative to it */
+    uint64_t oldest_cas;
+    uint32_t oldest_live;
+    uint32_t hashpower;
+    uint32_t slab_reassign;
+    uint32_t power_largest;
+    struct {
+        uint32_t size;
+        uint32_t perslab;
+        uint32_t slabs;
+        uint32_t list_size;
+        uint64_t list;          /* offset of slab_list in the region */
+    } classes[MAX_NUMBER_OF_SLAB_CLASSES];
+} slabs_meta;
+
+/*
+ * The header, then the slab lists. A list grows by doubling into a new one,
+ * so the lists of a class take up to 4 entries per page plus the first 16
+ * and 16 more, and a page is at least half of item_size_max.
+ */
+static size_t mem_slabs_lists_size = 0;
+
+static slabs_meta *meta = NULL;
+/* The slabs of the last run were reattached, see slabs_restore */
+static bool warm = false;
+
+/* The reattached slab pages, by address */
+typedef struct {
+    char *page;
+    unsigned int id;
+} restore_page;
+
+static restore_page *restore_pages = NULL;
+static unsigned int restore_npages = 0;
+
 /**
  * Access to the slab allocator is protected by this lock
  */
@@ -71,12 +180,19 @@ static pthread_mutex_t slabs_rebalance_lock = PTHREAD_MUTEX_INITIALIZER;
 /*
  * Forward Declarations
  */
-static int do_slabs_newslab(const unsigned int id);
-static void *memory_allocate(size_t size);
+static int do_slabs_newslab(const unsigned int id, const int arena, const bool local);
+static void slabs_commit_ahead(const unsigned int id, const int arena);
+static void *memory_allocate(size_t size, const int arena, const bool local);
 static void do_slabs_free(void *ptr, const size_t size, unsigned int id);
 
 static void *memory_slabs_lists_allocate(size_t size);
 
+static int slabs_attach(void);
+static int slabs_map(const size_t size);
+static void slabs_meta_init(void);
+static void slabs_meta_class(const unsigned int id);
+static void slabs_arenas_init(void);
+
 /* Preallocate as many slab pages as possible (called from slabs_init)
    on start-up, so users don't get confused out-of-memory errors when
    they do have free (in-slab) space, but no space to make new slabs.
@@ -104,35 +220,238 @@ unsigned int slabs_clsid(const size_t size) {
     return res;
 }
 
-/**
- * Determines the chunk sizes and initializes the slab class descriptors
- * accordingly.
+/*
+ * Cuts mem_base into the arenas, each placed on its node. An arena is a
+ * whole number of item_size_max pages, and the last one takes the rest.
  */
-void slabs_init(const size_t limit, const double factor, const bool prealloc) {
-    int i = POWER_SMALLEST - 1;
-    unsigned int size = sizeof(item) + settings.chunk_size;
-    mem_limit = limit;
+static void slabs_arenas_init(void) {
+    int k;
+
+    if (settings.numa_arenas)
+        narenas = numa_nodes();
+    arena_size = mem_mapped / narenas / settings.item_size_max * settings.item_size_max;
+    if (narenas == 1 || arena_size == 0) {
+        narenas = 1;
+        arena_size = mem_mapped;
+    }
+    for (k = 0; k < narenas; k++) {
+        arenas[k].base = (char *)mem_base + k * arena_size;
+        arenas[k].current = arenas[k].base;
+        arenas[k].avail = k + 1 < narenas ? arena_size : mem_mapped - k * arena_size;
+        if (narenas > 1)
+            numa_bind(arenas[k].base, arenas[k].avail, k);
+    }
+}
 
-    if (prealloc) {
-        /* Allocate everything in a big chunk with malloc */
-        if (settings.shared_malloc_slabs) {
-            mem_base = shared_malloc((void *)0x00007fa1fdf10000, mem_limit, settings.shared_malloc_slabs_key, NO_LOCK);     /* TODO: probably add lock */
-            mem_slabs_lists_base = shared_malloc((void *)0x00007fa2ff959000, 16 * sizeof(void *) * 34, settings.shared_malloc_slabs_lists_key, NO_LOCK);     /* TODO: probably add lock */ /* TODO: add variables / const, not magic numbers */
-        } else {
-            mem_base = malloc(mem_limit);
-            mem_slabs_lists_base = malloc(16 * sizeof(void *) * 34); /* TODO: add variables / const, not magic numbers */
+/* The arena ptr is in */
+static inline int arena_of(const void *ptr) {
+    size_t k;
+
+    if (narenas == 1)
+        return 0;
+    k = ((const char *)ptr - (const char *)mem_base) / arena_size;
+    return k < (size_t)narenas ? (int)k : narenas - 1;
+}
+
+/* The arena of the node the calling thread runs on */
+static int slabs_arena_self(void) {
+    int node;
+
+    if (narenas == 1)
+        return 0;
+    node = numa_node_self();
+    return node < narenas ? node : 0;
+}
+
+/* From mem_base to the end of the last page handed out, in any arena */
+static size_t slabs_arenas_used(void) {
+    size_t used = 0;
+    int k;
+
+    for (k = 0; k < narenas; k++) {
+        if ((size_t)(arenas[k].current - (char *)mem_base) > used)
+            used = arenas[k].current - (char *)mem_base;
+    }
+    return used;
+}
+
+/*
+ * Commits chunk c of mem_base, or waits until the thread that is doing it
+ * is done unless wait is false. Returns 0 once it is committed, or if it
+ * was left to another thread.
+ */
+static int commit_chunk(const size_t c, const bool wait) {
+    static bool warned = false;
+    char *ptr = (char *)mem_base + c * COMMIT_CHUNK_SIZE;
+    size_t len = mem_mapped - c * COMMIT_CHUNK_SIZE;
+
+    if (len > COMMIT_CHUNK_SIZE)
+        len = COMMIT_CHUNK_SIZE;
+    for (;;) {
+        if (commit_chunks[c] == CHUNK_COMMITTED)
+            return 0;
+        if (__sync_bool_compare_and_swap(&commit_chunks[c], CHUNK_UNCOMMITTED,
+                                         CHUNK_COMMITTING)) {
+            break;
         }
-        if (mem_base != NULL) {
-            mem_current = mem_base;
-            mem_avail = mem_limit;
+        if (!wait)
+            return 0;
+        usleep(100);
+    }
+    if (shared_commit(ptr, len) != 0) {
+        if (!warned) {
+            /* MADV_POPULATE_WRITE says EFAULT where a write would SIGBUS */
+            fprintf(stderr, "Failed to commit slab memory, out of memory or "
+                    "disk space: %s\n", strerror(errno));
+            warned = true;
+        }
+        commit_chunks[c] = CHUNK_UNCOMMITTED;
+        return -1;
+    }
+    __sync_synchronize();
+    commit_chunks[c] = CHUNK_COMMITTED;
+    __sync_fetch_and_add(&commit_done, 1);
+    return 0;
+}
 
-            mem_slabs_lists_current = mem_slabs_lists_base;
-            mem_slabs_lists_avail = 16 * sizeof(void *) * 34; /* TODO: add variables / const, not magic numbers */
-        } else {
-            fprintf(stderr, "Warning: Failed to allocate requested memory in"
-                    " one large chunk.\nWill allocate in smaller chunks\n");
+/* Commits the chunks of mem_base under [ptr, ptr + len). Returns 0 on success */
+static int slabs_commit(const char *ptr, const size_t len) {
+    size_t c, last;
+
+    if (commit_chunks == NULL || len == 0)
+        return 0;
+    c = (ptr - (char *)mem_base) / COMMIT_CHUNK_SIZE;
+    last = (ptr + len - 1 - (char *)mem_base) / COMMIT_CHUNK_SIZE;
+    for (; c <= last; c++) {
+        if (commit_chunk(c, true) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void *slabs_prefault_thread(void *arg) {
+    size_t c;
+
+    while ((c = __sync_fetch_and_add(&prefault_next, 1)) < commit_nchunks) {
+        if (commit_chunk(c, false) != 0) {
+            /* what is left is committed on demand, or fails then */
+            fprintf(stderr, "Prefaulting the slabs stopped after %zu MB\n",
+                    c * (COMMIT_CHUNK_SIZE / (1024 * 1024)));
+            prefault_next = commit_nchunks;
+            break;
         }
     }
+    return NULL;
+}
+
+int slabs_prefault_start(const int nthreads) {
+    pthread_t tid;
+    int i, ret;
+
+    if (commit_chunks == NULL)
+        return 0;
+    for (i = 0; i < nthreads; i++) {
+        if ((ret = pthread_create(&tid, NULL, slabs_prefault_thread, NULL)) != 0) {
+            fprintf(stderr, "Can't create prefault thread: %s\n", strerror(ret));
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+/*
+ * Maps mem_base, within address space reserved for memlimit_max when that is
+ * larger. Returns NULL on failure.
+ */
+static void *slabs_map_base(void) {
+    int flags = NO_LOCK | (settings.huge_pages ? HUGE_PAGES : 0) |
+        (settings.lazy_prealloc ? LAZY_ALLOC : 0);
+    void *base;
+
+    if (mem_reserved == mem_limit) {
+        if (settings.shared_malloc_slabs)
+            return shared_malloc(NULL, mem_limit, settings.shared_malloc_slabs_key,
+                                 flags);     /* TODO: probably add lock */
+        return settings.huge_pages ? huge_malloc(mem_limit) : malloc(mem_limit);
+    }
+    if ((base = shared_reserve(mem_reserved)) == NULL)
+        return NULL;
+    if (settings.shared_malloc_slabs ?
+        shared_malloc(base, mem_limit, settings.shared_malloc_slabs_key,
+                      flags | IN_RESERVE) == NULL :
+        shared_extend(base, 0, mem_limit, NULL, flags) != 0) {
+        shared_free(base, mem_reserved);
+        return NULL;
+    }
+    return base;
+}
+
+/*
+ * Maps mem_base up to size bytes, within mem_reserved, for the last arena to
+ * hand out. The backups get the larger region with their next sync.
+ * Returns 0 on success.
+ */
+static int slabs_map(const size_t size) {
+    int flags = NO_LOCK | (settings.huge_pages ? HUGE_PAGES : 0) |
+        (settings.lazy_prealloc ? LAZY_ALLOC : 0);
+    size_t old, c;
+
+    pthread_mutex_lock(&slabs_map_lock);
+    old = mem_mapped;
+    if (size <= old || size > mem_reserved ||
+        shared_extend(mem_base, old, size, settings.shared_malloc_slabs ?
+                      settings.shared_malloc_slabs_key : NULL, flags) != 0) {
+        pthread_mutex_unlock(&slabs_map_lock);
+        return size <= old ? 0 : -1;
+    }
+    if (narenas > 1)
+        numa_bind((char *)mem_base + old, size - old, narenas - 1);
+    if (region_get(REGION_SLABS) != NULL) {
+        backup_regions_hold();
+        region_resize(REGION_SLABS, size);
+        backup_region_resized(REGION_SLABS);
+        backup_regions_release();
+    }
+
+    pthread_mutex_lock(&slabs_lock);
+    arenas[narenas - 1].avail += size - old;
+    mem_mapped = size;
+    if (commit_chunks != NULL) {
+        commit_nchunks = (size + COMMIT_CHUNK_SIZE - 1) / COMMIT_CHUNK_SIZE;
+        /* a chunk committed up to the old end is committed again in full */
+        c = old / COMMIT_CHUNK_SIZE;
+        if (old % COMMIT_CHUNK_SIZE != 0 &&
+            __sync_bool_compare_and_swap(&commit_chunks[c], CHUNK_COMMITTED, CHUNK_UNCOMMITTED))
+            __sync_fetch_and_sub(&commit_done, 1);
+    }
+    pthread_mutex_unlock(&slabs_lock);
+    pthread_mutex_unlock(&slabs_map_lock);
+    return 0;
+}
+
+int slabs_adopt(const size_t size) {
+    if (mem_base == NULL || size > mem_reserved)
+        return -1;
+    return slabs_map(size);
+}
+
+/**
+ * Determines the chunk sizes and initializes the slab class descriptors
+ * accordingly.
+ */
+/* Sizes the reserve and the slab lists region for a limit of limit bytes */
+static void slabs_sizes_init(const size_t limit) {
+    mem_reserved = settings.memlimit_max > limit ? settings.memlimit_max : limit;
+    /* room for the lists of every page memlimit may map */
+    mem_slabs_lists_size = sizeof(slabs_meta) + (4 * (2 * (mem_reserved / settings.item_size_max) +
+        MAX_NUMBER_OF_SLAB_CLASSES) + 32 * MAX_NUMBER_OF_SLAB_CLASSES) * sizeof(item_ref);
+}
+
+/* Sets the chunk size and the chunks per page of every slab class */
+static void slabs_classes_init(const double factor, const bool verbose) {
+    int i = POWER_SMALLEST - 1;
+    unsigned int size = sizeof(item) + settings.chunk_size;
 
     memset(slabclass, 0, sizeof(slabclass));
     while (++i < MAX_NUMBER_OF_SLAB_CLASSES-1 && size <= settings.item_size_max / factor) {
@@ -143,7 +462,7 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc) {
         slabclass[i].size = size;
         slabclass[i].perslab = settings.item_size_max / slabclass[i].size;
         size *= factor;
-        if (settings.verbose > 1) {
+        if (verbose) {
             fprintf(stderr, "slab class %3d: chunk size %9u perslab %7u\n",
                     i, slabclass[i].size, slabclass[i].perslab);
         }
@@ -152,10 +471,69 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc) {
     power_largest = i;
     slabclass[power_largest].size = settings.item_size_max;
     slabclass[power_largest].perslab = 1;
-    if (settings.verbose > 1) {
+    if (verbose) {
         fprintf(stderr, "slab class %3d: chunk size %9u perslab %7u\n",
                 i, slabclass[i].size, slabclass[i].perslab);
     }
+}
+
+void slabs_init(const size_t limit, const double factor, const bool prealloc) {
+    mem_limit = limit;
+    mem_mapped = limit;
+    slabs_sizes_init(limit);
+
+    if (prealloc) {
+        /* Allocate everything in a big chunk with malloc */
+        if (settings.shared_malloc_slabs) {
+            mem_base = slabs_map_base();
+            mem_slabs_lists_base = shared_malloc(NULL, mem_slabs_lists_size, settings.shared_malloc_slabs_lists_key, NO_LOCK);     /* TODO: probably add lock */
+            if (mem_base != NULL && mem_slabs_lists_base != NULL) {
+                region_register(REGION_SLABS, mem_base, mem_limit,
+                                settings.shared_malloc_slabs_key);
+                region_reserve(REGION_SLABS, mem_reserved);
+                /* a full sync only sends the pages handed out, see
+                 * memory_allocate, however large the rest is */
+                region_set_sparse(REGION_SLABS);
+                region_register(REGION_SLABS_LISTS, mem_slabs_lists_base,
+                                mem_slabs_lists_size,
+                                settings.shared_malloc_slabs_lists_key);
+            }
+        } else {
+            mem_base = slabs_map_base();
+            mem_slabs_lists_base = malloc(mem_slabs_lists_size);
+        }
+        if (mem_base != NULL) {
+            slabs_arenas_init();
+            item_ref_base = mem_base;
+            if (settings.lazy_prealloc) {
+                commit_nchunks = (mem_limit + COMMIT_CHUNK_SIZE - 1) / COMMIT_CHUNK_SIZE;
+                commit_chunks = calloc((mem_reserved + COMMIT_CHUNK_SIZE - 1) / COMMIT_CHUNK_SIZE,
+                                       sizeof(uint8_t));
+                if (commit_chunks == NULL) {
+                    fprintf(stderr, "Failed to allocate the slab commit map\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            /* pages are only given back one at a time with slab_reassign */
+            if (settings.slab_reassign) {
+                released = calloc(mem_reserved / settings.item_size_max + 1, sizeof(char *));
+                if (released == NULL) {
+                    fprintf(stderr, "Failed to allocate the released page list\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            /* the lists go after the header */
+            meta = mem_slabs_lists_base;
+            mem_slabs_lists_current = (char *)mem_slabs_lists_base + sizeof(slabs_meta);
+            mem_slabs_lists_avail = mem_slabs_lists_size - sizeof(slabs_meta);
+        } else {
+            fprintf(stderr, "Warning: Failed to allocate requested memory in"
+                    " one large chunk.\nWill allocate in smaller chunks\n");
+        }
+    }
+
+    slabs_classes_init(factor, settings.verbose > 1);
     /* for the test suite:  faking of how much we've already malloc'd */
     {
         char *t_initial_malloc = getenv("T_MEMD_INITIAL_MALLOC");
@@ -164,11 +542,380 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc) {
         }
 
     }
+    if (meta != NULL && settings.warm_restart) {
+        if (slabs_attach() == 0) {
+            warm = true;
+            return;
+        }
+        fprintf(stderr, "Warm restart: the shared memory of the last run can't "
+                "be reattached, starting empty\n");
+    }
+    if (meta != NULL) {
+        slabs_meta_init();
+    }
+
     if (prealloc) {
         slabs_preallocate(power_largest);
     }
 }
 
+/* Starts an empty header, for the memory used from scratch */
+static void slabs_meta_init(void) {
+    int i;
+
+    memset(meta, 0, sizeof(slabs_meta));
+    meta->mem_limit = mem_limit;
+    meta->item_size_max = settings.item_size_max;
+    meta->lists_used = sizeof(slabs_meta);
+    meta->process_started = process_started;
+    meta->slab_reassign = settings.slab_reassign;
+    meta->power_largest = power_largest;
+    for (i = POWER_SMALLEST; i <= power_largest; i++) {
+        meta->classes[i].size = slabclass[i].size;
+        meta->classes[i].perslab = slabclass[i].perslab;
+    }
+    meta->magic = SLABS_META_MAGIC;
+    region_mark_dirty(meta, sizeof(slabs_meta));
+}
+
+/* Records the slab list of class id in the header, with the slabs_lock held */
+static void slabs_meta_class(const unsigned int id) {
+    slabclass_t *p = &slabclass[id];
+
+    if (meta == NULL)
+        return;
+    meta->classes[id].slabs = p->slabs;
+    meta->classes[id].list_size = p->list_size;
+    meta->classes[id].list = p->slab_list == NULL ? 0 :
+        (char *)p->slab_list - (char *)mem_slabs_lists_base;
+    meta->mem_malloced = mem_malloced;
+    meta->mem_used = slabs_arenas_used();
+    meta->lists_used = (char *)mem_slabs_lists_current - (char *)mem_slabs_lists_base;
+    region_mark_dirty(meta, sizeof(slabs_meta));
+}
+
+void slabs_meta_update(void) {
+    if (meta == NULL)
+        return;
+    meta->hashpower = hashpower;
+    meta->oldest_live = settings.oldest_live;
+    meta->oldest_cas = settings.oldest_cas;
+    region_mark_dirty(meta, sizeof(slabs_meta));
+}
+
+unsigned int slabs_warm_hashpower(void) {
+    return warm ? meta->hashpower : 0;
+}
+
+bool slabs_holds(const void *ptr, const size_t len) {
+    uintptr_t off = (uintptr_t)ptr - (uintptr_t)mem_base;
+
+    return mem_base != NULL && (uintptr_t)ptr >= (uintptr_t)mem_base &&
+        off <= mem_mapped && len <= mem_mapped - off;
+}
+
+bool slabs_replica_clock(rel_time_t *now, rel_time_t *oldest_live, uint64_t *oldest_cas) {
+    int64_t started;
+
+    if (meta == NULL || meta->magic != SLABS_META_MAGIC)
+        return false;
+    /* the item times count from the primary's start, ours from our own */
+    started = meta->process_started;
+    if ((int64_t)current_time + process_started < started)
+        return false;
+    *now = (rel_time_t)(current_time + process_started - started);
+    *oldest_live = meta->oldest_live;
+    *oldest_cas = meta->oldest_cas;
+    return true;
+}
+
+static int restore_page_cmp(const void *a, const void *b) {
+    const restore_page *x = a, *y = b;
+    return x->page < y->page ? -1 : x->page > y->page;
+}
+
+/* The bytes of a slab page of class id */
+static size_t slabs_page_size(const unsigned int id) {
+    return settings.slab_reassign ? settings.item_size_max
+        : slabclass[id].size * slabclass[id].perslab;
+}
+
+/*
+ * Puts the free pages below the current end of the arenas on the released
+ * list: the pages the last run gave back, and those the arenas of another
+ * layout left between theirs. They only hold pages of item_size_max.
+ */
+static void slabs_attach_released(void) {
+    size_t len = settings.item_size_max;
+    unsigned int x = 0;
+    char *gap = mem_base;
+    int k;
+
+    if (released == NULL)
+        return;
+    for (k = 0; k < narenas; k++) {
+        /* past a page that ran into this arena */
+        if (gap < arenas[k].base)
+            gap = arenas[k].base;
+        for (; x <= restore_npages; x++) {
+            char *next = x < restore_npages ? restore_pages[x].page : arenas[k].current;
+            if (next > arenas[k].current)
+                next = arenas[k].current;
+            for (; gap + len <= next; gap += len)
+                released[released_count++] = gap;
+            if (x == restore_npages || restore_pages[x].page >= arenas[k].current)
+                break;
+            if (restore_pages[x].page + len > gap)
+                gap = restore_pages[x].page + len;
+        }
+    }
+}
+
+/*
+ * Checks that the header m matches this configuration and that its slab
+ * lists lie in the used part of the region. Returns 0 if it does.
+ */
+static int slabs_meta_check(const slabs_meta *m) {
+    unsigned int i;
+
+    if (m->magic != SLABS_META_MAGIC ||
+        m->item_size_max != (uint64_t)settings.item_size_max ||
+        m->slab_reassign != settings.slab_reassign ||
+        m->power_largest != (uint32_t)power_largest ||
+        m->mem_used > mem_reserved || m->mem_malloced > mem_reserved ||
+        m->lists_used < sizeof(slabs_meta) || m->lists_used > mem_slabs_lists_size ||
+        m->hashpower < 12 || m->hashpower > 64) {
+        return -1;
+    }
+    for (i = POWER_SMALLEST; i <= power_largest; i++) {
+        if (m->classes[i].size != slabclass[i].size ||
+            m->classes[i].perslab != slabclass[i].perslab ||
+            m->classes[i].slabs > m->classes[i].list_size ||
+            (m->classes[i].list_size != 0 &&
+             (m->classes[i].list < sizeof(slabs_meta) ||
+              m->classes[i].list + m->classes[i].list_size * sizeof(item_ref) > m->lists_used))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Takes the slab classes from the header of the last run, once it is known
+ * to match this configuration and its slab lists to hold up: every page in
+ * the used memory and in no more than one list. The mem_limit of the last
+ * run may differ: its pages must fit in mem_reserved, and if they are more
+ * than mem_limit the maintenance thread gives the extra ones back.
+ * Returns 0 on success.
+ */
+static int slabs_attach(void) {
+    unsigned int i, x, n = 0;
+    int k;
+
+    if (slabs_meta_check(meta) != 0)
+        return -1;
+    for (i = POWER_SMALLEST; i <= power_largest; i++)
+        n += meta->classes[i].slabs;
+    /* the last run raised mem_limit past ours */
+    if (meta->mem_used > mem_mapped && slabs_map(meta->mem_used) != 0)
+        return -1;
+
+    restore_pages = calloc(n + 1, sizeof(restore_page));
+    if (restore_pages == NULL)
+        return -1;
+    for (i = POWER_SMALLEST; i <= power_largest; i++) {
+        item_ref *list = (item_ref *)((char *)mem_slabs_lists_base + meta->classes[i].list);
+        for (x = 0; x < meta->classes[i].slabs; x++) {
+            restore_pages[restore_npages].page = item_ref_ptr(list[x]);
+            restore_pages[restore_npages++].id = i;
+        }
+    }
+    qsort(restore_pages, restore_npages, sizeof(restore_page), restore_page_cmp);
+    for (x = 0; x < restore_npages; x++) {
+        char *page = restore_pages[x].page;
+        char *end = page + slabs_page_size(restore_pages[x].id);
+        if (page < (char *)mem_base || end > (char *)mem_base + meta->mem_used ||
+            (x + 1 < restore_npages && end > restore_pages[x + 1].page)) {
+            free(restore_pages);
+            restore_pages = NULL;
+            restore_npages = 0;
+            return -1;
+        }
+    }
+
+    for (i = POWER_SMALLEST; i <= power_largest; i++) {
+        slabclass_t *p = &slabclass[i];
+        p->slabs = meta->classes[i].slabs;
+        p->list_size = meta->classes[i].list_size;
+        if (p->list_size != 0)
+            p->slab_list = (item_ref *)((char *)mem_slabs_lists_base + meta->classes[i].list);
+    }
+    mem_malloced = meta->mem_malloced;
+    /* each arena goes on after the last of its pages, whatever the arenas
+     * of the last run were */
+    for (x = 0; x < restore_npages; x++) {
+        slabs_arena *a = &arenas[arena_of(restore_pages[x].page)];
+        char *end = restore_pages[x].page + slabs_page_size(restore_pages[x].id);
+        if (end > a->current)
+            a->current = end;
+    }
+    for (k = 0; k < narenas; k++) {
+        char *limit = k + 1 < narenas ? arenas[k + 1].base : (char *)mem_base + mem_mapped;
+        /* a page that runs into the next arena */
+        if (arenas[k].current > limit) {
+            if (arenas[k].current > arenas[k + 1].current)
+                arenas[k + 1].current = arenas[k].current;
+            arenas[k].current = limit;
+        }
+        arenas[k].avail = limit - arenas[k].current;
+    }
+    slabs_attach_released();
+    mem_slabs_lists_current = (char *)mem_slabs_lists_base + meta->lists_used;
+    mem_slabs_lists_avail = mem_slabs_lists_size - meta->lists_used;
+    process_started = meta->process_started;
+    settings.oldest_live = meta->oldest_live;
+    settings.oldest_cas = meta->oldest_cas;
+    return 0;
+}
+
+int slabs_standby_check(const double factor) {
+    const slabs_meta *m;
+    int ret;
+
+    slabs_sizes_init(settings.maxbytes);
+    slabs_classes_init(factor, false);
+    m = shared_attach(sizeof(slabs_meta), settings.shared_malloc_slabs_lists_key);
+    if (m == NULL) {
+        fprintf(stderr, "Standby: can't attach the slab lists %s\n",
+                settings.shared_malloc_slabs_lists_key);
+        return -1;
+    }
+    /* the running instance changes the header meanwhile, but not the part
+     * that tells whether we could take over */
+    if ((ret = slabs_meta_check(m)) != 0) {
+        fprintf(stderr, "Standby: the slabs of the running instance don't match "
+                "this configuration, a takeover would start empty\n");
+    } else {
+        fprintf(stderr, "Standby: following %llu MB of slabs\n",
+                (unsigned long long)m->mem_used / (1024 * 1024));
+    }
+    shared_free((void *)m, sizeof(slabs_meta));
+    return ret;
+}
+
+/* A restoring thread's share of the freelists, spliced in at the end */
+typedef struct {
+    pthread_t tid;
+    item *slots[MAX_NUMBER_OF_SLAB_CLASSES][NUMA_MAX_NODES];
+    item *last[MAX_NUMBER_OF_SLAB_CLASSES][NUMA_MAX_NODES];
+    unsigned int sl_curr[MAX_NUMBER_OF_SLAB_CLASSES];
+    unsigned int free_chunks[NUMA_MAX_NODES];
+    size_t requested[MAX_NUMBER_OF_SLAB_CLASSES];
+    uint64_t items;
+} restore_worker;
+
+static unsigned int restore_next = 0;
+
+static void *slabs_restore_thread(void *arg) {
+    restore_worker *w = arg;
+    void *lrus = item_restore_begin();
+    unsigned int x;
+
+    if (lrus == NULL)
+        return NULL;
+    while ((x = __sync_fetch_and_add(&restore_next, 1)) < restore_npages) {
+        unsigned int id = restore_pages[x].id;
+        slabclass_t *p = &slabclass[id];
+        char *ptr = restore_pages[x].page;
+        unsigned int i;
+
+        /* the page holds memory already, this only records it */
+        slabs_commit(ptr, slabs_page_size(id));
+        for (i = 0; i < p->perslab; i++, ptr += p->size) {
+            item *it = (item *)ptr;
+            int a;
+            if (item_restore(lrus, it, id, p->size)) {
+                w->requested[id] += ITEM_ntotal(it);
+                w->items++;
+                continue;
+            }
+            it->it_flags = ITEM_SLABBED;
+            it->slabs_clsid = 0;
+            it->refcount = 0;
+            it->prev = 0;
+            a = arena_of(it);
+            it->next = item_ref_of(w->slots[id][a]);
+            if (it->next) ITEM_next(it)->prev = item_ref_of(it);
+            else w->last[id][a] = it;
+            w->slots[id][a] = it;
+            w->sl_curr[id]++;
+            w->free_chunks[a]++;
+        }
+        region_mark_backed(REGION_SLABS, restore_pages[x].page, slabs_page_size(id));
+        region_mark_dirty(restore_pages[x].page, slabs_page_size(id));
+    }
+    item_restore_end(lrus);
+    return NULL;
+}
+
+void slabs_restore(const int nthreads) {
+    restore_worker *workers;
+    struct timeval start, end;
+    uint64_t items = 0;
+    int i, id, a, n = 0;
+
+    gettimeofday(&start, NULL);
+    workers = calloc(nthreads, sizeof(restore_worker));
+    if (workers == NULL) {
+        fprintf(stderr, "Warm restart: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&workers[i].tid, NULL, slabs_restore_thread, &workers[i]) != 0)
+            break;
+        n++;
+    }
+    /* with no thread to do it, do it here */
+    if (n == 0)
+        slabs_restore_thread(&workers[n++]);
+    for (i = 0; i < n; i++) {
+        if (workers[i].tid)
+            pthread_join(workers[i].tid, NULL);
+    }
+
+    pthread_mutex_lock(&slabs_lock);
+    for (i = 0; i < n; i++) {
+        restore_worker *w = &workers[i];
+        for (id = POWER_SMALLEST; id <= power_largest; id++) {
+            slabclass_t *p = &slabclass[id];
+            for (a = 0; a < narenas; a++) {
+                if (w->slots[id][a] == NULL)
+                    continue;
+                w->last[id][a]->next = item_ref_of(p->slots[a]);
+                if (p->slots[a]) ((item *)p->slots[a])->prev = item_ref_of(w->last[id][a]);
+                p->slots[a] = w->slots[id][a];
+                region_mark_dirty(w->last[id][a], sizeof(item));
+            }
+            p->sl_curr += w->sl_curr[id];
+        }
+        for (a = 0; a < narenas; a++)
+            arenas[a].free_chunks += w->free_chunks[a];
+        for (id = POWER_SMALLEST; id <= power_largest; id++)
+            slabclass[id].requested += workers[i].requested[id];
+        items += workers[i].items;
+    }
+    pthread_mutex_unlock(&slabs_lock);
+
+    gettimeofday(&end, NULL);
+    fprintf(stderr, "Warm restart: %llu items in %u slab pages restored by %d threads in %ld ms\n",
+            (unsigned long long)items, restore_npages, n,
+            (long)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000));
+    free(workers);
+    free(restore_pages);
+    restore_pages = NULL;
+    restore_npages = 0;
+}
+
 static void slabs_preallocate (const unsigned int maxslabs) {
     int i;
     unsigned int prealloc = 0;
@@ -182,7 +929,7 @@ static void slabs_preallocate (const unsigned int maxslabs) {
     for (i = POWER_SMALLEST; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
         if (++prealloc > maxslabs)
             return;
-        if (do_slabs_newslab(i) == 0) {
+        if (do_slabs_newslab(i, slabs_arena_self(), false) == 0) {
             fprintf(stderr, "Error while preallocating slab memory!\n"
                 "If using -L or other prealloc options, max memory must be "
                 "at least %d megabytes.\n", power_largest);
@@ -202,12 +949,18 @@ static int grow_slab_list (const unsigned int id) {
         {
             fprintf(stderr, "p->slab_list is null\n");
         }
-        fprintf(stderr, "new_size * sizeof(void *) = %zu\n", new_size * sizeof(void *));
-        /* void *new_list = realloc(p->slab_list, new_size * sizeof(void *)); */
-        void *new_list = memory_slabs_lists_allocate(new_size * sizeof(void *));
+        fprintf(stderr, "new_size * sizeof(item_ref) = %zu\n", new_size * sizeof(item_ref));
+        /* void *new_list = realloc(p->slab_list, new_size * sizeof(item_ref)); */
+        void *new_list = memory_slabs_lists_allocate(new_size * sizeof(item_ref));
         if (new_list == 0) return 0;
+        /* the pages already in the list move to the new one */
+        if (p->slabs != 0) {
+            memcpy(new_list, p->slab_list, p->slabs * sizeof(item_ref));
+            region_mark_dirty(new_list, p->slabs * sizeof(item_ref));
+        }
         p->list_size = new_size;
         p->slab_list = new_list;
+        slabs_meta_class(id);
     }
     return 1;
 }
@@ -221,7 +974,11 @@ static void split_slab_page_into_freelist(char *ptr, const unsigned int id) {
     }
 }
 
-static int do_slabs_newslab(const unsigned int id) {
+/*
+ * Adds a page to class id, from the given arena, or if that one is full and
+ * local is false, from another one.
+ */
+static int do_slabs_newslab(const unsigned int id, const int arena, const bool local) {
     slabclass_t *p = &slabclass[id];
     int len = settings.slab_reassign ? settings.item_size_max
         : p->size * p->perslab;
@@ -234,7 +991,7 @@ static int do_slabs_newslab(const unsigned int id) {
     }
 
     if ((grow_slab_list(id) == 0) ||
-        ((ptr = memory_allocate((size_t)len)) == 0)) {
+        ((ptr = memory_allocate((size_t)len, arena, local)) == 0)) {
 
         MEMCACHED_SLABS_SLABCLASS_ALLOCATE_FAILED(id);
         return 0;
@@ -243,8 +1000,11 @@ static int do_slabs_newslab(const unsigned int id) {
     memset(ptr, 0, (size_t)len);
     split_slab_page_into_freelist(ptr, id);
 
-    p->slab_list[p->slabs++] = ptr;
+    p->slab_list[p->slabs++] = item_ref_of(ptr);
     mem_malloced += len;
+    region_mark_dirty(ptr, (size_t)len);
+    region_mark_dirty(&p->slab_list[p->slabs - 1], sizeof(item_ref));
+    slabs_meta_class(id);
     MEMCACHED_SLABS_SLABCLASS_ALLOCATE(id);
 
     return 1;
@@ -255,30 +1015,43 @@ static void *do_slabs_alloc(const size_t size, unsigned int id, unsigned int *to
     slabclass_t *p;
     void *ret = NULL;
     item *it = NULL;
+    int a;
     if (id < POWER_SMALLEST || id > power_largest) {
         MEMCACHED_SLABS_ALLOCATE_FAILED(size, 0);
         return NULL;
     }
     p = &slabclass[id];
-    assert(p->sl_curr == 0 || ((item *)p->slots)->slabs_clsid == 0);
+    a = slabs_arena_self();
+    if (p->sl_curr == 0 || (narenas > 1 && p->slots[a] == NULL))
+        slabs_commit_ahead(id, a);
     *total_chunks = p->slabs * p->perslab;
+    /* a new page in the local arena is worth more than a free chunk in a
+       remote one */
+    if (narenas > 1 && p->slots[a] == NULL && p->sl_curr != 0)
+        do_slabs_newslab(id, a, true);
     /* fail unless we have space at the end of a recently allocated page,
        we have something on our freelist, or we could allocate a new page */
-    if (! (p->sl_curr != 0 || do_slabs_newslab(id) != 0)) {
+    if (! (p->sl_curr != 0 || do_slabs_newslab(id, a, false) != 0)) {
         /* We don't have more memory available */
         ret = NULL;
     } else if (p->sl_curr != 0) {
-        /* return off our freelist */
-        it = (item *)p->slots;
-        p->slots = it->next;
+        /* return off our freelist, the local one unless it is empty */
+        while (p->slots[a] == NULL)
+            a = (a + 1) % narenas;
+        it = (item *)p->slots[a];
+        assert(it->slabs_clsid == 0);
+        p->slots[a] = ITEM_next(it);
         if (it->next) {
-            it->next->prev = 0;
+            ITEM_next(it)->prev = 0;
         }
         /* Kill flag and initialize refcount here for lock safety in slab
          * mover's freeness detection. */
         it->it_flags &= ~ITEM_SLABBED;
         it->refcount = 1;
         p->sl_curr--;
+        arenas[a].free_chunks--;
+        region_mark_dirty(it, sizeof(item));
+        if (it->next) region_mark_dirty(ITEM_next(it), sizeof(item));
         ret = (void *)it;
     }
 
@@ -294,6 +1067,7 @@ static void *do_slabs_alloc(const size_t size, unsigned int id, unsigned int *to
 static void do_slabs_free(void *ptr, const size_t size, unsigned int id) {
     slabclass_t *p;
     item *it;
+    int a;
     assert(id >= POWER_SMALLEST && id <= power_largest);
     if (id < POWER_SMALLEST || id > power_largest)
         return;
@@ -301,15 +1075,20 @@ static void do_slabs_free(void *ptr, const size_t size, unsigned int id) {
     MEMCACHED_SLABS_FREE(size, id, ptr);
     p = &slabclass[id];
 
+    /* back to the freelist of the arena it lives in */
+    a = arena_of(ptr);
     it = (item *)ptr;
     it->it_flags |= ITEM_SLABBED;
     it->slabs_clsid = 0;
     it->prev = 0;
-    it->next = p->slots;
-    if (it->next) it->next->prev = it;
-    p->slots = it;
+    it->next = item_ref_of(p->slots[a]);
+    if (it->next) ITEM_next(it)->prev = item_ref_of(it);
+    p->slots[a] = it;
+    region_mark_dirty(it, sizeof(item));
+    if (it->next) region_mark_dirty(ITEM_next(it), sizeof(item));
 
     p->sl_curr++;
+    arenas[a].free_chunks++;
     p->requested -= size;
     return;
 }
@@ -348,7 +1127,7 @@ bool get_stats(const char *stat_type, int nkey, ADD_STAT add_stats, void *c) {
 }
 
 /*@null@*/
-static void do_slabs_stats(ADD_STAT add_stats, void *c) {
+static void do_slabs_stats(ADD_STAT add_stats, void *c, const size_t *huge_bytes) {
     int i, total;
     /* Get the per-thread stats which contain some interesting aggregates */
     struct thread_stats thread_stats;
@@ -401,6 +1180,36 @@ static void do_slabs_stats(ADD_STAT add_stats, void *c) {
 
     APPEND_STAT("active_slabs", "%d", total);
     APPEND_STAT("total_malloced", "%llu", (unsigned long long)mem_malloced);
+    if (settings.memlimit_max != 0) {
+        APPEND_STAT("mem_limit", "%llu", (unsigned long long)mem_limit);
+        APPEND_STAT("total_mapped", "%llu", (unsigned long long)mem_mapped);
+    }
+    if (released_count > 0 || tails_released)
+        APPEND_STAT("released_pages", "%u", released_count);
+    if (commit_chunks != NULL) {
+        size_t committed = commit_done * (size_t)COMMIT_CHUNK_SIZE;
+        APPEND_STAT("total_committed", "%llu",
+                    (unsigned long long)(committed < mem_mapped ? committed : mem_mapped));
+    }
+    if (narenas > 1) {
+        char key_str[STAT_KEY_LEN];
+        char val_str[STAT_VAL_LEN];
+        int klen = 0, vlen = 0;
+
+        for (i = 0; i < narenas; i++) {
+            slabs_arena *a = &arenas[i];
+            APPEND_NUM_FMT_STAT("arena_%d:%s", i, "node", "%d", numa_node_id(i));
+            APPEND_NUM_FMT_STAT("arena_%d:%s", i, "size", "%llu",
+                                (unsigned long long)(a->current - a->base + a->avail));
+            APPEND_NUM_FMT_STAT("arena_%d:%s", i, "total_malloced", "%llu",
+                                (unsigned long long)(a->current - a->base));
+            APPEND_NUM_FMT_STAT("arena_%d:%s", i, "free_chunks", "%u", a->free_chunks);
+        }
+    }
+    if (huge_bytes != NULL) {
+        APPEND_STAT("slabs_huge_bytes", "%llu", (unsigned long long)huge_bytes[0]);
+        APPEND_STAT("hash_huge_bytes", "%llu", (unsigned long long)huge_bytes[1]);
+    }
     add_stats(NULL, 0, NULL, 0, c);
 }
 
@@ -438,29 +1247,133 @@ static void *memory_slabs_lists_allocate(size_t size) {
     return ret;
 }
 
-static void *memory_allocate(size_t size) {
-    void *ret;
+/*
+ * Takes a released page, of the given arena if there is one, and commits it.
+ * Returns NULL if there is none.
+ */
+static void *released_take(const int arena, const bool local) {
+    unsigned int i = released_count;
+    char *page;
+
+    while (i > 0 && arena_of(released[i - 1]) != arena)
+        i--;
+    if (i == 0) {
+        if (local || released_count == 0)
+            return NULL;
+        i = released_count;
+    }
+    page = released[i - 1];
+    if (shared_commit(page, settings.item_size_max) != 0)
+        return NULL;
+    released[i - 1] = released[--released_count];
+    region_mark_backed(REGION_SLABS, page, settings.item_size_max);
+    return page;
+}
 
+/*
+ * Gives a page taken from its class back to the system, to lower mem_limit.
+ * Called with the slabs_lock held.
+ */
+static void slabs_release_page(char *page) {
+    mem_malloced -= settings.item_size_max;
     if (mem_base == NULL) {
-        /* We are not using a preallocated large memory chunk */
-        ret = malloc(size);
-    } else {
-        ret = mem_current;
+        free(page);
+        return;
+    }
+    shared_release(page, settings.item_size_max);
+    released[released_count++] = page;
+    released_unswept++;
+}
 
-        if (size > mem_avail) {
-            return NULL;
-        }
+/*
+ * Commits the memory the next page of class id would be cut from, with the
+ * slabs_lock dropped meanwhile: committing faults in up to a chunk, or
+ * waits for the thread that does, and the other threads need not wait for
+ * that too. Nothing is handed out here. memory_allocate commits again
+ * under the lock, which is quick once the pages are in, and fails the
+ * allocation if they could not be. Called with the slabs_lock held.
+ */
+static void slabs_commit_ahead(const unsigned int id, const int arena) {
+    slabclass_t *p = &slabclass[id];
+    size_t size = settings.slab_reassign ? settings.item_size_max
+        : p->size * p->perslab;
+    bool tails = tails_released;
+    char *ptr = NULL;
+    size_t c, last;
+    unsigned int i;
 
-        /* mem_current pointer _must_ be aligned!!! */
-        if (size % CHUNK_ALIGN_BYTES) {
+    if (mem_base == NULL || (commit_chunks == NULL && !tails && released_count == 0))
+        return;
+    if (released_count > 0 && size == settings.item_size_max) {
+        /* the page released_take would pick */
+        for (i = released_count; i > 0 && arena_of(released[i - 1]) != arena; i--)
+            ;
+        ptr = released[(i > 0 ? i : released_count) - 1];
+        tails = true;
+    } else {
+        if (size % CHUNK_ALIGN_BYTES)
             size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
+        for (i = 0; i < (unsigned int)narenas; i++) {
+            slabs_arena *a = &arenas[(arena + i) % narenas];
+
+            if (size <= a->avail) {
+                ptr = a->current;
+                break;
+            }
         }
+        if (ptr == NULL)
+            return;
+    }
+    if (!tails) {
+        c = (ptr - (char *)mem_base) / COMMIT_CHUNK_SIZE;
+        last = (ptr + size - 1 - (char *)mem_base) / COMMIT_CHUNK_SIZE;
+        while (c <= last && commit_chunks[c] == CHUNK_COMMITTED)
+            c++;
+        if (c > last)
+            return;
+    }
+    pthread_mutex_unlock(&slabs_lock);
+    if (slabs_commit(ptr, size) == 0 && tails)
+        shared_commit(ptr, size);
+    pthread_mutex_lock(&slabs_lock);
+}
 
-        mem_current = ((char*)mem_current) + size;
-        if (size < mem_avail) {
-            mem_avail -= size;
-        } else {
-            mem_avail = 0;
+static void *memory_allocate(size_t size, const int arena, const bool local) {
+    void *ret = NULL;
+    int i;
+
+    if (mem_base == NULL) {
+        /* We are not using a preallocated large memory chunk */
+        ret = malloc(size);
+    } else if (released_count > 0 && size == settings.item_size_max &&
+               (ret = released_take(arena, local)) != NULL) {
+        return ret;
+    } else {
+        /* the given arena first, then the others in turn */
+        for (i = 0; i < (local ? 1 : narenas); i++) {
+            slabs_arena *a = &arenas[(arena + i) % narenas];
+
+            if (size > a->avail) {
+                continue;
+            }
+            /* current pointer _must_ be aligned!!! */
+            if (size % CHUNK_ALIGN_BYTES) {
+                size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
+            }
+            if (slabs_commit(a->current, size < a->avail ? size : a->avail) != 0 ||
+                (tails_released && shared_commit(a->current, size) != 0)) {
+                break;
+            }
+            ret = a->current;
+            region_mark_backed(REGION_SLABS, ret, size);
+
+            a->current += size;
+            if (size < a->avail) {
+                a->avail -= size;
+            } else {
+                a->avail = 0;
+            }
+            break;
         }
     }
 
@@ -483,8 +1396,19 @@ void slabs_free(void *ptr, size_t size, unsigned int id) {
 }
 
 void slabs_stats(ADD_STAT add_stats, void *c) {
+    size_t huge_bytes[2] = { 0, 0 };
+
+    /* what the kernel actually backs with huge pages. Reading smaps walks
+     * the page tables, so it is done before taking the lock */
+    if (settings.huge_pages) {
+        region_t *r = region_get(REGION_ASSOC);
+        if (mem_base != NULL)
+            huge_bytes[0] = shared_huge_bytes(mem_base, mem_mapped);
+        if (r != NULL)
+            huge_bytes[1] = shared_huge_bytes(r->base, r->size);
+    }
     pthread_mutex_lock(&slabs_lock);
-    do_slabs_stats(add_stats, c);
+    do_slabs_stats(add_stats, c, settings.huge_pages ? huge_bytes : NULL);
     pthread_mutex_unlock(&slabs_lock);
 }
 
@@ -531,16 +1455,17 @@ static int slab_rebalance_start(void) {
 
     pthread_mutex_lock(&slabs_lock);
 
+    /* a d_clsid of 0 gives the page back, see slabs_release_page */
     if (slab_rebal.s_clsid < POWER_SMALLEST ||
         slab_rebal.s_clsid > power_largest  ||
-        slab_rebal.d_clsid < POWER_SMALLEST ||
+        (slab_rebal.d_clsid < POWER_SMALLEST && slab_rebal.d_clsid != 0) ||
         slab_rebal.d_clsid > power_largest  ||
         slab_rebal.s_clsid == slab_rebal.d_clsid)
         no_go = -2;
 
     s_cls = &slabclass[slab_rebal.s_clsid];
 
-    if (!grow_slab_list(slab_rebal.d_clsid)) {
+    if (slab_rebal.d_clsid != 0 && !grow_slab_list(slab_rebal.d_clsid)) {
         no_go = -1;
     }
 
@@ -554,7 +1479,7 @@ static int slab_rebalance_start(void) {
 
     s_cls->killing = 1;
 
-    slab_rebal.slab_start = s_cls->slab_list[s_cls->killing - 1];
+    slab_rebal.slab_start = item_ref_ptr(s_cls->slab_list[s_cls->killing - 1]);
     slab_rebal.slab_end   = (char *)slab_rebal.slab_start +
         (s_cls->size * s_cls->perslab);
     slab_rebal.slab_pos   = slab_rebal.slab_start;
@@ -618,12 +1543,16 @@ static int slab_rebalance_move(void) {
             /* ITEM_SLABBED can only be added/removed under the slabs_lock */
             if (it->it_flags & ITEM_SLABBED) {
                 /* remove from slab freelist */
-                if (s_cls->slots == it) {
-                    s_cls->slots = it->next;
+                int a = arena_of(it);
+                if (s_cls->slots[a] == it) {
+                    s_cls->slots[a] = ITEM_next(it);
                 }
-                if (it->next) it->next->prev = it->prev;
-                if (it->prev) it->prev->next = it->next;
+                if (it->next) ITEM_next(it)->prev = it->prev;
+                if (it->prev) ITEM_prev(it)->next = it->next;
+                if (it->next) region_mark_dirty(ITEM_next(it), sizeof(item));
+                if (it->prev) region_mark_dirty(ITEM_prev(it), sizeof(item));
                 s_cls->sl_curr--;
+                arenas[a].free_chunks--;
                 status = MOVE_FROM_SLAB;
             } else if ((it->it_flags & ITEM_LINKED) != 0) {
                 /* If it doesn't have ITEM_SLABBED, the item could be in any
@@ -679,6 +1608,7 @@ static int slab_rebalance_move(void) {
                 it->refcount = 0;
                 it->it_flags = 0;
                 it->slabs_clsid = 255;
+                region_mark_dirty(it, sizeof(item));
                 break;
             case MOVE_BUSY:
             case MOVE_LOCKED:
@@ -721,14 +1651,24 @@ static void slab_rebalance_finish(void) {
     /* At this point the stolen slab is completely clear */
     s_cls->slab_list[s_cls->killing - 1] =
         s_cls->slab_list[s_cls->slabs - 1];
+    region_mark_dirty(&s_cls->slab_list[s_cls->killing - 1], sizeof(item_ref));
     s_cls->slabs--;
     s_cls->killing = 0;
 
-    memset(slab_rebal.slab_start, 0, (size_t)settings.item_size_max);
-
-    d_cls->slab_list[d_cls->slabs++] = slab_rebal.slab_start;
-    split_slab_page_into_freelist(slab_rebal.slab_start,
-        slab_rebal.d_clsid);
+    if (slab_rebal.d_clsid == 0) {
+        /* in no list, the backups need not get it */
+        slabs_release_page(slab_rebal.slab_start);
+    } else {
+        memset(slab_rebal.slab_start, 0, (size_t)settings.item_size_max);
+
+        d_cls->slab_list[d_cls->slabs++] = item_ref_of(slab_rebal.slab_start);
+        split_slab_page_into_freelist(slab_rebal.slab_start,
+            slab_rebal.d_clsid);
+        region_mark_dirty(slab_rebal.slab_start, (size_t)settings.item_size_max);
+        region_mark_dirty(&d_cls->slab_list[d_cls->slabs - 1], sizeof(item_ref));
+        slabs_meta_class(slab_rebal.d_clsid);
+    }
+    slabs_meta_class(slab_rebal.s_clsid);
 
     slab_rebal.done       = 0;
     slab_rebal.s_clsid    = 0;
@@ -819,6 +1759,163 @@ static int slab_automove_decision(int *src, int *dst) {
     return 0;
 }
 
+static pthread_mutex_t slab_maintenance_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slab_maintenance_cond = PTHREAD_COND_INITIALIZER;
+
+/* Sleeps for usec, or until slabs_set_limit wakes the thread up */
+static void slab_maintenance_sleep(const long usec) {
+    struct timeval now;
+    struct timespec until;
+
+    gettimeofday(&now, NULL);
+    until.tv_sec = now.tv_sec + (now.tv_usec + usec) / 1000000;
+    until.tv_nsec = (now.tv_usec + usec) % 1000000 * 1000;
+    pthread_mutex_lock(&slab_maintenance_lock);
+    if (mem_limit_target == 0 && do_run_slab_thread)
+        pthread_cond_timedwait(&slab_maintenance_cond, &slab_maintenance_lock, &until);
+    pthread_mutex_unlock(&slab_maintenance_lock);
+}
+
+enum memlimit_result_type slabs_set_limit(const size_t limit) {
+    enum memlimit_result_type ret = MEMLIMIT_OK;
+
+    pthread_mutex_lock(&slabs_lock);
+    if (limit < (size_t)power_largest * settings.item_size_max)
+        ret = MEMLIMIT_TOO_SMALL;
+    else if (mem_base != NULL && limit > mem_reserved)
+        ret = MEMLIMIT_TOO_LARGE;
+    else if (limit < mem_malloced && !settings.slab_reassign)
+        ret = MEMLIMIT_NO_REASSIGN;
+    else
+        mem_limit_target = limit;
+    pthread_mutex_unlock(&slabs_lock);
+    if (ret == MEMLIMIT_OK) {
+        pthread_mutex_lock(&slab_maintenance_lock);
+        pthread_cond_signal(&slab_maintenance_cond);
+        pthread_mutex_unlock(&slab_maintenance_lock);
+    }
+    return ret;
+}
+
+/*
+ * Gives the tails of the arenas back, from their end, a step at a time so
+ * that the allocations are not held up for long
+ */
+static void slabs_release_tails(void) {
+    const size_t step = 64 * 1024 * 1024;
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    char *start, *end;
+    int k;
+
+    for (k = 0; k < narenas; k++) {
+        pthread_mutex_lock(&slabs_lock);
+        tails_released = true;
+        end = arenas[k].current + arenas[k].avail;
+        pthread_mutex_unlock(&slabs_lock);
+        for (;;) {
+            pthread_mutex_lock(&slabs_lock);
+            start = arenas[k].current;
+            if ((size_t)(end - start) > step)
+                start = end - step;
+            start = (char *)(((unsigned long)start + page - 1) & ~(page - 1));
+            if (start < end)
+                shared_release(start, end - start);
+            end = start;
+            pthread_mutex_unlock(&slabs_lock);
+            if (end <= arenas[k].current)
+                break;
+        }
+    }
+}
+
+/*
+ * Applies the limit set by slabs_set_limit: maps the memory it needs, or if
+ * it is lower, gives the tails of the arenas back. The pages over it are
+ * given back by the rebalancer, see slabs_shrink_source.
+ */
+static void slabs_apply_limit(void) {
+    size_t target = mem_limit_target, old;
+
+    if (target == 0)
+        return;
+    if (mem_base != NULL && slabs_map(target) != 0) {
+        fprintf(stderr, "memlimit: can't map %zu MB of slabs, the limit stays %zu MB\n",
+                target / (1024 * 1024), mem_limit / (1024 * 1024));
+        __sync_bool_compare_and_swap(&mem_limit_target, target, 0);
+        return;
+    }
+    pthread_mutex_lock(&slabs_lock);
+    old = mem_limit;
+    mem_limit = target;
+    settings.maxbytes = target;
+    if (mem_limit > old)
+        mem_limit_reached = false;
+    if (meta != NULL) {
+        meta->mem_limit = mem_limit;
+        region_mark_dirty(meta, sizeof(slabs_meta));
+    }
+    pthread_mutex_unlock(&slabs_lock);
+    /* a newer limit is applied next time */
+    __sync_bool_compare_and_swap(&mem_limit_target, target, 0);
+    if (mem_base != NULL && target < old)
+        slabs_release_tails();
+    if (settings.verbose > 0)
+        fprintf(stderr, "memlimit: the limit is %zu MB\n", target / (1024 * 1024));
+}
+
+/*
+ * Returns the class to take a page from while mem_malloced is over the
+ * limit, the one with the most pages, or 0 if there is none to take
+ */
+static int slabs_shrink_source(void) {
+    unsigned int most = 1;
+    int i, src = 0;
+
+    if (!settings.slab_reassign)
+        return 0;
+    pthread_mutex_lock(&slabs_lock);
+    if (mem_malloced > mem_limit) {
+        for (i = POWER_SMALLEST; i <= power_largest; i++) {
+            if (slabclass[i].slabs > most) {
+                most = slabclass[i].slabs;
+                src = i;
+            }
+        }
+    }
+    pthread_mutex_unlock(&slabs_lock);
+    return src;
+}
+
+/*
+ * Gives the released pages back again once a shrink is over. A file system
+ * with large folios may only zero a page punched out of the middle of one,
+ * and write it back later, which allocates its blocks again.
+ */
+static void slabs_released_sweep(void) {
+    unsigned int i;
+
+    pthread_mutex_lock(&slabs_lock);
+    if (released_unswept > 0 && mem_base != NULL) {
+        for (i = 0; i < released_count; i++)
+            shared_release(released[i], settings.item_size_max);
+    }
+    released_unswept = 0;
+    pthread_mutex_unlock(&slabs_lock);
+}
+
+/* Has the rebalancer give a page of class src back, unless it is busy */
+static void slabs_reassign_release(const int src) {
+    if (pthread_mutex_trylock(&slabs_rebalance_lock) != 0)
+        return;
+    if (slab_rebalance_signal == 0) {
+        slab_rebal.s_clsid = src;
+        slab_rebal.d_clsid = 0;
+        slab_rebalance_signal = 1;
+        pthread_cond_signal(&slab_rebalance_cond);
+    }
+    pthread_mutex_unlock(&slabs_rebalance_lock);
+}
+
 /* Slab rebalancer thread.
  * Does not use spinlocks since it is not timing sensitive. Burn less CPU and
  * go to sleep if locks are contended
@@ -827,16 +1924,25 @@ static void *slab_maintenance_thread(void *arg) {
     int src, dest;
 
     while (do_run_slab_thread) {
-        if (settings.slab_automove == 1) {
+        slabs_apply_limit();
+        if ((src = slabs_shrink_source()) != 0) {
+            /* the pages over a lowered limit go one at a time */
+            slabs_reassign_release(src);
+            slab_maintenance_sleep(1000);
+            continue;
+        }
+        if (released_unswept > 0 && slab_rebalance_signal == 0)
+            slabs_released_sweep();
+        /* runs for memlimit_max alone too, which moves no pages */
+        if (settings.slab_automove == 1 && settings.slab_reassign) {
             if (slab_automove_decision(&src, &dest) == 1) {
                 /* Blind to the return codes. It will retry on its own */
                 slabs_reassign(src, dest);
             }
-            sleep(1);
+            slab_maintenance_sleep(1000000);
         } else {
-            /* Don't wake as often if we're not enabled.
-             * This is lazier than setting up a condition right now. */
-            sleep(5);
+            /* Don't wake as often if we're not enabled. */
+            slab_maintenance_sleep(5000000);
         }
     }
     return NULL;
@@ -988,6 +2094,9 @@ void stop_slab_maintenance_thread(void) {
     do_run_slab_rebalance_thread = 0;
     pthread_cond_signal(&slab_rebalance_cond);
     pthread_mutex_unlock(&slabs_rebalance_lock);
+    pthread_mutex_lock(&slab_maintenance_lock);
+    pthread_cond_signal(&slab_maintenance_cond);
+    pthread_mutex_unlock(&slab_maintenance_lock);
 
     /* Wait for the maintenance thread to stop */
     pthread_join(maintenance_tid, NULL);
@@ -54,4 +54,66 @@ enum reassign_result_type slabs_reassign(int src, int dst);
 void slabs_rebalancer_pause(void);
 void slabs_rebalancer_resume(void);
 
+enum memlimit_result_type {
+    MEMLIMIT_OK=0, MEMLIMIT_TOO_SMALL, MEMLIMIT_TOO_LARGE, MEMLIMIT_NO_REASSIGN
+};
+
+/*
+ * Changes the memory limit at runtime (the memlimit command). The slab
+ * maintenance thread applies it: a higher limit than the preallocated memory
+ * maps more of the address space reserved for memlimit_max, and a lower one
+ * gives the memory over it back to the system, the unused tails of the arenas
+ * and then, with slab_reassign, whole pages taken from the classes by the
+ * rebalancer (their items are evicted).
+ */
+enum memlimit_result_type slabs_set_limit(const size_t limit);
+
+/*
+ * Grows the preallocated slabs to size bytes, within memlimit_max, for a
+ * backup whose primary raised its limit. Returns 0 on success.
+ */
+int slabs_adopt(const size_t size);
+
+/*
+ * Warm restart. With warm_restart, slabs_init reattaches the slabs left in the
+ * shared memory by the last run, as recorded in a header at the start of the
+ * slab lists region. slabs_warm_hashpower returns the hashpower of that run,
+ * or 0 if the memory was started from scratch.
+ */
+unsigned int slabs_warm_hashpower(void);
+
+/*
+ * For a backup serving reads from the replicated slabs (see item_read):
+ * slabs_holds tells whether [ptr, ptr + len) lies in the mapped slab memory,
+ * and slabs_replica_clock gives the current time and the flush_all marks of
+ * the primary, from the replicated header. It returns false if there is no
+ * header yet.
+ */
+bool slabs_holds(const void *ptr, const size_t len);
+bool slabs_replica_clock(rel_time_t *now, rel_time_t *oldest_live, uint64_t *oldest_cas);
+
+/*
+ * For a standby: checks, read-only, that the slabs header of the running
+ * instance matches this configuration (the chunk sizes from factor), so that
+ * a takeover reattaches them. Called before slabs_init. Returns 0 if it does.
+ */
+int slabs_standby_check(const double factor);
+
+/*
+ * Checks every chunk of the reattached slabs with nthreads threads, relinking
+ * the valid items into the hash table and the LRUs and putting the rest on the
+ * freelists. Called once, before any thread walks or moves the items.
+ */
+void slabs_restore(const int nthreads);
+
+/*
+ * Starts nthreads threads that commit the slab memory left sparse by
+ * lazy_prealloc from its start, ahead of the allocations. They exit when it
+ * is all committed.
+ */
+int slabs_prefault_start(const int nthreads);
+
+/* Records hashpower and flush_all's oldest_live in the header, for a warm restart */
+void slabs_meta_update(void);
+
 #endif
@@ -0,0 +1,36 @@
+#!/usr/bin/perl
+
+use strict;
+use Test::More tests => 9;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# The LOOP transport acknowledges every sync in-process, so the primary side
+# of the replication can be tested without a backup.
+my $server = new_memcached("-o failover_dest=loop,failover_src=loop,failover_comm_type=LOOP,failover_mode=oplog");
+my $sock = $server->sock;
+
+my $stored = 0;
+for my $i (1..100) {
+    print $sock "set key$i 0 0 5\r\nvalue\r\n";
+    $stored++ if scalar <$sock> eq "STORED\r\n";
+}
+is($stored, 100, "stored 100 keys");
+print $sock "delete key1\r\n";
+is(scalar <$sock>, "DELETED\r\n", "deleted key1");
+
+my $stats;
+for (1..50) {
+    $stats = mem_stats($sock, "backups");
+    last if $stats->{"0:acked_sync"} > 0 && $stats->{"0:pending_log_bytes"} == 0;
+    select undef, undef, undef, 0.1;
+}
+
+is($stats->{"0:addr"}, "loop", "backup address reported");
+is($stats->{"0:state"}, "connected", "loopback backup connected");
+ok($stats->{"0:syncs"} > 0, "syncs were sent");
+ok($stats->{"0:acked_sync"} > 0, "syncs were acknowledged");
+ok($stats->{"0:bytes_sent"} > 100 * 5, "the log records were sent");
+is($stats->{"0:pending_log_bytes"}, 0, "nothing left to send");
+is($stats->{"0:reconnects"}, 0, "no reconnects");
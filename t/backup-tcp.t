@@ -0,0 +1,173 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 33;
+use File::Compare;
+use File::Temp qw(tempdir);
+use IO::Select;
+use IO::Socket::INET;
+use Time::HiRes qw(time);
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# A primary replicating to a backup over TCP, through a proxy the test can
+# take down to cut the connection. Both keep their sections in files of
+# the same directory, so the test can compare them.
+my $dir = tempdir(CLEANUP => 1);
+my $proxy_port = free_port();
+my $repl_port = free_port();
+my $common = "-m 64 -L -o hashpower=13,shared_malloc_dir=$dir";
+
+# Forwards the connections to the backup, in a process group of its own
+sub start_proxy {
+    my $pid = fork();
+    die "fork: $!" unless defined $pid;
+    return $pid if $pid;
+    setpgrp(0, 0);
+    my $listen = IO::Socket::INET->new(LocalAddr => "127.0.0.1:$proxy_port",
+                                       Listen => 5, ReuseAddr => 1) or exit 1;
+    while (my $client = $listen->accept) {
+        next if fork();
+        my $server = IO::Socket::INET->new(PeerAddr => "127.0.0.1:$repl_port")
+            or exit 1;
+        my $sel = IO::Select->new($client, $server);
+        while (my @ready = $sel->can_read) {
+            for my $from (@ready) {
+                my $to = $from == $client ? $server : $client;
+                my $n = sysread($from, my $buf, 65536);
+                exit 0 unless $n;
+                for (my $off = 0; $off < $n; ) {
+                    my $w = syswrite($to, $buf, $n - $off, $off);
+                    exit 0 unless $w;
+                    $off += $w;
+                }
+            }
+        }
+        exit 0;
+    }
+    exit 0;
+}
+
+sub stop_proxy {
+    my $pid = shift;
+    kill 'KILL', -$pid;
+    waitpid($pid, 0);
+}
+
+my $backup = new_memcached("$common,shared_malloc_assoc=ba,shared_malloc_slabs=bs," .
+                           "shared_malloc_slabs_lists=bl,failover_comm_type=TCP," .
+                           "failover_src=127.0.0.1:$repl_port,failover_serve_reads," .
+                           "failover_dest=127.0.0.1:" . free_port());
+my $proxy = start_proxy();
+# Every conn is semisync, but the test's main one turns it off until needed
+my $port = free_port();
+my $primary = new_memcached("$common,shared_malloc_assoc=pa,shared_malloc_slabs=ps," .
+                            "shared_malloc_slabs_lists=pl,failover_comm_type=TCP," .
+                            "failover_dest=127.0.0.1:$proxy_port," .
+                            "failover_src=127.0.0.1:" . free_port() . "," .
+                            "failover_semisync_acks=1,failover_semisync_timeout_ms=300," .
+                            "failover_semisync_port=$port,failover_compress", $port);
+my $sock = $primary->sock;
+print $sock "semisync off\r\n";
+<$sock>;
+
+sub wait_backups {
+    my $cond = shift;
+    my $stats;
+    for (1..100) {
+        $stats = mem_stats($sock, "backups");
+        last if $cond->($stats);
+        select undef, undef, undef, 0.1;
+    }
+    return $stats;
+}
+
+sub synced {
+    my $stats = shift;
+    return $stats->{"0:state"} eq "connected" && $stats->{"0:acked_sync"} > 0 &&
+        $stats->{"0:pending_pages"} == 0 && $stats->{"0:pending_log_bytes"} == 0;
+}
+
+sub store {
+    my ($from, $to) = @_;
+    my $value = 'x' x 500;
+    my $stored = 0;
+    for my $i ($from..$to) {
+        print $sock "set key$i 0 0 500\r\n$value\r\n";
+        $stored++ if scalar <$sock> eq "STORED\r\n";
+    }
+    return $stored;
+}
+
+# Zero runs and packed runs
+is(store(1, 2000), 2000, "stored 2000 keys");
+my $stats = wait_backups(\&synced);
+is($stats->{"0:state"}, "connected", "backup connected over TCP");
+ok($stats->{"0:zero_bytes"} > 0, "zero pages sent as zero runs");
+ok($stats->{"0:packed_saved_bytes"} > 0, "the items were packed");
+ok($stats->{"0:bytes_sent"} < 64 * 1024 * 1024, "less than the slabs were sent");
+is(compare("$dir/ps", "$dir/bs"), 0, "the backup holds the slabs");
+is(compare("$dir/pl", "$dir/bl"), 0, "the backup holds the slab lists");
+
+# Consistent cuts: the incremental syncs are cut at a worker pause
+ok($stats->{"0:consistent_syncs"} > 0, "consistent cuts were sent");
+my $bstats = mem_stats($backup->sock, "backups");
+is($bstats->{applied_sync}, $stats->{"0:acked_sync"}, "the backup applied the acknowledged sync");
+is($bstats->{applied_consistent}, 1, "the last sync applied was a consistent cut");
+
+# A delete or a touch is synced on its own, with no store after it
+for my $cmd ("delete key1", "touch key2 1000") {
+    my $acked = $stats->{"0:acked_sync"};
+    print $sock "$cmd\r\n";
+    like(scalar <$sock>, qr/^(DELETED|TOUCHED)\r\n/, "$cmd done");
+    $stats = wait_backups(sub { synced($_[0]) && $_[0]->{"0:acked_sync"} > $acked });
+    ok($stats->{"0:acked_sync"} > $acked, "$cmd synced");
+}
+is(compare("$dir/ps", "$dir/bs"), 0, "the backup got the delete and the touch");
+my $bsock = $backup->sock;
+mem_get_is($bsock, "key1", undef, "the backup no longer serves the deleted key");
+mem_get_is($bsock, "key3", 'x' x 500, "the backup serves the others");
+
+# Semi-sync: the reply to a write waits for the backup's ack
+print $sock "semisync on\r\n";
+is(scalar <$sock>, "OK\r\n", "semisync turned on");
+is(store(2001, 2010), 10, "semisync sets stored");
+print $sock "set num 0 0 1\r\n1\r\n";
+is(scalar <$sock>, "STORED\r\n", "semisync set of a number");
+print $sock "incr num 5\r\n";
+is(scalar <$sock>, "6\r\n", "semisync incr");
+print $sock "delete key2001\r\n";
+is(scalar <$sock>, "DELETED\r\n", "semisync delete");
+# a binary set, on a conn of its own: magic, opcode, key and extras
+# lengths, body length, opaque and cas, then flags, expiration, key, value
+my $bin = $primary->new_sock;
+print $bin pack("CCnCCnNNNNNN", 0x80, 0x01, 3, 8, 0, 0, 8 + 3 + 3, 0, 0, 0, 0, 0) .
+    "binval";
+read($bin, my $header, 24);
+is((unpack("CCnCCnNNNN", $header))[5], 0, "semisync binary set");
+$stats = mem_stats($sock, "backups");
+is($stats->{semisync_waits}, 14, "every write waited for the ack");
+is($stats->{semisync_timeouts}, 0, "no ack timed out");
+
+# Cut the connection. A semisync set then gets STORED at the timeout.
+my $full = $stats->{"0:full_resyncs"};
+stop_proxy($proxy);
+my $start = time;
+is(store(2011, 2011), 1, "semisync set stored without the backup");
+ok(time - $start >= 0.25, "after the timeout");
+is(mem_stats($sock, "backups")->{semisync_timeouts}, 1, "the timeout was counted");
+print $sock "semisync off\r\n";
+is(scalar <$sock>, "OK\r\n", "semisync turned off");
+store(2012, 3000);
+
+# Reconnect and resume from the acknowledged sync, without a full resync
+$proxy = start_proxy();
+$stats = wait_backups(sub { synced($_[0]) && $_[0]->{"0:resumes"} > 0 });
+ok($stats->{"0:reconnects"} > 0, "the backup was reconnected");
+ok($stats->{"0:resumes"} > 0, "the backup resumed");
+is($stats->{"0:full_resyncs"}, $full, "without a full resync");
+is(compare("$dir/ps", "$dir/bs"), 0, "the backup got the writes of the outage");
+
+stop_proxy($proxy);
@@ -0,0 +1,72 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 7;
+use File::Compare;
+use File::Temp qw(tempdir);
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# A primary replicating to a backup over TCP. Both keep their sections in
+# files of the same directory, so the test can compare and damage them.
+my $dir = tempdir(CLEANUP => 1);
+my $repl_port = free_port();
+my $common = "-m 64 -L -o hashpower=13,shared_malloc_dir=$dir";
+
+my $backup = new_memcached("$common,shared_malloc_assoc=ba,shared_malloc_slabs=bs," .
+                           "shared_malloc_slabs_lists=bl,failover_comm_type=TCP," .
+                           "failover_src=127.0.0.1:$repl_port," .
+                           "failover_dest=127.0.0.1:" . free_port());
+my $primary = new_memcached("$common,shared_malloc_assoc=pa,shared_malloc_slabs=ps," .
+                            "shared_malloc_slabs_lists=pl,failover_comm_type=TCP," .
+                            "failover_dest=127.0.0.1:$repl_port," .
+                            "failover_src=127.0.0.1:" . free_port() . "," .
+                            "failover_verify_interval=1");
+my $sock = $primary->sock;
+
+sub wait_backups {
+    my $cond = shift;
+    my $stats;
+    for (1..100) {
+        $stats = mem_stats($sock, "backups");
+        last if $cond->($stats);
+        select undef, undef, undef, 0.1;
+    }
+    return $stats;
+}
+
+my $value = 'x' x 500;
+my $stored = 0;
+for my $i (1..5000) {
+    print $sock "set key$i 0 0 500\r\n$value\r\n";
+    $stored++ if scalar <$sock> eq "STORED\r\n";
+}
+is($stored, 5000, "stored 5000 keys");
+
+my $stats = wait_backups(sub { $_[0]->{"0:verify_passes"} > 0 &&
+                                   $_[0]->{"0:pending_log_bytes"} == 0 });
+is($stats->{"0:state"}, "connected", "backup connected over TCP");
+is(compare("$dir/ps", "$dir/bs"), 0, "the backup holds the slabs");
+my $blocks = $stats->{"0:verify_blocks"};
+
+# Damage a page of items behind the primary's back
+open(my $fh, "+<", "$dir/bs") or die "Can't open the backup slabs: $!";
+binmode $fh;
+seek($fh, 100 * 4096, 0);
+print $fh 'corrupted' x 1000;
+close $fh;
+isnt(compare("$dir/ps", "$dir/bs"), 0, "the backup slabs were damaged");
+
+$stats = wait_backups(sub { $_[0]->{"0:verify_blocks"} > $blocks });
+ok($stats->{"0:verify_blocks"} > $blocks, "a verify pass found the damaged blocks");
+
+# The next sync sends the blocks again
+my $repaired = 0;
+for (1..100) {
+    last if ($repaired = compare("$dir/ps", "$dir/bs") == 0);
+    select undef, undef, undef, 0.1;
+}
+ok($repaired, "the backup slabs were repaired");
+is(mem_stats($sock, "backups")->{"0:reconnects"}, 0, "without a reconnect");
@@ -0,0 +1,75 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 16;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+sub wait_slabs {
+    my ($sock, $cond) = @_;
+    my $stats;
+    for (1..100) {
+        $stats = mem_stats($sock, "slabs");
+        last if $cond->($stats);
+        select undef, undef, undef, 0.1;
+    }
+    return $stats;
+}
+
+my $mb = 1024 * 1024;
+my $value = 'x' x 100000;
+
+# Without slab_reassign the limit can go up, and down as far as the memory in use
+my $server = new_memcached("-m 48 -L -o memlimit_max=128");
+my $sock = $server->sock;
+
+print $sock "memlimit 256\r\n";
+like(scalar <$sock>, qr/^MEMLIMIT_TOO_LARGE/, "memlimit past memlimit_max refused");
+print $sock "memlimit 0\r\n";
+like(scalar <$sock>, qr/^MEMLIMIT_TOO_SMALL/, "memlimit below a page per class refused");
+
+print $sock "memlimit 96\r\n";
+is(scalar <$sock>, "OK\r\n", "memlimit grow accepted");
+my $stats = wait_slabs($sock, sub { $_[0]->{mem_limit} == 96 * $mb });
+is($stats->{mem_limit}, 96 * $mb, "the grow was applied");
+
+my $stored = 0;
+for my $i (1..600) {
+    print $sock "set key$i 0 0 100000\r\n$value\r\n";
+    $stored++ if scalar <$sock> eq "STORED\r\n";
+}
+is($stored, 600, "stored 60 MB of items");
+$stats = mem_stats($sock, "slabs");
+ok($stats->{total_malloced} > 48 * $mb, "the slabs grew past -m");
+ok($stats->{total_malloced} <= 96 * $mb, "and stayed within the new limit");
+mem_get_is($sock, "key600", $value);
+
+print $sock "memlimit 48\r\n";
+like(scalar <$sock>, qr/^CLIENT_ERROR/, "giving back memory in use needs slab_reassign");
+
+# With slab_reassign the pages over a lowered limit are evicted and given back
+$server = new_memcached("-m 48 -L -o memlimit_max=128,slab_reassign");
+$sock = $server->sock;
+
+print $sock "memlimit 96\r\n";
+is(scalar <$sock>, "OK\r\n", "memlimit grow accepted");
+wait_slabs($sock, sub { $_[0]->{mem_limit} == 96 * $mb });
+$stored = 0;
+for my $i (1..600) {
+    print $sock "set key$i 0 0 100000\r\n$value\r\n";
+    $stored++ if scalar <$sock> eq "STORED\r\n";
+}
+is($stored, 600, "stored 60 MB of items");
+
+print $sock "memlimit 48\r\n";
+is(scalar <$sock>, "OK\r\n", "memlimit shrink accepted");
+$stats = wait_slabs($sock, sub { $_[0]->{mem_limit} == 48 * $mb &&
+                                 $_[0]->{total_malloced} <= 48 * $mb });
+is($stats->{mem_limit}, 48 * $mb, "the shrink was applied");
+ok($stats->{total_malloced} <= 48 * $mb, "the pages over the limit were given back");
+ok($stats->{released_pages} > 0, "and released");
+
+print $sock "set after 0 0 5\r\nhello\r\n";
+is(scalar <$sock>, "STORED\r\n", "stores still work after the shrink");
@@ -0,0 +1,71 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 11;
+use File::Temp qw(tempdir);
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# The sections live in files of their own directory, which goes away with the test
+my $dir = tempdir(CLEANUP => 1);
+my $args = "-m 64 -L -o hashpower=13,warm_restart,shared_malloc_dir=$dir," .
+    "shared_malloc_assoc=assoc,shared_malloc_slabs=slabs,shared_malloc_slabs_lists=lists";
+
+sub gets_all {
+    my ($sock, $n) = @_;
+    my %cas;
+    for my $i (1..$n) {
+        print $sock "gets key$i\r\n";
+        my $line = <$sock>;
+        next unless $line =~ /^VALUE key$i 0 \d+ (\d+)/;
+        my $data = <$sock>;
+        $cas{$i} = $1 if $data eq "value$i\r\n";
+        $line = <$sock>;
+    }
+    return \%cas;
+}
+
+my $server = new_memcached($args);
+my $sock = $server->sock;
+my $port = $server->port;
+
+my $stored = 0;
+for my $i (1..1000) {
+    print $sock "set key$i 0 0 " . length("value$i") . "\r\nvalue$i\r\n";
+    $stored++ if scalar <$sock> eq "STORED\r\n";
+}
+is($stored, 1000, "stored 1000 keys");
+print $sock "delete key1000\r\n";
+is(scalar <$sock>, "DELETED\r\n", "deleted key1000");
+my $cas = gets_all($sock, 999);
+is(scalar keys %$cas, 999, "got the cas of every key");
+my $items = mem_stats($sock)->{curr_items};
+is($items, 999, "999 items before the restart");
+
+# Kill the server itself, not the timedrun wrapping it, so nothing is saved on exit
+my $pid = mem_stats($sock)->{pid};
+kill 9, $pid;
+waitpid($server->{pid}, 0);
+
+$server = new_memcached($args, $port);
+$sock = $server->sock;
+is(mem_stats($sock)->{curr_items}, $items, "curr_items kept across the restart");
+
+my $after = gets_all($sock, 999);
+is(scalar keys %$after, 999, "every key hit after the restart");
+is_deeply($after, $cas, "every cas kept across the restart");
+print $sock "get key1000\r\n";
+is(scalar <$sock>, "END\r\n", "the deleted key stays deleted");
+
+# The cas counter carries on from where it was
+print $sock "set key1 0 0 3\r\nnew\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored over a restored key");
+print $sock "gets key1\r\n";
+my ($new_cas) = (scalar <$sock>) =~ /^VALUE key1 0 3 (\d+)/;
+<$sock>; <$sock>;
+my $max = (sort { $b <=> $a } values %$cas)[0];
+ok($new_cas > $max, "a new cas is above the restored ones");
+print $sock "cas key2 0 0 3 $cas->{2}\r\nnew\r\n";
+is(scalar <$sock>, "STORED\r\n", "a restored cas is accepted");
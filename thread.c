@@ -3,6 +3,8 @@
  * Thread management for memcached.
  */
 #include "memcached.h"
+#include "numa.h"
+#include "backup.h"
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
@@ -75,6 +77,13 @@ static LIBEVENT_THREAD *threads;
  * Number of worker threads that have finished setting themselves up.
  */
 static int init_count = 0;
+/*
+ * Number of worker threads that got past worker_hang_lock since the last pause.
+ * A resume waits for all of them, or a pause right after it could take the lock
+ * back before they do, and they'd never see its request (back to back pauses,
+ * such as the ones around a hash table expansion).
+ */
+static int resumed_count = 0;
 static pthread_mutex_t init_lock;
 static pthread_cond_t init_cond;
 
@@ -153,6 +162,10 @@ static void register_thread_initialized(void) {
     /* Force worker threads to pile up if someone wants us to */
     pthread_mutex_lock(&worker_hang_lock);
     pthread_mutex_unlock(&worker_hang_lock);
+    pthread_mutex_lock(&init_lock);
+    resumed_count++;
+    pthread_cond_signal(&init_cond);
+    pthread_mutex_unlock(&init_lock);
 }
 
 /* Must not be called with any deeper locks held */
@@ -171,11 +184,19 @@ void pause_threads(enum pause_thread_types type) {
             pthread_mutex_lock(&worker_hang_lock);
             break;
         case RESUME_ALL_THREADS:
-            slabs_rebalancer_resume();
-            lru_crawler_resume();
-            lru_maintainer_resume();
         case RESUME_WORKER_THREADS:
             pthread_mutex_unlock(&worker_hang_lock);
+            pthread_mutex_lock(&init_lock);
+            while (resumed_count < settings.num_threads) {
+                pthread_cond_wait(&init_cond, &init_lock);
+            }
+            pthread_mutex_unlock(&init_lock);
+            /* the rebalancer lock keeps other pausers out until the workers are back */
+            if (type == RESUME_ALL_THREADS) {
+                slabs_rebalancer_resume();
+                lru_crawler_resume();
+                lru_maintainer_resume();
+            }
             break;
         default:
             fprintf(stderr, "Unknown lock type: %d\n", type);
@@ -190,6 +211,7 @@ void pause_threads(enum pause_thread_types type) {
 
     pthread_mutex_lock(&init_lock);
     init_count = 0;
+    resumed_count = 0;
     for (i = 0; i < settings.num_threads; i++) {
         if (write(threads[i].notify_send_fd, buf, 1) != 1) {
             perror("Failed writing to notify pipe");
@@ -373,6 +395,7 @@ static void *worker_libevent(void *arg) {
     /* Any per-thread setup can happen here; memcached_thread_init() will block until
      * all threads have finished initializing.
      */
+    numa_pin_thread(me->numa_node);
 
     register_thread_initialized();
 
@@ -422,6 +445,45 @@ static void thread_libevent_process(int fd, short which, void *arg) {
     case 'p':
     register_thread_initialized();
         break;
+    /* the backups acknowledged writes */
+    case 'b':
+    conn_backup_wakeup(me);
+        break;
+    /* an upgrade closes the client connections */
+    case 'd':
+    conn_drain(me);
+        break;
+    }
+}
+
+/*
+ * Wakes up the worker threads that hold replies for backup acks. Called from
+ * a backup sender thread after it sets the acked sequence number, which the
+ * parked conns re-check after putting themselves on the list.
+ */
+void backup_acks_notify(void) {
+    int i;
+    char buf[1] = { 'b' };
+
+    if (threads == NULL)
+        return;
+    for (i = 0; i < settings.num_threads; i++) {
+        if (threads[i].backup_waiters != NULL) {
+            if (write(threads[i].notify_send_fd, buf, 1) != 1) {
+                perror("Writing to thread notify pipe");
+            }
+        }
+    }
+}
+
+void threads_drain_conns(void) {
+    int i;
+    char buf[1] = { 'd' };
+
+    for (i = 0; i < settings.num_threads; i++) {
+        if (write(threads[i].notify_send_fd, buf, 1) != 1) {
+            perror("Writing to thread notify pipe");
+        }
     }
 }
 
@@ -498,12 +560,33 @@ item *item_get(const char *key, const size_t nkey) {
     return it;
 }
 
+/*
+ * Returns an item for a get, gets or binary GET. A backup serving reads
+ * (failover_serve_reads) returns a copy of the item replicated from its
+ * primary, or a miss while a sync is being applied.
+ */
+item *item_read(const char *key, const size_t nkey) {
+    item *it;
+
+    if (!settings.failover_serve_reads)
+        return item_get(key, nkey);
+    if (!backup_read_begin())
+        return NULL;
+    it = item_replica_copy(key, nkey, hash(key, nkey));
+    backup_read_end(it != NULL);
+    return it;
+}
+
 item *item_touch(const char *key, size_t nkey, uint32_t exptime) {
     item *it;
     uint32_t hv;
     hv = hash(key, nkey);
     item_lock(hv);
     it = do_item_touch(key, nkey, exptime, hv);
+    if (it != NULL) {
+        replog_item_touched(key, nkey, exptime);
+        backup_write_signal();
+    }
     item_unlock(hv);
     return it;
 }
@@ -528,6 +611,10 @@ int item_link(item *item) {
  */
 void item_remove(item *item) {
     uint32_t hv;
+    if (item->it_flags & ITEM_COPY) {
+        free(item);
+        return;
+    }
     hv = hash(ITEM_key(item), item->nkey);
 
     item_lock(hv);
@@ -552,6 +639,8 @@ void item_unlink(item *item) {
     hv = hash(ITEM_key(item), item->nkey);
     item_lock(hv);
     do_item_unlink(item, hv);
+    replog_item_deleted(ITEM_key(item), item->nkey);
+    backup_write_signal();
     item_unlock(hv);
 }
 
@@ -560,6 +649,8 @@ void item_unlink(item *item) {
  */
 void item_update(item *item) {
     uint32_t hv;
+    if (item->it_flags & ITEM_COPY)
+        return;
     hv = hash(ITEM_key(item), item->nkey);
 
     item_lock(hv);
@@ -785,6 +876,8 @@ void memcached_thread_init(int nthreads, struct event_base *main_base) {
 
         threads[i].notify_receive_fd = fds[0];
         threads[i].notify_send_fd = fds[1];
+        /* spread the workers over the nodes, as their slab arenas are */
+        threads[i].numa_node = settings.numa_arenas ? i % numa_nodes() : -1;
 
         setup_thread(&threads[i]);
         /* Reserve three fds for the libevent base, and two for the pipe */
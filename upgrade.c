@@ -0,0 +1,327 @@
+/*
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * Binary upgrade without closing the listening sockets. See upgrade.h.
+ */
+
+#include "upgrade.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define UPGRADE_MAGIC 0x75706772u
+/* How long the new instance waits for the old one to hand over and exit */
+#define UPGRADE_TIMEOUT_SEC 30
+/* How often a standby looks for the new instance after an upgrade */
+#define UPGRADE_RETRY_USEC 10000
+/* The first byte from the new instance, and the one to a standby on upgrade */
+#define UPGRADE_REQ_UPGRADE 'U'
+#define UPGRADE_REQ_STANDBY 'S'
+#define UPGRADE_NOBODY -2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    int32_t transport[UPGRADE_MAX_SOCKETS];
+} upgrade_msg;
+
+static int upgrade_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "upgrade_socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static void close_fds(const int *fds, int n) {
+    int i;
+
+    for (i = 0; i < n; i++)
+        close(fds[i]);
+}
+
+/*
+ * Connects to the instance listening on path and sends it req. Returns the
+ * connection, UPGRADE_NOBODY if no instance listens on path, or -1 on error.
+ */
+static int upgrade_connect(const char *path, char req) {
+    struct sockaddr_un addr;
+    struct timeval tv = { .tv_sec = UPGRADE_TIMEOUT_SEC, .tv_usec = 0 };
+    ssize_t n;
+    int fd;
+
+    if (upgrade_addr(path, &addr) != 0)
+        return -1;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("upgrade socket()");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        int err = errno;
+        close(fd);
+        /* nobody to take over from: a plain start */
+        if (err == ENOENT || err == ECONNREFUSED)
+            return UPGRADE_NOBODY;
+        fprintf(stderr, "upgrade connect(%s): %s\n", path, strerror(err));
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while ((n = write(fd, &req, 1)) == -1 && errno == EINTR);
+    if (n != 1) {
+        fprintf(stderr, "upgrade: can't reach the running instance: %s\n",
+                n == -1 ? strerror(errno) : "short write");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Receives the listening sockets of the running instance on fd into socks.
+ * Returns their number, or -1 on error, quietly if quiet is set.
+ */
+static int upgrade_receive(int fd, upgrade_socket *socks, int max, int quiet) {
+    upgrade_msg msg;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_SOCKETS)];
+    } control;
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf) };
+    struct cmsghdr *cmsg;
+    int fds[UPGRADE_MAX_SOCKETS];
+    int nfds = 0;
+    size_t got = 0;
+    ssize_t n;
+    int i;
+
+    while ((n = recvmsg(fd, &mh, 0)) == -1 && errno == EINTR);
+    if (n <= 0) {
+        if (!quiet)
+            fprintf(stderr, "upgrade: no sockets from the running instance: %s\n",
+                    n == 0 ? "connection closed" : strerror(errno));
+        return -1;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        }
+    }
+    got = n;
+    /* the descriptors came with the first bytes, the rest is plain data */
+    while (got < sizeof(msg)) {
+        n = read(fd, (char *)&msg + got, sizeof(msg) - got);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    if (got < sizeof(msg) || msg.magic != UPGRADE_MAGIC ||
+        msg.count != (uint32_t)nfds || nfds > max) {
+        if (!quiet)
+            fprintf(stderr, "upgrade: bad handover message from the running instance\n");
+        close_fds(fds, nfds);
+        return -1;
+    }
+    for (i = 0; i < nfds; i++) {
+        socks[i].fd = fds[i];
+        socks[i].transport = msg.transport[i];
+    }
+    return nfds;
+}
+
+static void close_socks(const upgrade_socket *socks, int n) {
+    int i;
+
+    for (i = 0; i < n; i++)
+        close(socks[i].fd);
+}
+
+int upgrade_takeover(const char *path, upgrade_socket *socks, int max) {
+    ssize_t n;
+    char c;
+    int fd, nfds;
+
+    if ((fd = upgrade_connect(path, UPGRADE_REQ_UPGRADE)) < 0)
+        return fd == UPGRADE_NOBODY ? 0 : -1;
+    if ((nfds = upgrade_receive(fd, socks, max, 0)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    /* The connection closes when the old instance exits, and only then is
+     * the shared memory ours */
+    while ((n = read(fd, &c, 1)) != 0) {
+        if (n == -1 && errno != EINTR) {
+            fprintf(stderr, "upgrade: the running instance did not exit: %s\n",
+                    strerror(errno));
+            close_socks(socks, nfds);
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return nfds;
+}
+
+int upgrade_standby(const char *path, upgrade_socket *socks, int max,
+                    int (*attached)(void)) {
+    struct timeval forever = { .tv_sec = 0, .tv_usec = 0 };
+    upgrade_socket next[UPGRADE_MAX_SOCKETS];
+    int retries = 0;
+    int fd, got = 0, nfds = 0;
+    ssize_t n;
+    char c;
+
+    for (;;) {
+        fd = upgrade_connect(path, UPGRADE_REQ_STANDBY);
+        /* after an upgrade, the old instance may still hold path, or the
+         * new one not yet */
+        if (fd >= 0 && (got = upgrade_receive(fd, next, max, retries > 0)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd < 0) {
+            if (nfds > 0 && retries-- > 0) {
+                usleep(UPGRADE_RETRY_USEC);
+                continue;
+            }
+            if (nfds > 0) {
+                fprintf(stderr, "standby: no new instance on %s, taking over\n", path);
+                return nfds;
+            }
+            return fd == UPGRADE_NOBODY ? 0 : -1;
+        }
+        close_socks(socks, nfds);
+        memcpy(socks, next, got * sizeof(upgrade_socket));
+        nfds = got;
+        if (attached != NULL && attached() != 0) {
+            close_socks(socks, nfds);
+            close(fd);
+            return -1;
+        }
+
+        /* nothing is sent until the running instance hands over or dies */
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &forever, sizeof(forever));
+        while ((n = read(fd, &c, 1)) == -1 && errno == EINTR);
+        close(fd);
+        if (n == 1 && c == UPGRADE_REQ_UPGRADE) {
+            retries = UPGRADE_TIMEOUT_SEC * 1000000 / UPGRADE_RETRY_USEC;
+            continue;
+        }
+        return nfds;
+    }
+}
+
+int upgrade_listen(const char *path) {
+    struct sockaddr_un addr;
+    struct stat tstat;
+    int fd, flags;
+
+    if (upgrade_addr(path, &addr) != 0)
+        return -1;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("upgrade socket()");
+        return -1;
+    }
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0 ||
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("setting O_NONBLOCK");
+        close(fd);
+        return -1;
+    }
+    /* the socket file of the instance we took over from */
+    if (lstat(path, &tstat) == 0 && S_ISSOCK(tstat.st_mode))
+        unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd, 1) == -1) {
+        fprintf(stderr, "upgrade listen(%s): %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int upgrade_accept(int lfd, int *standby) {
+    struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+    ssize_t n;
+    char req;
+    int fd;
+
+    while ((fd = accept(lfd, NULL, NULL)) == -1 && errno == EINTR);
+    if (fd == -1)
+        return -1;
+    /* sent right after connecting */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while ((n = read(fd, &req, 1)) == -1 && errno == EINTR);
+    if (n != 1 || (req != UPGRADE_REQ_UPGRADE && req != UPGRADE_REQ_STANDBY)) {
+        close(fd);
+        return -1;
+    }
+    *standby = req == UPGRADE_REQ_STANDBY;
+    return fd;
+}
+
+int upgrade_send(int fd, const upgrade_socket *socks, int n) {
+    upgrade_msg msg;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_SOCKETS)];
+    } control;
+    struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control.buf,
+                         .msg_controllen = CMSG_SPACE(sizeof(int) * n) };
+    struct cmsghdr *cmsg;
+    int *fds;
+    ssize_t sent;
+    int i;
+
+    if (n <= 0 || n > UPGRADE_MAX_SOCKETS) {
+        close(fd);
+        return -1;
+    }
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.magic = UPGRADE_MAGIC;
+    msg.count = n;
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    fds = (int *)CMSG_DATA(cmsg);
+    for (i = 0; i < n; i++) {
+        fds[i] = socks[i].fd;
+        msg.transport[i] = socks[i].transport;
+    }
+
+    while ((sent = sendmsg(fd, &mh, 0)) == -1 && errno == EINTR);
+    if (sent != (ssize_t)sizeof(msg)) {
+        fprintf(stderr, "upgrade: failed to send the listening sockets: %s\n",
+                sent == -1 ? strerror(errno) : "short write");
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+void upgrade_notify(int fd) {
+    char c = UPGRADE_REQ_UPGRADE;
+
+    while (write(fd, &c, 1) == -1 && errno == EINTR);
+    close(fd);
+}
@@ -0,0 +1,76 @@
+/*
+ * Added as part of the memcached-1.4.24_RDMA project.
+ * Binary upgrade without closing the listening sockets.
+ * An instance started with -o upgrade_socket=PATH listens on that UNIX
+ * socket. A new instance started with the same option connects to it and
+ * receives the listening TCP, UDP and UNIX sockets of the running one over
+ * SCM_RIGHTS; the running one then exits, and the new one reattaches its
+ * shared memory as on a warm restart. Clients that connect meanwhile wait
+ * in the listen backlog instead of being refused.
+ *
+ * An instance started with -o standby as well connects as a standby instead:
+ * it receives copies of the listening sockets while the running instance
+ * keeps serving them, and waits on the connection. When the running instance
+ * exits or dies, the kernel closes the connection and the standby takes the
+ * shared memory and the sockets over, with no network copy. On an upgrade the
+ * running instance tells its standby, which then follows the new instance.
+ */
+
+#ifndef UPGRADE_H_
+#define UPGRADE_H_
+
+#define UPGRADE_MAX_SOCKETS 64
+
+typedef struct {
+    int fd;
+    int transport;      /* enum network_transport of the socket */
+} upgrade_socket;
+
+/*
+ * Takes the listening sockets over from the instance listening on path.
+ * Returns once that instance has exited, with the number of sockets
+ * stored in socks (at most max), 0 if no instance listens on path, or -1
+ * on error.
+ */
+int upgrade_takeover(const char *path, upgrade_socket *socks, int max);
+
+/*
+ * Waits as the standby of the instance listening on path, then takes its
+ * listening sockets over as upgrade_takeover does. attached is called every
+ * time the sockets of a running instance were received, and a non-zero
+ * return gives up. Returns once the instance we follow is gone without
+ * handing over to a new one, with the number of sockets stored in socks, 0
+ * if no instance listens on path, or -1 on error.
+ */
+int upgrade_standby(const char *path, upgrade_socket *socks, int max,
+                    int (*attached)(void));
+
+/*
+ * Listens on path for the next instance, replacing the socket file of the
+ * last one. Returns the listening descriptor, or -1 on error.
+ */
+int upgrade_listen(const char *path);
+
+/*
+ * Accepts the next instance on the descriptor returned by upgrade_listen,
+ * and sets *standby if it is a standby. Returns the connection, or -1 if
+ * there was none.
+ */
+int upgrade_accept(int lfd, int *standby);
+
+/*
+ * Sends the n listening sockets in socks over the connection returned by
+ * upgrade_accept. Returns 0 on success. For an upgrade the caller then exits
+ * without closing fd: the next instance waits for the connection to close
+ * before it touches the shared memory. A standby's connection is kept open
+ * for as long as the caller runs. fd is closed on failure.
+ */
+int upgrade_send(int fd, const upgrade_socket *socks, int n);
+
+/*
+ * Tells the standby on fd that the caller hands over to a new instance
+ * rather than dying, so that it follows that one. Closes fd.
+ */
+void upgrade_notify(int fd);
+
+#endif /* UPGRADE_H_ */